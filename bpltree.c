@@ -15,92 +15,92 @@
 #define MAX_FIELDS          32
 #define FIELD_DSC          3 * MAX_FIELDS
 #define KEY_MAXLEN         250
-#define OPTIONS      "hs:xenqdk:f:" 
+#define LIST_BATCH          64   // Rows taken at once for list
+#define LOAD_BATCH       65536   // Rows read at once into a paged tree
+#define OPTIONS      "hs:xenuqdk:f:F:I:b:Hi:P:p:l:oOj:" 
 
 #define SHOW_NOTHING         0
 #define SHOW_TREE            1
 #define SHOW_LIST            2
 
-static char G_extended = 0;
-static char G_id = 1;
 static char G_echo = 0;
 static char G_prompt = 1;
+static char   *G_line = NULL;     // Last row read from the file
+static size_t  G_linesz = 0;
 
-static KEY_POS_T read_key(FILE *input, char *fields) {
-    char       buffer[KEY_MAXLEN +1];
-    char       idxkey[KEY_MAXLEN +1];
-    char      *fielddsc;
-    char      *buff;
-    char      *p;
-    int        len;
-    KEY_POS_T  keypos;
-    char      *q;
-    char      *f[MAX_FIELDS];
-    char       sep[2];
-    char       keysep[2];
-    int        i;
-    int        j;
-    int        k;
+static KEY_POS_T read_key(BPLTREE_T *t, FILE *input, char *fields) {
+    char         *buffer;
+    char          idxkey[KEY_MAXLEN +1];
+    char         *p;
+    int           len;
+    KEY_POS_T     keypos;
+    char         *q;
+    unsigned int  ends[MAX_FIELDS];
+    size_t        start;
+    size_t        rowlen;
+    size_t        n;
+    ssize_t       got;
+    int           i;
+    int           j;
+    int           k;
+
+    len = 0;
 
     keypos.pos = ftello(input);
     keypos.key = NULL;
-    if (fgets(buffer, KEY_MAXLEN + 1, input) != NULL) {
+    // Rows may be of any length, keys are cut
+    if ((got = getline(&G_line, &G_linesz, input)) != -1) {
+      buffer = G_line;
       p = buffer;
       while (isspace(*p)
-             && ((fields == NULL) || (*p != bpltree_filesep()))) {
+             && ((fields == NULL) || (*p != bpltree_filesep(t)))) {
         p++;
       }
       if (fields) {
-        fielddsc = strdup(fields);
-        assert(fielddsc);
-        buff = strdup(buffer);
-        assert(buff);
-        idxkey[0] = '\0';
-        sep[0] = bpltree_filesep();
-        sep[1] = '\0';
-        keysep[0] = KEYSEP;
-        keysep[1] = '\0';
-        // First split
-        q = strsep(&buff, sep);
-        i = 0;
-        while (q && (i < MAX_FIELDS)) {
-          f[i] = q;
-          i++;
-          q = strsep(&buff, sep);
-        }
-        free(buff);
+        // First split, in one pass over the row
+        i = bpltree_fieldsplit(buffer, (size_t)got, bpltree_filesep(t),
+                               ends, MAX_FIELDS, &rowlen);
         // Rebuild a key
-        q = strsep(&fielddsc, ",");
+        q = fields;
         j = 0;
         while (q) {
-          if (j) {
-            strncat(idxkey, keysep, KEY_MAXLEN + 1 - strlen(idxkey));
+          if (j && (len < KEY_MAXLEN)) {
+            idxkey[len++] = KEYSEP;
           }
           k = atoi(q);
-          if ((k > 0) && (k < i)) {
-            strncat(idxkey, f[k-1], KEY_MAXLEN + 1 - strlen(idxkey));
+          if ((k > 0) && (k <= i)) {
+            start = (k > 1 ? ends[k-2] + 1 : 0);
+            n = ends[k-1] - start;
+            if (n > (size_t)(KEY_MAXLEN - len)) {
+              n = KEY_MAXLEN - len;
+            }
+            memcpy(idxkey + len, buffer + start, n);
+            len += n;
           }
           j++;
-          q = strsep(&fielddsc, ",");
+          if ((q = strchr(q, ',')) != NULL) {
+            q++;
+          }
         }
-        free(fielddsc);
         p = idxkey;
-        len = strlen(p);
         while (len && isspace(p[len-1])) {
           len--;
         }
       } else {
         // Default - what comes first in the line
-        if ((q = strchr(p, bpltree_filesep())) != NULL) {
+        if ((q = strchr(p, bpltree_filesep(t))) != NULL) {
           *q = '\0';
           len = strlen(p);
         } else {
-          bpltree_setfilesep('\n');
+          bpltree_setfilesep(t, '\n');
           len = strlen(p);
           while (len && isspace(p[len-1])) {
             len--;
           }
         }
+        if (len > KEY_MAXLEN) {
+          len = KEY_MAXLEN;
+        }
       }
     }
     if (len) {
@@ -110,150 +110,165 @@ static KEY_POS_T read_key(FILE *input, char *fields) {
     return keypos;
 }
 
-static void  list_leaf(NODE_T *n) {
-    short i;
-
-    if (n && _is_leaf(n)) {
-      for (i = 0; i < n->keycnt; i++) {
-        if (n->node.leaf.k[i].key) {
-          if (bpltree_numeric()) {
-            printf("(%d", *((int*)(n->node.leaf.k[i].key)));
-          } else {
-            printf("(%s", n->node.leaf.k[i].key);
-          }
-        }
-        printf(", %lu)\n", (unsigned long)n->node.leaf.k[i].pos);
-        list_leaf(n->node.leaf.next);
-      }
-    }
-}
-
-static void list(void) {
-   NODE_T *n = bpltree_root();
+static void list(BPLTREE_T *t) {
+   CURSOR_T  *c;
+   KEY_POS_T  batch[LIST_BATCH];
+   long       got;
+   long       i;
+   char       buff[KEY_TEXTLEN];
 
-   while (n && !_is_leaf(n)) {
-     n = n->node.internal.k[0].bigger;
+   if ((c = bpltree_cursor_open(t, 0)) == NULL) {
+     printf("%s\n", bpltree_err_msg());
+     return;
    }
-   list_leaf(n);
+   (void)bpltree_cursor_seek(c, NULL, NULL);
+   while ((got = bpltree_cursor_next(c, batch, LIST_BATCH)) > 0) {
+     for (i = 0; i < got; i++) {
+       printf("(%s, %lu)\n",
+              bpltree_keytext(t, batch[i].key, buff, KEY_TEXTLEN),
+              (unsigned long)batch[i].pos);
+     }
+   }
+   bpltree_cursor_close(c);
 }
 
-extern void  bpltree_show_node(NODE_T *n, short indent) {
-   short i;
-
-   assert(n);
-   if (G_id) {
-     printf("%3d-", n->id);
-   }
-   putchar('[');
-   if (!n->is_leaf) {
-     if (!G_extended) {
-       for (i = 1; i <= n->keycnt; i++) {
-         if (i > 1) {
-           putchar(' ');
-         }
-         if (bpltree_numeric()) {
-           printf("%d", *((int*)(n->node.internal.k[i].key)));
-         } else {
-           printf("%s", n->node.internal.k[i].key);
-         }
-         if (i < n->keycnt) {
-           putchar(',');
-         }
-       }
-     } else {
-       // Internal node, not extended
-       for (i = 0; i <= bpltree_maxkeys(); i++) {
-         if (n->node.internal.k[i].key) {
-           if (bpltree_numeric()) {
-             printf("%d", *((int*)(n->node.internal.k[i].key)));
-           } else {
-             printf("%s", n->node.internal.k[i].key);
-           }
-         } else {
-           if (i) {
-             putchar('*');
-           }
-         }
-         if (n->node.internal.k[i].bigger) {
-           if (G_id) {
-             printf("<%hd>", (n->node.internal.k[i].bigger)->id);
-           } else {
-             putchar(':');
-           }
-         } else {
-           putchar('~');
-         }
-       }
-       if (n->parent) {
-         printf("(^%hd)", (n->parent)->id);
-       }
+static void show(BPLTREE_T *t, char how) {
+   // The tree, or its keys, after a change or on demand
+   if (how == SHOW_TREE) {
+     if (bpltree_show_tree(t)) {
+       printf("%s\n", bpltree_err_msg());
      }
    } else {
-     // Leaf node
-     short max_shown = (G_extended ? bpltree_maxkeys() : n->keycnt);
-     for (i = 0; i < max_shown; i++) {
-       if (i > 0) {
-         if (indent) {
-           for (short k = 0; k < indent; k++) {
-             putchar(' ');
-           }
-         }
-         if (G_id) {
-           for (short k = 0; k < 4; k++) {
-             putchar(' ');
-           }
-         }
-         putchar(' ');  // For the square bracket
-       }
-       if (bpltree_numeric()) {
-         printf("%d", *((int*)(n->node.leaf.k[i].key)));
-       } else {
-         printf("%s", n->node.leaf.k[i].key);
-       }
-       printf("\t%010lu", (unsigned long)(n->node.leaf.k[i].pos));
-       if ((i < max_shown-1) || G_extended) {
-         putchar('\n');
-       }
-     }
-     if (G_extended && n->parent) {
-       if (indent) {
-         for (short k = 0; k <= (indent + (G_id ? 4 : 0)); k++) {
-           putchar(' ');
-         }
-       }
-       printf("(^%hd)", (n->parent)->id);
-     }
-     if (G_extended && _is_leaf(n)) {
-       if (n->node.leaf.next) {
-         printf("(->%hd)", (n->node.leaf.next)->id);
-       } else {
-         printf("(->*)");
-       }
-     }
+     list(t);
    }
-   printf("]\n");
-   fflush(stdout);
+   putchar('\n');
 }
 
-extern void  bpltree_display(NODE_T *n, int blanks) {
-  if (n) {
-    int  i;
+static double seconds(void) {
+    // Wall clock, as scans may run on several threads
+    struct timespec ts;
 
-    for (i = 1; i <= blanks; i++) {
-      putchar(' ');
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void add_key(char ***keys, long *cnt, long *max, char *k) {
+    int len;
+
+    while (isspace(*k)) {
+      k++;
+    }
+    len = strlen(k);
+    while (len && isspace(k[len-1])) {
+      len--;
     }
-    bpltree_show_node(n, (n->is_leaf ? blanks : 0));
-    if (!n->is_leaf) {
-      for (i = 0; i <= n->keycnt; i++) {
-        bpltree_display(n->node.internal.k[i].bigger, blanks + 3);
+    if (len) {
+      if (*cnt == *max) {
+        *max = (*max ? 2 * *max : 64);
+        *keys = (char **)realloc(*keys, *max * sizeof(char *));
+        assert(*keys);
       }
+      k[len] = '\0';
+      (*keys)[(*cnt)++] = strdup(k);
     }
-  }                             /* End of if */
-  fflush(stdout);
-}                               /* End of bpltree_display() */
+}
 
+static char **key_list(char *q, long *cnt) {
+    // Keys for mget: separated by commas, or one per line
+    // in a file when q is @file. Each key is to be freed,
+    // then the array. The count is -1 if the file can't be
+    // opened.
+    char   buffer[LINE_LEN];
+    char **keys = NULL;
+    char  *k;
+    FILE  *kf;
+    long   max = 0;
+
+    *cnt = 0;
+    if (*q == '@') {
+      if ((kf = fopen(q + 1, "r")) == NULL) {
+        perror(q + 1);
+        *cnt = -1;
+        return NULL;
+      }
+      while (fgets(buffer, LINE_LEN, kf)) {
+        add_key(&keys, cnt, &max, buffer);
+      }
+      fclose(kf);
+    } else {
+      while ((k = strchr(q, ',')) != NULL) {
+        *k++ = '\0';
+        add_key(&keys, cnt, &max, q);
+        q = k;
+      }
+      add_key(&keys, cnt, &max, q);
+    }
+    return keys;
+}
+
+static char descending(char *q, long *limit) {
+    // A range followed by "desc", maybe with a number of rows
+    // after it, is wanted greatest keys first. Returns 1 if so,
+    // and cuts what follows the range off q.
+    char *p;
+    char *w;
+    char *end;
+    long  n;
+
+    *limit = 0;
+    if ((p = strrchr(q, ' ')) == NULL) {
+      return 0;
+    }
+    w = p + 1;
+    n = strtol(w, &end, 10);
+    if ((end != w) && (*end == '\0') && (n > 0)) {
+      // A number of rows, "desc" must come before
+      *p = '\0';
+      if (((w = strrchr(q, ' ')) == NULL) || strcmp(w + 1, "desc")) {
+        *p = ' ';
+        return 0;
+      }
+      *limit = n;
+      p = w;
+      w++;
+    }
+    if (strcmp(w, "desc")) {
+      return 0;
+    }
+    while ((p > q) && isspace(p[-1])) {
+      p--;
+    }
+    *p = '\0';
+    return 1;
+}
 
-static void usage(char *prog) {
+static void load_failed(BPLTREE_T *t, char *paged) {
+    // A paged tree being indexed would look like a complete
+    // index once freed: it goes
+    fprintf(stderr, "%s : %s\n",
+            bpltree_err_msg(), bpltree_err_info());
+    bpltree_free(t);
+    if (paged) {
+      (void)unlink(paged);
+    }
+    exit(1);
+}
+
+static long load(BPLTREE_T *t, KEY_POS_T *kp, long cnt, char *paged) {
+    // Loads keys read from the file, and frees them
+    long loaded;
+    long i;
+
+    if ((loaded = bpltree_load(t, kp, cnt)) < 0) {
+      load_failed(t, paged);
+    }
+    for (i = 0; i < cnt; i++) {
+      free(kp[i].key);
+    }
+    return loaded;
+}
+
+static void usage(BPLTREE_T *t, char *prog) {
    fprintf(stdout, "Usage: %s [flags] [text file]\n", prog);
    fprintf(stdout, "The text file is indexed if present.\n");
    fprintf(stdout, "  Flags:\n");
@@ -261,14 +276,16 @@ static void usage(char *prog) {
        "    -h           : show this help\n");
    fprintf(stdout,
            "    -k <n>       : store at most <n> keys per node (default %d)\n",
-           bpltree_maxkeys());
+           bpltree_maxkeys(t));
    fprintf(stdout,
        "    -x           : extended display - show links and empty slots\n");
    fprintf(stdout,
        "    -q           : quiet; don't display tree after changes\n");
    fprintf(stdout, "    -e           : echo value added/removed\n");
    fprintf(stdout,
-       "    -n           : numeric values (incompatible with -f with several fields)\n");
+       "    -n           : integer keys (incompatible with -f with several fields)\n");
+   fprintf(stdout,
+       "    -u           : accept duplicate keys (one per row)\n");
    fprintf(stdout, "    -s <sep>     : field separator (single character)\n");
    fprintf(stdout, "                   in the file (defaults to tab)\n");
    fprintf(stdout,
@@ -276,12 +293,80 @@ static void usage(char *prog) {
    fprintf(stdout, "                   by commas (no space). Leftmost is 1.\n");
    fprintf(stdout,
        "                   Multiple fields are incompatible with -n.\n");
+   fprintf(stdout,
+       "                   A field number may be followed by the type\n");
+   fprintf(stdout,
+       "                   of the field: %c (text, default), %c (integer),\n",
+       KEY_STRING, KEY_INT);
+   fprintf(stdout,
+       "                   %c (decimal number) or %c (YYYY-MM-DD date),\n",
+       KEY_DOUBLE, KEY_DATE);
+   fprintf(stdout,
+       "                   for instance 4%c,2 for (year, surname).\n",
+       KEY_INT);
+   fprintf(stdout,
+       "    -I n[,m..]   : columns of the file to keep in the index\n");
+   fprintf(stdout,
+       "                   next to the key, for \"iget\"\n");
+   fprintf(stdout,
+       "    -o           : read the rows that get finds in the order\n");
+   fprintf(stdout,
+       "                   of the file rather than of the keys\n");
+   fprintf(stdout,
+       "    -O           : same as -o, but show them in key order\n");
+   fprintf(stdout,
+       "    -j <n>       : threads for scans (default, 0: one per core)\n");
+   fprintf(stdout,
+       "    -F <rate>    : fill rate of nodes when the file is sorted\n");
+   fprintf(stdout,
+       "                   on the key and loaded bottom-up (default %.1f)\n",
+       bpltree_bulkfill(t));
+   fprintf(stdout,
+       "    -b <n>       : search nodes holding at least <n> keys by\n");
+   fprintf(stdout,
+       "                   halving rather than key by key (default %hd)\n",
+       bpltree_binsearch(t));
+   fprintf(stdout,
+       "    -H           : allocate the tree in huge pages if possible\n");
+   fprintf(stdout,
+       "    -i <image>   : search an index image saved with \"save\"\n");
+   fprintf(stdout,
+       "                   instead of indexing the text file, which\n");
+   fprintf(stdout,
+       "                   must be the one that was indexed\n");
+   fprintf(stdout,
+       "    -p <file>    : keep the tree in pages of <file>, which is\n");
+   fprintf(stdout,
+       "                   created, and the text file indexed into it,\n");
+   fprintf(stdout,
+       "                   if it doesn't exist; only the pages being\n");
+   fprintf(stdout,
+       "                   used are in memory (see -P)\n");
+   fprintf(stdout,
+       "    -P <n>       : read the image through a buffer pool of\n");
+   fprintf(stdout,
+       "                   <n> pages instead of mapping it (with -p,\n");
+   fprintf(stdout,
+       "                   the number of pages in memory)\n");
+   fprintf(stdout,
+       "    -l <log>     : log changes so that they survive a restart;\n");
+   fprintf(stdout,
+       "                   the tree is rebuilt from the last checkpoint\n");
+   fprintf(stdout,
+       "                   (<log>.ckpt) if any, otherwise from the text\n");
+   fprintf(stdout,
+       "                   file, then from the log\n");
 }
 
 int main(int argc, char **argv) {
+  BPLTREE_T *t = bpltree_new();
   KEY_POS_T keypos;
+  KEY_POS_T *kp = NULL;
+  long      kpcnt = 0;
+  long      kpmax = 0;
+  long      i;
   int       ch;
-  FILE     *fp;
+  FILE     *fp = NULL;
   int       preloaded = 0;
   char      feedback = SHOW_TREE;
   int       maxkeys;
@@ -294,16 +379,32 @@ int main(int argc, char **argv) {
   int       len;
   int       kw;
   char      ok;   // Flag
-  clock_t   begin;
-  clock_t   end;
+  double    begin;
+  double    end;
   char     *fields = NULL;
+  char      types[MAX_FIELDS + 1];
+  char      typed;
+  char     *image = NULL;
+  char     *paged = NULL;
+  char     *logname = NULL;
+  char      indexed = 0;
+  long      keycnt;
+  long      replayed = 0;
   char      sep;
   int       rows;
+  char      desc;
+  long      limit;
+  char    **keys;
+  long      nkeys;
+  float     fill;
+  int       binsearch;
+  int       threads;
+  long      frames;
 
   while ((ch = getopt(argc, argv, OPTIONS)) != -1) {
     switch (ch) {
       case 'x':
-        G_extended = 1;
+        bpltree_show_extended(1);
         break;
       case 'e':
         G_echo = 1;
@@ -320,67 +421,209 @@ int main(int argc, char **argv) {
           printf("Multiple fields are incompatible with -n\n");
           exit(1);
         }
-        bpltree_setnumeric();
+        bpltree_setnumeric(t);
+        break;
+      case 'u':
+        bpltree_setduplicates(t);
+        break;
+      case 'o':
+        bpltree_setfetch(t, FETCH_FILE);
+        break;
+      case 'O':
+        bpltree_setfetch(t, FETCH_SORTED);
+        break;
+      case 'j':
+        if ((sscanf(optarg, "%d", &threads) != 1) || (threads < 0)) {
+          printf("Invalid number of threads - using one per core\n");
+        } else {
+          bpltree_setthreads(t, (short)threads);
+        }
         break;
       case 'f':
-        // Quick check
+        // Quick check, and types of the fields if given
         p = optarg;
-        if (isdigit(*p)) {
-          while (*p && (isdigit(*p) || (*p == ','))) {
-            if ((*p == ',') && bpltree_numeric()) {
-              printf("Multiple fields are incompatible with -n\n");
-              exit(1);
-            }
+        i = 0;
+        typed = 0;
+        while (isdigit(*p)) {
+          while (isdigit(*p)) {
             p++;
           }
+          types[i] = KEY_STRING;
+          if (isalpha(*p)) {
+            types[i] = *p++;
+            typed = 1;
+          }
+          i++;
+          if ((*p != ',') || (i == MAX_FIELDS)) {
+            break;
+          }
+          if (bpltree_numeric(t)) {
+            printf("Multiple fields are incompatible with -n\n");
+            exit(1);
+          }
+          p++;
         }
-        if (*p) {
+        if (*p || (i == 0)) {
           printf("Invalid field specification");
           printf(" - comma-separated list of numbers expected\n");
           exit(1);
         }
+        types[i] = '\0';
+        if (typed && bpltree_setkeytypes(t, types)) {
+          printf("Invalid field type - %c, %c, %c or %c expected\n",
+                 KEY_STRING, KEY_INT, KEY_DOUBLE, KEY_DATE);
+          exit(1);
+        }
         fields = strdup(optarg);
         break;
+      case 'I':
+        if (bpltree_setincluded(t, optarg)) {
+          printf("Invalid column specification");
+          printf(" - comma-separated list of numbers expected\n");
+          exit(1);
+        }
+        break;
       case 's':
         if (!sscanf(optarg, "%c", &sep)) {
           printf("Invalid separator\n");
           exit(1);
         }
-        bpltree_setfilesep(sep);
+        bpltree_setfilesep(t, sep);
         break;
       case 'k':
         if (!sscanf(optarg, "%d", &maxkeys)) {
-          printf("Invalid max number of keys - using %d\n", bpltree_maxkeys());
+          printf("Invalid max number of keys - using %d\n", bpltree_maxkeys(t));
+        }
+        bpltree_setmaxkeys(t, maxkeys);
+        break;
+      case 'F':
+        if (sscanf(optarg, "%f", &fill) != 1) {
+          printf("Invalid fill rate - using %.1f\n", bpltree_bulkfill(t));
+        } else {
+          bpltree_setbulkfill(t, fill);
+        }
+        break;
+      case 'b':
+        if (sscanf(optarg, "%d", &binsearch) != 1) {
+          printf("Invalid number of keys - using %hd\n", bpltree_binsearch(t));
+        } else {
+          bpltree_setbinsearch(t, (short)binsearch);
+        }
+        break;
+      case 'H':
+        bpltree_sethugepages(t, 1);
+        break;
+      case 'i':
+        image = strdup(optarg);
+        break;
+      case 'p':
+        paged = strdup(optarg);
+        break;
+      case 'l':
+        logname = strdup(optarg);
+        break;
+      case 'P':
+        if ((sscanf(optarg, "%ld", &frames) != 1) || (frames <= 0)) {
+          printf("Invalid number of pages - mapping the image\n");
+        } else {
+          bpltree_setpool(t, frames);
         }
-        bpltree_setmaxkeys(maxkeys);
         break;
       case 'h':
       case '?':
       default:
-        usage(argv[0]);
+        usage(t, argv[0]);
         exit(1);
     }
   }
   argc -= optind;
   argv += optind;
+  if (paged && (image || logname)) {
+    fprintf(stderr, "-p cannot be used with -i or -l\n");
+    bpltree_free(t);
+    exit(1);
+  }
+  // An image or a checkpoint replaces the index,
+  // the file still holds the rows
+  if (image) {
+    if ((preloaded = (int)bpltree_map(t, image)) < 0) {
+      fprintf(stderr, "%s : %s\n",
+              bpltree_err_msg(), bpltree_err_info());
+      bpltree_free(t);
+      exit(1);
+    }
+    free(image);
+    indexed = 1;
+  } else if (paged) {
+    // Indexed unless just created
+    if ((preloaded = (int)bpltree_open(t, paged)) < 0) {
+      fprintf(stderr, "%s : %s\n",
+              bpltree_err_msg(), bpltree_err_info());
+      bpltree_free(t);
+      exit(1);
+    }
+    indexed = (preloaded > 0);
+    // Nodes aren't in memory to be shown
+    feedback = SHOW_NOTHING;
+  } else if (logname
+             && ((indexed = bpltree_recover(t, logname, &keycnt)) != 0)) {
+    if (indexed < 0) {
+      fprintf(stderr, "%s : %s\n",
+              bpltree_err_msg(), bpltree_err_info());
+      bpltree_free(t);
+      exit(1);
+    }
+    preloaded = (int)keycnt;
+  }
   if (argc) {
     strncpy(fname, argv[0], FILENAME_MAX);
-    if ((fp = fopen(fname, "r")) != NULL) {
-      keypos = read_key(fp, fields);
+    if ((fp = fopen(fname, "r")) == NULL) {
+      perror(fname);
+    } else {
+      // Rows are read from the mapped file if possible,
+      // included columns taken from it
+      (void)bpltree_mapdata(t, fp);
+    }
+    if (fp && !indexed) {
+      // Read everything first - if the file happens to be
+      // sorted on the key, the tree can be built bottom-up
+      keypos = read_key(t, fp, fields);
       while (keypos.key != NULL) {
-        if (bpltree_insert(keypos.key, keypos.pos)) {
-          fprintf(stderr, "%s : %s\n",
-                  bpltree_err_msg(), bpltree_err_info());
-          bpltree_free();
-          exit(1);
+        if (kpcnt == kpmax) {
+          kpmax = (kpmax ? 2 * kpmax : 1024);
+          kp = (KEY_POS_T *)realloc(kp, kpmax * sizeof(KEY_POS_T));
+          assert(kp);
         }
-        preloaded++;
-        keypos = read_key(fp, fields);
+        kp[kpcnt++] = keypos;
+        if (paged && (kpcnt == LOAD_BATCH)) {
+          // Keys go into a paged tree one by one anyway,
+          // only a batch is kept in memory
+          preloaded += (int)load(t, kp, kpcnt, paged);
+          kpcnt = 0;
+        }
+        keypos = read_key(t, fp, fields);
       }
-    } else {
-      perror(fname);
-    } 
-  } 
+      preloaded += (int)load(t, kp, kpcnt, paged);
+      free(kp);
+      if (paged && bpltree_checkpoint(t)) {
+        load_failed(t, paged);
+      }
+    }
+  }
+  if (paged) {
+    free(paged);
+  }
+  if (logname) {
+    // Changes made since the checkpoint, or since the file
+    // was first indexed
+    if ((replayed = bpltree_log(t, logname)) < 0) {
+      fprintf(stderr, "%s : %s\n",
+              bpltree_err_msg(), bpltree_err_info());
+      bpltree_free(t);
+      exit(1);
+    }
+    free(logname);
+  }
   if (fields) {
     free(fields);
     fields = NULL;
@@ -389,6 +632,9 @@ int main(int argc, char **argv) {
   if (preloaded) {
     printf("Indexed rows: %d\n", preloaded);
   }
+  if (replayed) {
+    printf("Changes replayed from the log: %ld\n", replayed);
+  }
   printf("Enter \"help\" for available commands.\n");
   while (read_cmd) {
     if (G_prompt) {
@@ -399,7 +645,7 @@ int main(int argc, char **argv) {
       }
     }
     if (fgets(line, LINE_LEN, stdin) == NULL) {
-      bpltree_free();
+      bpltree_free(t);
       printf("Goodbye\n");
       break;
     }
@@ -425,10 +671,10 @@ int main(int argc, char **argv) {
       }
       switch((kw = btplus_search(p))) {
           case BTPLUS_ID:
-              G_id = 1;
+              bpltree_show_ids(1);
               break;
           case BTPLUS_NOID:
-              G_id = 0;
+              bpltree_show_ids(0);
               break;
           case BTPLUS_AUTOTREE:
               feedback = SHOW_TREE;
@@ -447,30 +693,82 @@ int main(int argc, char **argv) {
               break;
           case BTPLUS_GET :
           case BTPLUS_GETTIME :
-              begin = clock();
-              rows = bpltree_get(q, fp, (kw == BTPLUS_GET));
-              end = clock();
+              desc = descending(q, &limit);
+              begin = seconds();
+              if (desc) {
+                rows = bpltree_get_desc(t, q, fp, (kw == BTPLUS_GET), limit);
+              } else {
+                rows = bpltree_get(t, q, fp, (kw == BTPLUS_GET));
+              }
+              end = seconds();
+              if (rows >= 0) {
+                if (rows == 0) {
+                  printf("No data found - ");
+                } else {
+                  printf("%d line%s selected - ", rows, (rows > 1 ? "s" : ""));
+                }
+                printf("%lfs\n", end - begin);
+              }
+              break;
+          case BTPLUS_COUNT :
+              begin = seconds();
+              rows = bpltree_count(t, q);
+              end = seconds();
+              if (rows >= 0) {
+                printf("%d row%s - %lfs\n", rows, (rows != 1 ? "s" : ""),
+                       end - begin);
+              }
+              break;
+          case BTPLUS_IGET :
+          case BTPLUS_IGETTIME :
+              begin = seconds();
+              rows = bpltree_iget(t, q, fp, (kw == BTPLUS_IGET));
+              end = seconds();
+              if (rows >= 0) {
+                if (rows == 0) {
+                  printf("No data found - ");
+                } else {
+                  printf("%d line%s selected - ", rows, (rows > 1 ? "s" : ""));
+                }
+                printf("%lfs\n", end - begin);
+              }
+              break;
+          case BTPLUS_MGET :
+          case BTPLUS_MGETTIME :
+              if ((keys = key_list(q, &nkeys)) == NULL) {
+                if (nkeys == 0) {
+                  printf("No key specified\n");
+                }
+                break;
+              }
+              begin = seconds();
+              rows = bpltree_mget(t, keys, nkeys, fp, (kw == BTPLUS_MGET));
+              end = seconds();
+              while (nkeys) {
+                free(keys[--nkeys]);
+              }
+              free(keys);
               if (rows >= 0) {
                 if (rows == 0) {
                   printf("No data found - ");
                 } else {
                   printf("%d line%s selected - ", rows, (rows > 1 ? "s" : ""));
                 }
-                printf("%lfs\n", (double)(end - begin) / CLOCKS_PER_SEC);
+                printf("%lfs\n", end - begin);
               }
               break;
           case BTPLUS_SCAN :
           case BTPLUS_SCANTIME :
-              begin = clock();
-              rows = bpltree_scan(q, fp, (kw == BTPLUS_SCAN));
-              end = clock();
+              begin = seconds();
+              rows = bpltree_scan(t, q, fp, (kw == BTPLUS_SCAN));
+              end = seconds();
               if (rows >= 0) {
                 if (rows == 0) {
                   printf("No data found - ");
                 } else {
                   printf("%d line%s selected - ", rows, (rows > 1 ? "s" : ""));
                 }
-                printf("%lfs\n", (double)(end - begin) / CLOCKS_PER_SEC);
+                printf("%lfs\n", end - begin);
               }
               break;
           case BTPLUS_ADD :
@@ -486,16 +784,11 @@ int main(int argc, char **argv) {
                 *q2++ = '\0';
                 if (sscanf(q2, "%lu", &off) == 1) {
                   ok = 1;
-                  if (bpltree_insert(q, off)) {
+                  if (bpltree_insert(t, q, off)) {
                     printf("%s\n", bpltree_err_msg());
                   } else {
                     if (feedback) {
-                      if (feedback == SHOW_TREE) {
-                         bpltree_display(bpltree_root(), 0);
-                      } else {
-                         list();
-                      }
-                      putchar('\n');
+                      show(t, feedback);
                     }
                   }
                 }
@@ -511,31 +804,54 @@ int main(int argc, char **argv) {
                 printf("-%s\n", q);
                 fflush(stdout);
               }
-              if (bpltree_delete(q) == 0) {
+              // With a position, only this row of the key goes
+              ok = 0;
+              bpltree_err_reset();
+              if ((q2 = strchr(q, ',')) != NULL) {
+                unsigned long off;
+                *q2++ = '\0';
+                if (sscanf(q2, "%lu", &off) == 1) {
+                  ok = (bpltree_delete_val(t, q, off) == 0 ? 1 : -1);
+                }
+              }
+              if ((ok == 0) && (q2 == NULL)) {
+                ok = (bpltree_delete(t, q) == 0 ? 1 : -1);
+              }
+              if (ok == 1) {
                 if (feedback) {
-                  if (feedback == SHOW_TREE) {
-                     bpltree_display(bpltree_root(), 0);
-                  } else {
-                     list();
-                  }
-                  putchar('\n');
+                  show(t, feedback);
                 }
+              } else if (ok == 0) {
+                printf("Expected : %s key[, <position>]\n",
+                       btplus_keyword(kw));
+              } else if (bpltree_err() != BPLT_ERR_NONE) {
+                printf("%s\n", bpltree_err_msg());
               } else {
                 printf("Key not found\n");
               }
               break;
+          case BTPLUS_SAVE :
+              if (*q == '\0') {
+                printf("Expected : %s <file>\n", btplus_keyword(kw));
+              } else if (bpltree_save(t, q)) {
+                printf("%s\n", bpltree_err_msg());
+              }
+              break;
+          case BTPLUS_CHECKPOINT :
+              if (bpltree_checkpoint(t)) {
+                printf("%s\n", bpltree_err_msg());
+              }
+              break;
           case BTPLUS_FIND :
           case BTPLUS_SEARCH :
-              bpltree_search(q);
+              bpltree_search(t, q);
               break;
           case BTPLUS_LIST :
-              list();
-              putchar('\n');
+              show(t, SHOW_LIST);
               break;
           case BTPLUS_SHOW :
           case BTPLUS_DISPLAY :
-              bpltree_display(bpltree_root(), 0);
-              putchar('\n');
+              show(t, SHOW_TREE);
               break;
           case BTPLUS_HELP :
               printf("Available commands:\n");
@@ -543,11 +859,24 @@ int main(int argc, char **argv) {
               printf(" ins <key>,<val>\n");
               printf("  or add <key>,<val>        : insert a (key,val) pair\n");
               printf(" rem <key> or del <key>     : remove a key\n");
+              printf(" del <key>,<val>            : remove a (key,val) pair only\n");
               printf(" get <key>[,<key>]          : retrieve info using the index\n");
               printf("                              ranges such as \",key\" or \"key,\" are supported\n");
               printf("                              composite keys are supported\n");
+              printf(" get <key>[,<key>] desc [n] : same as get, greatest keys first,\n");
+              printf("                              and only the first n rows if given\n");
               printf(" gettime <key>[,<key>]      : retrieve info using the index but\n");
               printf("                              only show time taken\n");
+              printf(" iget <key>[,<key>]         : same as get but only show the key\n");
+              printf("                              and the columns kept in the index\n");
+              printf("                              (see the -I flag)\n");
+              printf(" igettime <key>[,<key>]     : same as iget but only show time taken\n");
+              printf(" count <key>[,<key>]        : number of rows get would retrieve,\n");
+              printf("                              from the index only\n");
+              printf(" mget <key>,<key>[,...]\n");
+              printf("  or mget @<file>           : retrieve info for a batch of keys\n");
+              printf("                              (one per line in the file)\n");
+              printf(" mgettime <key>,<key>[,...] : same as mget but only show time taken\n");
               printf(" scan <key>[,<key>]         : retrieve info without using the index\n");
               printf(" scan <key>[,<key>]         : retrieve info without using the index\n");
               printf("                              ranges such as \",key\" or \"key,\" are supported\n");
@@ -558,6 +887,11 @@ int main(int argc, char **argv) {
               printf(" gettime <key>              : retrieve info using the index but\n");
               printf("                              only show time taken\n");
               printf(" find <key> or search <key> : display search path\n");
+              printf(" save <file>                : save the index as an image\n");
+              printf("                              (see the -i flag)\n");
+              printf(" checkpoint                 : save the tree and cut the log\n");
+              printf("                              (see the -l flag), or write\n");
+              printf("                              back a paged tree (see -p)\n");
               printf(" id                         : display id next to node (default)\n");
               printf(" noid                       : suppress id next to node\n");
               printf(" show or display            : display the tree\n");
@@ -573,7 +907,7 @@ int main(int argc, char **argv) {
           case BTPLUS_QUIT :
           case BTPLUS_STOP :
               read_cmd = 0;
-              bpltree_free();
+              bpltree_free(t);
               printf("Goodbye\n");
               break;
           default:
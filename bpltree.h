@@ -4,13 +4,76 @@
 
 #define DEF_MAX_KEYS  4
 #define DEF_FILL_RATE 0.5 
+#define DEF_BULK_FILL 1.0
+#define DEF_BIN_SEARCH 16   // Binary search in nodes from that many keys
 
 #define KEYSEP       ':'
 
+#define WAL_INSERT   'I'  // Log records (see bpltree_wal.c)
+#define WAL_DELETE   'D'
+#define WAL_REMOVE   'R'  // One position of a duplicate key
+
+// Keys are stored normalized (see bpltree_key.c): a 3-byte
+// header holding the length of the body (2 bytes, big-endian)
+// and its number of fields, then the body. Text fields are
+// each followed by a '\0', numbers and dates have a fixed
+// width and are stored so that bodies compare with memcmp().
+// The high bit of the number of fields is set when the last
+// field has a fixed width, and therefore no terminator.
+#define KEY_HDR         3
+#define KEY_TEXTLEN   256   // Buffer size for displaying a key
+#define KEY_FIXED    0x80
+#define _key_len(k)     (((((unsigned char *)(k))[0] & ~KEY_INCL) << 8) \
+                         | ((unsigned char *)(k))[1])
+#define _key_fields(k)  (((unsigned char *)(k))[2] & ~KEY_FIXED)
+#define _key_fixed(k)   (((unsigned char *)(k))[2] & KEY_FIXED)
+#define _key_body(k)    ((unsigned char *)(k) + KEY_HDR)
+
+// A key in a leaf may carry columns of its row (see
+// bpltree_incl.c) after the body: their length (2 bytes,
+// big-endian), then their text. KEY_INCL is then set in
+// the first byte of the header.
+#define KEY_INCL     0x80
+#define INCL_FIELDS    16   // Columns that can be included
+#define _key_incl(k)    (((unsigned char *)(k))[0] & KEY_INCL)
+#define _incl_len(k)    ((_key_body(k)[_key_len(k)] << 8) \
+                         | _key_body(k)[_key_len(k) + 1])
+#define _incl_text(k)   ((char *)_key_body(k) + _key_len(k) + 2)
+#define _key_size(k)    (KEY_HDR + _key_len(k) \
+                         + (_key_incl(k) ? 2 + _incl_len(k) : 0))
+
+// Types of key fields
+#define KEY_STRING    's'
+#define KEY_INT       'i'   // 64-bit
+#define KEY_DOUBLE    'f'
+#define KEY_DATE      'd'   // YYYY-MM-DD
+#define KEY_TYPES      16   // Fields that can be given a type
+
+// A leaf slot holds an offset in the file (-1 if the file
+// cannot seek), or if the tree accepts duplicates, maybe a
+// list of them (see bpltree_post.c)
+#define _is_posting(pos)  ((pos) < -1)
+
+// Order in which rows found with the index are read
+// (see bpltree_search.c)
+#define FETCH_KEY       0   // As keys come
+#define FETCH_FILE      1   // By offset, shown as read
+#define FETCH_SORTED    2   // By offset, shown in key order
+#define FETCH_NONE      3   // Not read, only counted
+
 #define _is_leaf(n)  (n->is_leaf)
-#define MIN_KEYS     (int)(bpltree_maxkeys() * bpltree_fillrate())
+#define MIN_KEYS(t)  (int)((t)->maxkeys * (t)->fillrate)
 
 struct node_t;
+struct arena_t;
+struct latch_t;
+struct image_t;
+struct pool_t;
+struct wal_t;
+
+// Order-preserving prefix of a key, stored inline in nodes
+// so that most comparisons don't need to fetch the key itself
+typedef unsigned long long PREFIX_T;
 
 // Convenience structures
 typedef struct redirect_t {
@@ -35,6 +98,7 @@ typedef struct internal_node_t {
 typedef struct leaf_node_t {
           KEY_POS_T     *k;      // 1 + maximum number of keys
           struct node_t *next;   // Link leaf nodes for range searches
+          struct node_t *prev;   // and for descending ones
          } LEAF_NODE_T;
 
 typedef struct node_t {
@@ -42,6 +106,10 @@ typedef struct node_t {
           short               id;       // For educational purposes
           short               keycnt;
           struct node_t      *parent;   // Helps when deleting
+          PREFIX_T           *pfx;      // Key prefixes, same slots as k
+          unsigned long       version;  // See bpltree_latch.c
+          unsigned long       epoch;    // Of the content
+          struct node_t      *older;    // Copies kept for snapshots
           union {
              INTERNAL_NODE_T  internal;
              LEAF_NODE_T      leaf;
@@ -54,34 +122,262 @@ typedef struct keyloc_t {
           short    pos;
          } KEYLOC_T;
 
-extern void     bpltree_setfilesep(char sep);
-extern char     bpltree_filesep(void);
-extern void     bpltree_setnumeric(void);
-extern char     bpltree_numeric(void);
-extern void     bpltree_setmaxkeys(short n);
-extern short    bpltree_maxkeys(void);
-extern float    bpltree_fillrate(void);
-extern NODE_T  *bpltree_root(void);
-extern void     bpltree_setroot(NODE_T *n);
-extern int      bpltree_insert(char *key, unsigned long val);
-extern int      bpltree_delete(char *key);
-extern void     bpltree_search(char *key);
-extern void     bpltree_free(void);
-extern void     bpltree_show_node(NODE_T *n, short indent);
-extern void     bpltree_display(NODE_T *n, int blanks);
-extern int      bpltree_keycmp(char *k1, char *k2, char sep);
-extern KEYLOC_T bpltree_find_key(char *key);
-extern int      bpltree_get(char *key, FILE *fp, char show_data);
-extern int      bpltree_scan(char *key, FILE *fp, char show_data);
+// A tree as it was at some point (see bpltree_latch.c)
+typedef struct snapshot_t {
+          NODE_T         *root;
+          unsigned long   epoch;
+         } SNAPSHOT_T;
+
+// How rows of the text file are read (see bpltree_data.c)
+#define DATA_SEQUENTIAL   's'
+#define DATA_RANDOM       'r'
+
+typedef struct data_t {
+          FILE           *fp;
+          char           *base;      // Of the mapped file, or NULL
+          size_t          size;
+          off_t           at;        // Where the next row starts
+          char           *buf;       // For rows read with stdio
+          size_t          bufsz;
+         } DATA_T;
+
+// Rows to read from the file (see bpltree_search.c)
+typedef struct rows_t {
+          DATA_T          data;
+          char            show;      // Rows are displayed
+          char            fetch;     // FETCH_xxx
+          char            once;      // Offsets may come several times,
+                                     // rows are read once
+          off_t          *offs;      // Kept to be read later
+          long            cnt;
+          long            max;
+          int             count;     // Rows read, -1 if one can't be
+         } ROWS_T;
+
+// A tree and its settings. Every public function takes one,
+// so that a process can hold several independent trees.
+// Any number of threads can search and change a tree at
+// the same time (see bpltree_latch.c).
+typedef struct bpltree_t {
+          NODE_T          *root;
+          short            maxkeys;
+          float            fillrate;
+          float            bulkfill;
+          short            binsearch;
+          char             numeric;   // Keys are a single number or date
+          char             types[KEY_TYPES];  // Of key fields, 0 is text
+          char             dupl;      // Duplicate keys accepted
+          char             fetch;     // Order rows are read in
+          short            threads;   // For scans, 0 for one per core
+          unsigned char    incl[INCL_FIELDS + 1];  // Columns kept
+                                      // in leaves, 0 ends
+          char             sep;       // Field separator in the file
+          short            last_id;   // Of nodes
+          struct arena_t  *arena;     // Where nodes and keys live
+          struct latch_t  *latch;     // Who reads and who writes
+          struct image_t  *image;     // Saved in a file, read-only
+                                      // unless a paged tree
+          long             poolsize;  // Pages kept of an image, 0 maps it
+          struct wal_t    *wal;       // Where changes are logged, if set
+          DATA_T          *data;      // The text file, if mapped
+        } BPLTREE_T;
+
+// Where a range is gone through (see bpltree_cursor.c)
+typedef struct cursor_t {
+          BPLTREE_T       *t;
+          SNAPSHOT_T      *snap;      // Pinned by the thread, or NULL
+                                      // to read the live tree
+          char             desc;      // Greatest keys first
+          char            *low_key;   // Bounds, normalized, or NULL
+          char            *high_key;
+          PREFIX_T         lpfx;
+          PREFIX_T         hpfx;
+          NODE_T          *n;         // Next leaf to read, or NULL
+          short            pos;       // Where to start in it, -1 for
+                                      // its end
+          KEY_POS_T       *entries;   // Of the last leaf read
+          short            cnt;
+          short            at;        // Next entry to hand out
+          off_t           *offs;      // Of the entry, if a list
+          long             offcnt;
+          long             offat;
+          // Live trees only
+          unsigned long    v;         // Of n when it was reached
+          char             lost;      // Where to go on must be found
+                                      // again
+          char            *resume;    // Last key seen, a copy
+          int              resume_len;
+          char           **copies;    // Keys of the leaves read
+          long             copycnt;
+          long             copymax;
+         } CURSOR_T;
+
+extern BPLTREE_T *bpltree_new(void);
+extern void     bpltree_setfilesep(BPLTREE_T *t, char sep);
+extern char     bpltree_filesep(BPLTREE_T *t);
+extern void     bpltree_setnumeric(BPLTREE_T *t);
+extern char     bpltree_numeric(BPLTREE_T *t);
+extern int      bpltree_setkeytypes(BPLTREE_T *t, char *types);
+extern void     bpltree_setduplicates(BPLTREE_T *t);
+extern char     bpltree_duplicates(BPLTREE_T *t);
+extern void     bpltree_setfetch(BPLTREE_T *t, char how);
+extern char     bpltree_fetch(BPLTREE_T *t);
+extern void     bpltree_setthreads(BPLTREE_T *t, short n);
+extern short    bpltree_threads(BPLTREE_T *t);
+extern void     bpltree_setmaxkeys(BPLTREE_T *t, short n);
+extern short    bpltree_maxkeys(BPLTREE_T *t);
+extern float    bpltree_fillrate(BPLTREE_T *t);
+extern void     bpltree_setbulkfill(BPLTREE_T *t, float f);
+extern float    bpltree_bulkfill(BPLTREE_T *t);
+extern void     bpltree_setbinsearch(BPLTREE_T *t, short n);
+extern short    bpltree_binsearch(BPLTREE_T *t);
+extern NODE_T  *bpltree_root(BPLTREE_T *t);
+extern void     bpltree_setroot(BPLTREE_T *t, NODE_T *n);
+extern int      bpltree_setincluded(BPLTREE_T *t, char *fields);
+extern int      bpltree_insert(BPLTREE_T *t, char *key, unsigned long val);
+extern int      bpltree_delete(BPLTREE_T *t, char *key);
+extern int      bpltree_delete_val(BPLTREE_T *t, char *key,
+                                   unsigned long val);
+extern long     bpltree_load(BPLTREE_T *t, KEY_POS_T *kp, long cnt);
+extern void     bpltree_search(BPLTREE_T *t, char *key);
+extern void     bpltree_free(BPLTREE_T *t);
+extern void     bpltree_sethugepages(BPLTREE_T *t, char on);
+extern void     bpltree_setpool(BPLTREE_T *t, long frames);
+extern void     bpltree_show_extended(char on);
+extern void     bpltree_show_ids(char on);
+extern void     bpltree_show_node(BPLTREE_T *t, NODE_T *n, short indent);
+extern void     bpltree_display(BPLTREE_T *t, NODE_T *n, int blanks);
+extern int      bpltree_show_tree(BPLTREE_T *t);
+extern char    *bpltree_keyencode(BPLTREE_T *t, char *text);
+extern char    *bpltree_keytext(BPLTREE_T *t, char *key, char *buf, int len);
+extern int      bpltree_keycmp(char *k1, char *k2);
+extern PREFIX_T bpltree_keyprefix(char *key);
+extern int      bpltree_pfxcmp(BPLTREE_T *t, PREFIX_T pfx, PREFIX_T other);
+extern int      bpltree_nodecmp(BPLTREE_T *t, NODE_T *n, short i,
+                                char *key, PREFIX_T pfx);
+extern short    bpltree_nodesearch(BPLTREE_T *t, NODE_T *n, char *key,
+                                   PREFIX_T pfx, int *cmp);
+extern KEYLOC_T bpltree_find_key(BPLTREE_T *t, char *text);
+extern int      bpltree_get(BPLTREE_T *t, char *key, FILE *fp,
+                            char show_data);
+extern int      bpltree_get_desc(BPLTREE_T *t, char *key, FILE *fp,
+                                 char show_data, long limit);
+extern int      bpltree_count(BPLTREE_T *t, char *key);
+extern CURSOR_T *bpltree_cursor_open(BPLTREE_T *t, char desc);
+extern int      bpltree_cursor_seek(CURSOR_T *c, char *low, char *high);
+extern long     bpltree_cursor_next(CURSOR_T *c, KEY_POS_T *buf, long n);
+extern long     bpltree_cursor_count(CURSOR_T *c);
+extern void     bpltree_cursor_close(CURSOR_T *c);
+extern int      bpltree_iget(BPLTREE_T *t, char *key, FILE *fp,
+                             char show_data);
+extern int      bpltree_mget(BPLTREE_T *t, char **keys, long cnt,
+                             FILE *fp, char show_data);
+extern int      bpltree_scan(BPLTREE_T *t, char *key, FILE *fp,
+                             char show_data);
+extern int      bpltree_mapdata(BPLTREE_T *t, FILE *fp);
+extern void     bpltree_snapshot(BPLTREE_T *t);
+extern void     bpltree_snapshot_end(BPLTREE_T *t);
+extern int      bpltree_save(BPLTREE_T *t, char *fname);
+extern long     bpltree_map(BPLTREE_T *t, char *fname);
+extern long     bpltree_open(BPLTREE_T *t, char *fname);
+extern long     bpltree_restore(BPLTREE_T *t, char *fname);
+extern int      bpltree_recover(BPLTREE_T *t, char *logname, long *keycnt);
+extern long     bpltree_log(BPLTREE_T *t, char *logname);
+extern int      bpltree_checkpoint(BPLTREE_T *t);
 // For debugging
-extern char     bpltree_check(NODE_T *n, char *prev_key);
+extern char     bpltree_check(BPLTREE_T *t, NODE_T *n, char *prev_key);
 
 
-extern char    *key_duplicate(char *key);
-extern NODE_T  *new_node(NODE_T *parent, char leaf);
+extern char    *key_duplicate(BPLTREE_T *t, char *key);
+extern char    *key_entry(BPLTREE_T *t, char *key);
+extern char    *key_encode(BPLTREE_T *t, char *text, char in_arena);
+extern NODE_T  *new_node(BPLTREE_T *t, NODE_T *parent, char leaf);
 extern NODE_T  *left_sibling(NODE_T *n, short *sep_pos);
 extern NODE_T  *right_sibling(NODE_T *n, short *sep_pos);
-extern NODE_T  *find_node(NODE_T *tree, char *key);
-extern short    find_pos(NODE_T *n, char *key, char present, short lvl);
+extern NODE_T  *find_node(BPLTREE_T *t, NODE_T *tree, char *key);
+extern NODE_T  *find_leaf(BPLTREE_T *t, char *key, unsigned long *version);
+extern NODE_T  *start_leaf(BPLTREE_T *t, char *key, char after,
+                           unsigned long *version, short *pos);
+extern short    find_pos(BPLTREE_T *t, NODE_T *n, char *key,
+                         char present, short lvl);
+extern char    *incl_attach(BPLTREE_T *t, char *key, off_t pos,
+                             char in_arena);
+extern void     incl_show(BPLTREE_T *t, char *key, char *row, size_t len);
+extern void     data_unmap(BPLTREE_T *t);
+extern void     data_open(BPLTREE_T *t, DATA_T *d, FILE *fp, char access);
+extern void     data_close(DATA_T *d);
+extern char    *data_row(DATA_T *d, off_t offset, size_t *len);
+extern char    *data_next(DATA_T *d, size_t *len);
+extern void     data_rewind(DATA_T *d);
+extern void     rows_begin(BPLTREE_T *t, ROWS_T *r, FILE *fp,
+                           char show_data);
+extern void     rows_add(ROWS_T *r, off_t offset);
+extern int      rows_end(ROWS_T *r);
+extern void     load_sorted(BPLTREE_T *t, KEY_POS_T *kp, long cnt);
+extern int      sort_keys(BPLTREE_T *t, KEY_POS_T *kp, long cnt);
+extern short    bpltree_numcount(PREFIX_T *p, short cnt, PREFIX_T key);
+extern short    bpltree_fieldsplit(char *row, size_t len, char sep,
+                                   unsigned int *ends, short max,
+                                   size_t *rowlen);
+extern off_t    posting_build(BPLTREE_T *t, off_t *offs, long cnt);
+extern long     posting_count(off_t pos);
+extern off_t   *posting_offsets(off_t pos, long *cnt);
+extern void     posting_free(BPLTREE_T *t, off_t pos);
+extern int      posting_add(BPLTREE_T *t, off_t *pos, off_t val);
+extern int      posting_remove(BPLTREE_T *t, off_t *pos, off_t val);
+extern long     posting_group(BPLTREE_T *t, KEY_POS_T *kp, long cnt);
+extern size_t   posting_pack(off_t pos, unsigned char **buf);
+extern size_t   posting_pack_offsets(off_t *offs, long cnt,
+                                     unsigned char **buf);
+extern off_t   *posting_unpack(unsigned char *buf, long *cnt);
+extern struct arena_t *arena_new(void);
+extern void     arena_hugepages(struct arena_t *a, char on);
+extern NODE_T  *arena_node(struct arena_t *a, short maxkeys, char leaf);
+extern void     arena_free_node(struct arena_t *a, NODE_T *n);
+extern char    *arena_key(struct arena_t *a, size_t len);
+extern void     arena_free_key(struct arena_t *a, char *key);
+extern char    *arena_block(struct arena_t *a, size_t len);
+extern void     arena_free_block(struct arena_t *a, void *p, size_t len);
+extern void     arena_release(struct arena_t *a);
+extern struct latch_t *latch_new(void);
+extern void     latch_destroy(struct latch_t *l);
+extern void     latch_writer_begin(BPLTREE_T *t);
+extern void     latch_writer_end(BPLTREE_T *t);
+extern void     latch_reader_begin(BPLTREE_T *t);
+extern void     latch_reader_end(BPLTREE_T *t);
+extern void     latch_root(BPLTREE_T *t);
+extern void     latch_write(BPLTREE_T *t, NODE_T *n);
+extern void     latch_release_above(BPLTREE_T *t, NODE_T *n);
+extern NODE_T  *latch_held(short i);
+extern char     latch_freed(NODE_T *n);
+extern void     latch_new_node(NODE_T *n);
+extern unsigned long latch_read(NODE_T *n);
+extern char     latch_check(NODE_T *n, unsigned long version);
+extern void     latch_free_node(BPLTREE_T *t, NODE_T *n);
+extern void     latch_free_key(BPLTREE_T *t, char *key);
+extern void     latch_free_block(BPLTREE_T *t, void *p, size_t len);
+extern void     latch_snapshot_take(BPLTREE_T *t, SNAPSHOT_T *s);
+extern void     latch_snapshot_drop(BPLTREE_T *t, SNAPSHOT_T *s);
+extern SNAPSHOT_T *latch_snapshot(BPLTREE_T *t);
+extern NODE_T  *latch_snapshot_node(SNAPSHOT_T *s, NODE_T *n,
+                                    unsigned long *version);
+extern int      image_get(BPLTREE_T *t, char *low_key, char *high_key,
+                          ROWS_T *r);
+extern void     image_release(struct image_t *img);
+extern short    image_err(BPLTREE_T *t);
+extern int      page_insert(BPLTREE_T *t, char *key, off_t val);
+extern int      page_delete(BPLTREE_T *t, char *key, off_t *val);
+extern int      page_checkpoint(BPLTREE_T *t);
+extern struct pool_t *pool_new(int fd, size_t page, long frames);
+extern char    *pool_pin(struct pool_t *p, off_t pageno);
+extern void     pool_unpin(struct pool_t *p, void *data, char dirty);
+extern int      pool_read(struct pool_t *p, off_t off, void *buf, size_t len);
+extern int      pool_write(struct pool_t *p, off_t off, void *buf, size_t len);
+extern int      pool_flush(struct pool_t *p);
+extern void     pool_release(struct pool_t *p);
+extern off_t    wal_append(BPLTREE_T *t, char op, char *key,
+                           unsigned long val);
+extern int      wal_commit(BPLTREE_T *t, off_t lsn);
+extern void     wal_close(struct wal_t *w);
 
 #endif
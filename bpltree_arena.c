@@ -0,0 +1,242 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_arena.c
+ *
+ *  Memory for the tree.
+ *
+ *  Nodes (with their slot and prefix arrays in the same block)
+ *  and keys are carved from large pages obtained with mmap(),
+ *  nodes in some pages and keys in others. What is freed goes
+ *  to free lists - one for nodes, which all have the same size,
+ *  and one per size class for keys - and is reused first. Other
+ *  blocks of any size (posting lists) share the pages and the
+ *  classes of keys, and are freed with their size.
+ *  Freeing the tree is giving the pages back. Each tree has
+ *  its own arena, which writers working at the same time share.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "debug.h"
+
+#define ARENA_PAGE     (2 * 1024 * 1024)  // Size of a huge page
+#define ALIGN          64                 // Cache line
+#define SMALL_STEP      8                 // Key classes up to SMALL_MAX
+#define SMALL_MAX     256                 // go by SMALL_STEP, then
+#define SMALL_CLASSES  (SMALL_MAX / SMALL_STEP)
+#define LARGE_CLASSES   9                 // double up to 128KB
+
+#define _round(x, r)   (((x) + (r) - 1) / (r) * (r))
+
+typedef struct page_t {
+           struct page_t *next;
+           size_t         size;
+         } PAGE_T;
+
+typedef struct free_t {
+           struct free_t *next;
+         } FREE_T;
+
+typedef struct arena_t {
+           PAGE_T *pages;
+           long    pagecnt;
+           char   *node_cur;   // Where the next node goes
+           char   *node_end;
+           char   *key_cur;    // Where the next key goes
+           char   *key_end;
+           FREE_T *free_nodes;
+           FREE_T *free_keys[SMALL_CLASSES + LARGE_CLASSES];
+           size_t  node_size;
+           char    hugepages;
+           pthread_mutex_t lock;  // Writers share the arena
+         } ARENA_T;
+
+extern ARENA_T *arena_new(void) {
+    ARENA_T *a = (ARENA_T *)calloc(1, sizeof(ARENA_T));
+
+    assert(a);
+    (void)pthread_mutex_init(&(a->lock), NULL);
+    return a;
+}
+
+extern void arena_hugepages(ARENA_T *a, char on) {
+    a->hugepages = on;
+}
+
+static char *new_page(ARENA_T *a, size_t needed, char **end) {
+    // Returns where data can go in a new page
+    // and sets *end to the end of the page
+    size_t  size = _round(needed + ALIGN, ARENA_PAGE);
+    void   *p = MAP_FAILED;
+    PAGE_T *page;
+
+#ifdef MAP_HUGETLB
+    if (a->hugepages) {
+      // Only works if huge pages have been reserved
+      p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (p == MAP_FAILED) {
+      p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      assert(p != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+      if (a->hugepages) {
+        // Transparent huge pages, if enabled
+        (void)madvise(p, size, MADV_HUGEPAGE);
+      }
+#endif
+    }
+    page = (PAGE_T *)p;
+    page->size = size;
+    page->next = a->pages;
+    a->pages = page;
+    a->pagecnt++;
+    *end = (char *)p + size;
+    return (char *)p + ALIGN;
+}
+
+extern NODE_T *arena_node(ARENA_T *a, short maxkeys, char leaf) {
+    // Returns a zeroed node, slot and prefix arrays included
+    NODE_T        *n;
+    size_t         slots = 1 + maxkeys;
+    unsigned long  version;
+
+    (void)pthread_mutex_lock(&(a->lock));
+    if (a->node_size == 0) {
+      assert(sizeof(KEY_POS_T) == sizeof(REDIRECT_T));
+      a->node_size = _round(_round(sizeof(NODE_T), sizeof(KEY_POS_T))
+                           + slots * sizeof(KEY_POS_T)
+                           + slots * sizeof(PREFIX_T), ALIGN);
+    }
+    if (a->free_nodes) {
+      n = (NODE_T *)a->free_nodes;
+      a->free_nodes = a->free_nodes->next;
+      (void)pthread_mutex_unlock(&(a->lock));
+      // The version survives (see latch_new_node())
+      version = n->version;
+      memset(n, 0, a->node_size);
+      n->version = version;
+    } else {
+      // Fresh pages are zeroed
+      if (a->node_cur + a->node_size > a->node_end) {
+        a->node_cur = new_page(a, a->node_size, &(a->node_end));
+      }
+      n = (NODE_T *)a->node_cur;
+      a->node_cur += a->node_size;
+      (void)pthread_mutex_unlock(&(a->lock));
+    }
+    if (leaf) {
+      n->node.leaf.k = (KEY_POS_T *)((char *)n
+                         + _round(sizeof(NODE_T), sizeof(KEY_POS_T)));
+    } else {
+      n->node.internal.k = (REDIRECT_T *)((char *)n
+                         + _round(sizeof(NODE_T), sizeof(KEY_POS_T)));
+    }
+    n->pfx = (PREFIX_T *)((char *)n
+                         + _round(sizeof(NODE_T), sizeof(KEY_POS_T))
+                         + slots * sizeof(KEY_POS_T));
+    return n;
+}
+
+extern void arena_free_node(ARENA_T *a, NODE_T *n) {
+    if (n) {
+      (void)pthread_mutex_lock(&(a->lock));
+      ((FREE_T *)n)->next = a->free_nodes;
+      a->free_nodes = (FREE_T *)n;
+      (void)pthread_mutex_unlock(&(a->lock));
+    }
+}
+
+static short key_class(size_t len, size_t *size) {
+    // Size class of a key of len bytes, *size is set
+    // to the size of the blocks in that class
+    short  c = SMALL_CLASSES;
+    size_t sz = 2 * SMALL_MAX;
+
+    if (len <= SMALL_MAX) {
+      *size = _round(len, SMALL_STEP);
+      return (short)(*size / SMALL_STEP - 1);
+    }
+    while (sz < len) {
+      sz *= 2;
+      c++;
+    }
+    assert(c < SMALL_CLASSES + LARGE_CLASSES);
+    *size = sz;
+    return c;
+}
+
+extern char *arena_block(ARENA_T *a, size_t len) {
+    // Room for len bytes, among the keys
+    size_t  size;
+    short   c = key_class(len, &size);
+    char   *k;
+
+    (void)pthread_mutex_lock(&(a->lock));
+    if (a->free_keys[c]) {
+      k = (char *)a->free_keys[c];
+      a->free_keys[c] = a->free_keys[c]->next;
+    } else {
+      if (a->key_cur + size > a->key_end) {
+        // What is left of the current page is lost
+        a->key_cur = new_page(a, size, &(a->key_end));
+      }
+      k = a->key_cur;
+      a->key_cur += size;
+    }
+    (void)pthread_mutex_unlock(&(a->lock));
+    return k;
+}
+
+extern void arena_free_block(ARENA_T *a, void *p, size_t len) {
+    // len is what was asked for when p was obtained
+    size_t size;
+    short  c;
+
+    if (p) {
+      c = key_class(len, &size);
+      (void)pthread_mutex_lock(&(a->lock));
+      ((FREE_T *)p)->next = a->free_keys[c];
+      a->free_keys[c] = (FREE_T *)p;
+      (void)pthread_mutex_unlock(&(a->lock));
+    }
+}
+
+extern char *arena_key(ARENA_T *a, size_t len) {
+    // Room for a key of len bytes
+    return arena_block(a, len);
+}
+
+extern void arena_free_key(ARENA_T *a, char *key) {
+    if (key) {
+      arena_free_block(a, key, _key_size(key));
+    }
+}
+
+extern void arena_release(ARENA_T *a) {
+    // Gives the pages back - the arena itself can be reused
+    PAGE_T *p;
+
+    debug(0, "releasing %ld page%s", a->pagecnt,
+          (a->pagecnt > 1 ? "s" : ""));
+    while (a->pages) {
+      p = a->pages;
+      a->pages = p->next;
+      (void)munmap(p, p->size);
+    }
+    a->pagecnt = 0;
+    a->node_cur = a->node_end = NULL;
+    a->key_cur = a->key_end = NULL;
+    a->free_nodes = NULL;
+    memset(a->free_keys, 0, sizeof(a->free_keys));
+    a->node_size = 0;
+}
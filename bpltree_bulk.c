@@ -0,0 +1,233 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_bulk.c
+ *
+ *  Bottom-up construction of a B+tree from sorted keys.
+ *
+ *  When keys are sorted there is no need to descend from the
+ *  root for each of them and to split nodes over and over again:
+ *  leaves can be filled from left to right, then the level above
+ *  them, and so forth up to the root. Unsorted keys are sorted
+ *  first (see bpltree_sort.c).
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "debug.h"
+
+static char check_sorted(BPLTREE_T *t, KEY_POS_T *kp, long cnt) {
+    // kp holds normalized keys.
+    // Returns 1 if keys are in strictly ascending order,
+    // 0 if they aren't, -1 if a key is duplicated
+    // (no point in going further, insertion would fail too).
+    // If the tree accepts duplicates, the same key must
+    // come with positions in ascending order.
+    long  i;
+    int   cmp;
+    char  buff[KEY_TEXTLEN];
+
+    for (i = 1; i < cnt; i++) {
+      cmp = bpltree_keycmp(kp[i-1].key, kp[i].key);
+      if ((cmp == 0) && t->dupl) {
+        cmp = (kp[i-1].pos < kp[i].pos ? -1
+                                       : (kp[i-1].pos > kp[i].pos ? 1 : 0));
+      }
+      if (cmp == 0) {
+        bpltree_err_seterr(BPLT_ERR_DUPL,
+                           bpltree_keytext(t, kp[i].key, buff, KEY_TEXTLEN));
+        return -1;
+      }
+      if (cmp > 0) {
+        debug(0, "key %ld out of order - not bulk-loading", i);
+        return 0;
+      }
+    }
+    return 1;
+}
+
+static long level_nodes(long items, short cap, short lo) {
+    // Number of nodes needed to hold 'items' entries
+    // (keys in leaves, children in internal nodes)
+    // with at most 'cap' and at least 'lo' entries per node.
+    long cnt = (items + cap - 1) / cap;
+
+    while ((cnt > 1) && (items / cnt < lo)) {
+      cnt--;
+    }
+    return cnt;
+}
+
+static short fill_cap(BPLTREE_T *t) {
+    // Number of keys we put into a bulk-loaded node
+    short cap = (short)(t->maxkeys * t->bulkfill + 0.5);
+
+    if (cap > t->maxkeys) {
+      cap = t->maxkeys;
+    }
+    if (cap < 1) {
+      cap = 1;
+    }
+    return cap;
+}
+
+static NODE_T *build(BPLTREE_T *t, KEY_POS_T *kp, long cnt) {
+    // Builds the tree from sorted normalized keys, which
+    // go to the leaves as they are, and returns its root.
+    // nodes[] holds the nodes of the level being built and
+    // greatest[] the greatest key found under each of them,
+    // which is the separator to move up to the next level.
+    NODE_T **nodes;
+    char   **greatest;
+    NODE_T  *n;
+    long     nodecnt;
+    long     j;
+    long     k;
+    short    i;
+    short    sz;
+    short    cap = fill_cap(t);
+    short    lo = (MIN_KEYS(t) > 0 ? MIN_KEYS(t) : 1);
+
+    // Leaves first
+    nodecnt = level_nodes(cnt, cap, lo);
+    debug(0, "bulk-loading %ld keys into %ld leaves", cnt, nodecnt);
+    nodes = (NODE_T **)malloc(nodecnt * sizeof(NODE_T *));
+    greatest = (char **)malloc(nodecnt * sizeof(char *));
+    assert(nodes && greatest);
+    k = 0;
+    for (j = 0; j < nodecnt; j++) {
+      sz = (short)(cnt / nodecnt + (j < cnt % nodecnt ? 1 : 0));
+      assert(sz <= t->maxkeys);
+      n = new_node(t, NULL, 1);
+      for (i = 0; i < sz; i++) {
+        n->node.leaf.k[i].key = kp[k].key;
+        n->node.leaf.k[i].pos = kp[k].pos;
+        n->pfx[i] = bpltree_keyprefix(kp[k].key);
+        k++;
+      }
+      n->keycnt = sz;
+      if (j) {
+        nodes[j-1]->node.leaf.next = n;
+        n->node.leaf.prev = nodes[j-1];
+      }
+      nodes[j] = n;
+      greatest[j] = n->node.leaf.k[sz-1].key;
+    }
+    // Then internal levels, until only one node is left.
+    // A level is written over the one below it, which is
+    // safe since we never write beyond what we have read.
+    cnt = nodecnt;
+    while (cnt > 1) {
+      nodecnt = level_nodes(cnt, cap + 1, lo + 1);
+      debug(0, "%ld nodes in the level above", nodecnt);
+      k = 0;
+      for (j = 0; j < nodecnt; j++) {
+        sz = (short)(cnt / nodecnt + (j < cnt % nodecnt ? 1 : 0));
+        assert((sz > 1) && (sz <= t->maxkeys + 1));
+        n = new_node(t, NULL, 0);
+        n->node.internal.k[0].bigger = nodes[k];
+        nodes[k]->parent = n;
+        k++;
+        for (i = 1; i < sz; i++) {
+          n->node.internal.k[i].key = key_duplicate(t, greatest[k-1]);
+          n->pfx[i] = bpltree_keyprefix(greatest[k-1]);
+          n->node.internal.k[i].bigger = nodes[k];
+          nodes[k]->parent = n;
+          k++;
+        }
+        n->keycnt = sz - 1;
+        nodes[j] = n;
+        greatest[j] = greatest[k-1];
+      }
+      cnt = nodecnt;
+    }
+    n = nodes[0];
+    free(nodes);
+    free(greatest);
+    return n;
+}
+
+extern void load_sorted(BPLTREE_T *t, KEY_POS_T *kp, long cnt) {
+    // Builds an empty tree from normalized keys that are
+    // already in the arena, sorted and unique (positions
+    // of duplicate keys grouped, see posting_group())
+    latch_writer_begin(t);
+    latch_root(t);
+    assert(t->root == NULL);
+    if (cnt > 0) {
+      bpltree_setroot(t, build(t, kp, cnt));
+    }
+    latch_writer_end(t);
+}
+
+extern long bpltree_load(BPLTREE_T *t, KEY_POS_T *kp, long cnt) {
+    // Loads (key, position) pairs as read from a file.
+    // If the tree is empty, keys are sorted if needed and
+    // the tree is built bottom-up, otherwise (and always in
+    // a paged tree) keys are inserted one by one. Returns
+    // the number of keys loaded, -1 if something went wrong.
+    long       i;
+    long       n;
+    long       keycnt;
+    KEY_POS_T *work;
+    char       sorted = -1;
+    char       empty;
+
+    debug(0, ">> bpltree_load");
+    if ((kp == NULL) || (cnt <= 0)) {
+      return 0;
+    }
+    latch_writer_begin(t);
+    latch_root(t);
+    if ((empty = ((t->root == NULL) && (t->image == NULL))) != 0) {
+      // Work on normalized keys, without touching the
+      // caller's array. They are allocated where the tree
+      // will keep them.
+      work = (KEY_POS_T *)malloc(cnt * sizeof(KEY_POS_T));
+      assert(work);
+      for (n = 0; n < cnt; n++) {
+        if ((work[n].key = key_encode(t, kp[n].key, 1)) == NULL) {
+          break;
+        }
+        work[n].key = incl_attach(t, work[n].key, kp[n].pos, 1);
+        work[n].pos = kp[n].pos;
+      }
+      if (n == cnt) {
+        sorted = check_sorted(t, work, cnt);
+      }
+      if ((sorted == 0) && sort_keys(t, work, cnt)) {
+        sorted = -1;
+      }
+      if (sorted != -1) {
+        keycnt = cnt;
+        if (t->dupl) {
+          keycnt = posting_group(t, work, cnt);
+        }
+        bpltree_setroot(t, build(t, work, keycnt));
+      } else {
+        for (i = 0; i < n; i++) {
+          arena_free_key(t->arena, work[i].key);
+        }
+        cnt = -1;
+      }
+      free(work);
+    }
+    latch_writer_end(t);
+    if (!empty) {
+      for (i = 0; i < cnt; i++) {
+        if (bpltree_insert(t, kp[i].key, kp[i].pos)) {
+          debug(0, "<< bpltree_load (-1)");
+          return -1;
+        }
+      }
+    }
+    debug(0, "<< bpltree_load (%ld)", cnt);
+    return cnt;
+}
@@ -0,0 +1,586 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_cursor.c
+ *
+ *  Cursors, to go through a range of keys.
+ *
+ *  A cursor is opened on a tree, positioned on a range with
+ *  bpltree_cursor_seek(), then hands out the rows of the range,
+ *  in key order or in descending key order, as (key, offset)
+ *  pairs in batches of the size the caller wants: nothing is
+ *  read from the file nor displayed, what to do with the rows
+ *  is up to the caller. A key found on several rows (a posting
+ *  list) comes once per row.
+ *
+ *  A cursor opened while the thread has pinned a snapshot (see
+ *  bpltree_latch.c) reads the snapshot, and sees none of the
+ *  changes made afterwards. Otherwise it reads the live tree
+ *  without locks, as bpltree_find_key() does, and sees the
+ *  changes made to what it hasn't read yet: when a leaf changes
+ *  while it is read, or between two calls, the cursor looks
+ *  again from the root for the key after the last one it saw.
+ *  Leaves are copied one at a time, only the entries in the
+ *  range, and a batch takes from as many leaves as it needs.
+ *  Keys handed out are normalized; they stay valid until the
+ *  cursor is closed if it reads a snapshot, until the next call
+ *  on the cursor if it reads the live tree.
+ *
+ *  Trees mapped from an image have no cursors.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "debug.h"
+
+static NODE_T *snapshot_leaf(BPLTREE_T *t, SNAPSHOT_T *s, char *key,
+                             short *pos) {
+    // Finds in snapshot s the leaf and the position in the leaf
+    // of the first key that isn't smaller than key, the first
+    // key of the tree if key is NULL. What is returned is the
+    // node as linked in the tree (see latch_snapshot_node()).
+    NODE_T        *n = s->root;
+    NODE_T        *img;
+    NODE_T        *child = NULL;
+    unsigned long  v;
+    int            cmp;
+    PREFIX_T       pfx = bpltree_keyprefix(key);
+
+    while (n) {
+      do {
+        img = latch_snapshot_node(s, n, &v);
+        *pos = (_is_leaf(img) ? 0 : 1);
+        if (key) {
+          *pos = bpltree_nodesearch(t, img, key, pfx, &cmp);
+        }
+        if (!_is_leaf(img)) {
+          child = img->node.internal.k[*pos-1].bigger;
+        }
+      } while (v && !latch_check(n, v));
+      if (_is_leaf(img)) {
+        return n;
+      }
+      n = child;
+    }
+    return NULL;
+}
+
+static NODE_T *snapshot_last(BPLTREE_T *t, SNAPSHOT_T *s, char *key,
+                             short *pos) {
+    // Finds in snapshot s the leaf and the position in the leaf
+    // of the last key that isn't greater than key (compared on
+    // the fields of key), the last key of the tree if key is NULL.
+    // *pos is -1 when it is the last key of the leaf returned.
+    NODE_T        *n = s->root;
+    NODE_T        *img;
+    NODE_T        *child = NULL;
+    NODE_T        *next;
+    NODE_T        *prev = NULL;
+    NODE_T        *last = NULL;
+    unsigned long  v;
+    short          i;
+    short          j;
+    short          keycnt;
+    char           first = 1;
+    PREFIX_T       pfx = bpltree_keyprefix(key);
+
+    *pos = -1;
+    if (key == NULL) {
+      // Right all the way down
+      while (n) {
+        do {
+          img = latch_snapshot_node(s, n, &v);
+          if (!_is_leaf(img)) {
+            child = img->node.internal.k[img->keycnt].bigger;
+          }
+        } while (v && !latch_check(n, v));
+        if (_is_leaf(img)) {
+          return n;
+        }
+        n = child;
+      }
+      return NULL;
+    }
+    // Keys equal to key on its fields may go on in the
+    // leaves that follow
+    n = snapshot_leaf(t, s, key, &i);
+    while (n) {
+      do {
+        img = latch_snapshot_node(s, n, &v);
+        keycnt = (img->keycnt < t->maxkeys ? img->keycnt : t->maxkeys);
+        for (j = i; j < keycnt; j++) {
+          if (bpltree_nodecmp(t, img, j, key, pfx) < 0) {
+            break;
+          }
+        }
+        next = img->node.leaf.next;
+        if (first) {
+          prev = img->node.leaf.prev;
+        }
+      } while (v && !latch_check(n, v));
+      first = 0;
+      if (j > 0) {
+        last = n;
+        *pos = j - 1;
+      }
+      if (j < keycnt) {
+        break;
+      }
+      n = next;
+      i = 0;
+    }
+    if (last == NULL) {
+      // Everything from where key would be is greater
+      *pos = -1;
+      return prev;
+    }
+    return last;
+}
+
+static NODE_T *live_last(BPLTREE_T *t, char *key, char before,
+                         unsigned long *version, short *pos) {
+    // Same as snapshot_last() on the live tree or, if before is
+    // set, finds the last key that is smaller than key (a whole
+    // key of the tree). *version is the version the leaf had.
+    NODE_T        *n;
+    NODE_T        *child;
+    NODE_T        *start;
+    NODE_T        *next;
+    NODE_T        *prev = NULL;
+    NODE_T        *last;
+    unsigned long  v;
+    unsigned long  sv;
+    unsigned long  nv;
+    unsigned long  lv = 0;
+    short          i;
+    short          j;
+    short          keycnt;
+    PREFIX_T       pfx = bpltree_keyprefix(key);
+
+  restart:
+    *pos = -1;
+    if (key == NULL) {
+      // Right all the way down
+      if ((n = bpltree_root(t)) == NULL) {
+        return NULL;
+      }
+      if (((v = latch_read(n)) == 0) || (n != bpltree_root(t))) {
+        goto restart;
+      }
+      while (!_is_leaf(n)) {
+        keycnt = (n->keycnt < t->maxkeys ? n->keycnt : t->maxkeys);
+        child = n->node.internal.k[keycnt].bigger;
+        if (!latch_check(n, v) || (child == NULL)) {
+          goto restart;
+        }
+        if (((nv = latch_read(child)) == 0) || !latch_check(n, v)) {
+          goto restart;
+        }
+        n = child;
+        v = nv;
+      }
+      *version = v;
+      return n;
+    }
+    // Keys equal to key on its fields may go on in the
+    // leaves that follow
+    start = n = start_leaf(t, key, 0, &v, &i);
+    sv = v;
+    last = NULL;
+    while (n) {
+      keycnt = (n->keycnt < t->maxkeys ? n->keycnt : t->maxkeys);
+      j = i;
+      while (!before && (j < keycnt)
+             && (bpltree_nodecmp(t, n, j, key, pfx) >= 0)) {
+        j++;
+      }
+      next = n->node.leaf.next;
+      if (n == start) {
+        prev = n->node.leaf.prev;
+      }
+      if (!latch_check(n, v)) {
+        goto restart;
+      }
+      if (j > 0) {
+        last = n;
+        lv = v;
+        *pos = j - 1;
+      }
+      if (before || (j < keycnt) || (next == NULL)) {
+        break;
+      }
+      if (((nv = latch_read(next)) == 0) || !latch_check(n, v)) {
+        goto restart;
+      }
+      n = next;
+      v = nv;
+      i = 0;
+    }
+    if (last == NULL) {
+      // Everything from where key would be is greater
+      *pos = -1;
+      if (prev == NULL) {
+        return NULL;
+      }
+      if (((lv = latch_read(prev)) == 0) || !latch_check(start, sv)) {
+        goto restart;
+      }
+      last = prev;
+    }
+    *version = lv;
+    return last;
+}
+
+static void keep(CURSOR_T *c, char *key) {
+    // Notes key as the last one seen in the live tree
+    int len = _key_size(key);
+
+    if (len > c->resume_len) {
+      c->resume = (char *)realloc(c->resume, len);
+      assert(c->resume);
+      c->resume_len = len;
+    }
+    (void)memcpy(c->resume, key, len);
+}
+
+static void locate(CURSOR_T *c) {
+    // Finds again in the live tree where the cursor goes on:
+    // after the last key seen, or from the bound
+    if (c->desc) {
+      c->n = live_last(c->t, (c->resume ? c->resume : c->high_key),
+                       (c->resume != NULL), &(c->v), &(c->pos));
+    } else {
+      c->n = start_leaf(c->t, (c->resume ? c->resume : c->low_key),
+                        (c->resume != NULL), &(c->v), &(c->pos));
+    }
+    c->lost = 0;
+}
+
+static void copy_keys(CURSOR_T *c) {
+    // Keys of the entries read from a live leaf, which may be
+    // freed once the cursor has let the tree go, are copied
+    char   *p;
+    size_t  len = 0;
+    short   i;
+
+    for (i = 0; i < c->cnt; i++) {
+      len += _key_size(c->entries[i].key);
+    }
+    if (len == 0) {
+      return;
+    }
+    p = (char *)malloc(len);
+    assert(p);
+    if (c->copycnt == c->copymax) {
+      c->copymax = (c->copymax ? 2 * c->copymax : 8);
+      c->copies = (char **)realloc(c->copies, c->copymax * sizeof(char *));
+      assert(c->copies);
+    }
+    c->copies[(c->copycnt)++] = p;
+    for (i = 0; i < c->cnt; i++) {
+      len = _key_size(c->entries[i].key);
+      (void)memcpy(p, c->entries[i].key, len);
+      c->entries[i].key = p;
+      p += len;
+    }
+}
+
+static void release_copies(CURSOR_T *c, long kept) {
+    // Frees the key copies but the last kept ones
+    long i;
+
+    if (c->copycnt > kept) {
+      for (i = 0; i < c->copycnt - kept; i++) {
+        free(c->copies[i]);
+      }
+      for (i = 0; i < kept; i++) {
+        c->copies[i] = c->copies[c->copycnt - kept + i];
+      }
+      c->copycnt = kept;
+    }
+}
+
+static void leave(CURSOR_T *c) {
+    // A cursor on the live tree keeps no node between calls:
+    // what is left of the leaf is dropped, to be found again
+    // after the last key handed out - but a posting list being
+    // handed out is kept
+    short kept = c->at + (c->offs ? 1 : 0);
+
+    if (c->n || (c->cnt > kept)) {
+      c->lost = 1;
+    }
+    c->cnt = kept;
+    c->n = NULL;
+}
+
+static char more(CURSOR_T *c) {
+    // Whether there are leaves left to read
+    return (c->n || c->lost);
+}
+
+static void release_offsets(CURSOR_T *c) {
+    free(c->offs);
+    c->offs = NULL;
+    c->offcnt = 0;
+    c->offat = 0;
+}
+
+static long read_leaf(CURSOR_T *c, char count_only) {
+    // Copies from the leaf the cursor is on the entries in the
+    // range, and moves the cursor to the leaf that follows, or
+    // to none if the range ends there. With count_only, a tree
+    // with one row per key may have rows counted, not copied:
+    // returns how many.
+    BPLTREE_T     *t = c->t;
+    NODE_T        *n;
+    NODE_T        *img;
+    NODE_T        *follow;
+    char          *edge = NULL;
+    unsigned long  v;
+    unsigned long  fv = 0;
+    long           counted;
+    char           stop;
+    short          i;
+    short          j;
+    short          keycnt;
+
+    if ((c->snap == NULL) && c->cnt) {
+      keep(c, c->entries[c->cnt - 1].key);
+    }
+    for (;;) {
+      if (c->snap) {
+        n = c->n;
+        img = latch_snapshot_node(c->snap, n, &v);
+      } else {
+        if (c->lost) {
+          locate(c);
+        }
+        if ((n = c->n) == NULL) {
+          c->cnt = 0;
+          c->at = 0;
+          return 0;
+        }
+        img = n;
+        v = c->v;
+      }
+      c->cnt = 0;
+      counted = 0;
+      stop = 0;
+      keycnt = (img->keycnt < t->maxkeys ? img->keycnt : t->maxkeys);
+      if (c->desc) {
+        i = (((c->pos < 0) || (c->pos >= keycnt)) ? keycnt - 1 : c->pos);
+        if (count_only && !t->dupl && (i >= 0)
+            && (!c->low_key
+                || (bpltree_nodecmp(t, img, 0, c->low_key, c->lpfx) <= 0))) {
+          // The rest of the leaf is in the range
+          counted = i + 1;
+          edge = img->node.leaf.k[0].key;
+        } else {
+          for (j = i; j >= 0; j--) {
+            if (c->low_key
+                && (bpltree_nodecmp(t, img, j, c->low_key, c->lpfx) > 0)) {
+              stop = 1;
+              break;
+            }
+            c->entries[c->cnt++] = img->node.leaf.k[j];
+          }
+        }
+        follow = img->node.leaf.prev;
+      } else {
+        i = c->pos;
+        if (count_only && !t->dupl && (i < keycnt)
+            && (!c->high_key
+                || (bpltree_nodecmp(t, img, keycnt - 1,
+                                    c->high_key, c->hpfx) >= 0))) {
+          counted = keycnt - i;
+          edge = img->node.leaf.k[keycnt - 1].key;
+        } else {
+          for (j = i; j < keycnt; j++) {
+            if (c->high_key
+                && (bpltree_nodecmp(t, img, j, c->high_key, c->hpfx) < 0)) {
+              stop = 1;
+              break;
+            }
+            c->entries[c->cnt++] = img->node.leaf.k[j];
+          }
+        }
+        follow = img->node.leaf.next;
+      }
+      if (c->snap) {
+        if (!v || latch_check(n, v)) {
+          break;
+        }
+      } else {
+        // The version of the leaf that follows is noted
+        // before this one is checked
+        if (!stop && follow) {
+          fv = latch_read(follow);
+        }
+        if (latch_check(n, v)) {
+          break;
+        }
+        debug(0, "leaf %hd changed while reading", n->id);
+        c->lost = 1;
+      }
+    }
+    if (c->snap == NULL) {
+      copy_keys(c);
+      if (counted) {
+        keep(c, edge);
+      }
+      c->v = fv;
+      c->lost = (!stop && follow && !fv);
+    }
+    c->n = (stop ? NULL : follow);
+    c->pos = (c->desc ? -1 : 0);
+    c->at = 0;
+    return counted;
+}
+
+extern CURSOR_T *bpltree_cursor_open(BPLTREE_T *t, char desc) {
+    // A cursor that goes through keys in descending order
+    // if desc is set. Returns NULL on an image or a paged tree.
+    CURSOR_T *c;
+
+    if (t->image) {
+      bpltree_err_seterr(image_err(t), NULL);
+      return NULL;
+    }
+    c = (CURSOR_T *)calloc(1, sizeof(CURSOR_T));
+    assert(c);
+    c->t = t;
+    c->desc = desc;
+    c->entries = (KEY_POS_T *)malloc(t->maxkeys * sizeof(KEY_POS_T));
+    assert(c->entries);
+    c->snap = latch_snapshot(t);
+    return c;
+}
+
+extern int bpltree_cursor_seek(CURSOR_T *c, char *low, char *high) {
+    // Positions the cursor on the keys from low to high,
+    // inclusive, given as text; no bound if NULL. A bound
+    // with fewer fields than the keys covers all the keys
+    // that start with it. Returns -1 if a bound is invalid.
+    char *low_key = NULL;
+    char *high_key = NULL;
+
+    if ((low && ((low_key = bpltree_keyencode(c->t, low)) == NULL))
+        || (high && ((high_key = bpltree_keyencode(c->t, high)) == NULL))) {
+      free(low_key);
+      return -1;
+    }
+    free(c->low_key);
+    free(c->high_key);
+    release_offsets(c);
+    c->low_key = low_key;
+    c->high_key = high_key;
+    c->lpfx = bpltree_keyprefix(low_key);
+    c->hpfx = bpltree_keyprefix(high_key);
+    c->cnt = 0;
+    c->at = 0;
+    if (c->snap == NULL) {
+      // Found when the first leaf is read
+      free(c->resume);
+      c->resume = NULL;
+      c->resume_len = 0;
+      c->n = NULL;
+      c->lost = 1;
+      return 0;
+    }
+    latch_reader_begin(c->t);
+    if (c->desc) {
+      c->n = snapshot_last(c->t, c->snap, high_key, &(c->pos));
+    } else {
+      c->n = snapshot_leaf(c->t, c->snap, low_key, &(c->pos));
+    }
+    latch_reader_end(c->t);
+    return 0;
+}
+
+extern long bpltree_cursor_next(CURSOR_T *c, KEY_POS_T *buf, long n) {
+    // Fills buf with the next n rows at most, and returns
+    // how many; 0 once past the end of the range
+    KEY_POS_T *e;
+    long       got = 0;
+
+    latch_reader_begin(c->t);
+    // Keys handed out by the previous call are no longer
+    // needed, only those of the leaf we are on
+    release_copies(c, 1);
+    while (got < n) {
+      if (c->offs) {
+        // Rows of a posting list
+        buf[got].key = c->entries[c->at].key;
+        buf[got].pos = c->offs[c->desc ? c->offcnt - 1 - c->offat
+                                       : c->offat];
+        got++;
+        if (++(c->offat) == c->offcnt) {
+          release_offsets(c);
+          c->at++;
+        }
+      } else if (c->at < c->cnt) {
+        e = &(c->entries[c->at]);
+        if (_is_posting(e->pos)) {
+          c->offs = posting_offsets(e->pos, &(c->offcnt));
+          c->offat = 0;
+        } else {
+          buf[got++] = *e;
+          c->at++;
+        }
+      } else if (more(c)) {
+        (void)read_leaf(c, 0);
+      } else {
+        break;
+      }
+    }
+    if (c->snap == NULL) {
+      leave(c);
+    }
+    latch_reader_end(c->t);
+    return got;
+}
+
+extern long bpltree_cursor_count(CURSOR_T *c) {
+    // Number of rows left in the range, which are skipped.
+    // Only a tree with duplicate keys looks at the entries
+    // of the leaves.
+    long cnt = 0;
+
+    latch_reader_begin(c->t);
+    release_copies(c, 1);
+    if (c->offs) {
+      cnt += c->offcnt - c->offat;
+      release_offsets(c);
+      c->at++;
+    }
+    for (;;) {
+      for (; c->at < c->cnt; c->at++) {
+        cnt += posting_count(c->entries[c->at].pos);
+      }
+      if (!more(c)) {
+        break;
+      }
+      cnt += read_leaf(c, 1);
+    }
+    latch_reader_end(c->t);
+    return cnt;
+}
+
+extern void bpltree_cursor_close(CURSOR_T *c) {
+    if (c) {
+      release_offsets(c);
+      release_copies(c, 0);
+      free(c->copies);
+      free(c->resume);
+      free(c->entries);
+      free(c->low_key);
+      free(c->high_key);
+      free(c);
+    }
+}
@@ -0,0 +1,157 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_data.c
+ *
+ *  Access to the rows of the text file.
+ *
+ *  Rows are handed out as views - where the row starts and
+ *  how long it is, end of line excluded - rather than copied
+ *  into a buffer of fixed size, and may be as long as they
+ *  are.
+ *
+ *  When the file has been mapped (bpltree_mapdata()), a view
+ *  points directly into the mapping and nothing is copied;
+ *  the kernel is told how the file is going to be read, row
+ *  by row or here and there, so that it reads ahead or not.
+ *  Otherwise, rows are read with stdio into a buffer that
+ *  grows as needed and that the view points into until the
+ *  next row is read. A file that cannot be mapped (a pipe,
+ *  for instance) is read that way, as is what was added to
+ *  the file after it was mapped.
+ *
+ *  A DATA_T holds what a search needs to read rows, and is
+ *  its own: the mapping is shared, read-only, by all searches.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "debug.h"
+
+extern int bpltree_mapdata(BPLTREE_T *t, FILE *fp) {
+    // Maps the text file for bpltree_get() and bpltree_scan()
+    // when they are given fp. Returns -1 if it cannot be
+    // mapped, and rows are then read with stdio.
+    struct stat  st;
+    void        *p;
+
+    data_unmap(t);
+    if ((fp == NULL)
+        || (fstat(fileno(fp), &st) == -1)
+        || !S_ISREG(st.st_mode)
+        || (st.st_size == 0)) {
+      return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (p == MAP_FAILED) {
+      bpltree_err_seterr(BPLT_ERR_IO, "mmap");
+      return -1;
+    }
+    t->data = (DATA_T *)calloc(1, sizeof(DATA_T));
+    assert(t->data);
+    t->data->fp = fp;
+    t->data->base = (char *)p;
+    t->data->size = st.st_size;
+    debug(0, "mapped %ld bytes of data", (long)st.st_size);
+    return 0;
+}
+
+extern void data_unmap(BPLTREE_T *t) {
+    if (t->data) {
+      (void)munmap(t->data->base, t->data->size);
+      free(t->data);
+      t->data = NULL;
+    }
+}
+
+extern void data_open(BPLTREE_T *t, DATA_T *d, FILE *fp, char access) {
+    // access is DATA_SEQUENTIAL or DATA_RANDOM
+    d->fp = fp;
+    d->base = NULL;
+    d->size = 0;
+    d->at = 0;
+    d->buf = NULL;
+    d->bufsz = 0;
+    if (t->data && (t->data->fp == fp)) {
+      d->base = t->data->base;
+      d->size = t->data->size;
+      (void)madvise(d->base, d->size,
+                    (access == DATA_SEQUENTIAL ? MADV_SEQUENTIAL
+                                               : MADV_RANDOM));
+    }
+}
+
+extern void data_close(DATA_T *d) {
+    free(d->buf);
+    d->buf = NULL;
+    d->bufsz = 0;
+}
+
+static char *mapped_row(DATA_T *d, off_t offset, size_t *len) {
+    char *p = d->base + offset;
+    char *eol;
+
+    if ((eol = memchr(p, '\n', d->size - offset)) != NULL) {
+      *len = eol - p;
+      d->at = offset + *len + 1;
+    } else {
+      *len = d->size - offset;
+      d->at = d->size;
+    }
+    return p;
+}
+
+static char *read_line(DATA_T *d, size_t *len) {
+    ssize_t n;
+
+    if ((n = getline(&(d->buf), &(d->bufsz), d->fp)) == -1) {
+      return NULL;
+    }
+    d->at += n;
+    *len = (size_t)n;
+    if (*len && (d->buf[*len - 1] == '\n')) {
+      (*len)--;
+    }
+    return d->buf;
+}
+
+extern char *data_row(DATA_T *d, off_t offset, size_t *len) {
+    // View of the row at offset, NULL if it cannot be read
+    char *p;
+
+    if (d->base && (offset >= 0) && (offset < (off_t)d->size)) {
+      return mapped_row(d, offset, len);
+    }
+    (void)fseeko(d->fp, offset, SEEK_SET);
+    d->at = offset;
+    if ((p = read_line(d, len)) == NULL) {
+      perror("File reading:");
+    }
+    return p;
+}
+
+extern void data_rewind(DATA_T *d) {
+    d->at = 0;
+    rewind(d->fp);
+}
+
+extern char *data_next(DATA_T *d, size_t *len) {
+    // View of the row after the last one, NULL at the end
+    if (d->base && (d->at < (off_t)d->size)) {
+      return mapped_row(d, d->at, len);
+    }
+    if (d->base) {
+      // Rows added since the file was mapped
+      (void)fseeko(d->fp, d->at, SEEK_SET);
+    }
+    return read_line(d, len);
+}
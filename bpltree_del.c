@@ -14,17 +14,30 @@
 #include <assert.h>
 
 #include "bpltree.h"
+#include "bpltree_err.h"
 #include "debug.h"
 
 // Forward declaration
-static short delete_key(NODE_T *n,
+static short delete_key(BPLTREE_T *t,
+                        NODE_T *n,
                         char   *key,
+                        off_t  *val,
+                        char    keep,
                         short   indent);
 
-static NODE_T *leaf_with_greatest_key(NODE_T *subtree) {
+static char delete_safe(BPLTREE_T *t, NODE_T *n) {
+    // 1 if removing a key from n can't change anything above it
+    if (n->parent == NULL) {
+      return (n->keycnt > 1 ? 1 : 0);
+    }
+    return (n->keycnt > MIN_KEYS(t) ? 1 : 0);
+}
+
+static NODE_T *leaf_with_greatest_key(BPLTREE_T *t, NODE_T *subtree) {
     if (subtree) {
+      latch_write(t, subtree);
       if (!_is_leaf(subtree)) {
-        return leaf_with_greatest_key(
+        return leaf_with_greatest_key(t,
                    subtree->node.internal.k[subtree->keycnt].bigger);
       } else {
         return subtree;
@@ -33,15 +46,18 @@ static NODE_T *leaf_with_greatest_key(NODE_T *subtree) {
     return NULL;
 }
 
-static int borrow_from_left_internal(NODE_T *n, short indent) {
+static int borrow_from_left_internal(BPLTREE_T *t, NODE_T *n, short indent) {
    if (n && !_is_leaf(n) && n->parent) {
       short   parent_pos;
       NODE_T *par = n->parent;
       NODE_T *l = left_sibling(n, &parent_pos);
       char   *k;
+      PREFIX_T pfx;
 
       // Check whether we can borrow a key from the left sibling
-      if (l && (l->keycnt > MIN_KEYS)) {
+      // (latched first, another writer may be working on it)
+      latch_write(t, l);
+      if (l && (l->keycnt > MIN_KEYS(t))) {
         // Let's call K the key in the parent that
         // is greater than all keys in the left sibling
         // and smaller than all keys in the node that
@@ -53,17 +69,22 @@ static int borrow_from_left_internal(NODE_T *n, short indent) {
         // bring K as the first key in the current node.
         // --------------
         debug(indent, "borrowing from left node %hd", l->id);
+        latch_write(t, n);
+        latch_write(t, par);
         if (debugging()) {
           debug_no_nl(indent, "left node before borrowing: ");
-          bpltree_show_node(l, 0);
+          bpltree_show_node(t, l, 0);
           debug_no_nl(indent, "current node %hd before borrowing: ", n->id);
-          bpltree_show_node(n, 0);
+          bpltree_show_node(t, n, 0);
         }
         // Make room for K (dest, src, size)
         (void)memmove(&(n->node.internal.k[1]), &(n->node.internal.k[0]),
                       sizeof(REDIRECT_T) * (n->keycnt+1));
+        (void)memmove(&(n->pfx[1]), &(n->pfx[0]),
+                      sizeof(PREFIX_T) * (n->keycnt+1));
         // Add K
         n->node.internal.k[1].key = par->node.internal.k[parent_pos].key;
+        n->pfx[1] = par->pfx[parent_pos];
         // Values that precede K are the ones bigger
         // than the biggest key in the left node
         n->node.internal.k[0].key = NULL;
@@ -72,17 +93,19 @@ static int borrow_from_left_internal(NODE_T *n, short indent) {
         (n->keycnt)++;
         // Find the greatest key in the left sibling
         k = l->node.internal.k[l->keycnt].key;
+        pfx = l->pfx[l->keycnt];
         // Cleanup
         l->node.internal.k[l->keycnt].key = NULL;
         l->node.internal.k[l->keycnt].bigger = NULL;
         (l->keycnt)--;
         // Store k in the parent
         par->node.internal.k[parent_pos].key = k;
+        par->pfx[parent_pos] = pfx;
         if (debugging()) {
           debug_no_nl(indent, "left node after borrowing: ");
-          bpltree_show_node(l, 0);
+          bpltree_show_node(t, l, 0);
           debug_no_nl(indent, "current node %hd after borrowing: ", n->id);
-          bpltree_show_node(n, 0);
+          bpltree_show_node(t, n, 0);
         }
         return 0;
       } 
@@ -90,33 +113,40 @@ static int borrow_from_left_internal(NODE_T *n, short indent) {
     return -1;
 }
 
-static int borrow_from_left_leaf(NODE_T *n, short indent) {
+static int borrow_from_left_leaf(BPLTREE_T *t, NODE_T *n, short indent) {
    if (n && _is_leaf(n) && n->parent) {
       short   parent_pos;
       NODE_T *par = n->parent;
       NODE_T *l = left_sibling(n, &parent_pos);
 
       // Check whether we can borrow a key from the left sibling
-      if (l && (l->keycnt > MIN_KEYS)) {
+      // (latched first, another writer may be working on it)
+      latch_write(t, l);
+      if (l && (l->keycnt > MIN_KEYS(t))) {
         // For leaf nodes, the parent key is also there.
         // If we borrow a leaf from left, the parent key
         // must be replaced with the last remaining value in 
         // the left node.
         debug(indent, "borrowing from left leaf node %hd", l->id);
+        latch_write(t, n);
+        latch_write(t, par);
         if (debugging()) {
           debug_no_nl(indent, "left node before borrowing: ");
-          bpltree_show_node(l, 0);
+          bpltree_show_node(t, l, 0);
           debug_no_nl(indent, "current node %hd before borrowing: ", n->id);
-          bpltree_show_node(n, 0);
+          bpltree_show_node(t, n, 0);
         }
         // Make room for the entry that comes from the left
         // (dest, src, size)
         (void)memmove(&(n->node.leaf.k[1]), &(n->node.leaf.k[0]),
                      sizeof(KEY_POS_T) * n->keycnt);
+        (void)memmove(&(n->pfx[1]), &(n->pfx[0]),
+                     sizeof(PREFIX_T) * n->keycnt);
         // Add the entry (dest, src, size)
         (void)memcpy(&(n->node.leaf.k[0]),
                      &(l->node.leaf.k[l->keycnt-1]),
                      sizeof(KEY_POS_T));
+        n->pfx[0] = l->pfx[l->keycnt-1];
         n->keycnt++;
         // Cleanup the left node
         if (l->node.leaf.k[l->keycnt-1].key) {
@@ -128,15 +158,16 @@ static int borrow_from_left_leaf(NODE_T *n, short indent) {
         // The parent now - move there what is now the last
         // entry in the left node
         if (par->node.internal.k[parent_pos].key) {
-          free(par->node.internal.k[parent_pos].key);
+          latch_free_key(t, par->node.internal.k[parent_pos].key);
         }
         par->node.internal.k[parent_pos].key
-               = key_duplicate(l->node.leaf.k[l->keycnt-1].key);
+               = key_duplicate(t, l->node.leaf.k[l->keycnt-1].key);
+        par->pfx[parent_pos] = l->pfx[l->keycnt-1];
         if (debugging()) {
           debug_no_nl(indent, "left node after borrowing: ");
-          bpltree_show_node(l, 0);
+          bpltree_show_node(t, l, 0);
           debug_no_nl(indent, "current node %hd after borrowing: ", n->id);
-          bpltree_show_node(n, 0);
+          bpltree_show_node(t, n, 0);
         }
         return 0;
       } 
@@ -144,57 +175,65 @@ static int borrow_from_left_leaf(NODE_T *n, short indent) {
     return -1;
 }
 
-static int borrow_from_left(NODE_T *n, short indent) {
+static int borrow_from_left(BPLTREE_T *t, NODE_T *n, short indent) {
    if (n) {
      if (_is_leaf(n)) {
-       return borrow_from_left_leaf(n, indent);
+       return borrow_from_left_leaf(t, n, indent);
      } else {
-       return borrow_from_left_internal(n, indent);
+       return borrow_from_left_internal(t, n, indent);
      }
    }
    return -1;
 }
 
-static int borrow_from_right_leaf(NODE_T *n, short indent) {
+static int borrow_from_right_leaf(BPLTREE_T *t, NODE_T *n, short indent) {
    if (n && n->parent) {
       short   parent_pos;
       NODE_T *par = n->parent;
       NODE_T *r = right_sibling(n, &parent_pos);
-      if (r && (r->keycnt > MIN_KEYS)) {
+
+      latch_write(t, r);
+      if (r && (r->keycnt > MIN_KEYS(t))) {
         // Basically the same operation as with borrowing from
         // the left, except that the moved key is the one that
         // is copied to the parent
         // --------------
         debug(indent, "borrowing from right leaf node %hd", r->id);
+        latch_write(t, n);
+        latch_write(t, par);
         if (debugging()) {
           debug_no_nl(indent, "current node %hd before borrowing: ", n->id);
-          bpltree_show_node(n, 0);
+          bpltree_show_node(t, n, 0);
           debug_no_nl(indent, "right node before borrowing: ");
-          bpltree_show_node(r, 0);
+          bpltree_show_node(t, r, 0);
         }
         // Add the entry (dest, src, size)
         (void)memcpy(&(n->node.leaf.k[n->keycnt]),
                      &(r->node.leaf.k[0]),
                      sizeof(KEY_POS_T));
+        n->pfx[n->keycnt] = r->pfx[0];
         (n->keycnt)++;
         // Remove from the right node
         (r->keycnt)--;
         // (dest, src, size)
         (void)memmove(&(r->node.leaf.k[0]), &(r->node.leaf.k[1]),
                      sizeof(KEY_POS_T) * r->keycnt);
+        (void)memmove(&(r->pfx[0]), &(r->pfx[1]),
+                     sizeof(PREFIX_T) * r->keycnt);
         r->node.leaf.k[r->keycnt].key = NULL;
         r->node.leaf.k[r->keycnt].pos = 0;
         // Deal with the parent
         if (par->node.internal.k[parent_pos].key) {
-          free(par->node.internal.k[parent_pos].key);
+          latch_free_key(t, par->node.internal.k[parent_pos].key);
         }
         par->node.internal.k[parent_pos].key
-               = key_duplicate(n->node.leaf.k[n->keycnt-1].key);
+               = key_duplicate(t, n->node.leaf.k[n->keycnt-1].key);
+        par->pfx[parent_pos] = n->pfx[n->keycnt-1];
         if (debugging()) {
           debug_no_nl(indent, "current node %hd after borrowing: ", n->id);
-          bpltree_show_node(n, 0);
+          bpltree_show_node(t, n, 0);
           debug_no_nl(indent, "right node after borrowing: ");
-          bpltree_show_node(r, 0);
+          bpltree_show_node(t, r, 0);
         }
         return 0;
       } 
@@ -202,14 +241,16 @@ static int borrow_from_right_leaf(NODE_T *n, short indent) {
     return -1;
 }
 
-static int borrow_from_right_internal(NODE_T *n, short indent) {
+static int borrow_from_right_internal(BPLTREE_T *t, NODE_T *n, short indent) {
    if (n && n->parent) {
       short   parent_pos;
       NODE_T *par = n->parent;
       NODE_T *r = right_sibling(n, &parent_pos);
       char   *k;
+      PREFIX_T pfx;
 
-      if (r && (r->keycnt > MIN_KEYS)) {
+      latch_write(t, r);
+      if (r && (r->keycnt > MIN_KEYS(t))) {
         // Let's call K the key in the parent that
         // is smaller than all keys in the right sibling
         // and greater than all keys in the node that
@@ -221,36 +262,43 @@ static int borrow_from_right_internal(NODE_T *n, short indent) {
         // add K as the last key in the current node.
         // --------------
         debug(indent, "borrowing from right node %hd", r->id);
+        latch_write(t, n);
+        latch_write(t, par);
         if (debugging()) {
           debug_no_nl(indent, "current node %hd before borrowing: ", n->id);
-          bpltree_show_node(n, 0);
+          bpltree_show_node(t, n, 0);
           debug_no_nl(indent, "right node before borrowing: ");
-          bpltree_show_node(r, 0);
+          bpltree_show_node(t, r, 0);
         }
         // Add K
         (n->keycnt)++;
         n->node.internal.k[n->keycnt].key
                  = par->node.internal.k[parent_pos].key;
+        n->pfx[n->keycnt] = par->pfx[parent_pos];
         n->node.internal.k[n->keycnt].bigger = r->node.internal.k[0].bigger;
         if (n->node.internal.k[n->keycnt].bigger) {
           (n->node.internal.k[n->keycnt].bigger)->parent = n;
         }
         // Find the smallest key in the right sibling
         k = r->node.internal.k[1].key;
+        pfx = r->pfx[1];
         // Cleanup the right sibling - dest, src, size
         (void)memmove(&(r->node.internal.k[0]), &(r->node.internal.k[1]),
                       sizeof(REDIRECT_T) * r->keycnt);
+        (void)memmove(&(r->pfx[0]), &(r->pfx[1]),
+                      sizeof(PREFIX_T) * r->keycnt);
         r->node.internal.k[0].key = NULL;
         r->node.internal.k[r->keycnt].key = NULL;
         r->node.internal.k[r->keycnt].bigger = NULL;
         (r->keycnt)--;
         // Store k in the parent
         par->node.internal.k[parent_pos].key = k;
+        par->pfx[parent_pos] = pfx;
         if (debugging()) {
           debug_no_nl(indent, "current node %hd after borrowing: ", n->id);
-          bpltree_show_node(n, 0);
+          bpltree_show_node(t, n, 0);
           debug_no_nl(indent, "right node after borrowing: ");
-          bpltree_show_node(r, 0);
+          bpltree_show_node(t, r, 0);
         }
         return 0;
       } 
@@ -258,18 +306,19 @@ static int borrow_from_right_internal(NODE_T *n, short indent) {
     return -1;
 }
 
-static int borrow_from_right(NODE_T *n, short indent) {
+static int borrow_from_right(BPLTREE_T *t, NODE_T *n, short indent) {
    if (n) {
      if (_is_leaf(n)) {
-       return borrow_from_right_leaf(n, indent);
+       return borrow_from_right_leaf(t, n, indent);
      } else {
-       return borrow_from_right_internal(n, indent);
+       return borrow_from_right_internal(t, n, indent);
      }
    }
    return -1;
 }
 
-static short merge_internal_nodes(NODE_T *left,
+static short merge_internal_nodes(BPLTREE_T *t,
+                                  NODE_T *left,
                                   NODE_T *right,
                                   NODE_T *par,  // parent of left and right
                                   short   lvl) {
@@ -280,13 +329,15 @@ static short merge_internal_nodes(NODE_T *left,
    assert(left && right && par && !_is_leaf(left));
    debug(lvl, "merging internal left node %hd with right node %hd",
               left->id, right->id);
+   latch_write(t, left);
+   latch_write(t, par);
    if (debugging()) {
       debug_no_nl(lvl, "left before merge: ");
-      bpltree_show_node(left, 0);
+      bpltree_show_node(t, left, 0);
       debug_no_nl(lvl, "right before merge: ");
-      bpltree_show_node(right, 0);
+      bpltree_show_node(t, right, 0);
    }
-   assert((left->keycnt + 1 + right->keycnt) <= bpltree_maxkeys());
+   assert((left->keycnt + 1 + right->keycnt) <= t->maxkeys);
    while ((i < par->keycnt)
           && (par->node.internal.k[i].bigger != left) > 0) {
      i++;
@@ -294,6 +345,7 @@ static short merge_internal_nodes(NODE_T *left,
    assert((i < par->keycnt) && (par->node.internal.k[i+1].bigger == right));
    i++; // We have stopped just before the key between left and right
    left->node.internal.k[left->keycnt+1].key = par->node.internal.k[i].key;
+   left->pfx[left->keycnt+1] = par->pfx[i];
    left->node.internal.k[left->keycnt+1].bigger
                  = right->node.internal.k[0].bigger;
    par->node.internal.k[i].key = NULL;
@@ -303,6 +355,8 @@ static short merge_internal_nodes(NODE_T *left,
    (void)memmove(&(left->node.internal.k[left->keycnt+1]),
                  &(right->node.internal.k[1]),
                  sizeof(REDIRECT_T) * right->keycnt);
+   (void)memcpy(&(left->pfx[left->keycnt+1]), &(right->pfx[1]),
+                sizeof(PREFIX_T) * right->keycnt);
    // Adjust parent pointer
    if (!_is_leaf(left)) {
      short k;
@@ -317,16 +371,16 @@ static short merge_internal_nodes(NODE_T *left,
    left->keycnt += right->keycnt; 
    if (debugging()) {
       debug_no_nl(lvl, "left after merge: ");
-      bpltree_show_node(left, 0);
+      bpltree_show_node(t, left, 0);
    }
    // Free the right node (except keys, moved)
    debug(lvl, "removing internal right node %hd after merge", right->id);
-   free(right->node.internal.k);
-   free(right);
+   latch_free_node(t, right);
    return i;
 }
 
-static short merge_leaf_nodes(NODE_T *left,
+static short merge_leaf_nodes(BPLTREE_T *t,
+                              NODE_T *left,
                               NODE_T *right,
                               NODE_T *par,  // parent of left and right
                               short   lvl) {
@@ -339,13 +393,15 @@ static short merge_leaf_nodes(NODE_T *left,
    assert(left && right && par && _is_leaf(left));
    debug(lvl, "merging leaf left node %hd with right node %hd",
               left->id, right->id);
+   latch_write(t, left);
+   latch_write(t, par);
    if (debugging()) {
       debug_no_nl(lvl, "left before merge: ");
-      bpltree_show_node(left, 0);
+      bpltree_show_node(t, left, 0);
       debug_no_nl(lvl, "right before merge: ");
-      bpltree_show_node(right, 0);
+      bpltree_show_node(t, right, 0);
    }
-   assert((left->keycnt + right->keycnt) <= bpltree_maxkeys());
+   assert((left->keycnt + right->keycnt) <= t->maxkeys);
    while ((i < par->keycnt)
           && (par->node.internal.k[i].bigger != left) > 0) {
      i++;
@@ -356,41 +412,50 @@ static short merge_leaf_nodes(NODE_T *left,
    (void)memmove(&(left->node.leaf.k[left->keycnt]),
                  &(right->node.leaf.k[0]),
                  sizeof(REDIRECT_T) * right->keycnt);
+   (void)memcpy(&(left->pfx[left->keycnt]), &(right->pfx[0]),
+                sizeof(PREFIX_T) * right->keycnt);
    left->node.leaf.next = right->node.leaf.next;
+   if (left->node.leaf.next) {
+     latch_write(t, left->node.leaf.next);
+     (left->node.leaf.next)->node.leaf.prev = left;
+   }
    left->keycnt += right->keycnt; 
    if (debugging()) {
       debug_no_nl(lvl, "left after merge: ");
-      bpltree_show_node(left, 0);
+      bpltree_show_node(t, left, 0);
    }
    // Free the right node (except keys, moved)
    debug(lvl, "removing leaf right node %hd after merge", right->id);
-   free(right->node.leaf.k);
-   free(right);
+   latch_free_node(t, right);
    return i;
 }
 
-static int delete_internal_node(NODE_T *n,
+static int delete_internal_node(BPLTREE_T *t,
+                                NODE_T *n,
                                 short   pos,
                                 short   indent) {
   assert(n && !_is_leaf(n) && (pos > 0) && (pos <= n->keycnt));
   debug(indent, "removing key at position %hd from internal node %hd",
         pos, n->id);
+  latch_write(t, n);
   if (n->node.internal.k[pos].key) {
-    free(n->node.internal.k[pos].key);
+    latch_free_key(t, n->node.internal.k[pos].key);
   }
   if (pos < n->keycnt) {
     // (dest, src, size)
     (void)memmove(&(n->node.internal.k[pos]), &(n->node.internal.k[pos+1]),
                   sizeof(REDIRECT_T) * (n->keycnt - pos));
+    (void)memmove(&(n->pfx[pos]), &(n->pfx[pos+1]),
+                  sizeof(PREFIX_T) * (n->keycnt - pos));
   }
   n->node.internal.k[n->keycnt].key = NULL;
   n->node.internal.k[n->keycnt].bigger = NULL;
   (n->keycnt)--;
   if (debugging()) {
     debug_no_nl(indent, "node now contains: ");
-    bpltree_show_node(n, 0);
+    bpltree_show_node(t, n, 0);
   }
-  if (n->keycnt >= MIN_KEYS) {
+  if (n->keycnt >= MIN_KEYS(t)) {
     debug(indent,
           "still %hd key%s in it - success",
           n->keycnt, (n->keycnt > 1? "s" : ""));
@@ -406,9 +471,8 @@ static int delete_internal_node(NODE_T *n,
       debug(indent,
             "node %hd deleted - new root node %hd",
             n->id, (n->node.internal.k[0].bigger)->id);
-      bpltree_setroot(n->node.internal.k[0].bigger);
-      free(n->node.internal.k);
-      free(n);
+      bpltree_setroot(t, n->node.internal.k[0].bigger);
+      latch_free_node(t, n);
       debug(indent, "former root freed");
     }
     return 0;  // Fine
@@ -416,9 +480,9 @@ static int delete_internal_node(NODE_T *n,
   // Underflow
   debug(indent, "underflow detected");
   // Try to borrow a key from the left
-  if (borrow_from_left(n, indent)) {
+  if (borrow_from_left(t, n, indent)) {
     // If it fails borrow from right
-    if (borrow_from_right(n, indent)) {
+    if (borrow_from_right(t, n, indent)) {
       // If it fails merge with left node, but
       // then we must recurse
       short   parent_pos = 0;
@@ -427,17 +491,17 @@ static int delete_internal_node(NODE_T *n,
 
       if (l) {
          debug(indent, "merging with left node");
-         parent_pos = merge_internal_nodes(l, n, par, indent);
+         parent_pos = merge_internal_nodes(t, l, n, par, indent);
       } else {
          NODE_T *r = right_sibling(n, &parent_pos);
          debug(indent, "merging with right node");
-         parent_pos = merge_internal_nodes(n, r, par, indent);
+         parent_pos = merge_internal_nodes(t, n, r, par, indent);
       }
       debug(indent, "remove key at position %hd from parent %hd",
                     parent_pos, par->id);
       // After merging one node must be removed from the 
       // parent - recurse
-      return delete_internal_node(par, parent_pos, indent+2);
+      return delete_internal_node(t, par, parent_pos, indent+2);
     } else {
       return 0;
     }
@@ -447,28 +511,33 @@ static int delete_internal_node(NODE_T *n,
   return -1;
 }
 
-static int delete_leaf_node(NODE_T *n,
+static int delete_leaf_node(BPLTREE_T *t,
+                            NODE_T *n,
                             short   pos,
                             short   indent) {
   assert(n && _is_leaf(n) && (pos >= 0) && (pos < n->keycnt));
   debug(indent, "removing key at position %hd from leaf node %hd",
         pos, n->id);
+  latch_write(t, n);
   if (n->node.leaf.k[pos].key) {
-    free(n->node.leaf.k[pos].key);
+    latch_free_key(t, n->node.leaf.k[pos].key);
   }
+  posting_free(t, n->node.leaf.k[pos].pos);
   if (pos < n->keycnt - 1) {
     // (dest, src, size)
     (void)memmove(&(n->node.leaf.k[pos]), &(n->node.leaf.k[pos+1]),
                   sizeof(REDIRECT_T) * (n->keycnt - pos));
+    (void)memmove(&(n->pfx[pos]), &(n->pfx[pos+1]),
+                  sizeof(PREFIX_T) * (n->keycnt - pos));
   }
   n->node.leaf.k[n->keycnt-1].key = NULL;
   n->node.leaf.k[n->keycnt-1].pos = 0;
   (n->keycnt)--;
   if (debugging()) {
     debug_no_nl(indent, "node now contains: ");
-    bpltree_show_node(n, 0);
+    bpltree_show_node(t, n, 0);
   }
-  if (n->keycnt >= MIN_KEYS) {
+  if (n->keycnt >= MIN_KEYS(t)) {
     debug(indent,
           "still %hd key%s in it - success",
           n->keycnt, (n->keycnt > 1? "s" : ""));
@@ -482,18 +551,17 @@ static int delete_leaf_node(NODE_T *n,
             n->keycnt, (n->keycnt > 1? "s" : ""));
     } else {
       debug(indent, "*** Tree emptied ***");
-      bpltree_setroot(NULL);
-      free(n->node.leaf.k);
-      free(n);
+      bpltree_setroot(t, NULL);
+      latch_free_node(t, n);
     }
     return 0;  // Fine
   }
   // Underflow
   debug(indent, "underflow detected");
   // Try to borrow a key from the left
-  if (borrow_from_left(n, indent)) {
+  if (borrow_from_left(t, n, indent)) {
     // If it fails borrow from right
-    if (borrow_from_right(n, indent)) {
+    if (borrow_from_right(t, n, indent)) {
       // If it fails merge with left node, but
       // then we must recurse
       short   parent_pos = 0;
@@ -502,17 +570,17 @@ static int delete_leaf_node(NODE_T *n,
 
       if (l) {
          debug(indent, "merging with left node");
-         parent_pos = merge_leaf_nodes(l, n, par, indent);
+         parent_pos = merge_leaf_nodes(t, l, n, par, indent);
       } else {
          NODE_T *r = right_sibling(n, &parent_pos);
          debug(indent, "merging with right node");
-         parent_pos = merge_leaf_nodes(n, r, par, indent);
+         parent_pos = merge_leaf_nodes(t, n, r, par, indent);
       }
       debug(indent, "remove key at position %hd from parent %hd",
                     parent_pos, par->id);
       // After merging one node must be removed from the 
       // parent - recurse
-      return delete_internal_node(par, parent_pos, indent+2);
+      return delete_internal_node(t, par, parent_pos, indent+2);
     } else {
       return 0;
     }
@@ -522,148 +590,208 @@ static int delete_leaf_node(NODE_T *n,
   return -1;
 }
 
-static short delete_internal_key(NODE_T    *n,
+static short delete_internal_key(BPLTREE_T *t,
+                                 NODE_T    *n,
                                  char      *key,
+                                 off_t     *val,
+                                 char       keep,
                                  short indent) {
     // -1 if there is something wrong, 0 if OK
-    short pos = 1;
-    short ret = -1;
-    int   cmp = -1;
-    char  is_root = 0;
+    // keep is set once the node holding the key as
+    // a separator has been met - nothing is released
+    // from there on, replace_separator() needs it all.
+    short    pos;
+    int      cmp = -1;
+    NODE_T  *child;
+    PREFIX_T pfx = bpltree_keyprefix(key);
 
     assert(key && n && !_is_leaf(n));
     if (debugging()) {
       debug_no_nl(indent, "searching node %hd: ", n->id);
-      bpltree_show_node(n, 0);
-    }
-    if (n->parent == NULL) {
-      is_root = 1;  // Special case
-    }
-    while ((pos <= n->keycnt)
-           && ((cmp = bpltree_keycmp(key,
-                                     n->node.internal.k[pos].key,
-                                     KEYSEP)) > 0)) {
-      pos++;
+      bpltree_show_node(t, n, 0);
     }
+    pos = bpltree_nodesearch(t, n, key, pfx, &cmp);
     if (cmp <= 0) {
-      ret = delete_key(n->node.internal.k[pos-1].bigger, key, indent+2);
-      if ((ret == 0) && (cmp == 0)) {
-        debug(indent, "** originally found at position %hd in node %hd",
-                      pos, n->id);
-        // Check whether the key is still where we believe it is
-        // in the node - some reorgs may have been triggered by
-        // deletions from the subtree
-        pos = 1;
-        while ((pos <= n->keycnt)
-               && ((cmp = bpltree_keycmp(key,
-                                         n->node.internal.k[pos].key,
-                                         KEYSEP)) > 0)) {
-          pos++;
-        }
-        if ((cmp == 0)
-            && (!is_root
-                || (is_root && (n == bpltree_root())))) {
-          // Don't do anything if we were at the root and 
-          // it is gone!
-          debug(indent, "** found at position %hd in internal node %hd",
-                        pos, n->id);
-          // Note that the previous key and the succeeding key of
-          // a key inside an internal node are always in a leaf.
-          // There is always a previous key for an internal node
-          debug(indent, "finding previous key");
-          NODE_T *prev
-              = leaf_with_greatest_key(n->node.internal.k[pos-1].bigger);
-
-          assert(prev);
-          if (bpltree_numeric()) {
-            debug(indent, "previous key %d in leaf node %hd",
-                  *((int*)(prev->node.leaf.k[prev->keycnt-1].key)),
-                  prev->id);
-          } else {
-            debug(indent, "previous key %s in leaf node %hd",
-                  prev->node.leaf.k[prev->keycnt-1].key,
-                  prev->id);
-          }
-          if (n->node.internal.k[pos].key) {
-            free(n->node.internal.k[pos].key);
-          }
-          n->node.internal.k[pos].key
-                 = key_duplicate(prev->node.leaf.k[prev->keycnt-1].key);
-          // Done ...
-        } 
+      // If the key is found here, it's as a separator and
+      // the real entry is in the subtree on its left. The
+      // separator is taken care of once the entry is gone,
+      // as merges may have freed this very node.
+      child = n->node.internal.k[pos-1].bigger;
+      if (cmp == 0) {
+        keep = 1;
       }
-      return ret;
     } else {
       // The search key is bigger than all keys in the node
-      return delete_key(n->node.internal.k[n->keycnt].bigger, key, indent+2);
+      child = n->node.internal.k[n->keycnt].bigger;
     }
-    debug(indent, "removal failed");
-    return -1;
+    latch_write(t, child);
+    if (!keep && delete_safe(t, child)) {
+      latch_release_above(t, child);
+    }
+    return delete_key(t, child, key, val, keep, indent+2);
 }
 
-static short delete_leaf_key(NODE_T    *n,
+static short delete_leaf_key(BPLTREE_T *t,
+                             NODE_T    *n,
                              char      *key,
+                             off_t     *val,
                              short indent) {
-    // -1 if there is something wrong, 0 if OK
+    // -1 if there is something wrong, 0 if OK, 1 if only
+    // *val was removed from the positions of the key and
+    // the key stays. If val is NULL the key goes, whatever
+    // its positions.
     // The only real deletion
-    short pos = 0;
-    int   cmp = -1;
+    short    pos;
+    int      cmp = -1;
+    PREFIX_T pfx = bpltree_keyprefix(key);
 
     assert(key && n && _is_leaf(n));
     if (debugging()) {
       debug_no_nl(indent, "searching node %hd: ", n->id);
-      bpltree_show_node(n, 0);
-    }
-    while ((pos < n->keycnt)
-           && ((cmp = bpltree_keycmp(key, n->node.leaf.k[pos].key,
-                                     KEYSEP)) > 0)) {
-      pos++;
+      bpltree_show_node(t, n, 0);
     }
+    pos = bpltree_nodesearch(t, n, key, pfx, &cmp);
     if (cmp == 0) {
       // We've found it
       debug(indent, "** found at position %hd", pos);
+      if (val) {
+        latch_write(t, n);
+        switch (posting_remove(t, &(n->node.leaf.k[pos].pos), *val)) {
+          case 0:
+            debug(indent, "position %ld removed", (long)*val);
+            return 1;
+          case -1:
+            debug(indent, "position %ld not found", (long)*val);
+            return -1;
+          default:
+            // The last one, the key goes
+            break;
+        }
+      }
       if (debugging()) {
         debug_no_nl(indent, "before calling delete_node:");
-        bpltree_show_node(n, 0);
+        bpltree_show_node(t, n, 0);
       }
-      return delete_leaf_node(n, pos, indent);
+      return delete_leaf_node(t, n, pos, indent);
     }
     debug(indent, "key not found");
     return -1;
 }
 
-static short delete_key(NODE_T    *n,
+static void replace_separator(BPLTREE_T *t, char *key, short indent) {
+    // A key removed from a leaf may still be used as a separator
+    // in (at most) one internal node. Replace it with the greatest
+    // key on its left, which is what a split would have moved up.
+    // That node, if any, is still latched (see delete_internal_key())
+    // - or it has been merged into a sibling that is.
+    short    i;
+    short    pos;
+    int      cmp = -1;
+    NODE_T  *n;
+    NODE_T  *prev;
+    PREFIX_T pfx = bpltree_keyprefix(key);
+
+    for (i = 0; (n = latch_held(i)) != NULL; i++) {
+      if (_is_leaf(n) || latch_freed(n)) {
+        continue;
+      }
+      pos = bpltree_nodesearch(t, n, key, pfx, &cmp);
+      if (cmp == 0) {
+        debug(indent, "** found at position %hd in internal node %hd",
+                      pos, n->id);
+        prev = leaf_with_greatest_key(t, n->node.internal.k[pos-1].bigger);
+        assert(prev);
+        if (debugging()) {
+          char buff[KEY_TEXTLEN];
+
+          debug(indent, "previous key %s in leaf node %hd",
+                bpltree_keytext(t, prev->node.leaf.k[prev->keycnt-1].key,
+                                buff, KEY_TEXTLEN),
+                prev->id);
+        }
+        latch_free_key(t, n->node.internal.k[pos].key);
+        n->node.internal.k[pos].key
+               = key_duplicate(t, prev->node.leaf.k[prev->keycnt-1].key);
+        n->pfx[pos] = prev->pfx[prev->keycnt-1];
+        return;
+      }
+    }
+}
+
+static short delete_key(BPLTREE_T *t,
+                        NODE_T    *n,
                         char      *key,
+                        off_t     *val,
+                        char       keep,
                         short indent) {
     if (_is_leaf(n)) {
-      return delete_leaf_key(n, key, indent);
+      return delete_leaf_key(t, n, key, val, indent);
     } else {
-      return delete_internal_key(n, key, indent);
+      return delete_internal_key(t, n, key, val, keep, indent);
     }
 }
 
-extern int bpltree_delete(char *key) {
-    int      val;
-    int      ret;
+static int delete_entry(BPLTREE_T *t, char *key, off_t *val) {
+    char    *k;
+    NODE_T  *root;
+    int      ret = -1;
+    off_t    lsn = 0;
 
-    if (bpltree_numeric()) {
-      if (sscanf(key, "%d", &val) == 0) {
-        fprintf(stdout, "Tree only contains numerical values\n");
-        return -1;
+    if ((k = bpltree_keyencode(t, key)) == NULL) {
+      return -1;
+    }
+    if (t->image) {
+      // Only paged trees can be changed, in their pages
+      ret = page_delete(t, k, val);
+      free(k);
+      return ret;
+    }
+    latch_writer_begin(t);
+    latch_root(t);
+    if ((root = t->root) != NULL) {
+      latch_write(t, root);
+      if (delete_safe(t, root)) {
+        // The root stays
+        latch_release_above(t, root);
+      }
+      ret = delete_key(t, root, k, val, 0, 0);
+      if (ret == 0) {
+        replace_separator(t, k, 0);
+      }
+      if (ret >= 0) {
+        ret = 0;
+        if (t->wal) {
+          // Logged while the leaf is still latched
+          lsn = (val ? wal_append(t, WAL_REMOVE, key, *val)
+                     : wal_append(t, WAL_DELETE, key, 0));
+        }
       }
     }
-    if (bpltree_numeric()) {
-      ret = delete_key(bpltree_root(), (char *)&val, 0);
-    } else {
-      ret = delete_key(bpltree_root(), key, 0);
+    latch_writer_end(t);
+    if (lsn && wal_commit(t, lsn)) {
+      ret = -1;
     }
+    free(k);
     /*
     if (debugging()) {
-      if (bpltree_check(bpltree_root(), (char *)NULL)) {
-        bpltree_display(bpltree_root(), 0);
+      if (bpltree_check(t, t->root, (char *)NULL)) {
+        bpltree_display(t, t->root, 0);
         assert(0);  // Force exit
       }
     }
     */
     return ret;
 }
+
+extern int bpltree_delete(BPLTREE_T *t, char *key) {
+    // Removes the key, and all its positions if the
+    // tree accepts duplicates
+    return delete_entry(t, key, NULL);
+}
+
+extern int bpltree_delete_val(BPLTREE_T *t, char *key, unsigned long val) {
+    // Removes the (key, val) pair only
+    off_t v = (off_t)val;
+
+    return delete_entry(t, key, &v);
+}
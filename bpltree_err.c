@@ -3,18 +3,30 @@
 
 #include "bpltree_err.h"
 
-static char  G_info[ERR_INFO_LEN] = "";
+// The last error is per thread, so that threads working
+// on different trees don't see each other's errors
+static __thread char  G_info[ERR_INFO_LEN] = "";
 
-#define BPLT_ERR_CNT    6
+#define BPLT_ERR_CNT   16
 
 static char *G_bplt_err[] = {"No error",
                              "Duplicate key",
                              "Invalid number",
                              "Composite keys unsupported with numerical trees",
                              "Field position must be given for one key only",
-                             "Invalid field position"
+                             "Invalid field position",
+                             "Key too long or with too many fields",
+                             "Cannot read or write file",
+                             "Not an index image",
+                             "Index images are read-only",
+                             "Not a log file",
+                             "Changes are not logged",
+                             "No included columns in the index",
+                             "Not available on an index image",
+                             "Changed, but the change could not be logged",
+                             "Not available on a paged tree"
                             };
-static short G_last_error = BPLT_ERR_NONE;
+static __thread short G_last_error = BPLT_ERR_NONE;
 
 extern short bpltree_err(void) {
   return G_last_error;
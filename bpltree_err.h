@@ -10,6 +10,16 @@
 #define BPLT_ERR_NUMKO      3
 #define BPLT_ERR_FIELDSPEC  4
 #define BPLT_ERR_INVSPEC    5 
+#define BPLT_ERR_KEYLEN     6
+#define BPLT_ERR_IO         7
+#define BPLT_ERR_IMAGE      8
+#define BPLT_ERR_READONLY   9
+#define BPLT_ERR_LOG       10
+#define BPLT_ERR_NOLOG     11
+#define BPLT_ERR_NOINCL    12
+#define BPLT_ERR_ONIMAGE   13
+#define BPLT_ERR_UNLOGGED  14
+#define BPLT_ERR_ONPAGED   15
 
 extern short  bpltree_err(void);
 extern void   bpltree_err_reset(void);
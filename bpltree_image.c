@@ -0,0 +1,732 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_image.c
+ *
+ *  Index images.
+ *
+ *  A tree can be saved as an image, which is later mapped
+ *  read-only into memory and searched as it is: there is no
+ *  need to read the data file again and rebuild the tree at
+ *  every start. Nothing in an image is a pointer - nodes and
+ *  keys are referred to by their offset from the start of the
+ *  image, which can therefore be mapped anywhere.
+ *
+ *  An image is a header, alone in the first page, then nodes,
+ *  which all have the same size and come in breadth-first order
+ *  (leaves are all at the bottom of the tree, so they come last
+ *  and in key order), then a heap holding the normalized keys
+ *  and the positions of keys found on several rows (packed by
+ *  posting_pack(), after their length), which the leaf slot
+ *  refers to with minus their offset instead of a position.
+ *  Nodes and heap start on page boundaries. Node sizes are
+ *  powers of two and pages are at least as big as nodes, so
+ *  that a node is always in one page; keys only span pages
+ *  when they are bigger than a page. What goes into the heap
+ *  takes a multiple of HEAP_GRAIN bytes, or a power of two
+ *  when big, so that paged trees, which are kept in images
+ *  (see bpltree_page.c), can give the room back and use it
+ *  again.
+ *
+ *  Instead of being mapped, an image can be read page by page
+ *  through a buffer pool (see bpltree_pool.c), which bounds
+ *  the memory it takes whatever its size. Images are written
+ *  through a pool too.
+ *
+ *  The image is saved from a snapshot, writers can go on.
+ *  Its header says that it is clean, which a paged tree only
+ *  says when all its changes have been written.
+ *
+ * ----------------------------------------------------------------- */
+
+#define _GNU_SOURCE     // For the writer of a paged tree not to wait forever
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "bpltree_image.h"
+#include "debug.h"
+
+#define IMAGE_MAGIC    "BPLTIMG6"
+#define IMAGE_PAGE     4096     // Smallest page
+#define IMAGE_ALIGN      64     // Smallest node
+#define SAVE_FRAMES      64     // Pool for saving and restoring
+#define PAGED_FRAMES   1024     // Pool of a paged tree, if not set
+
+#define _round(x, r)   (((x) + (r) - 1) / (r) * (r))
+
+extern size_t image_node_size(short maxkeys) {
+    size_t needed = offsetof(IMAGE_NODE_T, k)
+                    + (1 + maxkeys) * sizeof(IMAGE_SLOT_T);
+    size_t size = IMAGE_ALIGN;
+
+    while (size < needed) {
+      size *= 2;
+    }
+    return size;
+}
+
+extern size_t image_heap_size(size_t len) {
+    // Room taken in the heap by len bytes
+    size_t size = 2 * HEAP_SMALL;
+
+    if (len <= HEAP_SMALL) {
+      return _round(len, HEAP_GRAIN);
+    }
+    while (size < len) {
+      size *= 2;
+    }
+    return size;
+}
+
+extern IMAGE_NODE_T *image_pin(IMAGE_T *img, off_t off) {
+    // The node at off, NULL if it cannot be read.
+    // Must be given back with image_unpin().
+    char *page;
+
+    if (img->pool == NULL) {
+      return (IMAGE_NODE_T *)(img->base + off);
+    }
+    if ((page = pool_pin(img->pool, off / img->hdr.page)) == NULL) {
+      return NULL;
+    }
+    return (IMAGE_NODE_T *)(page + off % img->hdr.page);
+}
+
+extern void image_unpin(IMAGE_T *img, IMAGE_NODE_T *n, char dirty) {
+    // dirty if n was changed (only done on paged trees)
+    if (img->pool && n) {
+      pool_unpin(img->pool, n, dirty);
+    }
+}
+
+extern off_t *image_offsets(IMAGE_T *img, off_t val, long *cnt) {
+    // Positions of a key found on several rows, in an
+    // array to free. NULL if they cannot be read.
+    unsigned char *packed;
+    unsigned int   len;
+    off_t         *offs;
+    off_t          at = -val;
+
+    if (img->pool == NULL) {
+      return posting_unpack((unsigned char *)img->base + at + sizeof(len),
+                            cnt);
+    }
+    if (pool_read(img->pool, at, &len, sizeof(len))) {
+      return NULL;
+    }
+    packed = (unsigned char *)malloc(len);
+    assert(packed);
+    offs = NULL;
+    if (pool_read(img->pool, at + sizeof(len), packed, len) == 0) {
+      offs = posting_unpack(packed, cnt);
+    }
+    free(packed);
+    return offs;
+}
+
+static NODE_T **breadth_first(SNAPSHOT_T *s, long *cnt) {
+    // Nodes of the snapshot, root first and level by level.
+    // Children are appended in order after those of the nodes
+    // on their parent's left, which is what lets the image
+    // number them.
+    NODE_T        **nodes;
+    NODE_T         *n;
+    NODE_T         *img;
+    NODE_T         *child;
+    unsigned long   v;
+    long            max = 1024;
+    long            i;
+    short           j;
+    short           kc;
+
+    *cnt = 0;
+    if (s->root == NULL) {
+      return NULL;
+    }
+    nodes = (NODE_T **)malloc(max * sizeof(NODE_T *));
+    assert(nodes);
+    nodes[(*cnt)++] = s->root;
+    for (i = 0; i < *cnt; i++) {
+      n = nodes[i];
+      do {
+        img = latch_snapshot_node(s, n, &v);
+        kc = img->keycnt;
+      } while (v && !latch_check(n, v));
+      if (_is_leaf(img)) {
+        continue;
+      }
+      for (j = 0; j <= kc; j++) {
+        // A node that isn't a copy may change under our
+        // feet, but not as the snapshot sees it
+        do {
+          img = latch_snapshot_node(s, n, &v);
+          child = img->node.internal.k[j].bigger;
+        } while (v && !latch_check(n, v));
+        assert(child);
+        if (*cnt == max) {
+          max *= 2;
+          nodes = (NODE_T **)realloc(nodes, max * sizeof(NODE_T *));
+          assert(nodes);
+        }
+        nodes[(*cnt)++] = child;
+      }
+    }
+    return nodes;
+}
+
+extern void image_header(BPLTREE_T *t, IMAGE_HDR_T *hdr) {
+    // Header of an empty image of a tree with the settings of t
+    memset(hdr, 0, sizeof(IMAGE_HDR_T));
+    memcpy(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic));
+    hdr->maxkeys = t->maxkeys;
+    hdr->numeric = t->numeric;
+    hdr->sep = t->sep;
+    hdr->dupl = t->dupl;
+    memcpy(hdr->types, t->types, sizeof(hdr->types));
+    memcpy(hdr->incl, t->incl, sizeof(hdr->incl));
+    hdr->clean = 1;
+    hdr->node_size = image_node_size(t->maxkeys);
+    hdr->page = (hdr->node_size > IMAGE_PAGE ? hdr->node_size : IMAGE_PAGE);
+    hdr->heap = hdr->page;
+    hdr->size = hdr->page;
+    hdr->heap_at = hdr->page;
+    hdr->heap_end = hdr->page;
+}
+
+static off_t heap_place(size_t page, off_t *heap_at, size_t len) {
+    // Where a key of len bytes goes in the heap, which
+    // is moved past it. Keys only span pages if they must.
+    off_t at = *heap_at;
+
+    len = image_heap_size(len);
+    if ((len <= page) && (at % page + len > page)) {
+      at = _round(at, page);
+    }
+    *heap_at = at + len;
+    return at;
+}
+
+extern int bpltree_save(BPLTREE_T *t, char *fname) {
+    // Writes the tree as an image into file fname.
+    // Returns 0 if successful, -1 otherwise.
+    SNAPSHOT_T      s;
+    IMAGE_HDR_T     hdr;
+    IMAGE_NODE_T   *rec;
+    NODE_T        **nodes;
+    NODE_T         *n;
+    struct pool_t  *pool;
+    unsigned long   v;
+    char           *k;
+    unsigned char  *packed;
+    unsigned int    plen;
+    size_t          len;
+    off_t           heap_at;
+    off_t           at;
+    long            valcnt;
+    off_t           heap_mark;
+    long            child = 1;
+    long            i;
+    short           j;
+    short           slots;
+    int             fd;
+    int             ret = 0;
+
+    if (t->image) {
+      bpltree_err_seterr((t->image->writable ? BPLT_ERR_ONPAGED
+                                             : BPLT_ERR_READONLY), NULL);
+      return -1;
+    }
+    if ((fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+      bpltree_err_seterr(BPLT_ERR_IO, fname);
+      return -1;
+    }
+    latch_reader_begin(t);
+    latch_snapshot_take(t, &s);
+    image_header(t, &hdr);
+    nodes = breadth_first(&s, &(hdr.nodecnt));
+    hdr.root = (hdr.nodecnt ? hdr.page : 0);
+    hdr.heap = _round(hdr.page + hdr.nodecnt * hdr.node_size, hdr.page);
+    pool = pool_new(fd, hdr.page, SAVE_FRAMES);
+    rec = (IMAGE_NODE_T *)malloc(hdr.node_size);
+    assert(rec);
+    heap_at = hdr.heap;
+    for (i = 0; (ret == 0) && (i < hdr.nodecnt); i++) {
+      heap_mark = heap_at;
+      do {
+        // Keys of a node that changes while it is read are
+        // written again at the same place
+        n = latch_snapshot_node(&s, nodes[i], &v);
+        memset(rec, 0, hdr.node_size);
+        heap_at = heap_mark;
+        valcnt = 0;
+        rec->is_leaf = n->is_leaf;
+        rec->keycnt = n->keycnt;
+        slots = n->keycnt + (_is_leaf(n) ? 0 : 1);
+        for (j = 0; (j < slots) && (j <= t->maxkeys); j++) {
+          if (_is_leaf(n)) {
+            k = n->node.leaf.k[j].key;
+            rec->k[j].val = n->node.leaf.k[j].pos;
+            valcnt++;
+            if (_is_posting(rec->k[j].val)) {
+              // Lists are never changed, only replaced
+              valcnt += posting_count(rec->k[j].val) - 1;
+              plen = (unsigned int)posting_pack(rec->k[j].val, &packed);
+              at = heap_place(hdr.page, &heap_at, sizeof(plen) + plen);
+              if (pool_write(pool, at, &plen, sizeof(plen))
+                  || pool_write(pool, at + sizeof(plen), packed, plen)) {
+                ret = -1;
+              }
+              free(packed);
+              rec->k[j].val = -at;
+            }
+          } else {
+            k = n->node.internal.k[j].key;
+            rec->k[j].val = hdr.page + (child + j) * hdr.node_size;
+          }
+          rec->k[j].pfx = n->pfx[j];
+          if (k) {
+            // Columns carried by leaf keys go with them
+            len = _key_size(k);
+            rec->k[j].key = heap_place(hdr.page, &heap_at, len);
+            if (pool_write(pool, rec->k[j].key, k, len)) {
+              ret = -1;
+            }
+          }
+        }
+      } while (v && !latch_check(nodes[i], v));
+      if (_is_leaf(n)) {
+        // Leaves come last and in order
+        hdr.keycnt += rec->keycnt;
+        hdr.valcnt += valcnt;
+        if (i + 1 < hdr.nodecnt) {
+          rec->next = hdr.page + (i + 1) * hdr.node_size;
+        }
+      } else {
+        child += rec->keycnt + 1;
+      }
+      if (pool_write(pool, hdr.page + i * hdr.node_size,
+                     rec, hdr.node_size)) {
+        ret = -1;
+      }
+    }
+    latch_snapshot_drop(t, &s);
+    latch_reader_end(t);
+    hdr.size = _round(heap_at, hdr.page);
+    // Where a paged tree would put what comes next
+    hdr.heap_at = heap_at;
+    hdr.heap_end = hdr.size;
+    if ((ret == 0)
+        && (pool_write(pool, 0, &hdr, sizeof(hdr))
+            || pool_flush(pool)
+            || ftruncate(fd, hdr.size)
+            || fsync(fd))) {
+      ret = -1;
+    }
+    pool_release(pool);
+    if (close(fd)) {
+      ret = -1;
+    }
+    if (ret) {
+      bpltree_err_seterr(BPLT_ERR_IO, fname);
+    } else {
+      debug(0, "saved %ld node%s and %ld bytes of keys into %s",
+            hdr.nodecnt, (hdr.nodecnt > 1 ? "s" : ""),
+            (long)(heap_at - hdr.heap), fname);
+    }
+    free(rec);
+    free(nodes);
+    return ret;
+}
+
+static char check_header(IMAGE_HDR_T *hdr, struct stat *st) {
+    size_t page;
+
+    if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic))
+        || !hdr->clean
+        || (hdr->size != (size_t)st->st_size)
+        || (hdr->node_size != image_node_size(hdr->maxkeys))) {
+      return -1;
+    }
+    page = (hdr->node_size > IMAGE_PAGE ? hdr->node_size : IMAGE_PAGE);
+    return (hdr->page == page ? 0 : -1);
+}
+
+extern long image_open(BPLTREE_T *t, char *fname, char writable) {
+    // Opens an image for an empty tree, which takes the settings
+    // of the saved one. A writable image (a paged tree) is read
+    // and written through a buffer pool, a read-only one goes
+    // through a pool too if one was asked for (bpltree_setpool()),
+    // and is mapped otherwise. Returns the number of positions
+    // (of rows), -1 if the image cannot be used.
+    IMAGE_HDR_T          hdr;
+    struct stat          st;
+    pthread_rwlockattr_t attr;
+    void                *p = MAP_FAILED;
+    long                 frames = t->poolsize;
+    int                  fd;
+
+    assert(t->root == NULL);
+    if ((fd = open(fname, (writable ? O_RDWR : O_RDONLY))) == -1) {
+      bpltree_err_seterr(BPLT_ERR_IO, fname);
+      return -1;
+    }
+    if ((fstat(fd, &st) == -1)
+        || (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        || check_header(&hdr, &st)) {
+      close(fd);
+      bpltree_err_seterr(BPLT_ERR_IMAGE, fname);
+      return -1;
+    }
+    if (writable && (frames == 0)) {
+      frames = PAGED_FRAMES;
+    }
+    if (frames == 0) {
+      p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (p == MAP_FAILED) {
+        bpltree_err_seterr(BPLT_ERR_IO, fname);
+        return -1;
+      }
+    }
+    t->image = (IMAGE_T *)calloc(1, sizeof(IMAGE_T));
+    assert(t->image);
+    memcpy(&(t->image->hdr), &hdr, sizeof(hdr));
+    if (p != MAP_FAILED) {
+      t->image->base = (char *)p;
+      t->image->size = st.st_size;
+    } else {
+      t->image->fd = fd;
+      t->image->pool = pool_new(fd, hdr.page, frames);
+    }
+    t->image->writable = writable;
+    (void)pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // Searches would otherwise keep changes waiting
+    (void)pthread_rwlockattr_setkind_np(&attr,
+                          PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    (void)pthread_rwlock_init(&(t->image->lock), &attr);
+    (void)pthread_rwlockattr_destroy(&attr);
+    t->maxkeys = hdr.maxkeys;
+    t->numeric = hdr.numeric;
+    t->sep = hdr.sep;
+    t->dupl = hdr.dupl;
+    memcpy(t->types, hdr.types, sizeof(t->types));
+    memcpy(t->incl, hdr.incl, sizeof(t->incl));
+    debug(0, "%s %ld node%s from %s", (t->image->pool ? "opened" : "mapped"),
+          hdr.nodecnt, (hdr.nodecnt > 1 ? "s" : ""), fname);
+    return hdr.valcnt;
+}
+
+extern long bpltree_map(BPLTREE_T *t, char *fname) {
+    // Opens an image saved by bpltree_save() for an empty tree,
+    // which takes the settings of the saved one and can then
+    // only be searched with bpltree_get(). The image is mapped
+    // unless a buffer pool was asked for (bpltree_setpool()).
+    // Returns the number of positions (of rows), -1 if the
+    // image cannot be used.
+    return image_open(t, fname, 0);
+}
+
+extern long bpltree_restore(BPLTREE_T *t, char *fname) {
+    // Loads an image saved by bpltree_save() into an empty tree,
+    // which takes the settings that matter for keys and can then
+    // be changed like any other. Returns the number of positions
+    // (of rows), -1 if the image cannot be used.
+    IMAGE_T        img;
+    IMAGE_NODE_T  *n = NULL;
+    KEY_POS_T     *kp;
+    struct stat    st;
+    char           khdr[KEY_HDR];
+    unsigned char  ilen[2];
+    size_t         len;
+    off_t          next;
+    off_t         *offs;
+    long           cnt = 0;
+    long           valcnt = 0;
+    long           c;
+    short          i;
+    char           failed = 0;
+
+    assert(t->root == NULL);
+    if (t->image) {
+      bpltree_err_seterr(BPLT_ERR_READONLY, NULL);
+      return -1;
+    }
+    memset(&img, 0, sizeof(img));
+    if ((img.fd = open(fname, O_RDONLY)) == -1) {
+      bpltree_err_seterr(BPLT_ERR_IO, fname);
+      return -1;
+    }
+    if ((fstat(img.fd, &st) == -1)
+        || (pread(img.fd, &(img.hdr), sizeof(img.hdr), 0) != sizeof(img.hdr))
+        || check_header(&(img.hdr), &st)) {
+      close(img.fd);
+      bpltree_err_seterr(BPLT_ERR_IMAGE, fname);
+      return -1;
+    }
+    img.pool = pool_new(img.fd, img.hdr.page, SAVE_FRAMES);
+    kp = (KEY_POS_T *)malloc((img.hdr.keycnt + 1) * sizeof(KEY_POS_T));
+    assert(kp);
+    // Down to the first leaf, then from leaf to leaf
+    if (img.hdr.root && ((n = image_pin(&img, img.hdr.root)) == NULL)) {
+      failed = 1;
+    }
+    while (n && !n->is_leaf) {
+      next = n->k[0].val;
+      image_unpin(&img, n, 0);
+      if ((n = image_pin(&img, next)) == NULL) {
+        failed = 1;
+      }
+    }
+    while (n) {
+      for (i = 0; (i < n->keycnt) && (cnt < img.hdr.keycnt); i++) {
+        if (pool_read(img.pool, n->k[i].key, khdr, KEY_HDR)) {
+          failed = 1;
+          break;
+        }
+        len = KEY_HDR + _key_len(khdr);
+        if (_key_incl(khdr)) {
+          // Length of the columns that follow the body
+          if (pool_read(img.pool, n->k[i].key + len, ilen, 2)) {
+            failed = 1;
+            break;
+          }
+          len += 2 + ((ilen[0] << 8) | ilen[1]);
+        }
+        kp[cnt].key = arena_key(t->arena, len);
+        kp[cnt].pos = n->k[i].val;
+        cnt++;
+        valcnt++;
+        if (_is_posting(n->k[i].val)) {
+          if ((offs = image_offsets(&img, n->k[i].val, &c)) == NULL) {
+            kp[cnt-1].pos = 0;
+            failed = 1;
+            break;
+          }
+          kp[cnt-1].pos = posting_build(t, offs, c);
+          valcnt += c - 1;
+          free(offs);
+        }
+        if (pool_read(img.pool, n->k[i].key, kp[cnt-1].key, len)) {
+          failed = 1;
+          break;
+        }
+      }
+      next = n->next;
+      image_unpin(&img, n, 0);
+      n = NULL;
+      if (!failed && next && ((n = image_pin(&img, next)) == NULL)) {
+        failed = 1;
+      }
+    }
+    pool_release(img.pool);
+    close(img.fd);
+    if (failed) {
+      while (cnt) {
+        cnt--;
+        arena_free_key(t->arena, kp[cnt].key);
+        posting_free(t, kp[cnt].pos);
+      }
+      free(kp);
+      bpltree_err_seterr(BPLT_ERR_IO, fname);
+      return -1;
+    }
+    t->numeric = img.hdr.numeric;
+    t->sep = img.hdr.sep;
+    t->dupl = img.hdr.dupl;
+    memcpy(t->types, img.hdr.types, sizeof(t->types));
+    memcpy(t->incl, img.hdr.incl, sizeof(t->incl));
+    load_sorted(t, kp, cnt);
+    free(kp);
+    debug(0, "restored %ld key%s from %s", cnt, (cnt > 1 ? "s" : ""), fname);
+    return valcnt;
+}
+
+extern void image_release(IMAGE_T *img) {
+    if (img) {
+      if (img->writable && page_sync(img)) {
+        debug(0, "changes to the paged tree could not be written: %s",
+              bpltree_err_msg());
+      }
+      (void)pthread_rwlock_destroy(&(img->lock));
+      if (img->pool) {
+        pool_release(img->pool);
+        close(img->fd);
+      } else {
+        (void)munmap(img->base, img->size);
+      }
+      free(img);
+    }
+}
+
+extern short image_err(BPLTREE_T *t) {
+    // What cannot be done on an image, whether it is mapped
+    // read-only or a paged tree
+    return (t->image->writable ? BPLT_ERR_ONPAGED : BPLT_ERR_ONIMAGE);
+}
+
+static int slot_cmp(BPLTREE_T *t, IMAGE_SLOT_T *slot,
+                    char *key, PREFIX_T pfx, char *failed) {
+    // Same as bpltree_nodecmp() for an image node. *failed
+    // is set if the key in the slot cannot be read.
+    IMAGE_T  *img = t->image;
+    size_t    page = img->hdr.page;
+    size_t    at = slot->key % page;
+    char     *data;
+    char     *k;
+    char      khdr[KEY_HDR];
+    int       cmp;
+
+    if (((cmp = bpltree_pfxcmp(t, pfx, slot->pfx)) != 0) || t->numeric) {
+      return cmp;
+    }
+    if (img->pool == NULL) {
+      return bpltree_keycmp(key, img->base + slot->key);
+    }
+    if ((data = pool_pin(img->pool, slot->key / page)) == NULL) {
+      *failed = 1;
+      return 0;
+    }
+    k = data + at;
+    if ((at + KEY_HDR <= page) && (at + KEY_HDR + _key_len(k) <= page)) {
+      cmp = bpltree_keycmp(key, k);
+      pool_unpin(img->pool, data, 0);
+      return cmp;
+    }
+    // Spans pages, read into memory
+    pool_unpin(img->pool, data, 0);
+    if (pool_read(img->pool, slot->key, khdr, KEY_HDR)) {
+      *failed = 1;
+      return 0;
+    }
+    k = (char *)malloc(KEY_HDR + _key_len(khdr));
+    assert(k);
+    if (pool_read(img->pool, slot->key, k, KEY_HDR + _key_len(khdr))) {
+      *failed = 1;
+      cmp = 0;
+    } else {
+      cmp = bpltree_keycmp(key, k);
+    }
+    free(k);
+    return cmp;
+}
+
+extern short image_search(BPLTREE_T *t, IMAGE_NODE_T *n, char *key,
+                          PREFIX_T pfx, int *cmp, char *failed) {
+    // Same as bpltree_nodesearch() for an image node,
+    // always by halving
+    short pos = (n->is_leaf ? 0 : 1);
+    short end = pos + n->keycnt;
+    short cnt = n->keycnt;
+    short half;
+
+    while (cnt > 0) {
+      half = cnt / 2;
+      if (slot_cmp(t, &(n->k[pos + half]), key, pfx, failed) > 0) {
+        pos += half + 1;
+        cnt -= half + 1;
+      } else {
+        cnt = half;
+      }
+    }
+    if (pos < end) {
+      *cmp = slot_cmp(t, &(n->k[pos]), key, pfx, failed);
+    } else if (n->keycnt) {
+      *cmp = 1;
+    }
+    return pos;
+}
+
+extern int image_get(BPLTREE_T *t, char *low_key, char *high_key,
+                     ROWS_T *r) {
+    // bpltree_get() on an image, once keys are known. Rows
+    // go to r, returns -1 if the image cannot be read.
+    IMAGE_T       *img = t->image;
+    IMAGE_NODE_T  *n = NULL;
+    PREFIX_T       lpfx = bpltree_keyprefix(low_key);
+    PREFIX_T       hpfx = bpltree_keyprefix(high_key);
+    off_t          next;
+    off_t         *offs;
+    long           cnt;
+    long           j;
+    short          i = 0;
+    int            cmp = 1;
+    char           failed = 0;
+    char           stop = 0;
+
+    if (img->writable) {
+      // Paged trees are changed in place
+      (void)pthread_rwlock_rdlock(&(img->lock));
+    }
+    if (img->hdr.root && ((n = image_pin(img, img->hdr.root)) == NULL)) {
+      failed = 1;
+    }
+    while (n && !n->is_leaf) {
+      i = (low_key ? image_search(t, n, low_key, lpfx, &cmp, &failed) : 1);
+      next = n->k[i-1].val;
+      image_unpin(img, n, 0);
+      n = NULL;
+      if (!failed && ((n = image_pin(img, next)) == NULL)) {
+        failed = 1;
+      }
+    }
+    i = 0;
+    if (n && low_key) {
+      i = image_search(t, n, low_key, lpfx, &cmp, &failed);
+    }
+    while (n && !failed && !stop) {
+      for (; i < n->keycnt; i++) {
+        if (high_key
+            && (slot_cmp(t, &(n->k[i]), high_key, hpfx, &failed) < 0)) {
+          stop = 1;
+          break;
+        }
+        if (failed) {
+          break;
+        }
+        if (_is_posting(n->k[i].val)) {
+          if ((offs = image_offsets(img, n->k[i].val, &cnt)) == NULL) {
+            failed = 1;
+            break;
+          }
+          for (j = 0; j < cnt; j++) {
+            rows_add(r, offs[j]);
+          }
+          free(offs);
+        } else {
+          rows_add(r, n->k[i].val);
+        }
+        if (r->count < 0) {
+          break;
+        }
+      }
+      next = n->next;
+      image_unpin(img, n, 0);
+      n = NULL;
+      if ((r->count >= 0) && !failed && !stop && next
+          && ((n = image_pin(img, next)) == NULL)) {
+        failed = 1;
+      }
+      i = 0;
+    }
+    image_unpin(img, n, 0);
+    if (img->writable) {
+      (void)pthread_rwlock_unlock(&(img->lock));
+    }
+    if (failed) {
+      printf("%s\n", bpltree_err_msg());
+      r->count = -1;
+      return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef BPLTREE_IMAGE_H
+
+#define BPLTREE_IMAGE_H
+
+#include <pthread.h>
+
+// Layout of index images (see bpltree_image.c), which
+// paged trees (see bpltree_page.c) use too
+
+#define HEAP_GRAIN      16   // Heap space is given in multiples,
+#define HEAP_SMALL    1024   // up to there, then in powers of two
+#define HEAP_CLASSES   112   // Free lists of heap space, by size
+
+typedef struct image_slot_t {
+           off_t     key;       // In the heap, 0 if none
+           off_t     val;       // Child node, or position in the file
+           PREFIX_T  pfx;
+         } IMAGE_SLOT_T;
+
+typedef struct image_node_t {
+           char          is_leaf;
+           short         keycnt;
+           off_t         next;  // Next leaf, 0 if none
+           IMAGE_SLOT_T  k[1];  // 1 + maximum number of keys
+         } IMAGE_NODE_T;
+
+typedef struct image_hdr_t {
+           char    magic[8];
+           short   maxkeys;
+           char    numeric;
+           char    sep;
+           char    dupl;
+           char    types[KEY_TYPES];
+           unsigned char incl[INCL_FIELDS + 1];
+           char    clean;       // Not left in the middle of changes
+           long    keycnt;      // In leaves
+           long    valcnt;      // Positions, more than keys if dupl
+           long    nodecnt;
+           size_t  node_size;
+           size_t  page;
+           off_t   root;        // 0 if the tree is empty
+           off_t   heap;
+           size_t  size;        // Of the whole image
+           // Where paged trees find room
+           off_t   free_node;   // Chain of free node slots, 0 if none
+           off_t   heap_at;     // Room left in the last heap page
+           off_t   heap_end;
+           off_t   freed[HEAP_CLASSES];  // Chains of free heap space
+         } IMAGE_HDR_T;
+
+typedef struct image_t {
+           IMAGE_HDR_T       hdr;
+           char             *base;      // If mapped,
+           size_t            size;
+           struct pool_t    *pool;      // otherwise read through a pool
+           int               fd;
+           char              writable;  // A paged tree
+           char              changing;  // The file says so
+           pthread_rwlock_t  lock;      // Readers against the writer
+         } IMAGE_T;
+
+extern size_t        image_node_size(short maxkeys);
+extern size_t        image_heap_size(size_t len);
+extern void          image_header(BPLTREE_T *t, IMAGE_HDR_T *hdr);
+extern long          image_open(BPLTREE_T *t, char *fname, char writable);
+extern IMAGE_NODE_T *image_pin(IMAGE_T *img, off_t off);
+extern void          image_unpin(IMAGE_T *img, IMAGE_NODE_T *n, char dirty);
+extern off_t        *image_offsets(IMAGE_T *img, off_t val, long *cnt);
+extern short         image_search(BPLTREE_T *t, IMAGE_NODE_T *n, char *key,
+                                  PREFIX_T pfx, int *cmp, char *failed);
+extern int           page_sync(IMAGE_T *img);
+
+#endif
@@ -0,0 +1,172 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_incl.c
+ *
+ *  Included columns.
+ *
+ *  A tree may keep, next to each key in the leaves, some
+ *  other columns of its row, so that a get that needs nothing
+ *  more can be answered from the index without reading the
+ *  file (see bpltree_iget()). The columns are taken from the
+ *  mapped file (see bpltree_mapdata()) when the key is added,
+ *  joined by the field separator, and stored after the body
+ *  of the key in the same block: they move with the key when
+ *  nodes split or merge, and go with it. Separators in internal
+ *  nodes are copies of the key alone (see key_duplicate()).
+ *
+ *  A key with several rows (a posting list) doesn't keep the
+ *  columns of any, nor does a key whose row couldn't be read
+ *  when it was added: their rows are read.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "debug.h"
+
+#define INCL_MAXFIELD   255   // Highest column number
+#define INCL_MAXLEN  0xffff   // Of the columns of a key
+
+extern int bpltree_setincluded(BPLTREE_T *t, char *fields) {
+    // fields is a comma-separated list of column numbers
+    // (leftmost is 1). Must be set before any key is added.
+    // Returns -1 if the list is invalid.
+    unsigned char  incl[INCL_FIELDS + 1];
+    char          *p = fields;
+    char          *end;
+    long           k;
+    int            i = 0;
+
+    memset(incl, 0, sizeof(incl));
+    while (p && *p) {
+      k = strtol(p, &end, 10);
+      if ((end == p) || (k < 1) || (k > INCL_MAXFIELD)
+          || (i == INCL_FIELDS) || (*end && (*end != ','))) {
+        bpltree_err_seterr(BPLT_ERR_INVSPEC, fields);
+        return -1;
+      }
+      incl[i++] = (unsigned char)k;
+      p = (*end ? end + 1 : end);
+    }
+    if (i == 0) {
+      bpltree_err_seterr(BPLT_ERR_INVSPEC, fields);
+      return -1;
+    }
+    memcpy(t->incl, incl, sizeof(t->incl));
+    return 0;
+}
+
+static size_t columns(BPLTREE_T *t, char *row, size_t len, char *out) {
+    // Writes the included columns of a row, joined by the
+    // separator, into out if not NULL. Returns their length.
+    unsigned int  ends[INCL_MAXFIELD + 1];
+    size_t        rowlen;
+    size_t        start;
+    size_t        n;
+    size_t        total = 0;
+    short         cnt;
+    short         i;
+    short         k;
+
+    cnt = bpltree_fieldsplit(row, len, t->sep, ends,
+                             INCL_MAXFIELD + 1, &rowlen);
+    for (i = 0; t->incl[i]; i++) {
+      if (i) {
+        if (out) {
+          out[total] = t->sep;
+        }
+        total++;
+      }
+      k = t->incl[i];
+      if (k <= cnt) {
+        start = (k > 1 ? ends[k-2] + 1 : 0);
+        n = ends[k-1] - start;
+        while (n && isspace(row[start + n - 1])) {
+          n--;
+        }
+        if (out) {
+          memcpy(out + total, row + start, n);
+        }
+        total += n;
+      }
+    }
+    return total;
+}
+
+extern char *incl_attach(BPLTREE_T *t, char *key, off_t pos,
+                         char in_arena) {
+    // Returns key with the included columns of the row at
+    // pos, or key itself if the tree keeps none or the row
+    // cannot be read. The key passed is then freed.
+    DATA_T  d;
+    char   *k;
+    char   *row;
+    size_t  len;
+    size_t  ilen;
+    size_t  klen;
+
+    if ((t->incl[0] == 0) || (t->data == NULL) || (pos < 0)
+        || _key_incl(key)) {
+      return key;
+    }
+    // The mapping is shared, a buffer for rows read with
+    // stdio is not
+    d = *(t->data);
+    d.buf = NULL;
+    d.bufsz = 0;
+    if ((row = data_row(&d, pos, &len)) == NULL) {
+      data_close(&d);
+      return key;
+    }
+    if ((ilen = columns(t, row, len, NULL)) > INCL_MAXLEN) {
+      data_close(&d);
+      return key;
+    }
+    klen = KEY_HDR + _key_len(key);
+    if (in_arena) {
+      k = arena_key(t->arena, klen + 2 + ilen);
+    } else {
+      k = (char *)malloc(klen + 2 + ilen);
+      assert(k);
+    }
+    memcpy(k, key, klen);
+    k[0] |= KEY_INCL;
+    k[klen] = (char)((ilen >> 8) & 0xff);
+    k[klen + 1] = (char)(ilen & 0xff);
+    (void)columns(t, row, len, k + klen + 2);
+    data_close(&d);
+    if (in_arena) {
+      arena_free_key(t->arena, key);
+    } else {
+      free(key);
+    }
+    return k;
+}
+
+extern void incl_show(BPLTREE_T *t, char *key, char *row, size_t len) {
+    // Displays a key and its included columns, taken from
+    // row if not NULL, otherwise from the key
+    char    buff[KEY_TEXTLEN];
+    char   *p = NULL;
+    size_t  n;
+
+    fputs(bpltree_keytext(t, key, buff, KEY_TEXTLEN), stdout);
+    putchar(t->sep);
+    if (row) {
+      n = columns(t, row, len, NULL);
+      p = (char *)malloc(n ? n : 1);
+      assert(p);
+      (void)columns(t, row, len, p);
+      fwrite(p, 1, n, stdout);
+      free(p);
+    } else {
+      fwrite(_incl_text(key), 1, _incl_len(key), stdout);
+    }
+    putchar('\n');
+}
@@ -18,7 +18,8 @@
 #include "debug.h"
 
 
-static short split_position(short target_pos, char *new_up, char leaf) {
+static short split_position(BPLTREE_T *t, short target_pos,
+                            char *new_up, char leaf) {
     // Reminder: the split position is the 
     // position of the key that moves up.
     // Everything smaller remains in the left node,
@@ -29,7 +30,7 @@ static short split_position(short target_pos, char *new_up, char leaf) {
     // from 0 to MAX - 1, but for internal nodes
     // as there is one more pointer than keys
     // it's numbered from 1 to MAX.
-    short maxkeys = bpltree_maxkeys();
+    short maxkeys = t->maxkeys;
 
     assert(new_up);
     *new_up = 0;
@@ -66,7 +67,8 @@ static short split_position(short target_pos, char *new_up, char leaf) {
     return -1; 
 }
 
-static NODE_T  *split_node(NODE_T *n, short split_pos, short indent) {
+static NODE_T  *split_node(BPLTREE_T *t, NODE_T *n,
+                           short split_pos, short indent) {
    // Splits n at position split_pos (moves everything
    // from split_pos + 1 to the end into a new node to the
    // right) and returns a pointer to the new sibling node.
@@ -75,7 +77,7 @@ static NODE_T  *split_node(NODE_T *n, short split_pos, short indent) {
    short   i;
 
    assert(n
-          && (n->keycnt == bpltree_maxkeys())
+          && (n->keycnt == t->maxkeys)
           && (split_pos > 0)
           && (split_pos < n->keycnt));
    debug(indent, "splitting node %hd", n->id);
@@ -83,11 +85,11 @@ static NODE_T  *split_node(NODE_T *n, short split_pos, short indent) {
      debug(indent, "splitting the root");
      // We are splitting the root. We need a new root and
      // it will necessarily be an internal node.
-     n->parent = new_node(NULL, 0);
+     n->parent = new_node(t, NULL, 0);
      debug(indent, "new root node %hd", (n->parent)->id);
-     bpltree_setroot(n->parent);
+     bpltree_setroot(t, n->parent);
    }
-   new_n = new_node(n->parent,
+   new_n = new_node(t, n->parent,
                     (_is_leaf(n) ? 1 : 0)); // New sibling, same parent
    assert(new_n);
    debug(indent, "created new node %hd, parent %hd",
@@ -96,7 +98,7 @@ static NODE_T  *split_node(NODE_T *n, short split_pos, short indent) {
    debug(indent, "splitting at %hd", split_pos);
    if (debugging()) {
      debug_no_nl(indent, "before split: ");
-     bpltree_show_node(n, 0);
+     bpltree_show_node(t, n, 0);
    }
    // (dest, src, size)
    if (!_is_leaf(n)) {
@@ -106,6 +108,8 @@ static NODE_T  *split_node(NODE_T *n, short split_pos, short indent) {
      // Blank out what was moved for safety
      (void)memset(&(n->node.internal.k[split_pos+1]), 0,
                   sizeof(REDIRECT_T) * (n->keycnt - split_pos));
+     (void)memcpy(&(new_n->pfx[1]), &(n->pfx[split_pos+1]),
+                  sizeof(PREFIX_T) * (n->keycnt - split_pos));
    } else {
      // For leaves the value at split_pos remains
      // in the first node, and numbering is from zero.
@@ -114,8 +118,16 @@ static NODE_T  *split_node(NODE_T *n, short split_pos, short indent) {
                    sizeof(KEY_POS_T) * (n->keycnt - split_pos - 1));
      (void)memset(&(n->node.leaf.k[split_pos+1]), 0,
                   sizeof(KEY_POS_T) * (n->keycnt - split_pos - 1));
-     // Set the "next" pointer
+     (void)memcpy(&(new_n->pfx[0]), &(n->pfx[split_pos+1]),
+                  sizeof(PREFIX_T) * (n->keycnt - split_pos - 1));
+     // Set the "next" and "prev" pointers. The leaf that
+     // followed changes too.
      new_n->node.leaf.next = n->node.leaf.next;
+     new_n->node.leaf.prev = n;
+     if (new_n->node.leaf.next) {
+       latch_write(t, new_n->node.leaf.next);
+       (new_n->node.leaf.next)->node.leaf.prev = new_n;
+     }
      n->node.leaf.next = new_n;
    }
    // Adjust key counts
@@ -123,12 +135,12 @@ static NODE_T  *split_node(NODE_T *n, short split_pos, short indent) {
    n->keycnt = split_pos + (_is_leaf(n) ? 1 : 0);
    if (debugging()) {
      debug_no_nl(indent, "-> %hd keys in node %d ", n->keycnt, n->id);
-     bpltree_show_node(n, 0);
+     bpltree_show_node(t, n, 0);
    }
    new_n->keycnt -= (split_pos + (_is_leaf(n) ? 1 : 0));
    if (debugging()) {
      debug_no_nl(indent, "-> %hd keys in node %d ", new_n->keycnt, new_n->id);
-     bpltree_show_node(new_n, 0);
+     bpltree_show_node(t, new_n, 0);
    }
    if (!_is_leaf(n)) {
      // Change parent pointer in the new node
@@ -141,7 +153,8 @@ static NODE_T  *split_node(NODE_T *n, short split_pos, short indent) {
    return new_n;
 }
 
-static short insert_in_node(NODE_T *n,
+static short insert_in_node(BPLTREE_T *t,
+                            NODE_T *n,
                             char   *key,
                             off_t   val,
                             NODE_T *smaller,
@@ -154,48 +167,49 @@ static short insert_in_node(NODE_T *n,
   assert(key);
   if (n == NULL) {
     debug(indent, "need to create a new root (internal node)");
-    NODE_T *root = new_node(NULL, 0);  // Can no longer be a leaf
+    NODE_T *root = new_node(t, NULL, 0);  // Can no longer be a leaf
     root->keycnt = 1;
     root->node.internal.k[0].bigger = smaller; 
     root->node.internal.k[1].key = key;
+    root->pfx[1] = bpltree_keyprefix(key);
     root->node.internal.k[1].bigger = bigger; 
-    bpltree_setroot(root);
+    bpltree_setroot(t, root);
     if (debugging()) {
       debug_no_nl(indent, "new root is node %hd ", root->id);
-      bpltree_show_node(root, 0);
+      bpltree_show_node(t, root, 0);
     }
   } else {
-    short pos = find_pos(n, key, 0, indent);
+    short pos = find_pos(t, n, key, 0, indent);
     if (debugging()) {
-      if (bpltree_numeric()) {
-        debug_no_nl(indent, "inserting key %d at pos %hd in node %hd ",
-                    *((int*)key), pos, n->id);
-      } else {
-        debug_no_nl(indent, "inserting key %s at pos %hd in node %hd ",
-                    key, pos, n->id);
-      }
-      bpltree_show_node(n, 0);
+      char buff[KEY_TEXTLEN];
+
+      debug_no_nl(indent, "inserting key %s at pos %hd in node %hd ",
+                  bpltree_keytext(t, key, buff, KEY_TEXTLEN), pos, n->id);
+      bpltree_show_node(t, n, 0);
     }
     if (pos >= 0) {
-      if (n->keycnt == bpltree_maxkeys()) {
+      // Whether it splits or not, the node changes
+      // (it was latched on the way down, this only makes sure)
+      latch_write(t, n);
+      if (n->keycnt == t->maxkeys) {
         // Must split
         // Contrary to what happens in internal nodes,
         // a key (and its associated position) are ALWAYS
         // inserted inside a leaf node.
         char   *key_up;
         char    new_up = 0; // Flag
-        short   split_pos = split_position(pos, &new_up, n->is_leaf);
+        short   split_pos = split_position(t, pos, &new_up, n->is_leaf);
         if (new_up) {
           // The key that will go up is the one being inserted
           key_up = key;
         } else {
           if (_is_leaf(n)) {
-            key_up = key_duplicate(n->node.leaf.k[split_pos].key);
+            key_up = key_duplicate(t, n->node.leaf.k[split_pos].key);
           } else {
             key_up = n->node.internal.k[split_pos].key;
           }
         }
-        NODE_T *new_n = split_node(n, split_pos, indent);
+        NODE_T *new_n = split_node(t, n, split_pos, indent);
         if (!new_up) {
           // A key that already was in the node (at split_pos)
           // moves up.
@@ -217,16 +231,16 @@ static short insert_in_node(NODE_T *n,
             (n->keycnt)--;
           } // else keep the record in the leaf
           // Move up the key at split_pos in the left sibling (n)
-          if (insert_in_node(n->parent, key_up, 0,
+          if (insert_in_node(t, n->parent, key_up, 0,
                              n, new_n, indent+2) >= 0) {
             if (pos <= split_pos) {
               // Insert into n
-              ret = insert_in_node(n, key, val, smaller, bigger, indent+2);
+              ret = insert_in_node(t, n, key, val, smaller, bigger, indent+2);
               debug(indent, "<< insert_in_node (%hd)", ret);
               return ret;
             } else {
               // Insert into new_sibling
-              ret = insert_in_node(new_n, key, val,
+              ret = insert_in_node(t, new_n, key, val,
                                    smaller, bigger, indent+2);
               debug(indent, "<< insert_in_node (%hd)", ret);
               return ret;
@@ -244,7 +258,7 @@ static short insert_in_node(NODE_T *n,
               (new_n->node.internal.k[0].bigger)->parent = new_n;
             }
           }
-          ret= insert_in_node(n->parent, key_up, val,
+          ret= insert_in_node(t, n->parent, key_up, val,
                               n, new_n, indent+2);
           debug(indent, "<< insert_in_node (%hd)", ret);
           return ret;
@@ -265,7 +279,10 @@ static short insert_in_node(NODE_T *n,
                           &(n->node.leaf.k[pos]),
                           sizeof(KEY_POS_T) * (1 + n->keycnt - pos));
           }
+          (void)memmove(&(n->pfx[pos+1]), &(n->pfx[pos]),
+                        sizeof(PREFIX_T) * (1 + n->keycnt - pos));
         }
+        n->pfx[pos] = bpltree_keyprefix(key);
         if (!_is_leaf(n)) {
           n->node.internal.k[pos].key = key;
           if (!n->node.internal.k[pos-1].bigger) {
@@ -286,7 +303,7 @@ static short insert_in_node(NODE_T *n,
         (n->keycnt)++;
         if (debugging()) {
           debug_no_nl(indent, "updated node %d ", n->id);
-          bpltree_show_node(n, 0);
+          bpltree_show_node(t, n, 0);
         }
       }
     } else {
@@ -298,48 +315,56 @@ static short insert_in_node(NODE_T *n,
   return 0;
 }
 
-static short insert_key(NODE_T       *n,
+static short insert_key(BPLTREE_T    *t,
+                        NODE_T       *n,
                         char         *key,
                         unsigned long val,
                         short         indent) {
     // -1 if there is something wrong, 0 if OK
-    short pos = 1;
-    int   cmp = -1;
-    short ret;
+    short    pos;
+    int      cmp = -1;
+    short    ret;
+    NODE_T  *child;
+    char    *k;
+    PREFIX_T pfx = bpltree_keyprefix(key);
 
     debug(indent, ">> insert_key");
     assert(key && n);
     // Find the leaf node where the key should be stored
     if (debugging()) {
       debug_no_nl(indent, "searching node %hd: ", n->id);
-      bpltree_show_node(n, 0);
+      bpltree_show_node(t, n, 0);
     }
-    if (!_is_leaf(n)) {
-      while ((pos <= n->keycnt)
-             && ((cmp = bpltree_keycmp(key,
-                                     n->node.internal.k[pos].key,
-                                     KEYSEP)) > 0)) {
-        pos++;
-      }
-    } else {
-      pos = 0;
-      while ((pos < n->keycnt)
-             && ((cmp = bpltree_keycmp(key,
-                                     n->node.leaf.k[pos].key,
-                                     KEYSEP)) > 0)) {
-        pos++;
+    pos = bpltree_nodesearch(t, n, key, pfx, &cmp);
+    if ((cmp == 0) && t->dupl) {
+      // The key is in the leaf, as a separator it is
+      // the greatest key of the subtree on its left
+      if (_is_leaf(n)) {
+        debug(indent, "** found at position %hd, adding a position", pos);
+        // The node is latched already, this makes it ours
+        latch_write(t, n);
+        if (posting_add(t, &(n->node.leaf.k[pos].pos), (off_t)val) == 0) {
+          k = n->node.leaf.k[pos].key;
+          if (_key_incl(k)) {
+            // The columns were those of the first row only
+            n->node.leaf.k[pos].key = key_duplicate(t, k);
+            latch_free_key(t, k);
+          }
+          debug(indent, "<< insert_key (0)");
+          return 0;
+        }
+      } else {
+        cmp = -1;
       }
     }
     if (cmp == 0) {
       // We've found it in the tree
       debug(indent, "** found at position %hd", pos);
       debug(indent, "duplicates not allowed");
-      if (bpltree_numeric()) {
-         char buff[20];
-         snprintf(buff, 20, "%d", *((int *)key));
-         bpltree_err_seterr(BPLT_ERR_DUPL, buff);
-      } else {
-         bpltree_err_seterr(BPLT_ERR_DUPL, key);
+      {
+         char buff[KEY_TEXTLEN];
+         bpltree_err_seterr(BPLT_ERR_DUPL,
+                            bpltree_keytext(t, key, buff, KEY_TEXTLEN));
       }
       debug(indent, "<< insert_key (-1)");
       return -1;
@@ -347,15 +372,19 @@ static short insert_key(NODE_T       *n,
     // We have found a key that is greater (or equal) or we have reached
     // the end of the node
     if (!_is_leaf(n)) {
-      ret = insert_key(n->node.internal.k[pos-1].bigger,
-                       key, val, indent+2);
+      child = n->node.internal.k[pos-1].bigger;
+      latch_write(t, child);
+      if (child->keycnt < t->maxkeys) {
+        // A split below will stop here
+        latch_release_above(t, child);
+      }
+      ret = insert_key(t, child, key, val, indent+2);
       debug(indent, "<< insert_key (%hd)", ret);
       return ret;
     } else {
-      char *k;
       debug(indent, "should go in this leaf node");
-      k = key_duplicate(key);
-      ret = insert_in_node(n, k, val, NULL, NULL, indent);
+      k = key_entry(t, key);
+      ret = insert_in_node(t, n, k, val, NULL, NULL, indent);
       debug(indent, "<< insert_key (%hd)", ret);
       return ret;
     }
@@ -363,21 +392,29 @@ static short insert_key(NODE_T       *n,
     return -1;
 }
 
-static int insert_from_root(char *key, unsigned long val, int indent) {
+static int insert_from_root(BPLTREE_T *t, char *key,
+                            unsigned long val, int indent) {
    NODE_T *n;
    int     ret;
 
    debug(indent, ">> insert_from_root");
-   if (!bpltree_root()) {
+   latch_root(t);
+   if (!t->root) {
      debug(indent, "insert_from_root() - creating root");
-     n = new_node(NULL, 1);  // The first root ever created is a leaf
-     bpltree_setroot(n);
+     n = new_node(t, NULL, 1);  // The first root ever created is a leaf
+     bpltree_setroot(t, n);
+   }
+   n = t->root;
+   latch_write(t, n);
+   if (n->keycnt < t->maxkeys) {
+     // The root won't split
+     latch_release_above(t, n);
    }
-   ret = insert_key(bpltree_root(), key, val, indent);
+   ret = insert_key(t, n, key, val, indent);
    /*
    if (debugging()) {
-     if (bpltree_check(bpltree_root(), (char *)NULL)) {
-       bpltree_display(bpltree_root(), 0);
+     if (bpltree_check(t, t->root, (char *)NULL)) {
+       bpltree_display(t, t->root, 0);
        assert(0);  // Force exit
      }
    }
@@ -386,23 +423,35 @@ static int insert_from_root(char *key, unsigned long val, int indent) {
    return ret;
 }
 
-extern int bpltree_insert(char *key, unsigned long keyval) {
-    int     val;
+extern int bpltree_insert(BPLTREE_T *t, char *key, unsigned long keyval) {
+    char   *k;
     short   ret = -1;
+    off_t   lsn = 0;
 
     debug(0, ">> bpltree_insert");
-    if (bpltree_numeric()) {
-      if (sscanf(key, "%d", &val) == 0) {
-        bpltree_err_seterr(BPLT_ERR_INVNUM, key);
-        debug(0, "<< bpltree_insert (%hd)", ret);
-        return ret;
-      }
-    } 
-    if (bpltree_numeric()) {
-      ret = insert_from_root((char *)&val, keyval, 0);
-    } else {
-      ret = insert_from_root(key, keyval, 0);
+    if ((k = bpltree_keyencode(t, key)) == NULL) {
+      debug(0, "<< bpltree_insert (%hd)", ret);
+      return ret;
+    }
+    k = incl_attach(t, k, (off_t)keyval, 0);
+    if (t->image) {
+      // Only paged trees can be changed, in their pages
+      ret = (short)page_insert(t, k, (off_t)keyval);
+      free(k);
+      debug(0, "<< bpltree_insert (%hd)", ret);
+      return ret;
+    }
+    latch_writer_begin(t);
+    ret = insert_from_root(t, k, keyval, 0);
+    if ((ret == 0) && t->wal) {
+      // Logged while the leaf is still latched
+      lsn = wal_append(t, WAL_INSERT, key, keyval);
+    }
+    latch_writer_end(t);
+    if (lsn && wal_commit(t, lsn)) {
+      ret = -1;
     }
+    free(k);
     debug(0, "<< bpltree_insert (%hd)", ret);
     return ret;
 }
@@ -0,0 +1,335 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_key.c
+ *
+ *  Normalized keys.
+ *
+ *  Keys are converted once, when they enter the tree or a search
+ *  starts, into a binary form that compares with memcmp(). Each
+ *  field of a key has a type (text unless told otherwise):
+ *
+ *    - text fields are followed by a '\0', which sorts before
+ *      any character, so that "Le:Paul" comes before
+ *      "Le Mat:Paul";
+ *    - integers are stored on 8 bytes big-endian with their
+ *      sign bit flipped, so that negative values sort first;
+ *    - doubles are stored the same way, with all their bits
+ *      flipped when negative (bigger magnitude, smaller value);
+ *    - dates (YYYY-MM-DD) are stored as a number of days since
+ *      1970-01-01 on 4 bytes, like integers.
+ *
+ *  Numbers and dates are parsed once here, searches compare
+ *  bytes. A 3-byte header gives the length of what follows and
+ *  the number of fields, which is what partial composite keys
+ *  need (see bpltree_keycmp()).
+ *
+ *  A tree whose keys are a single number or date is numeric:
+ *  such keys fit in node prefixes (see bpltree_keyprefix()),
+ *  which are all searches need to look at.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+
+#define MAX_KEY_BODY   0x7fff   // See KEY_INCL
+#define MAX_FIELDS     (KEY_FIXED - 1)
+#define SIGN64         0x8000000000000000ULL
+#define SIGN32         0x80000000U
+
+static char field_type(BPLTREE_T *t, int i) {
+    return (((i < KEY_TYPES) && t->types[i]) ? t->types[i] : KEY_STRING);
+}
+
+static int field_width(char type) {
+    // 0 for text, which ends with a terminator
+    switch (type) {
+      case KEY_INT:
+      case KEY_DOUBLE:
+        return 8;
+      case KEY_DATE:
+        return 4;
+      default:
+        break;
+    }
+    return 0;
+}
+
+extern int bpltree_setkeytypes(BPLTREE_T *t, char *types) {
+    // Types of the fields of keys, one letter per field
+    // (KEY_STRING, KEY_INT, KEY_DOUBLE, KEY_DATE); fields
+    // past the last letter are text. Must be set before any
+    // key is added. Returns -1 if a type is unknown.
+    int i;
+
+    for (i = 0; types[i]; i++) {
+      if ((i == KEY_TYPES)
+          || ((types[i] != KEY_STRING) && !field_width(types[i]))) {
+        return -1;
+      }
+    }
+    memset(t->types, 0, sizeof(t->types));
+    for (i = 0; types[i]; i++) {
+      t->types[i] = (types[i] == KEY_STRING ? 0 : types[i]);
+    }
+    t->numeric = ((i == 1) && field_width(types[0]) ? 1 : 0);
+    return 0;
+}
+
+static void put_be(unsigned char *p, unsigned long long u, int width) {
+    int i;
+
+    for (i = width - 1; i >= 0; i--) {
+      p[i] = (unsigned char)(u & 0xff);
+      u >>= 8;
+    }
+}
+
+static unsigned long long get_be(unsigned char *p, int width) {
+    unsigned long long u = 0;
+    int                i;
+
+    for (i = 0; i < width; i++) {
+      u = (u << 8) | p[i];
+    }
+    return u;
+}
+
+static long days_from_civil(long y, int m, int d) {
+    // Days since 1970-01-01 of a date of the proleptic
+    // Gregorian calendar (eras of 400 years start in March)
+    long     era;
+    unsigned yoe;
+    unsigned doy;
+    unsigned doe;
+
+    y -= (m <= 2);
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned)(y - era * 400);
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long)doe - 719468;
+}
+
+static void civil_from_days(long z, long *y, int *m, int *d) {
+    long     era;
+    unsigned doe;
+    unsigned yoe;
+    unsigned doy;
+    unsigned mp;
+
+    z += 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = (unsigned)(z - era * 146097);
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = (long)yoe + era * 400 + (*m <= 2);
+}
+
+static char end_of_field(char *end) {
+    // Only spaces may follow a number or a date
+    while (isspace(*end)) {
+      end++;
+    }
+    return (*end == '\0');
+}
+
+static int field_encode(char type, char *text, unsigned char *out) {
+    // Writes the binary form of a number or a date.
+    // Returns -1 if text isn't one.
+    static const char  mdays[] = {31, 29, 31, 30, 31, 30,
+                                  31, 31, 30, 31, 30, 31};
+    long long          ll;
+    double             dbl;
+    unsigned long long u;
+    long               y;
+    int                m;
+    int                d;
+    int                n = 0;
+    char              *end;
+
+    errno = 0;
+    switch (type) {
+      case KEY_INT:
+        ll = strtoll(text, &end, 10);
+        if ((end == text) || errno || !end_of_field(end)) {
+          return -1;
+        }
+        put_be(out, (unsigned long long)ll ^ SIGN64, 8);
+        break;
+      case KEY_DOUBLE:
+        dbl = strtod(text, &end);
+        if ((end == text) || isnan(dbl) || !end_of_field(end)) {
+          return -1;
+        }
+        if (dbl == 0.0) {
+          dbl = 0.0;  // No -0
+        }
+        memcpy(&u, &dbl, sizeof(u));
+        u = ((u & SIGN64) ? ~u : u ^ SIGN64);
+        put_be(out, u, 8);
+        break;
+      case KEY_DATE:
+        if ((sscanf(text, "%ld-%d-%d%n", &y, &m, &d, &n) != 3)
+            || !end_of_field(text + n)
+            || (y < 0) || (y > 9999)
+            || (m < 1) || (m > 12) || (d < 1) || (d > mdays[m-1])
+            || ((m == 2) && (d == 29)
+                && ((y % 4) || (!(y % 100) && (y % 400))))) {
+          return -1;
+        }
+        put_be(out, (unsigned long long)days_from_civil(y, m, d) ^ SIGN32, 4);
+        break;
+      default:
+        return -1;
+    }
+    return 0;
+}
+
+extern char *key_encode(BPLTREE_T *t, char *text, char in_arena) {
+    // Returns a normalized key, allocated in the tree arena
+    // if in_arena is set (it can go straight into a node),
+    // with malloc() otherwise. Returns NULL (and sets the
+    // error) if the key isn't valid.
+    char          *key;
+    char          *copy;
+    unsigned char *body;
+    char          *p;
+    char          *q;
+    char           type = KEY_STRING;
+    int            len = 0;
+    int            width;
+    int            fields;
+    int            i;
+
+    if (text == NULL) {
+      return NULL;
+    }
+    // Fields are cut on KEYSEP, then converted one by one
+    copy = strdup(text);
+    assert(copy);
+    fields = 1;
+    for (p = copy; (p = strchr(p, KEYSEP)) != NULL; p++) {
+      fields++;
+    }
+    if (t->numeric && (fields > 1)) {
+      bpltree_err_seterr(BPLT_ERR_INVNUM, text);
+      free(copy);
+      return NULL;
+    }
+    for (i = 0, p = copy; i < fields; i++, p += strlen(p) + 1) {
+      if ((q = strchr(p, KEYSEP)) != NULL) {
+        *q = '\0';
+      }
+      width = field_width(field_type(t, i));
+      len += (width ? width : (int)strlen(p) + 1);
+    }
+    if ((len > MAX_KEY_BODY) || (fields > MAX_FIELDS)) {
+      bpltree_err_seterr(BPLT_ERR_KEYLEN, NULL);
+      free(copy);
+      return NULL;
+    }
+    if (in_arena) {
+      key = arena_key(t->arena, KEY_HDR + len);
+    } else {
+      key = (char *)malloc(KEY_HDR + len);
+      assert(key);
+    }
+    body = _key_body(key);
+    for (i = 0, p = copy; i < fields; i++, p += strlen(p) + 1) {
+      type = field_type(t, i);
+      if ((width = field_width(type)) == 0) {
+        width = strlen(p) + 1;
+        memcpy(body, p, width);
+      } else if (field_encode(type, p, body)) {
+        bpltree_err_seterr(BPLT_ERR_INVNUM, p);
+        if (in_arena) {
+          arena_free_key(t->arena, key);
+        } else {
+          free(key);
+        }
+        free(copy);
+        return NULL;
+      }
+      body += width;
+    }
+    free(copy);
+    key[0] = (char)((len >> 8) & 0xff);
+    key[1] = (char)(len & 0xff);
+    key[2] = (char)(fields | (field_width(type) ? KEY_FIXED : 0));
+    return key;
+}
+
+extern char *bpltree_keyencode(BPLTREE_T *t, char *text) {
+    // The caller frees the key
+    return key_encode(t, text, 0);
+}
+
+extern char *bpltree_keytext(BPLTREE_T *t, char *key, char *buf, int len) {
+    // Writes a displayable version of a normalized key
+    // into buf (fields separated by KEYSEP) and returns buf
+    unsigned char      *body;
+    unsigned char      *end;
+    unsigned long long  u;
+    double              dbl;
+    long                y;
+    int                 m;
+    int                 d;
+    int                 fields;
+    int                 i;
+    int                 j = 0;
+
+    assert(buf && (len > 0));
+    *buf = '\0';
+    if (key == NULL) {
+      return buf;
+    }
+    body = _key_body(key);
+    end = body + _key_len(key);
+    fields = _key_fields(key);
+    for (i = 0; (i < fields) && (body < end) && (j < len - 1); i++) {
+      if (i) {
+        buf[j++] = KEYSEP;
+        buf[j] = '\0';
+      }
+      switch (field_type(t, i)) {
+        case KEY_INT:
+          u = get_be(body, 8) ^ SIGN64;
+          snprintf(buf + j, len - j, "%lld", (long long)u);
+          body += 8;
+          break;
+        case KEY_DOUBLE:
+          u = get_be(body, 8);
+          u = ((u & SIGN64) ? u ^ SIGN64 : ~u);
+          memcpy(&dbl, &u, sizeof(dbl));
+          snprintf(buf + j, len - j, "%.15g", dbl);
+          body += 8;
+          break;
+        case KEY_DATE:
+          civil_from_days((long)(int)(get_be(body, 4) ^ SIGN32), &y, &m, &d);
+          snprintf(buf + j, len - j, "%04ld-%02d-%02d", y, m, d);
+          body += 4;
+          break;
+        default:
+          while ((body < end) && *body && (j < len - 1)) {
+            buf[j++] = (char)*body++;
+          }
+          buf[j] = '\0';
+          body++;
+          break;
+      }
+      j = strlen(buf);
+    }
+    return buf;
+}
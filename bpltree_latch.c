@@ -0,0 +1,654 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_latch.c
+ *
+ *  Searching a tree while it changes.
+ *
+ *  Readers take no lock. Every node carries a version number,
+ *  which a reader notes before looking at the node and checks
+ *  again once it has found what it was looking for (the child
+ *  to descend to, the entries of a leaf): if the version has
+ *  changed, what was read may be inconsistent and the reader
+ *  starts again. Going from a node to the next one, the version
+ *  of the next node is noted before the version of the current
+ *  one is checked, so that nothing can slip in between.
+ *
+ *  Writers latch the nodes they modify, which makes readers and
+ *  other writers wait, and release them, bumping their versions,
+ *  when they are done. Several writers can work at once thanks
+ *  to latch crabbing: going down the tree, a writer latches the
+ *  child before letting go of anything, and once the child is
+ *  known to be safe (it will not split, or not underflow) it
+ *  releases every latch it holds above it, since changes cannot
+ *  propagate further up. Changing the root pointer requires the
+ *  root latch, which is taken first and released like the others.
+ *  Latches are always taken from the top down, or on siblings
+ *  while holding their parent, which prevents deadlocks.
+ *
+ *  Nodes and keys that a writer frees may still be looked at by
+ *  readers or by writers waiting for a latch. Readers and writers
+ *  are counted by the reclamation period they started in (only
+ *  its parity matters), and what is freed is stamped with the
+ *  current period: once nobody who started in the period before
+ *  the current one is left, everything freed before the current
+ *  period is handed back to the arena, and the period moves on if
+ *  more is waiting. Nobody has to stop for memory to be reclaimed.
+ *
+ *  The low bits of a version say whether the node is latched
+ *  and whether it has been freed.
+ *
+ *  A reader can also pin a snapshot, the tree as it was at some
+ *  point, and see nothing of what writers do afterwards. Taking
+ *  a snapshot closes an epoch (waiting for the writers that
+ *  started in it) and records the root. While snapshots are
+ *  pinned, a writer copies every node it latches before changing
+ *  it, the first time it does so in an epoch, and chains the copy
+ *  to the node: a snapshot reader follows the same pointers as
+ *  everybody else and, when a node is more recent than its epoch,
+ *  takes the newest copy that isn't. Copies are immutable, which
+ *  spares long range scans restarts, and what writers free is
+ *  kept as long as a snapshot taken before may need it.
+ *  Snapshots aren't cheap: taking one locks the tree's snapshot
+ *  mutex and waits for the writers of the epoch it closes, and
+ *  while one is pinned every writer copies the nodes it changes.
+ *  They are only taken by bpltree_snapshot(); searches of threads
+ *  that haven't pinned one read the live tree as described above.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "debug.h"
+
+#define LATCH_LOCKED    1UL
+#define LATCH_OBSOLETE  2UL
+#define LATCH_STEP      4UL
+
+#define SPINS         100   // Before yielding
+#define NO_SNAPSHOT   (~0UL)
+#define MAX_NESTING     8   // Of readers in a thread
+
+typedef struct limbo_t {
+           void          *p;
+           size_t         len;         // Of a block
+           unsigned long  epoch;       // When it was freed, for
+                                       // snapshots,
+           unsigned long  period;      // and for reclamation
+         } LIMBO_T;
+
+typedef struct latch_t {
+           pthread_mutex_t   root;        // Root latch
+           unsigned long     period;      // Of reclamation
+           long              active[2];   // Readers and writers, by
+                                          // period parity
+           pthread_mutex_t   freeing;     // Protects what follows
+           LIMBO_T          *free_nodes;  // Freed, still visible
+           long              free_nodecnt;
+           long              free_nodemax;
+           LIMBO_T          *free_keys;
+           long              free_keycnt;
+           long              free_keymax;
+           pthread_mutex_t   snapping;    // Protects what follows
+           unsigned long     epoch;       // Current
+           long              writers[2];  // At work, by epoch parity
+           unsigned long    *pinned;      // Epochs of the snapshots
+           long              pinnedcnt;
+           long              pinnedmax;
+           unsigned long     oldest;      // Oldest pinned epoch
+         } LATCH_T;
+
+// What the current writer holds, top-down. The array
+// is freed when the thread exits.
+static pthread_key_t     G_held_key;
+static pthread_once_t    G_held_once = PTHREAD_ONCE_INIT;
+static __thread NODE_T **G_held = NULL;
+static __thread long     G_heldcnt = 0;
+static __thread long     G_heldmax = 0;
+static __thread char     G_root_held = 0;
+static __thread unsigned long G_epoch = 0;  // Of the writer
+static __thread char     G_counted = 0;
+
+// Periods the thread's readers started in, innermost last
+static __thread unsigned long G_periods[MAX_NESTING];
+static __thread short    G_nesting = 0;
+
+// The snapshot the thread has pinned
+static __thread BPLTREE_T  *G_snap_tree = NULL;
+static __thread SNAPSHOT_T  G_snap;
+
+static void **push(void **arr, long *cnt, long *max, void *p) {
+    // Appends p to a growable array, returns the array
+    if (*cnt == *max) {
+      *max = (*max ? 2 * *max : 64);
+      arr = (void **)realloc(arr, *max * sizeof(void *));
+      assert(arr);
+    }
+    arr[(*cnt)++] = p;
+    return arr;
+}
+
+static void held_key(void) {
+    (void)pthread_key_create(&G_held_key, free);
+}
+
+static void hold(NODE_T *n) {
+    // Appends n to what the writer holds
+    NODE_T **held = G_held;
+
+    G_held = (NODE_T **)push((void **)G_held, &G_heldcnt, &G_heldmax, n);
+    if (G_held != held) {
+      (void)pthread_once(&G_held_once, held_key);
+      (void)pthread_setspecific(G_held_key, G_held);
+    }
+}
+
+static LIMBO_T *defer(LIMBO_T *arr, long *cnt, long *max,
+                      void *p, size_t len, unsigned long epoch,
+                      unsigned long period) {
+    // Same as push() for limbo lists
+    if (*cnt == *max) {
+      *max = (*max ? 2 * *max : 64);
+      arr = (LIMBO_T *)realloc(arr, *max * sizeof(LIMBO_T));
+      assert(arr);
+    }
+    arr[*cnt].p = p;
+    arr[*cnt].len = len;
+    arr[*cnt].epoch = epoch;
+    arr[*cnt].period = period;
+    (*cnt)++;
+    return arr;
+}
+
+extern LATCH_T *latch_new(void) {
+    LATCH_T *l = (LATCH_T *)calloc(1, sizeof(LATCH_T));
+
+    assert(l);
+    (void)pthread_mutex_init(&(l->root), NULL);
+    (void)pthread_mutex_init(&(l->freeing), NULL);
+    (void)pthread_mutex_init(&(l->snapping), NULL);
+    l->oldest = NO_SNAPSHOT;
+    return l;
+}
+
+extern void latch_destroy(LATCH_T *l) {
+    if (l) {
+      (void)pthread_mutex_destroy(&(l->root));
+      (void)pthread_mutex_destroy(&(l->freeing));
+      (void)pthread_mutex_destroy(&(l->snapping));
+      free(l->free_nodes);
+      free(l->free_keys);
+      free(l->pinned);
+      free(l);
+    }
+}
+
+extern void latch_reader_begin(BPLTREE_T *t) {
+    // Counted in the current period - checked again once
+    // counted, in case it has just moved on
+    LATCH_T       *l = t->latch;
+    unsigned long  p;
+
+    assert(G_nesting < MAX_NESTING);
+    for (;;) {
+      p = __atomic_load_n(&(l->period), __ATOMIC_SEQ_CST);
+      (void)__atomic_add_fetch(&(l->active[p & 1]), 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&(l->period), __ATOMIC_SEQ_CST) == p) {
+        break;
+      }
+      (void)__atomic_sub_fetch(&(l->active[p & 1]), 1, __ATOMIC_SEQ_CST);
+    }
+    G_periods[G_nesting++] = p;
+}
+
+static void free_copies(BPLTREE_T *t, NODE_T *img) {
+    NODE_T *older;
+
+    while (img) {
+      older = img->older;
+      arena_free_node(t->arena, img);
+      img = older;
+    }
+}
+
+static void reclaim(BPLTREE_T *t, char wait) {
+    // Hands back to the arena the nodes and keys freed before
+    // the current period if nobody who started in the period
+    // before is left, unless a snapshot taken before they were
+    // freed is still pinned - then moves to the next period if
+    // anything is still waiting. Whoever starts in the current
+    // period started after what was freed before it was unlinked.
+    // Readers don't wait for the lock, somebody else is at it.
+    LATCH_T       *l = t->latch;
+    unsigned long  oldest;
+    unsigned long  p;
+    NODE_T        *n;
+    long           i;
+    long           kept;
+
+    if (wait) {
+      (void)pthread_mutex_lock(&(l->freeing));
+    } else if (pthread_mutex_trylock(&(l->freeing))) {
+      return;
+    }
+    // Read once the lock is held: a snapshot pinned while we
+    // waited for it may need what has been freed since
+    oldest = __atomic_load_n(&(l->oldest), __ATOMIC_SEQ_CST);
+    p = __atomic_load_n(&(l->period), __ATOMIC_SEQ_CST);
+    if ((l->free_nodecnt || l->free_keycnt)
+        && (__atomic_load_n(&(l->active[(p - 1) & 1]),
+                            __ATOMIC_SEQ_CST) == 0)) {
+      debug(0, "reclaiming up to %ld node%s and %ld key%s",
+            l->free_nodecnt, (l->free_nodecnt > 1 ? "s" : ""),
+            l->free_keycnt, (l->free_keycnt > 1 ? "s" : ""));
+      kept = 0;
+      for (i = 0; i < l->free_nodecnt; i++) {
+        if ((l->free_nodes[i].period >= p)
+            || (l->free_nodes[i].epoch > oldest)) {
+          l->free_nodes[kept++] = l->free_nodes[i];
+        } else {
+          n = (NODE_T *)l->free_nodes[i].p;
+          free_copies(t, n->older);
+          arena_free_node(t->arena, n);
+        }
+      }
+      l->free_nodecnt = kept;
+      kept = 0;
+      for (i = 0; i < l->free_keycnt; i++) {
+        if ((l->free_keys[i].period >= p)
+            || (l->free_keys[i].epoch > oldest)) {
+          l->free_keys[kept++] = l->free_keys[i];
+        } else {
+          arena_free_block(t->arena, l->free_keys[i].p,
+                           l->free_keys[i].len);
+        }
+      }
+      l->free_keycnt = kept;
+      if (l->free_nodecnt || l->free_keycnt) {
+        __atomic_store_n(&(l->period), p + 1, __ATOMIC_SEQ_CST);
+      }
+    }
+    (void)pthread_mutex_unlock(&(l->freeing));
+}
+
+static char waiting(LATCH_T *l) {
+    // Whether anything freed is waiting to be reclaimed
+    return (__atomic_load_n(&(l->free_nodecnt), __ATOMIC_RELAXED)
+            || __atomic_load_n(&(l->free_keycnt), __ATOMIC_RELAXED));
+}
+
+extern void latch_reader_end(BPLTREE_T *t) {
+    LATCH_T       *l = t->latch;
+    unsigned long  p;
+
+    assert(G_nesting > 0);
+    p = G_periods[--G_nesting];
+    (void)__atomic_sub_fetch(&(l->active[p & 1]), 1, __ATOMIC_SEQ_CST);
+    if (waiting(l)) {
+      reclaim(t, 0);
+    }
+}
+
+extern void latch_new_node(NODE_T *n) {
+    // A node that was freed keeps its version and gets
+    // a bigger one, so that readers who knew it see it changed
+    n->version = (n->version | (LATCH_STEP - 1)) + 1;
+    n->epoch = G_epoch;
+}
+
+extern unsigned long latch_read(NODE_T *n) {
+    // Waits until n isn't latched and returns its version,
+    // 0 if the node has been freed
+    unsigned long v;
+    int           spins = 0;
+
+    while ((v = __atomic_load_n(&(n->version), __ATOMIC_ACQUIRE))
+           & LATCH_LOCKED) {
+      if (++spins == SPINS) {
+        (void)sched_yield();
+        spins = 0;
+      }
+    }
+    return (v & LATCH_OBSOLETE ? 0 : v);
+}
+
+extern char latch_check(NODE_T *n, unsigned long version) {
+    // 1 if n hasn't changed since version was read
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&(n->version), __ATOMIC_RELAXED) == version);
+}
+
+extern void latch_writer_begin(BPLTREE_T *t) {
+    latch_reader_begin(t);
+}
+
+extern void latch_root(BPLTREE_T *t) {
+    // Must come before any other latch. Writers are counted
+    // by epoch from there, so that taking a snapshot can wait
+    // for those of the epoch it closes (and only for those
+    // that have started working on the tree).
+    LATCH_T       *l = t->latch;
+    unsigned long  e;
+
+    assert(G_heldcnt == 0);
+    (void)pthread_mutex_lock(&(l->root));
+    G_root_held = 1;
+    for (;;) {
+      e = __atomic_load_n(&(l->epoch), __ATOMIC_SEQ_CST);
+      (void)__atomic_add_fetch(&(l->writers[e & 1]), 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&(l->epoch), __ATOMIC_SEQ_CST) == e) {
+        break;
+      }
+      (void)__atomic_sub_fetch(&(l->writers[e & 1]), 1, __ATOMIC_SEQ_CST);
+    }
+    G_epoch = e;
+    G_counted = 1;
+}
+
+static void trim_copies(BPLTREE_T *t, NODE_T *n, unsigned long oldest) {
+    // Drops the copies of n that no pinned snapshot can use:
+    // a copy is used by snapshots taken before the copy (or
+    // the node) that follows it in the chain
+    LATCH_T       *l = t->latch;
+    NODE_T        *prev = NULL;
+    NODE_T        *img = n->older;
+    unsigned long  until = n->epoch;
+
+    while (img && (until > oldest)) {
+      until = img->epoch;
+      prev = img;
+      img = img->older;
+    }
+    if (img) {
+      if (prev) {
+        __atomic_store_n(&(prev->older), NULL, __ATOMIC_RELEASE);
+      } else {
+        __atomic_store_n(&(n->older), NULL, __ATOMIC_RELEASE);
+      }
+      // Snapshot readers no longer get there, others never did
+      (void)pthread_mutex_lock(&(l->freeing));
+      l->free_nodes = defer(l->free_nodes, &(l->free_nodecnt),
+                            &(l->free_nodemax), img, 0, 0, l->period);
+      (void)pthread_mutex_unlock(&(l->freeing));
+    }
+}
+
+static void copy_on_write(BPLTREE_T *t, NODE_T *n) {
+    // Called on a node just latched by a writer. If a snapshot
+    // may need the node as it is, keeps a copy.
+    unsigned long  oldest = __atomic_load_n(&(t->latch->oldest),
+                                            __ATOMIC_SEQ_CST);
+    NODE_T        *img;
+    size_t         slots = n->keycnt + 1;
+
+    if (n->older) {
+      trim_copies(t, n, oldest);
+    }
+    if ((oldest == NO_SNAPSHOT) || (n->epoch >= G_epoch)) {
+      return;
+    }
+    img = arena_node(t->arena, t->maxkeys, n->is_leaf);
+    img->is_leaf = n->is_leaf;
+    img->id = n->id;
+    img->keycnt = n->keycnt;
+    img->parent = n->parent;
+    if (_is_leaf(n)) {
+      (void)memcpy(img->node.leaf.k, n->node.leaf.k,
+                   slots * sizeof(KEY_POS_T));
+      img->node.leaf.next = n->node.leaf.next;
+      img->node.leaf.prev = n->node.leaf.prev;
+    } else {
+      (void)memcpy(img->node.internal.k, n->node.internal.k,
+                   slots * sizeof(REDIRECT_T));
+    }
+    (void)memcpy(img->pfx, n->pfx, slots * sizeof(PREFIX_T));
+    img->epoch = n->epoch;
+    img->older = n->older;
+    // The copy must be in the chain before the epoch
+    // sends snapshot readers there
+    __atomic_store_n(&(n->older), img, __ATOMIC_RELEASE);
+    __atomic_store_n(&(n->epoch), G_epoch, __ATOMIC_RELEASE);
+}
+
+extern void latch_write(BPLTREE_T *t, NODE_T *n) {
+    // Latches n (if we don't hold it yet) until
+    // the writer is done or lets it go
+    unsigned long v;
+    long          i;
+    int           spins = 0;
+
+    if (n == NULL) {
+      return;
+    }
+    for (i = G_heldcnt - 1; i >= 0; i--) {
+      if (G_held[i] == n) {
+        return;
+      }
+    }
+    for (;;) {
+      v = __atomic_load_n(&(n->version), __ATOMIC_RELAXED);
+      if (!(v & LATCH_LOCKED)
+          && __atomic_compare_exchange_n(&(n->version), &v, v | LATCH_LOCKED,
+                                         0, __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED)) {
+        break;
+      }
+      if (++spins == SPINS) {
+        (void)sched_yield();
+        spins = 0;
+      }
+    }
+    hold(n);
+    copy_on_write(t, n);
+}
+
+static void release(NODE_T *n) {
+    __atomic_store_n(&(n->version),
+                     (n->version & ~LATCH_LOCKED) + LATCH_STEP,
+                     __ATOMIC_RELEASE);
+}
+
+extern void latch_release_above(BPLTREE_T *t, NODE_T *n) {
+    // n is safe - lets go of the root latch and of all
+    // latches taken before the one on n
+    long i;
+    long j;
+
+    if (G_root_held) {
+      (void)pthread_mutex_unlock(&(t->latch->root));
+      G_root_held = 0;
+    }
+    for (i = 0; (i < G_heldcnt) && (G_held[i] != n); i++) {
+      release(G_held[i]);
+    }
+    if (i < G_heldcnt) {
+      for (j = 0; i + j < G_heldcnt; j++) {
+        G_held[j] = G_held[i + j];
+      }
+      G_heldcnt = j;
+    }
+}
+
+extern NODE_T *latch_held(short i) {
+    // i-th node latched by the writer, NULL after the last
+    // one (nodes it has freed included)
+    return (i < G_heldcnt ? G_held[i] : NULL);
+}
+
+extern char latch_freed(NODE_T *n) {
+    return (n->version & LATCH_OBSOLETE ? 1 : 0);
+}
+
+extern void latch_free_node(BPLTREE_T *t, NODE_T *n) {
+    LATCH_T *l = t->latch;
+
+    if (n) {
+      latch_write(t, n);
+      (void)__atomic_fetch_or(&(n->version), LATCH_OBSOLETE,
+                              __ATOMIC_SEQ_CST);
+      (void)pthread_mutex_lock(&(l->freeing));
+      l->free_nodes = defer(l->free_nodes, &(l->free_nodecnt),
+                            &(l->free_nodemax), n, 0, G_epoch, l->period);
+      (void)pthread_mutex_unlock(&(l->freeing));
+    }
+}
+
+extern void latch_free_key(BPLTREE_T *t, char *key) {
+    if (key) {
+      latch_free_block(t, key, _key_size(key));
+    }
+}
+
+extern void latch_free_block(BPLTREE_T *t, void *p, size_t len) {
+    // Same as latch_free_key() for a block from arena_block()
+    LATCH_T *l = t->latch;
+
+    if (p) {
+      (void)pthread_mutex_lock(&(l->freeing));
+      l->free_keys = defer(l->free_keys, &(l->free_keycnt),
+                           &(l->free_keymax), p, len, G_epoch, l->period);
+      (void)pthread_mutex_unlock(&(l->freeing));
+    }
+}
+
+extern void latch_writer_end(BPLTREE_T *t) {
+    // Releases everything the writer holds
+    long i;
+
+    if (G_root_held) {
+      (void)pthread_mutex_unlock(&(t->latch->root));
+      G_root_held = 0;
+    }
+    for (i = 0; i < G_heldcnt; i++) {
+      release(G_held[i]);
+    }
+    G_heldcnt = 0;
+    if (G_counted) {
+      (void)__atomic_sub_fetch(&(t->latch->writers[G_epoch & 1]), 1,
+                               __ATOMIC_SEQ_CST);
+      G_counted = 0;
+    }
+    latch_reader_end(t);
+}
+
+static void set_oldest(LATCH_T *l) {
+    // Called with the snapping lock held
+    unsigned long oldest = NO_SNAPSHOT;
+    long          i;
+
+    for (i = 0; i < l->pinnedcnt; i++) {
+      if (l->pinned[i] < oldest) {
+        oldest = l->pinned[i];
+      }
+    }
+    __atomic_store_n(&(l->oldest), oldest, __ATOMIC_SEQ_CST);
+}
+
+extern void latch_snapshot_take(BPLTREE_T *t, SNAPSHOT_T *s) {
+    // Closes the current epoch and pins it
+    LATCH_T       *l = t->latch;
+    unsigned long  e;
+    int            spins = 0;
+
+    (void)pthread_mutex_lock(&(l->snapping));
+    e = l->epoch;
+    if (l->pinnedcnt == l->pinnedmax) {
+      l->pinnedmax = (l->pinnedmax ? 2 * l->pinnedmax : 8);
+      l->pinned = (unsigned long *)realloc(l->pinned,
+                                  l->pinnedmax * sizeof(unsigned long));
+      assert(l->pinned);
+    }
+    l->pinned[(l->pinnedcnt)++] = e;
+    set_oldest(l);
+    // From now on writers copy what they change
+    __atomic_store_n(&(l->epoch), e + 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&(l->writers[e & 1]), __ATOMIC_SEQ_CST)) {
+      if (++spins == SPINS) {
+        (void)sched_yield();
+        spins = 0;
+      }
+    }
+    s->root = bpltree_root(t);
+    s->epoch = e;
+    (void)pthread_mutex_unlock(&(l->snapping));
+    debug(0, "snapshot taken at epoch %lu", e);
+}
+
+extern void latch_snapshot_drop(BPLTREE_T *t, SNAPSHOT_T *s) {
+    LATCH_T *l = t->latch;
+    long     i;
+
+    (void)pthread_mutex_lock(&(l->snapping));
+    for (i = 0; i < l->pinnedcnt; i++) {
+      if (l->pinned[i] == s->epoch) {
+        l->pinned[i] = l->pinned[--(l->pinnedcnt)];
+        break;
+      }
+    }
+    set_oldest(l);
+    (void)pthread_mutex_unlock(&(l->snapping));
+    if (waiting(l)) {
+      reclaim(t, 1);
+    }
+}
+
+extern SNAPSHOT_T *latch_snapshot(BPLTREE_T *t) {
+    // The snapshot of t the calling thread has pinned, if any
+    return (G_snap_tree == t ? &G_snap : NULL);
+}
+
+extern NODE_T *latch_snapshot_node(SNAPSHOT_T *s, NODE_T *n,
+                                   unsigned long *version) {
+    // Returns n as the snapshot sees it. If that is n itself,
+    // *version is set as by latch_read(), otherwise it is set
+    // to 0 and what is returned is a copy that never changes.
+    // A node being changed has already been copied (writers
+    // copy when they latch), so we only wait for writers
+    // working on nodes that no snapshot needs to copy.
+    NODE_T        *img;
+    unsigned long  v;
+    int            spins = 0;
+
+    while (__atomic_load_n(&(n->epoch), __ATOMIC_ACQUIRE) <= s->epoch) {
+      v = __atomic_load_n(&(n->version), __ATOMIC_ACQUIRE);
+      if (!(v & LATCH_LOCKED)
+          && (__atomic_load_n(&(n->epoch), __ATOMIC_ACQUIRE) <= s->epoch)) {
+        // Writers copy a node before freeing it
+        assert(!(v & LATCH_OBSOLETE));
+        *version = v;
+        return n;
+      }
+      if (++spins == SPINS) {
+        (void)sched_yield();
+        spins = 0;
+      }
+    }
+    img = __atomic_load_n(&(n->older), __ATOMIC_ACQUIRE);
+    while (img->epoch > s->epoch) {
+      img = img->older;
+    }
+    *version = 0;
+    return img;
+}
+
+extern void bpltree_snapshot(BPLTREE_T *t) {
+    // Until bpltree_snapshot_end(), the range searches of the
+    // calling thread see the tree as it is now
+    if (G_snap_tree) {
+      bpltree_snapshot_end(G_snap_tree);
+    }
+    latch_snapshot_take(t, &G_snap);
+    G_snap_tree = t;
+}
+
+extern void bpltree_snapshot_end(BPLTREE_T *t) {
+    if (G_snap_tree == t) {
+      latch_snapshot_drop(t, &G_snap);
+      G_snap_tree = NULL;
+    }
+}
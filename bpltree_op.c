@@ -17,117 +17,305 @@
 #include "debug.h"
 
 #define DEFAULT_SEP  '\t'
+#define NUM_BLOCK     64   // Numeric slots compared in one go
+#define MIN_FRAMES     8   // In a buffer pool
+
+extern BPLTREE_T *bpltree_new(void) {
+  // A new, empty tree with default settings
+  BPLTREE_T *t = (BPLTREE_T *)malloc(sizeof(BPLTREE_T));
+
+  assert(t);
+  t->root = NULL;
+  t->maxkeys = DEF_MAX_KEYS;
+  t->fillrate = DEF_FILL_RATE;
+  t->bulkfill = DEF_BULK_FILL;
+  t->binsearch = DEF_BIN_SEARCH;
+  t->numeric = 0;
+  memset(t->types, 0, sizeof(t->types));
+  t->dupl = 0;
+  t->fetch = FETCH_KEY;
+  t->threads = 0;
+  memset(t->incl, 0, sizeof(t->incl));
+  t->sep = DEFAULT_SEP;
+  t->last_id = 0;
+  t->arena = arena_new();
+  t->latch = latch_new();
+  t->image = NULL;
+  t->poolsize = 0;
+  t->wal = NULL;
+  t->data = NULL;
+  return t;
+}
+
+extern void bpltree_setfilesep(BPLTREE_T *t, char sep) {
+  t->sep = sep;
+}
+
+extern char bpltree_filesep(BPLTREE_T *t) {
+  return t->sep;
+}
+
+extern void bpltree_setmaxkeys(BPLTREE_T *t, short n) {
+  t->maxkeys = n;
+}
 
-static short   G_maxkeys = DEF_MAX_KEYS;
-static float   G_fillrate = DEF_FILL_RATE;
-static NODE_T *G_root = NULL;
-static char    G_numeric = 0;
-static char    G_sep = DEFAULT_SEP;
+extern short bpltree_maxkeys(BPLTREE_T *t) {
+  return t->maxkeys;
+}
 
-extern void bpltree_setfilesep(char sep) {
-  G_sep = sep;
+extern float bpltree_fillrate(BPLTREE_T *t) {
+  return t->fillrate;
 }
 
-extern char bpltree_filesep(void) {
-  return G_sep;
+extern void bpltree_setbulkfill(BPLTREE_T *t, float f) {
+  // Bulk-loaded nodes can't be emptier than what
+  // deletions tolerate, nor fuller than full.
+  if (f < t->fillrate) {
+    f = t->fillrate;
+  }
+  if (f > 1.0) {
+    f = 1.0;
+  }
+  t->bulkfill = f;
 }
 
-extern void bpltree_setmaxkeys(short n) {
-  G_maxkeys = n;
+extern float bpltree_bulkfill(BPLTREE_T *t) {
+  return t->bulkfill;
 }
 
-extern short bpltree_maxkeys(void) {
-  return G_maxkeys;
+extern void bpltree_setbinsearch(BPLTREE_T *t, short n) {
+  // Below 2 keys there is nothing to halve
+  t->binsearch = (n < 2 ? 2 : n);
 }
 
-extern float bpltree_fillrate(void) {
-  return G_fillrate;
+extern short bpltree_binsearch(BPLTREE_T *t) {
+  return t->binsearch;
 }
 
-extern void bpltree_setroot(NODE_T *n) {
-  G_root = n;
+extern void bpltree_setroot(BPLTREE_T *t, NODE_T *n) {
   if (n) {
     n->parent = NULL;
   }
+  // Readers may be looking
+  __atomic_store_n(&(t->root), n, __ATOMIC_RELEASE);
+}
+
+extern NODE_T *bpltree_root(BPLTREE_T *t) {
+  return __atomic_load_n(&(t->root), __ATOMIC_ACQUIRE);
 }
 
-extern NODE_T *bpltree_root(void) {
-  return G_root;
+extern void bpltree_setnumeric(BPLTREE_T *t) {
+  // Keys are 64-bit integers
+  (void)bpltree_setkeytypes(t, "i");
 }
 
-extern void bpltree_setnumeric(void) {
-  G_numeric = 1;
+extern char bpltree_numeric(BPLTREE_T *t) {
+  return t->numeric;
 }
 
-extern char bpltree_numeric(void) {
-  return G_numeric;
+extern void bpltree_setduplicates(BPLTREE_T *t) {
+  // Must be set before any key is added
+  t->dupl = 1;
 }
 
-extern int bpltree_keycmp(char *k1, char *k2, char sep) {
+extern char bpltree_duplicates(BPLTREE_T *t) {
+  return t->dupl;
+}
+
+extern void bpltree_setfetch(BPLTREE_T *t, char how) {
+  // FETCH_KEY, FETCH_FILE or FETCH_SORTED
+  t->fetch = how;
+}
+
+extern char bpltree_fetch(BPLTREE_T *t) {
+  return t->fetch;
+}
+
+extern void bpltree_setthreads(BPLTREE_T *t, short n) {
+  // Threads a scan may use, 0 for as many as there are cores
+  t->threads = (n < 0 ? 0 : n);
+}
+
+extern short bpltree_threads(BPLTREE_T *t) {
+  return t->threads;
+}
+
+extern void bpltree_sethugepages(BPLTREE_T *t, char on) {
+  arena_hugepages(t->arena, on);
+}
+
+extern void bpltree_setpool(BPLTREE_T *t, long frames) {
+  // Images are then read through a buffer pool of that many
+  // pages instead of being mapped. Each thread searching the
+  // image may pin two pages at once.
+  t->poolsize = ((frames > 0) && (frames < MIN_FRAMES) ? MIN_FRAMES : frames);
+}
+
+extern int bpltree_keycmp(char *k1, char *k2) {
+  // Compares two normalized keys.
   // Returns 0 if k1 == k2,
   //        a value > 0 if k1 > k2
   //        a value < 0 if k1 < k2
-  int cmp;
-
-  if (G_numeric) {
-    if (*((int *)k1) == *((int *)k2)) {
-      cmp = 0;
-    } else if (*((int *)k1) > *((int *)k2)) {
+  // A key with fewer fields than the other one is compared,
+  // without its last terminator, as a prefix: "Ford" matches
+  // "Ford:Harrison" but also "Fordham:Joan". A last field with
+  // a fixed width (a number) has no terminator and must match.
+  int  len1 = _key_len(k1);
+  int  len2 = _key_len(k2);
+  int  cmp;
+
+  if (_key_fields(k1) == _key_fields(k2)) {
+    cmp = memcmp(_key_body(k1), _key_body(k2), (len1 < len2 ? len1 : len2));
+    if (cmp == 0) {
+      cmp = len1 - len2;
+    }
+  } else if (_key_fields(k1) < _key_fields(k2)) {
+    len1 -= !_key_fixed(k1);
+    cmp = memcmp(_key_body(k1), _key_body(k2), (len1 < len2 ? len1 : len2));
+    if ((cmp == 0) && (len1 > len2)) {
       cmp = 1;
-    } else {
-      cmp = -1;
     }
   } else {
-    int   len;
-    int   sep1_cnt = 0;
-    int   sep2_cnt = 0;
-    char *sep1 = k1;
-    char *sep2 = k2;
-    while ((sep1 = strchr(sep1, sep)) != NULL) {
-      sep1_cnt++;
-      sep1++;
+    len2 -= !_key_fixed(k2);
+    cmp = memcmp(_key_body(k1), _key_body(k2), (len1 < len2 ? len1 : len2));
+    if ((cmp == 0) && (len2 > len1)) {
+      cmp = -1;
+    }
+  }
+  return cmp;
+}
+
+extern PREFIX_T bpltree_keyprefix(char *key) {
+  // First bytes of the normalized key, packed so that
+  // comparing prefixes as numbers compares them as memcmp()
+  // does (unused trailing bytes are zero).
+  PREFIX_T       pfx = 0;
+  unsigned char *body;
+  short          len;
+  short          i;
+
+  if (key) {
+    body = _key_body(key);
+    len = _key_len(key);
+    for (i = 0; (i < (short)sizeof(PREFIX_T)) && (i < len); i++) {
+      pfx |= (PREFIX_T)body[i] << (8 * (sizeof(PREFIX_T) - 1 - i));
     }
-    while ((sep2 = strchr(sep2, sep)) != NULL) {
-      sep2_cnt++;
-      sep2++;
+  }
+  return pfx;
+}
+
+extern int bpltree_pfxcmp(BPLTREE_T *t, PREFIX_T pfx, PREFIX_T other) {
+  // -1 or 1 if the prefixes of two keys are enough to
+  // tell which key is the smaller one, 0 if they aren't
+  PREFIX_T diff = pfx ^ other;
+  int      shift;
+
+  if (diff) {
+    if (t->numeric) {
+      return (pfx < other ? -1 : 1);
     }
-    if (sep1_cnt == sep2_cnt) {
-      len = (strlen(k1) > strlen(k2) ? strlen(k1) : strlen(k2));
-    } else {
-      if (sep1_cnt < sep2_cnt) {
-        len = strlen(k1);
-      } else {
-        len = strlen(k2);
-      }
+    // Prefixes decide, unless the first difference is on a
+    // terminator or where one of the keys ends - a key with
+    // fewer fields may then match the beginning of a longer one.
+    shift = 56 - (__builtin_clzll(diff) & ~7);
+    if (((pfx >> shift) & 0xff) && ((other >> shift) & 0xff)) {
+      return (pfx < other ? -1 : 1);
     }
-    cmp = strncmp(k1, k2, len);
   }
-  return cmp;
+  return 0;
 }
 
-extern char bpltree_check(NODE_T *n, char *prev_key) {
-  // Debugging - check that everything is OK in the tree
-  static char *last_key;
+extern int bpltree_nodecmp(BPLTREE_T *t, NODE_T *n, short i,
+                           char *key, PREFIX_T pfx) {
+  // Same as bpltree_keycmp(key, <key in slot i of n>)
+  // where pfx is the prefix of key. The key in the node is
+  // only looked at when prefixes cannot tell.
+  int    cmp;
+  char  *k;
+
+  if (((cmp = bpltree_pfxcmp(t, pfx, n->pfx[i])) != 0) || t->numeric) {
+    // Numbers fit in the prefix
+    return cmp;
+  }
+  k = (_is_leaf(n) ? n->node.leaf.k[i].key : n->node.internal.k[i].key);
+  if (k == NULL) {
+    // Only seen by a reader racing a writer, who will
+    // find out that the node has changed and start again
+    return 1;
+  }
+  return bpltree_keycmp(key, k);
+}
+
+extern short bpltree_nodesearch(BPLTREE_T *t, NODE_T *n, char *key,
+                                PREFIX_T pfx, int *cmp) {
+  // Returns the first slot of n (from 1 in internal nodes, from 0
+  // in leaves) holding a key that isn't smaller than key, or the
+  // slot after the last key if there is none. *cmp is set to the
+  // comparison of key with the key in that slot (with the last key
+  // if past it), and left as it is if the node is empty.
+  // Nodes holding fewer than t->binsearch keys are scanned from
+  // left to right, bigger ones are searched by halving.
+  // Numeric keys are entirely in the prefixes: halving stops
+  // at NUM_BLOCK slots, which are then compared all at once
+  // with vector instructions (see bpltree_simd.c).
+  short pos = (_is_leaf(n) ? 0 : 1);
+  short end = pos + n->keycnt;
+  short cnt = n->keycnt;
+  short half;
+
+  if (t->numeric) {
+    while (cnt > NUM_BLOCK) {
+      half = cnt / 2;
+      pos += (pfx > n->pfx[pos + half - 1]) * half;
+      cnt -= half;
+    }
+    pos += bpltree_numcount(&(n->pfx[pos]), cnt, pfx);
+    if (pos < end) {
+      *cmp = (pfx == n->pfx[pos] ? 0 : -1);
+    } else if (n->keycnt) {
+      *cmp = 1;
+    }
+    return pos;
+  }
+  if (cnt < t->binsearch) {
+    while ((pos < end) && ((*cmp = bpltree_nodecmp(t, n, pos, key, pfx)) > 0)) {
+      pos++;
+    }
+    return pos;
+  }
+  // The answer is always between pos and pos + cnt; moving
+  // pos doesn't depend on a branch, only on a comparison.
+  while (cnt > 1) {
+    half = cnt / 2;
+    pos += (bpltree_nodecmp(t, n, pos + half - 1, key, pfx) > 0) * half;
+    cnt -= half;
+  }
+  if (((*cmp = bpltree_nodecmp(t, n, pos, key, pfx)) > 0) && (++pos < end)) {
+    *cmp = bpltree_nodecmp(t, n, pos, key, pfx);
+  }
+  return pos;
+}
 
+static char check_node(BPLTREE_T *t, NODE_T *n, char *prev_key,
+                       char **last_key) {
   if (n) {
     int  i;
 
     assert((n->parent == NULL)
-           && (n->keycnt <= bpltree_maxkeys())
-           && (n->keycnt >= MIN_KEYS));
+           && (n->keycnt <= t->maxkeys)
+           && (n->keycnt >= MIN_KEYS(t)));
     if (prev_key == NULL) {
-      last_key = prev_key;
+      *last_key = prev_key;
     }   
-    for (i = 0; i <= bpltree_maxkeys(); i++) {
+    for (i = 0; i <= t->maxkeys; i++) {
       if (!n->is_leaf && n->node.internal.k[i].key) {
         if (i == 0) {
           // Should be null
           debug(0, "Slot %d in node %hd: key should be null", i, n->id);
           return 1;
         }
-        if (last_key) {
-          if (bpltree_keycmp(n->node.internal.k[i].key,
-                             last_key, KEYSEP) < 0) {
+        if (*last_key) {
+          if (bpltree_keycmp(n->node.internal.k[i].key, *last_key) < 0) {
             debug(0, "Slot %d in node %hd: misplaced key", i, n->id);
             return 1;  // Inconsistent, current key
                        // should be greater than the previous one
@@ -138,7 +326,7 @@ extern char bpltree_check(NODE_T *n, char *prev_key) {
           debug(0, "Slot %d in node %hd: key should be null", i, n->id);
           return 1;
         }
-        last_key = n->node.internal.k[i].key;
+        *last_key = n->node.internal.k[i].key;
       } else {
         if (!n->is_leaf && i && (i <= n->keycnt)) {
           debug(0, "Slot %d in node %hd: no value, keycnt is %hd",
@@ -153,8 +341,8 @@ extern char bpltree_check(NODE_T *n, char *prev_key) {
                      (n->node.internal.k[i].bigger)->id);
             return 1;
           }
-          if (bpltree_check(n->node.internal.k[i].bigger,
-                          n->node.internal.k[i].key)) {
+          if (check_node(t, n->node.internal.k[i].bigger,
+                         n->node.internal.k[i].key, last_key)) {
             return 1;
           }
         } else {
@@ -166,76 +354,64 @@ extern char bpltree_check(NODE_T *n, char *prev_key) {
     }
   }                             /* End of if */
   return 0;
-}                               /* End of bpltree_check() */
+}                               /* End of check_node() */
 
-extern char *key_duplicate(char *key) {
+extern char bpltree_check(BPLTREE_T *t, NODE_T *n, char *prev_key) {
+  // Debugging - check that everything is OK in the tree
+  char *last_key = NULL;
+
+  return check_node(t, n, prev_key, &last_key);
+}
+
+extern char *key_duplicate(BPLTREE_T *t, char *key) {
+    // The key alone, without the columns it may carry
     char *dupl = NULL;
+    int   len;
+
     if (key) {
-      if (G_numeric) {
-        // A union would be more space efficient, but
-        // would complicate the code unnecessarily for
-        // what shouldn't be the most common case.
-        int val = *((int *)key);
-
-        if ((dupl = (char *)malloc(sizeof(int))) != NULL) {
-          memcpy(dupl, &val, sizeof(int));
-        }
-      } else { 
-        dupl = strdup(key);
-      }
+      len = KEY_HDR + _key_len(key);
+      dupl = arena_key(t->arena, len);
+      memcpy(dupl, key, len);
+      dupl[0] &= ~KEY_INCL;
     }
     return dupl;
 }
 
-extern NODE_T *new_node(NODE_T *parent, char leaf) {
-    static short last_id = 0;
+extern char *key_entry(BPLTREE_T *t, char *key) {
+    // Copy of a key for a leaf, columns included
+    char *dupl = NULL;
+    int   len;
 
-    NODE_T *n =(NODE_T *)malloc(sizeof(NODE_T));
-    assert(n);
-    last_id++;
-    n->parent = parent;
-    n->id = last_id;
-    n->keycnt = 0;
-    n->is_leaf = leaf;
-    if (leaf) {
-      n->node.leaf.k = (KEY_POS_T *)calloc((1 + G_maxkeys),
-                                            sizeof(KEY_POS_T));
-      assert(n->node.leaf.k);
-    } else {
-      n->node.internal.k = (REDIRECT_T *)calloc((1 + G_maxkeys),
-                                                 sizeof(REDIRECT_T));
-      assert(n->node.internal.k);
+    if (key) {
+      len = _key_size(key);
+      dupl = arena_key(t->arena, len);
+      memcpy(dupl, key, len);
     }
-    return n;
+    return dupl;
 }
 
-static void free_tree(NODE_T **root_ptr) {
-    if (root_ptr && *root_ptr) {
-      int i;
+extern NODE_T *new_node(BPLTREE_T *t, NODE_T *parent, char leaf) {
+    NODE_T *n = arena_node(t->arena, t->maxkeys, leaf);
 
-      if (!(*root_ptr)->is_leaf) {
-        for (i = 0; i < (*root_ptr)->keycnt; i++) {
-          free_tree(&((*root_ptr)->node.internal.k[i].bigger));
-          if ((*root_ptr)->node.internal.k[i].key) {
-            free((*root_ptr)->node.internal.k[i].key);
-          }
-        }
-        free((*root_ptr)->node.internal.k);
-      } else {
-        for (i = 0; i < (*root_ptr)->keycnt; i++) {
-          if ((*root_ptr)->node.leaf.k[i].key) {
-            free((*root_ptr)->node.leaf.k[i].key);
-          }
-        }
-        free((*root_ptr)->node.leaf.k);
-      }
-      free(*root_ptr);
-      *root_ptr = NULL;
-    }
+    latch_new_node(n);
+    n->parent = parent;
+    n->id = __atomic_add_fetch(&(t->last_id), 1, __ATOMIC_RELAXED);
+    n->is_leaf = leaf;
+    return n;
 }
 
-extern void bpltree_free(void) {
-    free_tree(&G_root);
+extern void bpltree_free(BPLTREE_T *t) {
+    // Nodes and keys all live in the arena
+    if (t) {
+      // A checkpoint may still be reading the tree
+      wal_close(t->wal);
+      arena_release(t->arena);
+      free(t->arena);
+      latch_destroy(t->latch);
+      image_release(t->image);
+      data_unmap(t);
+      free(t);
+    }
 }
 
 extern NODE_T *left_sibling(NODE_T *n, short *sep_pos) {
@@ -290,19 +466,13 @@ extern NODE_T *right_sibling(NODE_T *n, short *sep_pos) {
   return r;
 }
 
-extern NODE_T *find_node(NODE_T *tree, char *key) {
+extern NODE_T *find_node(BPLTREE_T *t, NODE_T *tree, char *key) {
     // Find the leaf node where the key should be stored
     if (tree && key) {
        if (!_is_leaf(tree)) {
-         short i = 1;
-         int   cmp = -1;
-
-         while ((i <= tree->keycnt)
-                && ((cmp = bpltree_keycmp(key,
-                                        tree->node.internal.k[i].key,
-                                        KEYSEP)) > 0)) {
-           i++;
-         }
+         int cmp = -1;
+
+         (void)bpltree_nodesearch(t, tree, key, bpltree_keyprefix(key), &cmp);
          if (cmp == 0) {
            // We've found it in the tree
            return NULL;
@@ -315,53 +485,41 @@ extern NODE_T *find_node(NODE_T *tree, char *key) {
     return NULL;
 }
 
-extern short find_pos(NODE_T *n, char *key, char present, short lvl) {
+extern short find_pos(BPLTREE_T *t, NODE_T *n, char *key,
+                      char present, short lvl) {
     // 'present' says whether the key is expected to be
     // present or absent
-    short pos = -1;
-    int   cmp = 1;
+    short    pos = -1;
+    int      cmp = 1;
+    PREFIX_T pfx = bpltree_keyprefix(key);
+    char     buff[KEY_TEXTLEN];
+    char     buff2[KEY_TEXTLEN];
 
     if (n && key) {
       // Find where the key should go.
       // Note that we don't worry whether the node
       // is full or not.
       if (!_is_leaf(n)) {
-        pos = 1;
-        while ((pos <= n->keycnt)
-               && ((cmp = bpltree_keycmp(key,
-                                       n->node.internal.k[pos].key,
-                                       KEYSEP)) > 0)) {
-          pos++;
-        }
+        pos = bpltree_nodesearch(t, n, key, pfx, &cmp);
         if (pos > 1) {
-          if (G_numeric) {
-            debug(lvl, "%d at pos %hd of internal node %hd (after %d)",
-                  *((int*)key), pos, n->id,
-                  *((int *)(n->node.internal.k[pos-1].key)));
-          } else {
+          if (debugging()) {
             debug(lvl, "%s at pos %hd of internal node %hd (after %s)",
-                    key, pos, n->id, n->node.internal.k[pos-1].key);
+                  bpltree_keytext(t, key, buff, KEY_TEXTLEN), pos, n->id,
+                  bpltree_keytext(t, n->node.internal.k[pos-1].key,
+                                  buff2, KEY_TEXTLEN));
           }
         } else {
           debug(lvl, "goes at pos 1 in internal node %hd", n->id);
         }
       } else {
         // Leaf
-        pos = 0;
-        while ((pos < n->keycnt)
-               && ((cmp = bpltree_keycmp(key,
-                                       n->node.leaf.k[pos].key,
-                                       KEYSEP)) > 0)) {
-          pos++;
-        }
+        pos = bpltree_nodesearch(t, n, key, pfx, &cmp);
         if (pos > 0) {
-          if (G_numeric) {
-            debug(lvl, "%d at pos %hd of leaf node %hd (after %d)",
-                  *((int*)key), pos, n->id,
-                  *((int *)(n->node.leaf.k[pos-1].key)));
-          } else {
+          if (debugging()) {
             debug(lvl, "%s at pos %hd of leaf node %hd (after %s)",
-                    key, pos, n->id, n->node.leaf.k[pos-1].key);
+                  bpltree_keytext(t, key, buff, KEY_TEXTLEN), pos, n->id,
+                  bpltree_keytext(t, n->node.leaf.k[pos-1].key,
+                                  buff2, KEY_TEXTLEN));
           }
         } else {
           debug(lvl, "goes at pos 0 in leaf node %hd", n->id);
@@ -0,0 +1,852 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_page.c
+ *
+ *  Paged trees.
+ *
+ *  A paged tree is kept in a file, as an index image (see
+ *  bpltree_image.c) that can be changed, and only the pages
+ *  being used are in memory, in a buffer pool (see
+ *  bpltree_pool.c): it can hold many more keys than memory
+ *  could, while the pool keeps the pages used most, those of
+ *  the upper levels first. Nodes are referred to by their
+ *  offset in the file. They all have the same size and never
+ *  span pages - with enough keys per node (bpltree_setmaxkeys())
+ *  a node is a page. Keys, and the positions of keys found on
+ *  several rows, are in heap pages.
+ *
+ *  Inserts and deletes pin the pages they change, which are
+ *  marked dirty when unpinned and written back when their
+ *  frame is needed for another page, or when the tree is
+ *  synced. Nodes are split when full and, when they have
+ *  fewer than MIN_KEYS, take a key from a sibling or are
+ *  merged with it, as in memory. Node slots and heap space
+ *  that are freed are chained, from the header (heap space
+ *  by size), and used again before the file grows.
+ *
+ *  The file is only consistent once synced - at a checkpoint
+ *  (bpltree_checkpoint()) or when the tree is freed. Before
+ *  the first change that follows, its header says that it is
+ *  being changed, and a file left in that state by a crash is
+ *  refused.
+ *
+ *  Any number of threads can search the tree, but not while
+ *  it changes; writers take turns.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "bpltree_image.h"
+#include "debug.h"
+
+#define MAX_DEPTH    64
+
+#define _round(x, r)   (((x) + (r) - 1) / (r) * (r))
+
+// The way down to a leaf
+typedef struct path_t {
+          off_t   node[MAX_DEPTH];
+          short   slot[MAX_DEPTH];   // Of the child taken
+          short   depth;             // Of the leaf
+        } PATH_T;
+
+static int heap_class(size_t size) {
+    // Chain of free heap space of that size, as given
+    // by image_heap_size()
+    size_t s = 2 * HEAP_SMALL;
+    int    c = HEAP_SMALL / HEAP_GRAIN;
+
+    if (size <= HEAP_SMALL) {
+      return (int)(size / HEAP_GRAIN) - 1;
+    }
+    while (s < size) {
+      s *= 2;
+      c++;
+    }
+    assert(c < HEAP_CLASSES);
+    return c;
+}
+
+static off_t heap_alloc(IMAGE_T *img, size_t len) {
+    // Room for len bytes in the heap, 0 if the file
+    // cannot be read
+    IMAGE_HDR_T *hdr = &(img->hdr);
+    size_t       size = image_heap_size(len);
+    int          c = heap_class(size);
+    off_t        at;
+
+    if ((at = hdr->freed[c]) != 0) {
+      // Free space holds the next one
+      if (pool_read(img->pool, at, &(hdr->freed[c]), sizeof(off_t))) {
+        return 0;
+      }
+      return at;
+    }
+    if (size > hdr->page) {
+      at = hdr->size;
+      hdr->size += _round(size, hdr->page);
+      return at;
+    }
+    if (hdr->heap_at + size > hdr->heap_end) {
+      hdr->heap_at = hdr->size;
+      hdr->size += hdr->page;
+      hdr->heap_end = hdr->size;
+    }
+    at = hdr->heap_at;
+    hdr->heap_at += size;
+    return at;
+}
+
+static int heap_free(IMAGE_T *img, off_t at, size_t len) {
+    off_t *head = &(img->hdr.freed[heap_class(image_heap_size(len))]);
+
+    if (pool_write(img->pool, at, head, sizeof(off_t))) {
+      return -1;
+    }
+    *head = at;
+    return 0;
+}
+
+static size_t key_size(IMAGE_T *img, off_t at) {
+    // Of the key at at in the heap, 0 if it cannot be read
+    unsigned char khdr[KEY_HDR];
+    unsigned char ilen[2];
+    size_t        len;
+
+    if (pool_read(img->pool, at, khdr, KEY_HDR)) {
+      return 0;
+    }
+    len = KEY_HDR + _key_len(khdr);
+    if (_key_incl(khdr)) {
+      // Columns follow the body
+      if (pool_read(img->pool, at + len, ilen, 2)) {
+        return 0;
+      }
+      len += 2 + ((ilen[0] << 8) | ilen[1]);
+    }
+    return len;
+}
+
+static off_t key_put(IMAGE_T *img, char *key, size_t len) {
+    // Where the key is copied in the heap, 0 if it
+    // cannot be written
+    off_t at;
+
+    if (((at = heap_alloc(img, len)) == 0)
+        || pool_write(img->pool, at, key, len)) {
+      return 0;
+    }
+    return at;
+}
+
+static int key_drop(IMAGE_T *img, off_t at) {
+    size_t len;
+
+    if ((len = key_size(img, at)) == 0) {
+      return -1;
+    }
+    return heap_free(img, at, len);
+}
+
+static off_t key_bare(IMAGE_T *img, off_t at) {
+    // A copy of the key at at, without the columns it may
+    // carry, 0 if it cannot be made
+    char   *k;
+    size_t  len;
+    off_t   copy = 0;
+
+    if ((len = key_size(img, at)) != 0) {
+      k = (char *)malloc(len);
+      assert(k);
+      if (pool_read(img->pool, at, k, len) == 0) {
+        k[0] &= ~KEY_INCL;
+        copy = key_put(img, k, KEY_HDR + _key_len(k));
+      }
+      free(k);
+    }
+    return copy;
+}
+
+static int key_strip(IMAGE_T *img, off_t *at) {
+    // The columns a leaf key carries are those of its
+    // first row: they go when it is found on a second one
+    unsigned char first;
+    off_t         bare;
+
+    if (pool_read(img->pool, *at, &first, 1)) {
+      return -1;
+    }
+    if (first & KEY_INCL) {
+      if (((bare = key_bare(img, *at)) == 0) || key_drop(img, *at)) {
+        return -1;
+      }
+      *at = bare;
+    }
+    return 0;
+}
+
+static int list_put(IMAGE_T *img, off_t *offs, long cnt, off_t *val) {
+    // What a leaf slot holds for sorted offsets goes to *val,
+    // a list being written into the heap. Returns -1 if it
+    // cannot be.
+    unsigned char *packed;
+    unsigned int   len;
+    off_t          at;
+    int            ret = 0;
+
+    if (cnt == 1) {
+      *val = offs[0];
+      return 0;
+    }
+    len = (unsigned int)posting_pack_offsets(offs, cnt, &packed);
+    if (((at = heap_alloc(img, sizeof(len) + len)) == 0)
+        || pool_write(img->pool, at, &len, sizeof(len))
+        || pool_write(img->pool, at + sizeof(len), packed, len)) {
+      ret = -1;
+    }
+    free(packed);
+    *val = -at;
+    return ret;
+}
+
+static int list_drop(IMAGE_T *img, off_t val) {
+    unsigned int len;
+
+    if (!_is_posting(val)) {
+      return 0;
+    }
+    if (pool_read(img->pool, -val, &len, sizeof(len))) {
+      return -1;
+    }
+    return heap_free(img, -val, sizeof(len) + len);
+}
+
+static int slot_change(IMAGE_T *img, IMAGE_SLOT_T *s, off_t val, char add) {
+    // Adds val to the positions of a leaf slot, or removes it.
+    // Returns 0 if done, 1 if val is the only position left (the
+    // key itself must go, the slot is left as it is), -1 if val
+    // is already there when added, or isn't when removed, -2 if
+    // the list cannot be read or written.
+    off_t *offs;
+    off_t  newval;
+    long   cnt = 1;
+    long   i;
+    int    ret = 0;
+
+    if (_is_posting(s->val)) {
+      if ((offs = image_offsets(img, s->val, &cnt)) == NULL) {
+        return -2;
+      }
+    } else {
+      offs = (off_t *)malloc(sizeof(off_t));
+      assert(offs);
+      offs[0] = s->val;
+    }
+    for (i = 0; (i < cnt) && (offs[i] < val); i++) {
+      ;
+    }
+    if (add) {
+      if ((i < cnt) && (offs[i] == val)) {
+        ret = -1;
+      } else {
+        offs = (off_t *)realloc(offs, (cnt + 1) * sizeof(off_t));
+        assert(offs);
+        memmove(&(offs[i+1]), &(offs[i]), (cnt - i) * sizeof(off_t));
+        offs[i] = val;
+        cnt++;
+      }
+    } else if ((i == cnt) || (offs[i] != val)) {
+      ret = -1;
+    } else if (cnt == 1) {
+      ret = 1;
+    } else {
+      memmove(&(offs[i]), &(offs[i+1]), (cnt - i - 1) * sizeof(off_t));
+      cnt--;
+    }
+    if (ret == 0) {
+      if (list_put(img, offs, cnt, &newval) || list_drop(img, s->val)) {
+        ret = -2;
+      } else {
+        s->val = newval;
+      }
+    }
+    free(offs);
+    return ret;
+}
+
+static IMAGE_NODE_T *node_new(IMAGE_T *img, char leaf, off_t *at) {
+    // A new empty node, pinned, NULL if the file
+    // cannot be read
+    IMAGE_HDR_T  *hdr = &(img->hdr);
+    IMAGE_NODE_T *n;
+    char         *page;
+    size_t        i;
+
+    if (hdr->free_node == 0) {
+      // A new page, cut into nodes
+      if ((page = pool_pin(img->pool, hdr->size / hdr->page)) == NULL) {
+        return NULL;
+      }
+      for (i = hdr->page / hdr->node_size; i > 0; i--) {
+        ((IMAGE_NODE_T *)(page + (i - 1) * hdr->node_size))->next
+                                                    = hdr->free_node;
+        hdr->free_node = hdr->size + (i - 1) * hdr->node_size;
+      }
+      pool_unpin(img->pool, page, 1);
+      hdr->size += hdr->page;
+    }
+    *at = hdr->free_node;
+    if ((n = image_pin(img, *at)) == NULL) {
+      return NULL;
+    }
+    hdr->free_node = n->next;
+    memset(n, 0, hdr->node_size);
+    n->is_leaf = leaf;
+    hdr->nodecnt++;
+    return n;
+}
+
+static int node_free(IMAGE_T *img, off_t at) {
+    IMAGE_NODE_T *n;
+
+    if ((n = image_pin(img, at)) == NULL) {
+      return -1;
+    }
+    memset(n, 0, img->hdr.node_size);
+    n->next = img->hdr.free_node;
+    img->hdr.free_node = at;
+    img->hdr.nodecnt--;
+    image_unpin(img, n, 1);
+    return 0;
+}
+
+static IMAGE_NODE_T *descend(BPLTREE_T *t, char *key, PREFIX_T pfx,
+                             PATH_T *p, short *pos, int *cmp) {
+    // The leaf where key is or would go, pinned, NULL if
+    // the file cannot be read. The way there goes to p,
+    // *pos and *cmp are set as by image_search().
+    IMAGE_T      *img = t->image;
+    IMAGE_NODE_T *n;
+    off_t         at = img->hdr.root;
+    char          failed = 0;
+    short         i;
+
+    p->depth = 0;
+    for (;;) {
+      if ((n = image_pin(img, at)) == NULL) {
+        return NULL;
+      }
+      p->node[p->depth] = at;
+      *cmp = 1;
+      i = image_search(t, n, key, pfx, cmp, &failed);
+      if (failed) {
+        image_unpin(img, n, 0);
+        return NULL;
+      }
+      if (n->is_leaf) {
+        *pos = i;
+        return n;
+      }
+      // A key equal to a separator is on its left
+      assert(p->depth + 1 < MAX_DEPTH);
+      p->slot[(p->depth)++] = i - 1;
+      at = n->k[i-1].val;
+      image_unpin(img, n, 0);
+    }
+}
+
+static int insert_up(BPLTREE_T *t, PATH_T *p, IMAGE_NODE_T *n,
+                     short i, IMAGE_SLOT_T *s) {
+    // Puts s into slot i of n, pinned at the end of the path.
+    // A full node is split: its slots and the new one are
+    // shared with a new node on its right, and a key goes up
+    // into its parent, which may be split in turn.
+    IMAGE_T      *img = t->image;
+    IMAGE_SLOT_T *tmp = NULL;
+    IMAGE_SLOT_T  slot = *s;
+    IMAGE_NODE_T *r;
+    off_t         at;
+    off_t         greatest = 0;
+    short         d = p->depth;
+    short         slots;
+    short         keep;
+    int           ret = 0;
+
+    for (;;) {
+      slots = n->keycnt + (n->is_leaf ? 0 : 1);
+      if (n->keycnt < t->maxkeys) {
+        memmove(&(n->k[i+1]), &(n->k[i]), (slots - i) * sizeof(IMAGE_SLOT_T));
+        n->k[i] = slot;
+        n->keycnt++;
+        image_unpin(img, n, 1);
+        break;
+      }
+      if (tmp == NULL) {
+        tmp = (IMAGE_SLOT_T *)malloc((t->maxkeys + 2) * sizeof(IMAGE_SLOT_T));
+        assert(tmp);
+      }
+      memcpy(tmp, n->k, i * sizeof(IMAGE_SLOT_T));
+      tmp[i] = slot;
+      memcpy(&(tmp[i+1]), &(n->k[i]), (slots - i) * sizeof(IMAGE_SLOT_T));
+      slots++;
+      if ((r = node_new(img, n->is_leaf, &at)) == NULL) {
+        image_unpin(img, n, 0);
+        ret = -1;
+        break;
+      }
+      if (n->is_leaf) {
+        // The separator is the greatest key on the left
+        keep = (slots + 1) / 2;
+        r->keycnt = slots - keep;
+        memcpy(r->k, &(tmp[keep]), r->keycnt * sizeof(IMAGE_SLOT_T));
+        r->next = n->next;
+        n->next = at;
+        n->keycnt = keep;
+        greatest = tmp[keep-1].key;
+        slot.pfx = tmp[keep-1].pfx;
+      } else {
+        // Keys are in slots 1 to maxkeys + 1, the one
+        // after those that stay goes up
+        n->keycnt = (t->maxkeys + 1) / 2;
+        keep = n->keycnt + 1;
+        r->k[0].val = tmp[keep].val;
+        r->keycnt = slots - keep - 1;
+        memcpy(&(r->k[1]), &(tmp[keep+1]), r->keycnt * sizeof(IMAGE_SLOT_T));
+        greatest = 0;
+        slot.key = tmp[keep].key;
+        slot.pfx = tmp[keep].pfx;
+      }
+      memcpy(n->k, tmp, keep * sizeof(IMAGE_SLOT_T));
+      memset(&(n->k[keep]), 0, (t->maxkeys + 1 - keep) * sizeof(IMAGE_SLOT_T));
+      slot.val = at;
+      image_unpin(img, r, 1);
+      image_unpin(img, n, 1);
+      if (greatest && ((slot.key = key_bare(img, greatest)) == 0)) {
+        ret = -1;
+        break;
+      }
+      if (d == 0) {
+        // The tree grows a level
+        if ((n = node_new(img, 0, &at)) == NULL) {
+          ret = -1;
+          break;
+        }
+        n->k[0].val = p->node[0];
+        n->k[1] = slot;
+        n->keycnt = 1;
+        img->hdr.root = at;
+        image_unpin(img, n, 1);
+        break;
+      }
+      d--;
+      if ((n = image_pin(img, p->node[d])) == NULL) {
+        ret = -1;
+        break;
+      }
+      i = p->slot[d] + 1;
+    }
+    free(tmp);
+    return ret;
+}
+
+static int insert(BPLTREE_T *t, char *key, off_t val) {
+    IMAGE_T      *img = t->image;
+    IMAGE_NODE_T *n;
+    IMAGE_SLOT_T  s;
+    PATH_T        path;
+    PREFIX_T      pfx = bpltree_keyprefix(key);
+    char          buff[KEY_TEXTLEN];
+    off_t         at;
+    short         pos;
+    int           cmp;
+    int           ret;
+
+    if (img->hdr.root == 0) {
+      // The first root is a leaf
+      if ((n = node_new(img, 1, &at)) == NULL) {
+        return -1;
+      }
+      img->hdr.root = at;
+      image_unpin(img, n, 1);
+    }
+    if ((n = descend(t, key, pfx, &path, &pos, &cmp)) == NULL) {
+      return -1;
+    }
+    if (cmp == 0) {
+      ret = (t->dupl ? slot_change(img, &(n->k[pos]), val, 1) : -1);
+      if (ret == 0) {
+        img->hdr.valcnt++;
+        ret = key_strip(img, &(n->k[pos].key));
+        image_unpin(img, n, 1);
+        return ret;
+      }
+      image_unpin(img, n, 0);
+      if (ret == -1) {
+        bpltree_err_seterr(BPLT_ERR_DUPL,
+                           bpltree_keytext(t, key, buff, KEY_TEXTLEN));
+      }
+      return -1;
+    }
+    if ((s.key = key_put(img, key, _key_size(key))) == 0) {
+      image_unpin(img, n, 0);
+      return -1;
+    }
+    s.val = val;
+    s.pfx = pfx;
+    img->hdr.keycnt++;
+    img->hdr.valcnt++;
+    return insert_up(t, &path, n, pos, &s);
+}
+
+static int from_left(BPLTREE_T *t, IMAGE_NODE_T *parent, short s,
+                     IMAGE_NODE_T *l, IMAGE_NODE_T *r) {
+    // r takes the greatest key of l, its left sibling;
+    // s is the slot of their separator in the parent
+    IMAGE_T *img = t->image;
+    off_t    sep;
+
+    if (l->is_leaf) {
+      memmove(&(r->k[1]), &(r->k[0]), r->keycnt * sizeof(IMAGE_SLOT_T));
+      r->k[0] = l->k[l->keycnt-1];
+      // The separator is the new greatest key on the left
+      if (((sep = key_bare(img, l->k[l->keycnt-2].key)) == 0)
+          || key_drop(img, parent->k[s].key)) {
+        return -1;
+      }
+      parent->k[s].key = sep;
+      parent->k[s].pfx = l->k[l->keycnt-2].pfx;
+      memset(&(l->k[l->keycnt-1]), 0, sizeof(IMAGE_SLOT_T));
+    } else {
+      // Through the parent
+      memmove(&(r->k[1]), &(r->k[0]), (r->keycnt + 1) * sizeof(IMAGE_SLOT_T));
+      r->k[1].key = parent->k[s].key;
+      r->k[1].pfx = parent->k[s].pfx;
+      r->k[0].key = 0;
+      r->k[0].pfx = 0;
+      r->k[0].val = l->k[l->keycnt].val;
+      parent->k[s].key = l->k[l->keycnt].key;
+      parent->k[s].pfx = l->k[l->keycnt].pfx;
+      memset(&(l->k[l->keycnt]), 0, sizeof(IMAGE_SLOT_T));
+    }
+    l->keycnt--;
+    r->keycnt++;
+    return 0;
+}
+
+static int from_right(BPLTREE_T *t, IMAGE_NODE_T *parent, short s,
+                      IMAGE_NODE_T *l, IMAGE_NODE_T *r) {
+    // l takes the smallest key of r, its right sibling
+    IMAGE_T *img = t->image;
+    off_t    sep;
+
+    if (l->is_leaf) {
+      l->k[l->keycnt] = r->k[0];
+      memmove(&(r->k[0]), &(r->k[1]), (r->keycnt - 1) * sizeof(IMAGE_SLOT_T));
+      memset(&(r->k[r->keycnt-1]), 0, sizeof(IMAGE_SLOT_T));
+      if (((sep = key_bare(img, l->k[l->keycnt].key)) == 0)
+          || key_drop(img, parent->k[s].key)) {
+        return -1;
+      }
+      parent->k[s].key = sep;
+      parent->k[s].pfx = l->k[l->keycnt].pfx;
+    } else {
+      l->k[l->keycnt+1].key = parent->k[s].key;
+      l->k[l->keycnt+1].pfx = parent->k[s].pfx;
+      l->k[l->keycnt+1].val = r->k[0].val;
+      parent->k[s].key = r->k[1].key;
+      parent->k[s].pfx = r->k[1].pfx;
+      r->k[0].val = r->k[1].val;
+      memmove(&(r->k[1]), &(r->k[2]), (r->keycnt - 1) * sizeof(IMAGE_SLOT_T));
+      memset(&(r->k[r->keycnt]), 0, sizeof(IMAGE_SLOT_T));
+    }
+    l->keycnt++;
+    r->keycnt--;
+    return 0;
+}
+
+static int merge(BPLTREE_T *t, IMAGE_NODE_T *parent, short s,
+                 IMAGE_NODE_T *l, IMAGE_NODE_T *r) {
+    // The keys of r go into l, their separator
+    // leaves the parent
+    IMAGE_T *img = t->image;
+    int      ret = 0;
+
+    if (l->is_leaf) {
+      memcpy(&(l->k[l->keycnt]), r->k, r->keycnt * sizeof(IMAGE_SLOT_T));
+      l->keycnt += r->keycnt;
+      l->next = r->next;
+      ret = key_drop(img, parent->k[s].key);
+    } else {
+      // The separator comes down
+      l->k[l->keycnt+1].key = parent->k[s].key;
+      l->k[l->keycnt+1].pfx = parent->k[s].pfx;
+      l->k[l->keycnt+1].val = r->k[0].val;
+      memcpy(&(l->k[l->keycnt+2]), &(r->k[1]),
+             r->keycnt * sizeof(IMAGE_SLOT_T));
+      l->keycnt += r->keycnt + 1;
+    }
+    memmove(&(parent->k[s]), &(parent->k[s+1]),
+            (parent->keycnt - s) * sizeof(IMAGE_SLOT_T));
+    memset(&(parent->k[parent->keycnt]), 0, sizeof(IMAGE_SLOT_T));
+    parent->keycnt--;
+    return ret;
+}
+
+static int rebalance(BPLTREE_T *t, PATH_T *p, IMAGE_NODE_T *n) {
+    // n, pinned at the end of the path, has lost a key. If
+    // it has too few left, it takes one from a sibling, or is
+    // merged with it - its parent then loses a key too.
+    IMAGE_T      *img = t->image;
+    IMAGE_NODE_T *parent;
+    IMAGE_NODE_T *l;
+    IMAGE_NODE_T *r;
+    off_t         gone;
+    short         d = p->depth;
+    short         s;
+    char          left;
+    int           ret;
+
+    while (d && (n->keycnt < MIN_KEYS(t))) {
+      image_unpin(img, n, 1);
+      if ((parent = image_pin(img, p->node[d-1])) == NULL) {
+        return -1;
+      }
+      // The sibling on the left if there is one,
+      // on the right otherwise
+      left = (p->slot[d-1] > 0);
+      s = (left ? p->slot[d-1] : 1);
+      r = NULL;
+      if (((l = image_pin(img, parent->k[s-1].val)) == NULL)
+          || ((r = image_pin(img, parent->k[s].val)) == NULL)) {
+        image_unpin(img, l, 0);
+        image_unpin(img, parent, 0);
+        return -1;
+      }
+      gone = 0;
+      if (left && (l->keycnt > MIN_KEYS(t))) {
+        ret = from_left(t, parent, s, l, r);
+      } else if (!left && (r->keycnt > MIN_KEYS(t))) {
+        ret = from_right(t, parent, s, l, r);
+      } else {
+        gone = parent->k[s].val;
+        ret = merge(t, parent, s, l, r);
+      }
+      image_unpin(img, l, 1);
+      image_unpin(img, r, 1);
+      if (gone && (node_free(img, gone) == -1)) {
+        ret = -1;
+      }
+      if (ret || !gone) {
+        image_unpin(img, parent, 1);
+        return ret;
+      }
+      n = parent;
+      d--;
+    }
+    if ((d == 0) && (n->keycnt == 0)) {
+      // The root is empty: the tree loses a level,
+      // or its last key
+      img->hdr.root = (n->is_leaf ? 0 : n->k[0].val);
+      image_unpin(img, n, 0);
+      return node_free(img, p->node[0]);
+    }
+    image_unpin(img, n, 1);
+    return 0;
+}
+
+static int delete(BPLTREE_T *t, char *key, off_t *val) {
+    // Returns 0 if done, -1 if the key (or the position)
+    // isn't there, -2 if the file cannot be read or written
+    IMAGE_T      *img = t->image;
+    IMAGE_NODE_T *n;
+    PATH_T        path;
+    off_t        *offs;
+    long          cnt = 1;
+    short         pos;
+    int           cmp;
+
+    if (img->hdr.root == 0) {
+      return -1;
+    }
+    if ((n = descend(t, key, bpltree_keyprefix(key),
+                     &path, &pos, &cmp)) == NULL) {
+      return -2;
+    }
+    if (cmp != 0) {
+      image_unpin(img, n, 0);
+      return -1;
+    }
+    if (val) {
+      switch (slot_change(img, &(n->k[pos]), *val, 0)) {
+        case 0:
+          img->hdr.valcnt--;
+          image_unpin(img, n, 1);
+          return 0;
+        case 1:
+          break;
+        case -1:
+          image_unpin(img, n, 1);
+          return -1;
+        default:
+          image_unpin(img, n, 1);
+          return -2;
+      }
+    }
+    // The key goes, with all its positions
+    if (_is_posting(n->k[pos].val)) {
+      if ((offs = image_offsets(img, n->k[pos].val, &cnt)) == NULL) {
+        image_unpin(img, n, 0);
+        return -2;
+      }
+      free(offs);
+    }
+    if (key_drop(img, n->k[pos].key) || list_drop(img, n->k[pos].val)) {
+      image_unpin(img, n, 0);
+      return -2;
+    }
+    img->hdr.keycnt--;
+    img->hdr.valcnt -= cnt;
+    n->keycnt--;
+    memmove(&(n->k[pos]), &(n->k[pos+1]),
+            (n->keycnt - pos) * sizeof(IMAGE_SLOT_T));
+    memset(&(n->k[n->keycnt]), 0, sizeof(IMAGE_SLOT_T));
+    return (rebalance(t, &path, n) ? -2 : 0);
+}
+
+static int page_begin(IMAGE_T *img) {
+    // Before the first change since the file was synced,
+    // its header says that it is being changed - on disk,
+    // before any changed page can get there
+    if (img->changing) {
+      return 0;
+    }
+    img->hdr.clean = 0;
+    if (pool_write(img->pool, 0, &(img->hdr), sizeof(IMAGE_HDR_T))
+        || pool_flush(img->pool)
+        || fsync(img->fd)) {
+      bpltree_err_seterr(BPLT_ERR_IO, NULL);
+      return -1;
+    }
+    img->changing = 1;
+    return 0;
+}
+
+extern int page_sync(IMAGE_T *img) {
+    // Writes back all changed pages, then a header
+    // saying that the file is clean
+    if (!img->changing) {
+      return 0;
+    }
+    img->hdr.clean = 1;
+    if (pool_flush(img->pool)
+        || ftruncate(img->fd, img->hdr.size)
+        || fsync(img->fd)
+        || pool_write(img->pool, 0, &(img->hdr), sizeof(IMAGE_HDR_T))
+        || pool_flush(img->pool)
+        || fsync(img->fd)) {
+      img->hdr.clean = 0;
+      bpltree_err_seterr(BPLT_ERR_IO, NULL);
+      return -1;
+    }
+    img->changing = 0;
+    debug(0, "paged tree synced: %ld node%s, %ld key%s, %ld bytes",
+          img->hdr.nodecnt, (img->hdr.nodecnt > 1 ? "s" : ""),
+          img->hdr.keycnt, (img->hdr.keycnt > 1 ? "s" : ""),
+          (long)img->hdr.size);
+    return 0;
+}
+
+extern int page_insert(BPLTREE_T *t, char *key, off_t val) {
+    // bpltree_insert() on an image, once the key is known:
+    // only paged trees can be changed
+    IMAGE_T *img = t->image;
+    int      ret = -1;
+
+    if (!img->writable) {
+      bpltree_err_seterr(BPLT_ERR_READONLY, NULL);
+      return -1;
+    }
+    (void)pthread_rwlock_wrlock(&(img->lock));
+    if (page_begin(img) == 0) {
+      ret = insert(t, key, val);
+    }
+    (void)pthread_rwlock_unlock(&(img->lock));
+    return ret;
+}
+
+extern int page_delete(BPLTREE_T *t, char *key, off_t *val) {
+    // Same as page_insert() for deletions of the key,
+    // or of one of its positions if val isn't NULL
+    IMAGE_T *img = t->image;
+    int      ret = -1;
+
+    if (!img->writable) {
+      bpltree_err_seterr(BPLT_ERR_READONLY, NULL);
+      return -1;
+    }
+    (void)pthread_rwlock_wrlock(&(img->lock));
+    if ((page_begin(img) == 0) && ((ret = delete(t, key, val)) == -2)) {
+      bpltree_err_seterr(BPLT_ERR_IO, NULL);
+      ret = -1;
+    }
+    (void)pthread_rwlock_unlock(&(img->lock));
+    return ret;
+}
+
+extern int page_checkpoint(BPLTREE_T *t) {
+    // bpltree_checkpoint() on a paged tree
+    IMAGE_T *img = t->image;
+    int      ret;
+
+    if (!img->writable) {
+      bpltree_err_seterr(BPLT_ERR_READONLY, NULL);
+      return -1;
+    }
+    (void)pthread_rwlock_wrlock(&(img->lock));
+    ret = page_sync(img);
+    (void)pthread_rwlock_unlock(&(img->lock));
+    return ret;
+}
+
+extern long bpltree_open(BPLTREE_T *t, char *fname) {
+    // Opens the paged tree kept in fname for an empty tree,
+    // which takes its settings - the tree is first created,
+    // empty and with the settings of t, if there is no such
+    // file. It can then be searched with bpltree_get() and
+    // changed with bpltree_insert() and bpltree_delete();
+    // its pages go through a buffer pool (bpltree_setpool()),
+    // and changes are on disk after bpltree_checkpoint() or
+    // bpltree_free(). Returns the number of positions (of rows),
+    // -1 if the file cannot be used.
+    IMAGE_HDR_T hdr;
+    int         fd;
+
+    assert((t->root == NULL) && (t->image == NULL));
+    if ((fd = open(fname, O_RDWR | O_CREAT | O_EXCL, 0644)) != -1) {
+      image_header(t, &hdr);
+      if ((pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+          || ftruncate(fd, hdr.size)
+          || fsync(fd)) {
+        close(fd);
+        (void)unlink(fname);
+        bpltree_err_seterr(BPLT_ERR_IO, fname);
+        return -1;
+      }
+      close(fd);
+      debug(0, "created paged tree %s", fname);
+    } else if (errno != EEXIST) {
+      bpltree_err_seterr(BPLT_ERR_IO, fname);
+      return -1;
+    }
+    return image_open(t, fname, 1);
+}
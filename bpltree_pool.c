@@ -0,0 +1,273 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_pool.c
+ *
+ *  Buffer pool.
+ *
+ *  A fixed number of frames holds pages of a file, which are
+ *  read when first needed. A page is pinned while it is used
+ *  and cannot leave the pool until it is unpinned; a page that
+ *  has been changed is written back to the file when its frame
+ *  is needed for another page, or when the pool is flushed.
+ *  Frames to reuse are chosen by the CLOCK algorithm: a hand
+ *  goes round the frames, skipping pinned ones and those used
+ *  since it last came by, which it marks as unused - pages
+ *  used often, such as the upper levels of a tree, stay.
+ *
+ *  One mutex protects the pool, threads only hold it to find
+ *  or load a page, not while they use it. A thread that finds
+ *  all frames pinned waits for one to be unpinned: pools must
+ *  have a few frames for each thread that uses them.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "debug.h"
+
+#define NO_FRAME    -1L
+#define ALL_PINNED  -2L
+
+typedef struct frame_t {
+           off_t  pageno;    // -1 if the frame is free
+           long   next;      // In the same hash bucket
+           int    pins;
+           char   dirty;
+           char   used;      // Since the hand last came by
+         } FRAME_T;
+
+typedef struct pool_t {
+           int              fd;
+           size_t           page;
+           long             cnt;
+           char            *mem;       // Frame i at mem + i * page
+           FRAME_T         *frames;
+           long            *buckets;   // Page number to frame
+           long             hand;
+           long             hits;
+           long             reads;
+           long             writes;
+           pthread_mutex_t  lock;
+           pthread_cond_t   unpinned;
+         } POOL_T;
+
+#define _bucket(p, pageno)  ((unsigned long)(pageno) % (unsigned long)(p)->cnt)
+
+extern POOL_T *pool_new(int fd, size_t page, long frames) {
+    // A pool of frames pages of page bytes for file fd
+    POOL_T *p = (POOL_T *)calloc(1, sizeof(POOL_T));
+    long    i;
+
+    assert(p && (frames > 0));
+    p->fd = fd;
+    p->page = page;
+    p->cnt = frames;
+    if (posix_memalign((void **)&(p->mem), page, frames * page)) {
+      p->mem = NULL;
+    }
+    p->frames = (FRAME_T *)malloc(frames * sizeof(FRAME_T));
+    p->buckets = (long *)malloc(frames * sizeof(long));
+    assert(p->mem && p->frames && p->buckets);
+    for (i = 0; i < frames; i++) {
+      p->frames[i].pageno = -1;
+      p->frames[i].next = NO_FRAME;
+      p->frames[i].pins = 0;
+      p->frames[i].dirty = 0;
+      p->frames[i].used = 0;
+      p->buckets[i] = NO_FRAME;
+    }
+    (void)pthread_mutex_init(&(p->lock), NULL);
+    (void)pthread_cond_init(&(p->unpinned), NULL);
+    return p;
+}
+
+static char write_back(POOL_T *p, long i) {
+    FRAME_T *f = &(p->frames[i]);
+
+    if (f->dirty) {
+      if (pwrite(p->fd, p->mem + i * p->page, p->page,
+                 f->pageno * p->page) != (ssize_t)p->page) {
+        return -1;
+      }
+      f->dirty = 0;
+      p->writes++;
+    }
+    return 0;
+}
+
+static long victim(POOL_T *p) {
+    // Frame to reuse, taken out of its hash bucket,
+    // NO_FRAME if a page cannot be written back and
+    // ALL_PINNED if there is none
+    FRAME_T *f;
+    long     i;
+    long    *b;
+    long     turns;
+
+    // Twice round: the first round may only clear marks
+    for (turns = 0; turns < 2 * p->cnt; turns++) {
+      i = p->hand;
+      p->hand = (p->hand + 1) % p->cnt;
+      f = &(p->frames[i]);
+      if (f->pins) {
+        continue;
+      }
+      if (f->used) {
+        f->used = 0;
+        continue;
+      }
+      if (f->pageno != -1) {
+        if (write_back(p, i)) {
+          bpltree_err_seterr(BPLT_ERR_IO, NULL);
+          return NO_FRAME;
+        }
+        b = &(p->buckets[_bucket(p, f->pageno)]);
+        while (*b != i) {
+          b = &(p->frames[*b].next);
+        }
+        *b = f->next;
+        f->pageno = -1;
+      }
+      return i;
+    }
+    return ALL_PINNED;
+}
+
+extern char *pool_pin(POOL_T *p, off_t pageno) {
+    // Returns the page, read if needed, which stays in the pool
+    // until pool_unpin() is called. Returns NULL if the page
+    // cannot be read.
+    FRAME_T *f;
+    long     i;
+    ssize_t  got;
+    char    *data = NULL;
+
+    (void)pthread_mutex_lock(&(p->lock));
+    do {
+      i = p->buckets[_bucket(p, pageno)];
+      while ((i != NO_FRAME) && (p->frames[i].pageno != pageno)) {
+        i = p->frames[i].next;
+      }
+      if ((i == NO_FRAME) && ((i = victim(p)) == ALL_PINNED)) {
+        // Someone else may load the page in the meantime
+        (void)pthread_cond_wait(&(p->unpinned), &(p->lock));
+      }
+    } while (i == ALL_PINNED);
+    if ((i != NO_FRAME) && (p->frames[i].pageno == pageno)) {
+      p->hits++;
+    } else if (i != NO_FRAME) {
+      // Past the end of the file, the page is new
+      data = p->mem + i * p->page;
+      if ((got = pread(p->fd, data, p->page, pageno * p->page)) < 0) {
+        bpltree_err_seterr(BPLT_ERR_IO, NULL);
+        i = NO_FRAME;
+      } else {
+        memset(data + got, 0, p->page - got);
+        f = &(p->frames[i]);
+        f->pageno = pageno;
+        f->next = p->buckets[_bucket(p, pageno)];
+        p->buckets[_bucket(p, pageno)] = i;
+        p->reads++;
+      }
+    }
+    if (i != NO_FRAME) {
+      f = &(p->frames[i]);
+      f->pins++;
+      f->used = 1;
+      data = p->mem + i * p->page;
+    } else {
+      data = NULL;
+    }
+    (void)pthread_mutex_unlock(&(p->lock));
+    return data;
+}
+
+extern void pool_unpin(POOL_T *p, void *data, char dirty) {
+    // data may point anywhere in the page
+    long i = ((char *)data - p->mem) / p->page;
+
+    assert((i >= 0) && (i < p->cnt));
+    (void)pthread_mutex_lock(&(p->lock));
+    assert(p->frames[i].pins > 0);
+    if (--(p->frames[i].pins) == 0) {
+      (void)pthread_cond_signal(&(p->unpinned));
+    }
+    if (dirty) {
+      p->frames[i].dirty = 1;
+    }
+    (void)pthread_mutex_unlock(&(p->lock));
+}
+
+static int copy(POOL_T *p, off_t off, char *buf, size_t len, char out) {
+    // Copies len bytes from (out) or into the file at off,
+    // page by page
+    char   *data;
+    size_t  at;
+    size_t  n;
+
+    while (len) {
+      at = off % p->page;
+      n = (len < p->page - at ? len : p->page - at);
+      if ((data = pool_pin(p, off / p->page)) == NULL) {
+        return -1;
+      }
+      if (out) {
+        memcpy(buf, data + at, n);
+      } else {
+        memcpy(data + at, buf, n);
+      }
+      pool_unpin(p, data, !out);
+      off += n;
+      buf += n;
+      len -= n;
+    }
+    return 0;
+}
+
+extern int pool_read(POOL_T *p, off_t off, void *buf, size_t len) {
+    return copy(p, off, (char *)buf, len, 1);
+}
+
+extern int pool_write(POOL_T *p, off_t off, void *buf, size_t len) {
+    return copy(p, off, (char *)buf, len, 0);
+}
+
+extern int pool_flush(POOL_T *p) {
+    // Writes back all changed pages
+    long i;
+    int  ret = 0;
+
+    (void)pthread_mutex_lock(&(p->lock));
+    for (i = 0; i < p->cnt; i++) {
+      if ((p->frames[i].pageno != -1) && write_back(p, i)) {
+        bpltree_err_seterr(BPLT_ERR_IO, NULL);
+        ret = -1;
+      }
+    }
+    (void)pthread_mutex_unlock(&(p->lock));
+    return ret;
+}
+
+extern void pool_release(POOL_T *p) {
+    // Changed pages that haven't been flushed are lost
+    if (p) {
+      debug(0, "pool of %ld page%s: %ld hit%s, %ld read%s, %ld write%s",
+            p->cnt, (p->cnt > 1 ? "s" : ""),
+            p->hits, (p->hits > 1 ? "s" : ""),
+            p->reads, (p->reads > 1 ? "s" : ""),
+            p->writes, (p->writes > 1 ? "s" : ""));
+      (void)pthread_mutex_destroy(&(p->lock));
+      (void)pthread_cond_destroy(&(p->unpinned));
+      free(p->mem);
+      free(p->frames);
+      free(p->buckets);
+      free(p);
+    }
+}
@@ -0,0 +1,400 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_post.c
+ *
+ *  Posting lists, for trees that accept duplicate keys.
+ *
+ *  A key found on several rows is stored once in its leaf,
+ *  with the list of their offsets in the file instead of a
+ *  single one. An offset is stored as is in the leaf until
+ *  a second one comes; the slot then holds minus the address
+ *  of the list, which offsets (never below -1) can't be taken
+ *  for.
+ *
+ *  A list is a chain of blocks holding sorted offsets, the
+ *  greatest ones first since rows are mostly added at the end
+ *  of the file. In a block, offsets are stored as the smallest
+ *  one then the differences between consecutive ones, each
+ *  with as few bytes as it needs (7 bits per byte, the high
+ *  bit set when more bytes follow) - rows with the same key
+ *  are often close to each other, and differences small.
+ *
+ *  Blocks are never changed once linked, as readers may be
+ *  going through them without latches: a change replaces the
+ *  block concerned and those before it in the chain, the rest
+ *  is shared. Blocks come from the arena with arena_block(), and
+ *  are freed with their size (see latch_free_block()).
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "debug.h"
+
+#define BLOCK_BYTES   1024   // Of offsets at most in a block
+#define VARINT_MAX      10   // Bytes for a 64-bit value
+
+typedef struct posting_t {
+           unsigned int      len;           // Bytes of data
+           unsigned int      cnt;           // Offsets in the block
+           struct posting_t *next;          // Smaller offsets
+           unsigned char     data[1];
+         } POSTING_T;
+
+#define _block(pos)   ((POSTING_T *)(uintptr_t)(-(pos)))
+#define _slot(b)      (-(off_t)(uintptr_t)(b))
+#define _size(b)      (offsetof(POSTING_T, data) + (b)->len)
+
+static size_t varint_put(unsigned char *p, unsigned long v) {
+    size_t n = 0;
+
+    while (v >= 0x80) {
+      p[n++] = (unsigned char)(v | 0x80);
+      v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static unsigned long varint_get(unsigned char **p) {
+    unsigned long v = 0;
+    int           shift = 0;
+
+    while (**p & 0x80) {
+      v |= (unsigned long)(**p & 0x7f) << shift;
+      shift += 7;
+      (*p)++;
+    }
+    v |= (unsigned long)**p << shift;
+    (*p)++;
+    return v;
+}
+
+static POSTING_T *block_new(BPLTREE_T *t, unsigned char *data,
+                            size_t len, unsigned int cnt,
+                            POSTING_T *next) {
+    POSTING_T *b = (POSTING_T *)arena_block(t->arena,
+                                     offsetof(POSTING_T, data) + len);
+
+    b->len = (unsigned int)len;
+    b->cnt = cnt;
+    b->next = next;
+    memcpy(b->data, data, len);
+    return b;
+}
+
+static long block_decode(POSTING_T *b, off_t *offs) {
+    unsigned char *p = b->data;
+    unsigned int   i;
+    off_t          val = 0;
+
+    for (i = 0; i < b->cnt; i++) {
+      val += (off_t)varint_get(&p);
+      offs[i] = val;
+    }
+    return (long)b->cnt;
+}
+
+static POSTING_T *chain_build(BPLTREE_T *t, off_t *offs, long cnt,
+                              POSTING_T *tail) {
+    // Blocks for sorted offs, the smallest block linked to tail.
+    // Returns the first block of the chain.
+    unsigned char  buf[BLOCK_BYTES + VARINT_MAX];
+    unsigned char  one[VARINT_MAX];
+    size_t         len = 0;
+    size_t         n;
+    unsigned int   in = 0;
+    long           i;
+
+    for (i = 0; i < cnt; i++) {
+      n = varint_put(one, (unsigned long)(in ? offs[i] - offs[i-1]
+                                             : offs[i]));
+      if (in && (len + n > BLOCK_BYTES)) {
+        tail = block_new(t, buf, len, in, tail);
+        len = 0;
+        in = 0;
+        n = varint_put(one, (unsigned long)offs[i]);
+      }
+      memcpy(buf + len, one, n);
+      len += n;
+      in++;
+    }
+    if (in) {
+      tail = block_new(t, buf, len, in, tail);
+    }
+    return tail;
+}
+
+extern off_t posting_build(BPLTREE_T *t, off_t *offs, long cnt) {
+    // What a leaf slot holds for sorted, unique offsets
+    assert(offs && (cnt > 0));
+    if (cnt == 1) {
+      return offs[0];
+    }
+    return _slot(chain_build(t, offs, cnt, NULL));
+}
+
+extern long posting_count(off_t pos) {
+    POSTING_T *b;
+    long       cnt = 0;
+
+    if (!_is_posting(pos)) {
+      return 1;
+    }
+    for (b = _block(pos); b; b = b->next) {
+      cnt += b->cnt;
+    }
+    return cnt;
+}
+
+extern off_t *posting_offsets(off_t pos, long *cnt) {
+    // The offsets a leaf slot holds, in ascending order,
+    // in an array to free
+    POSTING_T *b;
+    off_t     *offs;
+    long       end;
+
+    *cnt = posting_count(pos);
+    offs = (off_t *)malloc(*cnt * sizeof(off_t));
+    assert(offs);
+    if (!_is_posting(pos)) {
+      offs[0] = pos;
+      return offs;
+    }
+    // Greatest offsets first
+    end = *cnt;
+    for (b = _block(pos); b; b = b->next) {
+      end -= b->cnt;
+      (void)block_decode(b, offs + end);
+    }
+    return offs;
+}
+
+extern void posting_free(BPLTREE_T *t, off_t pos) {
+    POSTING_T *b;
+
+    if (_is_posting(pos)) {
+      for (b = _block(pos); b; b = b->next) {
+        latch_free_block(t, b, _size(b));
+      }
+    }
+}
+
+static long find_offset(off_t *offs, long cnt, off_t val) {
+    // Where val is or would go in offs
+    long lo = 0;
+    long hi = cnt;
+    long mid;
+
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (offs[mid] < val) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+}
+
+static int change(BPLTREE_T *t, off_t *pos, off_t val, char add) {
+    // Adds val to the offsets of a list, or removes it
+    POSTING_T    **chain = NULL;
+    POSTING_T     *b;
+    POSTING_T     *seg;
+    unsigned char *p;
+    off_t         *offs;
+    long           cnt;
+    long           i;
+    long           depth = 0;
+    long           max = 0;
+
+    if (!add && (posting_count(*pos) == 2)) {
+      // Back to a single offset, held by the slot
+      offs = posting_offsets(*pos, &cnt);
+      if ((offs[0] != val) && (offs[1] != val)) {
+        free(offs);
+        return -1;
+      }
+      posting_free(t, *pos);
+      *pos = (offs[0] == val ? offs[1] : offs[0]);
+      free(offs);
+      return 0;
+    }
+    // Blocks before the one that holds val, or would
+    for (b = _block(*pos); b->next; b = b->next) {
+      p = b->data;
+      if ((off_t)varint_get(&p) <= val) {
+        break;
+      }
+      if (depth == max) {
+        max = (max ? 2 * max : 8);
+        chain = (POSTING_T **)realloc(chain, max * sizeof(POSTING_T *));
+        assert(chain);
+      }
+      chain[depth++] = b;
+    }
+    offs = (off_t *)malloc((b->cnt + 1) * sizeof(off_t));
+    assert(offs);
+    cnt = block_decode(b, offs);
+    i = find_offset(offs, cnt, val);
+    if (add == ((i < cnt) && (offs[i] == val))) {
+      // Already there, or not there to remove
+      free(offs);
+      free(chain);
+      return -1;
+    }
+    if (add) {
+      memmove(&(offs[i+1]), &(offs[i]), (cnt - i) * sizeof(off_t));
+      offs[i] = val;
+      cnt++;
+    } else {
+      memmove(&(offs[i]), &(offs[i+1]), (cnt - i - 1) * sizeof(off_t));
+      cnt--;
+    }
+    seg = (cnt ? chain_build(t, offs, cnt, b->next) : b->next);
+    latch_free_block(t, b, _size(b));
+    while (depth) {
+      b = chain[--depth];
+      seg = block_new(t, b->data, b->len, b->cnt, seg);
+      latch_free_block(t, b, _size(b));
+    }
+    *pos = _slot(seg);
+    free(offs);
+    free(chain);
+    return 0;
+}
+
+extern int posting_add(BPLTREE_T *t, off_t *pos, off_t val) {
+    // Adds val to what a leaf slot holds.
+    // Returns -1 if it is already there.
+    off_t pair[2];
+
+    if (!_is_posting(*pos)) {
+      if (*pos == val) {
+        return -1;
+      }
+      pair[0] = (*pos < val ? *pos : val);
+      pair[1] = (*pos < val ? val : *pos);
+      *pos = posting_build(t, pair, 2);
+      return 0;
+    }
+    return change(t, pos, val, 1);
+}
+
+extern int posting_remove(BPLTREE_T *t, off_t *pos, off_t val) {
+    // Removes val from what a leaf slot holds. Returns 0 if
+    // done, -1 if it isn't there, 1 if it is the only offset
+    // (the key itself must go, the slot is left as it is).
+    if (!_is_posting(*pos)) {
+      return (*pos == val ? 1 : -1);
+    }
+    return change(t, pos, val, 0);
+}
+
+static int off_cmp(const void *a, const void *b) {
+    off_t x = *(off_t *)a;
+    off_t y = *(off_t *)b;
+
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+extern long posting_group(BPLTREE_T *t, KEY_POS_T *kp, long cnt) {
+    // kp holds sorted keys, duplicates included but with
+    // different offsets. The offsets of a key are grouped
+    // into one entry, the other copies of the key are freed.
+    // Returns the number of entries left.
+    off_t *offs = NULL;
+    char  *key;
+    long   max = 0;
+    long   i;
+    long   j;
+    long   k;
+    long   n = 0;
+
+    for (i = 0; i < cnt; i = j) {
+      j = i + 1;
+      while ((j < cnt) && (bpltree_keycmp(kp[i].key, kp[j].key) == 0)) {
+        j++;
+      }
+      kp[n] = kp[i];
+      if (j - i > 1) {
+        if (j - i > max) {
+          max = j - i;
+          offs = (off_t *)realloc(offs, max * sizeof(off_t));
+          assert(offs);
+        }
+        for (k = i; k < j; k++) {
+          offs[k - i] = kp[k].pos;
+          if (k > i) {
+            arena_free_key(t->arena, kp[k].key);
+          }
+        }
+        qsort(offs, j - i, sizeof(off_t), off_cmp);
+        kp[n].pos = posting_build(t, offs, j - i);
+        if (_key_incl(kp[n].key)) {
+          // Columns of one row only
+          key = kp[n].key;
+          kp[n].key = key_duplicate(t, key);
+          arena_free_key(t->arena, key);
+        }
+      }
+      n++;
+    }
+    free(offs);
+    debug(0, "%ld row%s grouped under %ld key%s",
+          cnt, (cnt > 1 ? "s" : ""), n, (n > 1 ? "s" : ""));
+    return n;
+}
+
+extern size_t posting_pack(off_t pos, unsigned char **buf) {
+    // The offsets of a list as a count followed by the
+    // offsets in ascending order, each as the difference
+    // with the one before. Returns the number of bytes.
+    off_t  *offs;
+    long    cnt;
+    size_t  len;
+
+    offs = posting_offsets(pos, &cnt);
+    len = posting_pack_offsets(offs, cnt, buf);
+    free(offs);
+    return len;
+}
+
+extern size_t posting_pack_offsets(off_t *offs, long cnt,
+                                   unsigned char **buf) {
+    // Same as posting_pack() for sorted offsets
+    long    i;
+    size_t  len;
+
+    *buf = (unsigned char *)malloc((cnt + 1) * VARINT_MAX);
+    assert(*buf);
+    len = varint_put(*buf, (unsigned long)cnt);
+    for (i = 0; i < cnt; i++) {
+      len += varint_put(*buf + len,
+                        (unsigned long)(i ? offs[i] - offs[i-1] : offs[i]));
+    }
+    return len;
+}
+
+extern off_t *posting_unpack(unsigned char *buf, long *cnt) {
+    // Offsets packed by posting_pack(), in an array to free
+    unsigned char *p = buf;
+    off_t         *offs;
+    long           i;
+
+    *cnt = (long)varint_get(&p);
+    offs = (off_t *)malloc((*cnt ? *cnt : 1) * sizeof(off_t));
+    assert(offs);
+    for (i = 0; i < *cnt; i++) {
+      offs[i] = (i ? offs[i-1] : 0) + (off_t)varint_get(&p);
+    }
+    return offs;
+}
@@ -10,6 +10,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <assert.h>
 
 #include "bpltree.h"
@@ -18,142 +20,163 @@
 
 #define  MAX_FIELDS    32
 
-static void find_smallest_loc(NODE_T *n, KEYLOC_T *locptr) {
-    // Return the position of the smallest key in the index 
-    // No need for recursion
-    // debug(2, ">> find_smallest_loc");
-    if (n && locptr) {
-      while (!_is_leaf(n)) {
-        n = n->node.internal.k[0].bigger;
+extern NODE_T *find_leaf(BPLTREE_T *t, char *key, unsigned long *version) {
+    // Returns the leaf where key is or would be (the leftmost
+    // leaf if key is NULL) and sets *version to the version of
+    // the leaf that was read. Starts again from the root if a
+    // node changes under our feet.
+    NODE_T        *n;
+    NODE_T        *child;
+    unsigned long  v;
+    unsigned long  cv;
+    short          pos;
+    int            cmp;
+    PREFIX_T       pfx = bpltree_keyprefix(key);
+
+  restart:
+    if ((n = bpltree_root(t)) == NULL) {
+      return NULL;
+    }
+    if (((v = latch_read(n)) == 0) || (n != bpltree_root(t))) {
+      goto restart;
+    }
+    while (!_is_leaf(n)) {
+      if (key) {
+        pos = bpltree_nodesearch(t, n, key, pfx, &cmp);
+      } else {
+        pos = 1;
+      }
+      child = n->node.internal.k[pos-1].bigger;
+      if (!latch_check(n, v) || (child == NULL)) {
+        goto restart;
       }
-      // Got it
-      locptr->n = n;
-      locptr->pos = 0;
+      if (((cv = latch_read(child)) == 0) || !latch_check(n, v)) {
+        goto restart;
+      }
+      n = child;
+      v = cv;
     }
-    // debug(2, "<< find_smallest_loc");
+    *version = v;
+    return n;
 }
 
-static void find_key_loc(NODE_T *n, char *key, KEYLOC_T *locptr, short lvl) {
-    short     i = 1;
-    int       cmp = -1;
-
-    // debug(lvl, ">> find_key_loc");
-    // Find the leaf node where the key should be stored
-    if (n && key && locptr) {
-      debug(lvl, "searching node %hd", n->id);
-      if (_is_leaf(n)) {
-        i = 0;
-        while ((i < n->keycnt)
-               && ((cmp = bpltree_keycmp(key,
-                                         n->node.leaf.k[i].key,
-                                         KEYSEP)) > 0)) {
-          i++;
-        }
-        if (cmp == 0) {
-          // We've found it in the tree
-          debug(lvl, "** found at position %hd", i);
-          locptr->n = n;
-          locptr->pos = i;
-          // debug(lvl, "<< find_key_loc");
-          return;
-        } else {
-          // Not found
-          locptr->n = NULL;
-          locptr->pos = 0;
-          // debug(lvl, "<< find_key_loc");
-          return;
-        }
-      } else {
-        // Internal node
-        while ((i <= n->keycnt)
-               && ((cmp = bpltree_keycmp(key,
-                                         n->node.internal.k[i].key,
-                                         KEYSEP)) > 0)) {
-          i++;
-        }
-        if (cmp > 0) { // Key searched is bigger than
-                       // last key in the node
-          find_key_loc(n->node.internal.k[n->keycnt].bigger,
-                       key, locptr, lvl+2);
-        } else {
-          find_key_loc(n->node.internal.k[i-1].bigger, key, locptr, lvl+2);
+extern NODE_T *start_leaf(BPLTREE_T *t, char *key, char after,
+                          unsigned long *version, short *pos) {
+    // Finds the leaf and the position in the leaf of the
+    // first key that isn't smaller than key (that is greater
+    // than key if after is set), the first key of the tree
+    // if key is NULL. The leaf is read live, *version is
+    // the version it had.
+    NODE_T *n;
+    int     cmp;
+
+    do {
+      *pos = 0;
+      cmp = 1;
+      if ((n = find_leaf(t, key, version)) != NULL) {
+        if (key) {
+          *pos = bpltree_nodesearch(t, n, key, bpltree_keyprefix(key), &cmp);
+          if (after && (cmp == 0)) {
+            (*pos)++;
+          }
         }
       }
-    }
-    // debug(lvl, "<< find_key_loc");
+    } while (n && !latch_check(n, *version));
+    return n;
 }
 
-extern KEYLOC_T bpltree_find_key(char *key) {
-    KEYLOC_T  loc = {NULL, 0};
+extern KEYLOC_T bpltree_find_key(BPLTREE_T *t, char *text) {
+    // Where the key given as text is, the first key of the
+    // tree if text is NULL; loc.n is NULL if it isn't there
+    // or text isn't a valid key. With writers about, the
+    // location is only a hint.
+    KEYLOC_T       loc = {NULL, 0};
+    NODE_T        *n;
+    char          *key = NULL;
+    unsigned long  v;
+    short          pos;
+    int            cmp;
 
-    // debug(0, ">> bpltree_find_key");
-    if (key) {
-      debug(0, "looking for key location");
-      find_key_loc(bpltree_root(), key, &loc, 0);
-    } else {
-      debug(0, "looking for smallest key location");
-      find_smallest_loc(bpltree_root(), &loc);
+    if (text && ((key = bpltree_keyencode(t, text)) == NULL)) {
+      return loc;
     }
-    // debug(0, "<< bpltree_find_key");
+    latch_reader_begin(t);
+    do {
+      cmp = 1;
+      pos = 0;
+      if ((n = find_leaf(t, key, &v)) != NULL) {
+        if (key) {
+          pos = bpltree_nodesearch(t, n, key, bpltree_keyprefix(key), &cmp);
+        } else if (n->keycnt) {
+          cmp = 0;
+        }
+      }
+    } while (n && !latch_check(n, v));
+    if (n && (cmp == 0) && (pos < n->keycnt)) {
+      debug(0, "** found at position %hd", pos);
+      loc.n = n;
+      loc.pos = pos;
+    }
+    latch_reader_end(t);
+    free(key);
     return loc;
 }
 
 // The following function is merely to display the search path
-static char search_tree(char *key, NODE_T *t, short lvl) {
+static char search_tree(BPLTREE_T *t, char *key, NODE_T *n, short lvl) {
    // Returns 1 if found, 0 if not
-   char ret = 0;
-   int  i;
-   int  cmp = -1;
+   char     ret = 0;
+   int      i;
+   short    pos;
+   int      cmp = -1;
+   NODE_T  *child;
+   PREFIX_T pfx = bpltree_keyprefix(key);
+   char     buff[KEY_TEXTLEN];
 
-   if (key && t) {
+   if (key && n) {
      for (i = 0; i < lvl; i++) {
        putchar(' ');
      }
-     printf("[node %hd] ", t->id);
-     if (!_is_leaf(t)) {
+     printf("[node %hd] ", n->id);
+     pos = bpltree_nodesearch(t, n, key, pfx, &cmp);
+     // Show the keys we had to go past
+     if (!_is_leaf(n)) {
        i = 1;
-       while ((i <= t->keycnt)
-              && ((cmp = bpltree_keycmp(key,
-                                        t->node.internal.k[i].key,
-                                        KEYSEP)) > 0)) {
+       while (i < pos) {
          if (i > 1) {
            putchar(',');
          }
-         if (bpltree_numeric()) {
-           printf("%d", (int)(t->node.internal.k[i].key));
-         } else {
-           printf("%s", t->node.internal.k[i].key);
-         }
+         printf("%s", bpltree_keytext(t, n->node.internal.k[i].key,
+                                      buff, KEY_TEXTLEN));
          i++;
        }
        putchar('\n');
-       return search_tree(key, t->node.internal.k[i-1].bigger, lvl+2);
+       child = n->node.internal.k[i-1].bigger;
+       latch_write(t, child);
+       latch_release_above(t, child);
+       return search_tree(t, key, child, lvl+2);
      } else {
        // Leaf
        printf("LEAF-");
        i = 0;
-       while ((i < t->keycnt)
-              && ((cmp = bpltree_keycmp(key,
-                                        t->node.leaf.k[i].key,
-                                        KEYSEP)) > 0)) {
+       while (i < pos) {
          if (i > 0) {
            putchar(',');
          }
-         if (bpltree_numeric()) {
-           printf("%d", (int)(t->node.leaf.k[i].key));
-         } else {
-           printf("%s", t->node.leaf.k[i].key);
-         }
+         printf("%s", bpltree_keytext(t, n->node.leaf.k[i].key,
+                                      buff, KEY_TEXTLEN));
          i++;
        }
        if (cmp == 0) {
          printf("\n*** FOUND (");
-         if (bpltree_numeric()) {
-           printf("%d", (int)(t->node.leaf.k[i].key));
+         printf("%s", bpltree_keytext(t, n->node.leaf.k[i].key,
+                                      buff, KEY_TEXTLEN));
+         if (_is_posting(n->node.leaf.k[i].pos)) {
+           printf(", %ld positions) ***\n",
+                  posting_count(n->node.leaf.k[i].pos));
          } else {
-           printf("%s", t->node.leaf.k[i].key);
+           printf(", %ld) ***\n", (long)n->node.leaf.k[i].pos);
          }
-         printf(", %ld) ***\n", (long)t->node.leaf.k[i].pos);
          ret = 1;
        } else {
          printf("\n*** NOT FOUND ***\n");
@@ -165,42 +188,261 @@ static char search_tree(char *key, NODE_T *t, short lvl) {
    return ret;
 }
 
-extern void   bpltree_search(char *key) {
-  int     numkey;
-  NODE_T *root = bpltree_root();
-  char   *p;
+extern void   bpltree_search(BPLTREE_T *t, char *key) {
+  char   *k;
+  NODE_T *n;
 
   if (key) {
+    if (t->image) {
+      // Image nodes aren't tree nodes
+      bpltree_err_seterr(image_err(t), NULL);
+      printf("%s\n", bpltree_err_msg());
+      return;
+    }
+    if ((k = bpltree_keyencode(t, key)) == NULL) {
+      printf("%s\n", bpltree_err_msg());
+      return;
+    }
     printf("Search path:\n");
-    if (bpltree_numeric()) {
-      numkey = atoi(key);
-      (void)search_tree((char *)&numkey, root, 0);
-    } else {
-      while ((p = strchr(key, ':')) != NULL) {
-        *p = bpltree_filesep();
+    // Keep writers away from the node we show, crabbing
+    // down like they do
+    latch_writer_begin(t);
+    latch_root(t);
+    if ((n = t->root) != NULL) {
+      latch_write(t, n);
+      latch_release_above(t, n);
+    }
+    (void)search_tree(t, k, n, 0);
+    latch_writer_end(t);
+    free(k);
+  }
+}
+
+#define BUFFER_SIZE    2048   // For the key fields of a row
+
+static void show_row(char *p, size_t len) {
+  // Without trailing spaces
+  while (len && isspace(p[len-1])) {
+    len--;
+  }
+  fwrite(p, 1, len, stdout);
+  putchar('\n');
+}
+
+//
+//  Rows found with the index are read as they come, in key
+//  order, which for a wide range means jumping all over the
+//  file. With FETCH_FILE or FETCH_SORTED, their offsets are
+//  only collected, then sorted, and rows are read in the order
+//  they are in the file - each read then mostly finds its row
+//  in what the previous one brought. FETCH_SORTED keeps the
+//  rows and shows them in key order once all are read.
+//  When the same offset may come several times (once is set),
+//  offsets are always collected, so that each row is read
+//  once, and shown in key order.
+//
+extern void rows_begin(BPLTREE_T *t, ROWS_T *r, FILE *fp,
+                       char show_data) {
+  r->show = show_data;
+  r->fetch = t->fetch;
+  r->once = 0;
+  r->offs = NULL;
+  r->cnt = 0;
+  r->max = 0;
+  r->count = 0;
+  data_open(t, &(r->data), fp,
+            (r->fetch == FETCH_KEY ? DATA_RANDOM : DATA_SEQUENTIAL));
+}
+
+extern void rows_add(ROWS_T *r, off_t offset) {
+  char   *p;
+  size_t  len;
+
+  if (r->count < 0) {
+    return;
+  }
+  if ((r->fetch == FETCH_NONE) && !r->once) {
+    r->count++;
+    return;
+  }
+  if ((r->fetch == FETCH_KEY) && !r->once) {
+    if ((p = data_row(&(r->data), offset, &len)) == NULL) {
+      r->count = -1;
+      return;
+    }
+    if (r->show) {
+      show_row(p, len);
+    }
+    r->count++;
+    return;
+  }
+  if (r->cnt == r->max) {
+    r->max = (r->max ? 2 * r->max : 1024);
+    r->offs = (off_t *)realloc(r->offs, r->max * sizeof(off_t));
+    assert(r->offs);
+  }
+  r->offs[r->cnt++] = offset;
+}
+
+typedef struct row_t {
+          off_t   offset;
+          long    rank;      // In key order
+          char   *p;         // Kept for FETCH_SORTED
+          size_t  len;
+          char    copied;    // p is to be freed
+        } ROW_T;
+
+static int row_cmp(const void *a, const void *b) {
+  // By offset, then in key order
+  off_t x = ((ROW_T *)a)->offset;
+  off_t y = ((ROW_T *)b)->offset;
+
+  if (x == y) {
+    x = ((ROW_T *)a)->rank;
+    y = ((ROW_T *)b)->rank;
+  }
+  return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+extern int rows_end(ROWS_T *r) {
+  // Reads what was kept. Returns the number of rows read,
+  // -1 if one couldn't be.
+  DATA_T  *d = &(r->data);
+  ROW_T   *order;
+  ROW_T  **by_rank = NULL;
+  char     keep;
+  char    *p;
+  size_t   len;
+  long     i;
+
+  if (r->cnt && (r->count >= 0)) {
+    keep = (r->show
+            && ((r->fetch == FETCH_SORTED) || (r->fetch == FETCH_KEY)));
+    order = (ROW_T *)malloc(r->cnt * sizeof(ROW_T));
+    assert(order);
+    for (i = 0; i < r->cnt; i++) {
+      order[i].offset = r->offs[i];
+      order[i].rank = i;
+      order[i].p = NULL;
+      order[i].copied = 0;
+    }
+    qsort(order, r->cnt, sizeof(ROW_T), row_cmp);
+    for (i = 0; i < r->cnt; i++) {
+      if (r->once && i && (order[i].offset == order[i-1].offset)) {
+        // Read for a key before
+        continue;
+      }
+      if (r->fetch == FETCH_NONE) {
+        r->count++;
+        continue;
+      }
+      if ((p = data_row(d, order[i].offset, &len)) == NULL) {
+        r->count = -1;
+        break;
+      }
+      r->count++;
+      if (keep) {
+        // Rows read with stdio are copied, mapped ones
+        // stay where they are
+        order[i].copied = (p == d->buf);
+        if (order[i].copied) {
+          p = (char *)malloc(len ? len : 1);
+          assert(p);
+          memcpy(p, d->buf, len);
+        }
+        order[i].p = p;
+        order[i].len = len;
+      } else if (r->show) {
+        show_row(p, len);
+      }
+    }
+    if (keep) {
+      by_rank = (ROW_T **)malloc(r->cnt * sizeof(ROW_T *));
+      assert(by_rank);
+      for (i = 0; i < r->cnt; i++) {
+        by_rank[order[i].rank] = &(order[i]);
+      }
+      for (i = 0; i < r->cnt; i++) {
+        p = by_rank[i]->p;
+        if (p && (r->count >= 0)) {
+          show_row(p, by_rank[i]->len);
+        }
+        if (by_rank[i]->copied) {
+          free(p);
+        }
       }
-      (void)search_tree(key, root, 0);
+      free(by_rank);
     }
+    free(order);
   }
+  free(r->offs);
+  r->offs = NULL;
+  r->cnt = 0;
+  data_close(d);
+  return r->count;
 }
 
-#define BUFFER_SIZE    2048
+static void add_rows(ROWS_T *r, off_t pos) {
+  // What a leaf slot holds: one row, or a list of them
+  off_t *offs;
+  long   cnt;
+  long   i;
 
-extern int bpltree_get(char *key, FILE *fp, char show_data) {
-  int        numkey;
-  int        numkey2;
-  long       offset;
-  char      *p;
-  int        len;
-  char      *low_key = NULL;
-  char      *high_key = NULL;
-  KEYLOC_T   loc;
-  NODE_T    *n;
-  char       buffer[BUFFER_SIZE];
-  short      i;
-  int        count = 0;
+  if (!_is_posting(pos)) {
+    rows_add(r, pos);
+    return;
+  }
+  offs = posting_offsets(pos, &cnt);
+  for (i = 0; i < cnt; i++) {
+    rows_add(r, offs[i]);
+  }
+  free(offs);
+}
 
-  if (key && fp) {
+static void covered_row(BPLTREE_T *t, ROWS_T *r, char *key, off_t pos) {
+  // A key and its included columns, taken from its row
+  // if it doesn't keep them
+  char   *p = NULL;
+  size_t  len = 0;
+
+  if (r->count < 0) {
+    return;
+  }
+  if (!_key_incl(key) && ((p = data_row(&(r->data), pos, &len)) == NULL)) {
+    r->count = -1;
+    return;
+  }
+  if (r->show) {
+    incl_show(t, key, p, len);
+  }
+  r->count++;
+}
+
+// What get_range() does with the rows in the range
+#define GET_ROWS      0   // Reads them
+#define GET_COVERED   1   // Shows keys and included columns
+#define GET_COUNT     2   // Counts them
+
+static int get_range(BPLTREE_T *t, char *key, FILE *fp, char show_data,
+                     char what, char desc, long limit) {
+  // Rows of a range of keys, what is done with them
+  // depending on what (GET_xxx). If desc is set, they
+  // come in descending key order, limit at most.
+  char          *p;
+  int            len;
+  char          *low = NULL;
+  char          *high = NULL;
+  char          *low_key = NULL;
+  char          *high_key = NULL;
+  CURSOR_T      *c;
+  KEY_POS_T     *batch;
+  long           got;
+  long           left = (limit > 0 ? limit : -1);
+  long           j;
+  int            count = 0;
+  ROWS_T         rows;
+
+  if (key && (fp || (what == GET_COUNT))) {
     // Support of range scans: a, b - a to b, inclusive
     //                         ,b   - smaller than b or equal
     //                         a,   - greater than b or equal
@@ -215,160 +457,464 @@ extern int bpltree_get(char *key, FILE *fp, char show_data) {
         printf("No key specified\n");
         return -1;
       }
-      if (bpltree_numeric()) {
-        if (sscanf(key, "%d", &numkey) != 1) {
-          printf("Numeric value expected\n");
-          return -1;
-        }
-        high_key = (char *)&numkey;
-      } else {
-        high_key = key;
-      }
+      high = key;
     } else {
       if ((p = strchr(key, ',')) != NULL) {
         len = strlen(key);
         if (key[len - 1] == ',') {
           // Lower-bound scan
           *p = '\0';
-          if (bpltree_numeric()) {
-            if (sscanf(key, "%d", &numkey) != 1) {
-              printf("Numeric value expected\n");
-              return -1;
-            }
-            low_key = (char *)&numkey;
-          } else {
-            low_key = key;
-          }
+          low = key;
          } else {
           // Bound scan
           *p++ = '\0';
           while (isspace(*p)) {
             p++;
           }
-          if (bpltree_numeric()) {
-            if (sscanf(key, "%d", &numkey) != 1) {
-              printf("Numeric values expected\n");
-              return -1;
-            }
-            if (sscanf(key, "%d", &numkey2) != 1) {
-              printf("Numeric values expected\n");
-              return -1;
-            }
-            low_key = (char *)&numkey;
-            high_key = (char *)&numkey2;
-          } else {
-            low_key = key;
-            high_key = p;
-          }
+          low = key;
+          high = p;
         }
       } else {
         // Single key search
-        if (bpltree_numeric()) {
-          if (sscanf(key, "%d", &numkey) != 1) {
-            printf("Numeric value expected\n");
-            return -1;
+        low = key;
+        high = key;
+      }
+    }
+    debug(0, "range scan from %s to %s",
+          (low ? low : "smallest"), (high ? high : "greatest"));
+    rows_begin(t, &rows, fp, show_data);
+    if (what == GET_COVERED) {
+      // As they come, with the keys
+      rows.fetch = FETCH_KEY;
+    } else if (what == GET_COUNT) {
+      rows.fetch = FETCH_NONE;
+    }
+    if (t->image) {
+      if (desc) {
+        // Image leaves are only linked forwards
+        bpltree_err_seterr(image_err(t), NULL);
+        printf("%s\n", bpltree_err_msg());
+        rows.count = -1;
+      } else if ((low && ((low_key = bpltree_keyencode(t, low)) == NULL))
+                 || (high
+                     && ((high_key = bpltree_keyencode(t, high)) == NULL))) {
+        printf("%s\n", (t->numeric ? "Numeric value expected"
+                                   : bpltree_err_msg()));
+        rows.count = -1;
+      } else {
+        (void)image_get(t, low_key, high_key, &rows);
+      }
+      free(low_key);
+      free(high_key);
+      return rows_end(&rows);
+    }
+    // Rows come from a cursor, a leaf at a time
+    c = bpltree_cursor_open(t, desc);
+    if (bpltree_cursor_seek(c, low, high) == -1) {
+      printf("%s\n", (t->numeric ? "Numeric value expected"
+                                 : bpltree_err_msg()));
+      bpltree_cursor_close(c);
+      rows.count = -1;
+      return rows_end(&rows);
+    }
+    if (what == GET_COUNT) {
+      rows.count = (int)bpltree_cursor_count(c);
+    } else {
+      batch = (KEY_POS_T *)malloc(t->maxkeys * sizeof(KEY_POS_T));
+      assert(batch);
+      while ((rows.count >= 0) && left
+             && ((got = bpltree_cursor_next(c, batch,
+                                  ((left > 0) && (left < t->maxkeys)
+                                   ? left : t->maxkeys))) > 0)) {
+        for (j = 0; j < got; j++) {
+          if (what == GET_COVERED) {
+            covered_row(t, &rows, batch[j].key, batch[j].pos);
+          } else {
+            rows_add(&rows, batch[j].pos);
           }
-          low_key = (char *)&numkey;
-          high_key = (char *)&numkey;
-        } else {
-          low_key = key;
-          high_key = key;
+        }
+        if (left > 0) {
+          left -= got;
         }
       }
+      free(batch);
     }
-    if (bpltree_numeric()) {
-      if (low_key) {
-         if (high_key) {
-           debug(0, "range scan from %d to %d",
-                   (int)low_key, (int)high_key);
-         } else {
-           debug(0, "range scan from %d to greatest",
-                   (int)low_key);
-         }
+    bpltree_cursor_close(c);
+    count = rows_end(&rows);
+  }
+  return count;
+}
+
+extern int bpltree_get(BPLTREE_T *t, char *key, FILE *fp, char show_data) {
+  return get_range(t, key, fp, show_data, GET_ROWS, 0, 0);
+}
+
+extern int bpltree_get_desc(BPLTREE_T *t, char *key, FILE *fp,
+                            char show_data, long limit) {
+  // Same as bpltree_get(), greatest keys first, and
+  // at most limit rows if not 0
+  return get_range(t, key, fp, show_data, GET_ROWS, 1, limit);
+}
+
+extern int bpltree_count(BPLTREE_T *t, char *key) {
+  // Number of rows that bpltree_get() would return, from
+  // the leaves only
+  return get_range(t, key, NULL, 0, GET_COUNT, 0, 0);
+}
+
+extern int bpltree_iget(BPLTREE_T *t, char *key, FILE *fp, char show_data) {
+  // Same as bpltree_get(), but shows for each row its key
+  // and the included columns (see bpltree_incl.c), without
+  // reading the file when the index keeps them
+  if (t->incl[0] == 0) {
+    bpltree_err_seterr(BPLT_ERR_NOINCL, NULL);
+    printf("%s\n", bpltree_err_msg());
+    return -1;
+  }
+  if (t->image) {
+    bpltree_err_seterr(image_err(t), NULL);
+    printf("%s\n", bpltree_err_msg());
+    return -1;
+  }
+  return get_range(t, key, fp, show_data, GET_COVERED, 0, 0);
+}
+
+#define MAX_DEPTH   64
+
+typedef struct probe_t {
+          char     *key;
+          PREFIX_T  pfx;
+        } PROBE_T;
+
+static int probe_cmp(const void *a, const void *b) {
+  // Exact order of normalized keys: bpltree_keycmp() finds
+  // a key on some fields only equal to the longer keys it
+  // matches, which isn't an order
+  char *k1 = ((PROBE_T *)a)->key;
+  char *k2 = ((PROBE_T *)b)->key;
+  int   len1 = _key_len(k1);
+  int   len2 = _key_len(k2);
+  int   cmp;
+
+  cmp = memcmp(_key_body(k1), _key_body(k2), (len1 < len2 ? len1 : len2));
+  if (cmp == 0) {
+    cmp = len1 - len2;
+  }
+  if (cmp == 0) {
+    cmp = (int)((unsigned char *)k1)[2] - (int)((unsigned char *)k2)[2];
+  }
+  return cmp;
+}
+
+static char probes_overlap(PROBE_T *p, long cnt) {
+  // Whether two sorted keys may match the same rows: a key
+  // on some fields only matches the keys that start with it,
+  // which come right after it
+  long i;
+  int  len;
+
+  for (i = 1; i < cnt; i++) {
+    len = _key_len(p[i-1].key) - !_key_fixed(p[i-1].key);
+    if ((len >= 0) && (len <= _key_len(p[i].key))
+        && (memcmp(_key_body(p[i-1].key), _key_body(p[i].key), len) == 0)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static NODE_T *live_root(BPLTREE_T *t, unsigned long *version) {
+  // The root of the live tree and the version it had
+  NODE_T *n;
+
+  do {
+    if ((n = bpltree_root(t)) == NULL) {
+      return NULL;
+    }
+  } while (((*version = latch_read(n)) == 0) || (n != bpltree_root(t)));
+  return n;
+}
+
+static void mget_follow(BPLTREE_T *t, SNAPSHOT_T *s, NODE_T *n,
+                        unsigned long v, char *last, PROBE_T *p,
+                        off_t *offsets, ROWS_T *r) {
+  // Rows of a key that matched the last entry of a leaf
+  // (a key on some of its fields only) in the leaves that
+  // follow, starting with n - as bpltree_get() does. Without
+  // a snapshot, n is read live from version v, and when a leaf
+  // changes we look again for the key after last, the last
+  // key seen.
+  NODE_T        *img;
+  NODE_T        *next;
+  char          *seen = NULL;
+  unsigned long  nv = 0;
+  char           stop = 0;
+  short          i = 0;
+  short          j;
+  short          cnt;
+
+  while (n && !stop && (r->count >= 0)) {
+    do {
+      img = (s ? latch_snapshot_node(s, n, &v) : n);
+      cnt = 0;
+      stop = 0;
+      for (j = i; (j < img->keycnt) && (j < t->maxkeys); j++) {
+        if (bpltree_nodecmp(t, img, j, p->key, p->pfx) < 0) {
+          stop = 1;
+          break;
+        }
+        offsets[cnt++] = img->node.leaf.k[j].pos;
+        seen = img->node.leaf.k[j].key;
+      }
+      next = img->node.leaf.next;
+    } while (s && v && !latch_check(n, v));
+    if (s == NULL) {
+      if (!stop && next) {
+        nv = latch_read(next);
+      }
+      if (!latch_check(n, v) || (!stop && next && !nv)) {
+        debug(0, "leaf %hd changed while reading", n->id);
+        n = start_leaf(t, last, 1, &v, &i);
+        stop = 0;
+        continue;
+      }
+      if (cnt) {
+        last = seen;
+      }
+      v = nv;
+    }
+    for (j = 0; j < cnt; j++) {
+      add_rows(r, offsets[j]);
+    }
+    n = next;
+    i = 0;
+  }
+}
+
+extern int bpltree_mget(BPLTREE_T *t, char **keys, long cnt, FILE *fp,
+                        char show_data) {
+  // Rows of a batch of keys, in key order, each row once
+  // even if several keys match it. Keys are sorted,
+  // then looked up in one pass: the path to the last leaf
+  // is kept, with the greatest key each node on it can hold,
+  // and the next key only climbs as far as needed before
+  // going down again. All the keys that fall in one leaf are
+  // found with one pass over the leaf.
+  PROBE_T       *probes;
+  SNAPSHOT_T    *s;
+  NODE_T        *path[MAX_DEPTH];
+  unsigned long  pathv[MAX_DEPTH];  // Versions, live tree only
+  char          *fence[MAX_DEPTH];  // NULL if there is no bound
+  NODE_T        *n;
+  NODE_T        *img;
+  NODE_T        *child = NULL;
+  NODE_T        *next;
+  unsigned long  v;
+  unsigned long  cv;
+  unsigned long  nv = 0;
+  off_t         *offsets;
+  long           i;
+  long           j;
+  long           pcnt = 0;
+  long           follow;
+  long           ocnt;
+  long           omax;
+  long           o;
+  ROWS_T         rows;
+  short          depth = 0;
+  short          e;
+  short          f;
+  short          kc;
+  short          pos;
+  int            cmp;
+  int            count;
+  char          *bound = NULL;
+  char          *seen = NULL;
+  char           lost;
+
+  if ((keys == NULL) || (cnt <= 0) || (fp == NULL)) {
+    return 0;
+  }
+  probes = (PROBE_T *)malloc(cnt * sizeof(PROBE_T));
+  assert(probes);
+  for (i = 0; i < cnt; i++) {
+    if ((probes[pcnt].key = bpltree_keyencode(t, keys[i])) == NULL) {
+      if (t->numeric) {
+        printf("Numeric value expected\n");
       } else {
-           debug(0, "range scan from smallest to %d",
-                   (int)high_key);
+        printf("%s\n", bpltree_err_msg());
       }
+      for (j = 0; j < pcnt; j++) {
+        free(probes[j].key);
+      }
+      free(probes);
+      return -1;
+    }
+    probes[pcnt].pfx = bpltree_keyprefix(probes[pcnt].key);
+    pcnt++;
+  }
+  qsort(probes, pcnt, sizeof(PROBE_T), probe_cmp);
+  // Each key once
+  for (i = 0, j = 0; i < pcnt; i++) {
+    if (j && (probe_cmp(&(probes[j-1]), &(probes[i])) == 0)) {
+      free(probes[i].key);
     } else {
-      debug(0, "range scan from %s to %s",
-            (low_key ? low_key : "smallest"),
-            (high_key ? high_key : "greatest"));
+      probes[j++] = probes[i];
     }
-    loc = bpltree_find_key(low_key);
-    if (loc.n) {
-      n = loc.n;
-      i = loc.pos;
-      offset = 0;
-      if (high_key) {
-        while ((offset >= 0)
-               && (bpltree_keycmp(high_key,
-                                  n->node.leaf.k[i].key,
-                                  KEYSEP) >= 0)) {
-          offset = n->node.leaf.k[i].pos;
-          (void)fseek(fp, offset, SEEK_SET);
-          if (fgets(buffer, BUFFER_SIZE, fp)) {
-            len = strlen(buffer);
-            while (len && isspace(buffer[len-1])) {
-              len--;
-            }
-            buffer[len] = '\0';
-            if (show_data) {
-              printf("%s\n", buffer);
-            }
-            count++;
+  }
+  pcnt = j;
+  debug(0, "mget: %ld distinct key%s", pcnt, (pcnt > 1 ? "s" : ""));
+  rows_begin(t, &rows, fp, show_data);
+  // Rows that keys share come once
+  rows.once = probes_overlap(probes, pcnt);
+  if (t->image) {
+    // Images are searched key by key
+    for (i = 0; (i < pcnt) && (rows.count >= 0); i++) {
+      (void)image_get(t, probes[i].key, probes[i].key, &rows);
+    }
+  } else if (pcnt) {
+    latch_reader_begin(t);
+    // A snapshot pinned by the thread is read, otherwise the
+    // live tree: when a node has changed by the time it is
+    // checked, the key is looked for again from the root
+    s = latch_snapshot(t);
+    omax = t->maxkeys;
+    offsets = (off_t *)malloc(omax * sizeof(off_t));
+    assert(offsets);
+    path[0] = (s ? s->root : live_root(t, &(pathv[0])));
+    fence[0] = NULL;
+    i = 0;
+    while (path[0] && (i < pcnt) && (rows.count >= 0)) {
+      // Up to the lowest node that may hold the key
+      while (depth && fence[depth]
+             && (bpltree_keycmp(probes[i].key, fence[depth]) > 0)) {
+        depth--;
+      }
+      n = path[depth];
+      lost = 0;
+      for (;;) {
+        do {
+          if (s) {
+            img = latch_snapshot_node(s, n, &v);
           } else {
-            perror("File reading:");
-            return -1;
+            img = n;
+            v = pathv[depth];
           }
-          i++;
-          if (i == n->keycnt) {
-            i = 0;
-            if ((n = n->node.leaf.next) == NULL) {
-              offset = -1;
-            }
+          if (_is_leaf(img)) {
+            break;
           }
+          pos = bpltree_nodesearch(t, img, probes[i].key,
+                                   probes[i].pfx, &cmp);
+          child = img->node.internal.k[pos-1].bigger;
+          bound = (pos <= img->keycnt ? img->node.internal.k[pos].key
+                                      : fence[depth]);
+        } while (s && v && !latch_check(n, v));
+        if (_is_leaf(img)) {
+          break;
         }
-      } else {
-        // No upper bound - read all entries
-        while (offset >= 0) {
-          offset = n->node.leaf.k[i].pos;
-          (void)fseek(fp, offset, SEEK_SET);
-          if (fgets(buffer, BUFFER_SIZE, fp)) {
-            len = strlen(buffer);
-            while (len && isspace(buffer[len-1])) {
-              len--;
-            }
-            buffer[len] = '\0';
-            if (show_data) {
-              printf("%s\n", buffer);
-            }
-            count++;
+        assert(depth + 1 < MAX_DEPTH);
+        if (s == NULL) {
+          // The version of the child is noted before
+          // the node is checked
+          if ((child == NULL) || ((cv = latch_read(child)) == 0)
+              || !latch_check(n, v)) {
+            lost = 1;
+            break;
+          }
+          pathv[depth + 1] = cv;
+        }
+        path[++depth] = child;
+        fence[depth] = bound;
+        n = child;
+      }
+      if (!lost) {
+        // Keys of this leaf, merged with its entries
+        do {
+          if (s) {
+            img = latch_snapshot_node(s, n, &v);
           } else {
-            perror("File reading:");
-            return -1;
+            img = n;
+            v = pathv[depth];
           }
-          i++;
-          if (i == n->keycnt) {
-            i = 0;
-            if ((n = n->node.leaf.next) == NULL) {
-              offset = -1;
+          kc = img->keycnt;
+          if (kc > t->maxkeys) {
+            kc = t->maxkeys;
+          }
+          ocnt = 0;
+          follow = -1;
+          e = 0;
+          next = img->node.leaf.next;
+          for (j = i; j < pcnt; j++) {
+            if ((j > i) && fence[depth]
+                && (bpltree_keycmp(probes[j].key, fence[depth]) > 0)) {
+              break;
+            }
+            while ((e < kc)
+                   && (bpltree_nodecmp(t, img, e, probes[j].key,
+                                       probes[j].pfx) > 0)) {
+              e++;
+            }
+            // Keys on some fields only may overlap, the next
+            // key starts again from the same entry
+            for (f = e; (f < kc)
+                        && (bpltree_nodecmp(t, img, f, probes[j].key,
+                                            probes[j].pfx) == 0); f++) {
+              if (ocnt == omax) {
+                omax *= 2;
+                offsets = (off_t *)realloc(offsets, omax * sizeof(off_t));
+                assert(offsets);
+              }
+              offsets[ocnt++] = img->node.leaf.k[f].pos;
+            }
+            if ((f == kc) && (f > e) && next) {
+              // Matches may go on in the next leaf
+              seen = img->node.leaf.k[kc - 1].key;
+              follow = j++;
+              break;
             }
           }
+        } while (s && v && !latch_check(n, v));
+        if (s == NULL) {
+          if (follow >= 0) {
+            nv = latch_read(next);
+          }
+          lost = (!latch_check(n, v) || ((follow >= 0) && !nv));
         }
       }
+      if (lost) {
+        debug(0, "mget: node %hd changed while reading", n->id);
+        depth = 0;
+        path[0] = live_root(t, &(pathv[0]));
+        continue;
+      }
+      for (o = 0; o < ocnt; o++) {
+        add_rows(&rows, offsets[o]);
+      }
+      if (follow >= 0) {
+        mget_follow(t, s, next, nv, seen, &(probes[follow]),
+                    offsets, &rows);
+      }
+      i = j;
     }
+    latch_reader_end(t);
+    free(offsets);
   }
+  count = rows_end(&rows);
+  for (i = 0; i < pcnt; i++) {
+    free(probes[i].key);
+  }
+  free(probes);
   return count;
 }
 
-static short prepare_scan(char *key, short *fields) {
+static short prepare_scan(BPLTREE_T *t, char *key, short *fields) {
     // Modifies the key
     short  ret = 0;
     char  *k;
     char  *k2;
     char  *p;
     char  *q;
-    char   sep = bpltree_filesep();
+    char   sep = t->sep;
     char   strsep[2];
     short  i = 0;
     short  n;
@@ -379,7 +925,7 @@ static short prepare_scan(char *key, short *fields) {
     // We number from 0 to n-1 internally
     if (key && fields) {
      /*
-      if (bpltree_numeric()) {
+      if (t->numeric) {
         debug(0, "prepare_scan - key = %d", *((int *)key));
       } else {
         debug(0, "prepare_scan - key = %s", key);
@@ -391,7 +937,7 @@ static short prepare_scan(char *key, short *fields) {
       if (strchr(k, ':')) {
         while ((p = strchr(k, ':')) != NULL) {
           // debug(0, "prepare_scan - part %hd of the key", i + 1);
-          if (bpltree_numeric()) {
+          if (t->numeric) {
             bpltree_err_seterr(BPLT_ERR_NUMKO, NULL);
             return -1;
           }
@@ -464,48 +1010,39 @@ static short prepare_scan(char *key, short *fields) {
     return ret;
 }
 
-static char *rebuild_line(char *line, short *fields) {
-  // Not supposed to be multi threaded ...
-  static char   good_bits[BUFFER_SIZE];
-         char  *l;
-         short  i;
-         short  j;
-         char  *chunks[MAX_FIELDS];
-         char  *p;
-         char  *q;
-         char   sep = bpltree_filesep();
-         char   strsep[2];
-         int    len;
+static char *rebuild_line(BPLTREE_T *t, char *line, size_t linelen,
+                          short *fields, char *good_bits) {
+  // good_bits must be able to hold BUFFER_SIZE bytes.
+  // The line is only read, and needn't end with '\0'.
+  unsigned int  ends[MAX_FIELDS];
+  short         i;
+  short         j;
+  char          sep = t->sep;
+  size_t        start;
+  size_t        n;
+  int           len;
 
   assert(line && fields);
-  l = strdup(line);
-  assert(l);
-  strsep[0] = sep;
-  strsep[1] = '\0';
-  p = l;
-  i = 0;
-  while ((q = strchr(p, sep)) != NULL) {
-    *q++ = '\0';
-    chunks[i++] = p;
-    p = q;
-  }
-  // Don't forget the last one
-  chunks[i] = p;
+  // i is the last field
+  i = bpltree_fieldsplit(line, linelen, sep, ends, MAX_FIELDS, &n) - 1;
   // OK, now rebuild the line with only what we want
-  good_bits[0] = '\0';
   len = 0;
   j = 0;
   while ((j < MAX_FIELDS) && (fields[j] >= 0)) {
-    if (j <= i) {
-      if (j > 0) {
-        strncat(good_bits, strsep, BUFFER_SIZE - len);
+    if ((j <= i) && (fields[j] <= i)) {
+      if ((j > 0) && (len < BUFFER_SIZE - 1)) {
+        good_bits[len++] = sep;
+      }
+      start = (fields[j] ? ends[fields[j] - 1] + 1 : 0);
+      n = ends[fields[j]] - start;
+      if (n > (size_t)(BUFFER_SIZE - 1 - len)) {
+        n = BUFFER_SIZE - 1 - len;
       }
-      strncat(good_bits, chunks[fields[j]], BUFFER_SIZE - len - 1);
-      len = strlen(good_bits);
+      memcpy(good_bits + len, line + start, n);
+      len += n;
     }  // Else do nothing. Perhaps the last field is missing on a line
     j++;
   }
-  free(l);
   while (len
          && (good_bits[len-1] != sep)
          && isspace(good_bits[len-1])) {
@@ -515,28 +1052,225 @@ static char *rebuild_line(char *line, short *fields) {
   return good_bits;
 }
 
-extern int bpltree_scan(char *key, FILE *fp, char show_data) {
+//
+//  A scan reads every row of the file. When the file is
+//  mapped and big enough, it is cut into as many chunks as
+//  there are threads, each starting at the beginning of a
+//  row, and each thread checks the rows of its chunk. What a
+//  thread finds is kept (as views into the mapping) and shown
+//  once all are done, chunk after chunk, so that rows come in
+//  the order of the file as they would with a single thread.
+//
+#define SCAN_CHUNK_MIN   (1024 * 1024)  // Bytes, per thread at least
+
+typedef struct scan_t {
+          BPLTREE_T  *t;
+          short      *fields;
+          char       *key;         // Single key search, or NULL
+          char       *low_key;
+          char       *high_key;
+          int         keylen;
+          int         low_keylen;
+          int         high_keylen;
+        } SCAN_T;
+
+typedef struct chunk_t {
+          SCAN_T     *sc;
+          char       *start;
+          char       *end;
+          char        show;        // Keep the rows found
+          char        started;     // Scanned by a thread of its own
+          char      **rows;
+          size_t     *lens;
+          long        cnt;
+          long        max;
+        } CHUNK_T;
+
+static char scan_match(SCAN_T *sc, char *p, size_t len) {
+  // Does the row (leading spaces skipped) qualify?
+  char  good_bits[BUFFER_SIZE];
+  int   linelen;
+  int   hcmp;
+  int   lcmp;
+
+  (void)rebuild_line(sc->t, p, len, sc->fields, good_bits);
+  if (sc->key) {
+    linelen = strlen(good_bits);
+    //debug(0, "[%s] (%d)", good_bits, strlen(good_bits));
+    return ((sc->keylen && (strncmp(sc->key, good_bits, linelen) == 0))
+            || (!sc->keylen && !*good_bits));
+  }
+  if (sc->low_key) {
+    lcmp = strncmp(good_bits, sc->low_key, sc->low_keylen);
+    if (lcmp < 0) {
+      return 0;
+    }
+    if (sc->high_key) {
+      // Bounded
+      hcmp = strncmp(good_bits, sc->high_key, sc->high_keylen);
+      return (hcmp <= 0);
+    }
+    return 1;
+  }
+  hcmp = strncmp(good_bits, sc->high_key, sc->high_keylen);
+  return (hcmp <= 0);
+}
+
+static char *skip_spaces(BPLTREE_T *t, char *row, size_t *len) {
+  char *p = row;
+
+  while ((p < row + *len) && (*p != t->sep) && isspace(*p)) {
+    p++;
+  }
+  *len -= p - row;
+  return p;
+}
+
+static void *scan_chunk(void *arg) {
+  CHUNK_T *c = (CHUNK_T *)arg;
+  char    *row = c->start;
+  char    *eol;
+  char    *p;
+  size_t   len;
+
+  while (row < c->end) {
+    if ((eol = memchr(row, '\n', c->end - row)) == NULL) {
+      eol = c->end;
+    }
+    len = eol - row;
+    p = skip_spaces(c->sc->t, row, &len);
+    if (scan_match(c->sc, p, len)) {
+      if (c->show) {
+        if (c->cnt == c->max) {
+          c->max = (c->max ? 2 * c->max : 1024);
+          c->rows = (char **)realloc(c->rows, c->max * sizeof(char *));
+          c->lens = (size_t *)realloc(c->lens, c->max * sizeof(size_t));
+          assert(c->rows && c->lens);
+        }
+        c->rows[c->cnt] = p;
+        c->lens[c->cnt] = len;
+      }
+      c->cnt++;
+    }
+    row = eol + 1;
+  }
+  return NULL;
+}
+
+static int scan_parallel(SCAN_T *sc, DATA_T *d, char show_data) {
+  // Rows of the mapping, found by several threads.
+  // Returns how many qualify.
+  CHUNK_T    *chunks;
+  pthread_t  *tids;
+  char       *start;
+  char       *end;
+  char       *eol;
+  long        n;
+  long        i;
+  long        j;
+  int         count = 0;
+
+  n = sc->t->threads;
+  if (n <= 0) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (n > (long)(d->size / SCAN_CHUNK_MIN)) {
+    n = d->size / SCAN_CHUNK_MIN;
+  }
+  if (n < 1) {
+    n = 1;
+  }
+  chunks = (CHUNK_T *)calloc(n, sizeof(CHUNK_T));
+  tids = (pthread_t *)malloc(n * sizeof(pthread_t));
+  assert(chunks && tids);
+  start = d->base;
+  for (i = 0; i < n; i++) {
+    // Chunks end after a newline
+    end = d->base + d->size;
+    if (i < n - 1) {
+      end = d->base + (d->size * (i + 1)) / n;
+      if (end <= start) {
+        end = start;
+      } else if ((eol = memchr(end - 1, '\n',
+                               d->base + d->size - end + 1)) != NULL) {
+        end = eol + 1;
+      } else {
+        end = d->base + d->size;
+      }
+    }
+    chunks[i].sc = sc;
+    chunks[i].start = start;
+    chunks[i].end = end;
+    chunks[i].show = show_data;
+    start = end;
+  }
+  debug(0, "scan of %ld bytes with %ld thread%s",
+        (long)d->size, n, (n > 1 ? "s" : ""));
+  for (i = 1; i < n; i++) {
+    if (pthread_create(&(tids[i]), NULL, scan_chunk, &(chunks[i]))) {
+      // Done by this thread then
+      (void)scan_chunk(&(chunks[i]));
+    } else {
+      chunks[i].started = 1;
+    }
+  }
+  (void)scan_chunk(&(chunks[0]));
+  for (i = 0; i < n; i++) {
+    if (chunks[i].started) {
+      (void)pthread_join(tids[i], NULL);
+    }
+    for (j = 0; show_data && (j < chunks[i].cnt); j++) {
+      show_row(chunks[i].rows[j], chunks[i].lens[j]);
+    }
+    count += (int)chunks[i].cnt;
+    free(chunks[i].rows);
+    free(chunks[i].lens);
+  }
+  d->at = d->size;
+  free(chunks);
+  free(tids);
+  return count;
+}
+
+static int scan_rows(SCAN_T *sc, FILE *fp, char show_data) {
+  DATA_T   d;
+  char    *row;
+  char    *p;
+  size_t   len;
+  int      count = 0;
+
+  data_open(sc->t, &d, fp, DATA_SEQUENTIAL);
+  data_rewind(&d);
+  if (d.base && (d.size >= 2 * SCAN_CHUNK_MIN)
+      && (sc->t->threads != 1)) {
+    count = scan_parallel(sc, &d, show_data);
+  }
+  // What isn't mapped, all of it if the file isn't
+  while ((row = data_next(&d, &len)) != NULL) {
+    p = skip_spaces(sc->t, row, &len);
+    if (scan_match(sc, p, len)) {
+      // Found
+      if (show_data) {
+        show_row(p, len);
+      }
+      count++;
+    }
+  }
+  data_close(&d);
+  return count;
+}
+
+extern int bpltree_scan(BPLTREE_T *t, char *key, FILE *fp, char show_data) {
   // Search without using the index
   char      *p;
   int        len;
   char      *low_key = NULL;
   char      *high_key = NULL;
-  char       buffer[BUFFER_SIZE];
   short      fields[MAX_FIELDS];
-  char      *good_bits;
-  char       show = 0;
-  int        keylen;
-  int        low_keylen;
-  int        high_keylen;
-  int        linelen;
-  int        hcmp;
-  int        lcmp;
-  char       sep = bpltree_filesep();
-  int        count = 0;
+  SCAN_T     sc;
 
   if (key && fp) {
     (void)memset(fields, -1, sizeof(short) * MAX_FIELDS);
-    rewind(fp);
     // Support of range scans: a, b - a to b, inclusive
     //                         ,b   - smaller than b or equal
     //                         a,   - greater than b or equal
@@ -551,7 +1285,7 @@ extern int bpltree_scan(char *key, FILE *fp, char show_data) {
         return -1;
       }
       high_key = key;
-      if (prepare_scan(high_key, fields) == -1) {
+      if (prepare_scan(t, high_key, fields) == -1) {
         printf("%s\n", bpltree_err_msg());
         return -1;
       }
@@ -562,7 +1296,7 @@ extern int bpltree_scan(char *key, FILE *fp, char show_data) {
           // Lower-bound scan
           *p = '\0';
           low_key = key;
-          if (prepare_scan(low_key, fields) == -1) {
+          if (prepare_scan(t, low_key, fields) == -1) {
             printf("%s\n", bpltree_err_msg());
             return -1;
           }
@@ -574,137 +1308,47 @@ extern int bpltree_scan(char *key, FILE *fp, char show_data) {
           }
           low_key = key;
           high_key = p;
-          if (prepare_scan(low_key, fields) == -1) {
+          if (prepare_scan(t, low_key, fields) == -1) {
             printf("%s\n", bpltree_err_msg());
             return -1;
           }
-          if (prepare_scan(high_key, fields) == -1) {
+          if (prepare_scan(t, high_key, fields) == -1) {
             printf("%s\n", bpltree_err_msg());
             return -1;
           }
         }
       } else {
         // Single key search
-        if (prepare_scan(key, fields) == -1) {
+        if (prepare_scan(t, key, fields) == -1) {
           printf("%s\n", bpltree_err_msg());
           return -1;
         }
-        keylen = strlen(key);
-       /*
-        debug(0, "keylen = %d", keylen);
-        if (debugging()) {
-          int i;
-          for (i = 0; i < MAX_FIELDS; i++) {
-            if (i) {
-              debug_no_nl(0, ",");
-            }
-            debug_no_nl(0, "%hd", fields[i]);
-          }
-          debug(0, "");
-        }
-        */
-        while (fgets(buffer, BUFFER_SIZE, fp)) {
-          p = buffer;
-          while (*p && (*p != sep) && isspace(*p)) {
-            p++;
-          }
-          good_bits = rebuild_line(p, fields);
-          linelen = strlen(good_bits);
-          //debug(0, "[%s] (%d)", good_bits, strlen(good_bits));
-          if ((keylen && (strncmp(key, good_bits, linelen) == 0))
-              || (!keylen && !*good_bits)) {
-            // Found 
-            len = strlen(p);
-            while (isspace(p[len-1])) {
-              len--;
-            }
-            p[len] = '\0';
-            if (show_data) {
-              printf("%s\n", p);
-            }
-            count++;
-          }
-        }
-        return count;
       }
     }
-    // Range scans here
-    if (bpltree_numeric()) {
-      if (low_key) {
-        if (high_key) {
-          debug(0, "range scan from %d to %d",
-                  (int)low_key, (int)high_key);
-        } else {
-          debug(0, "range scan from %d to greatest",
-                  (int)low_key);
-        }
-      } else {
-        debug(0, "range scan from smallest to %d",
-                 (int)high_key);
-      }
+    sc.t = t;
+    sc.fields = fields;
+    sc.key = NULL;
+    sc.low_key = low_key;
+    sc.high_key = high_key;
+    sc.keylen = 0;
+    sc.low_keylen = 0;
+    sc.high_keylen = 0;
+    if (!low_key && !high_key) {
+      sc.key = key;
+      sc.keylen = strlen(key);
     } else {
+      // Range scans here - bounds are text, numeric or not
       debug(0, "range scan from %s to %s",
             (low_key ? low_key : "smallest"),
             (high_key ? high_key : "greatest"));
-    }
-    if (low_key) {
-      low_keylen = strlen(low_key);
-    }
-    if (high_key) {
-      high_keylen = strlen(high_key);
-    }
-    /*
-    if (debugging()) {
-      int i;
-      for (i = 0; i < MAX_FIELDS; i++) {
-        if (i) {
-          debug_no_nl(0, ",");
-        }
-        debug_no_nl(0, "%hd", fields[i]);
-      }
-      debug(0, "");
-    }
-    */
-    while (fgets(buffer, BUFFER_SIZE, fp)) {
-      show = 0;
-      p = buffer;
-      while (*p && (*p != sep) && isspace(*p)) {
-        p++;
-      }
-      good_bits = rebuild_line(p, fields);
       if (low_key) {
-        lcmp = strncmp(good_bits, low_key, low_keylen);
-        if (lcmp >= 0) {
-          if (high_key) {
-            // Bounded
-            hcmp = strncmp(good_bits, high_key, high_keylen);
-            if ((lcmp >= 0) && (hcmp <= 0)) {
-              show = 1;
-            } 
-          } else {
-            if (lcmp >= 0) {
-              show = 1;
-            }
-          }
-        }
-      } else {
-        hcmp = strncmp(good_bits, high_key, high_keylen);
-        if (hcmp <= 0) {
-          show = 1;
-        }
+        sc.low_keylen = strlen(low_key);
       }
-      if (show) {
-        count++;
-        if (show_data) {
-          len = strlen(p);
-          while (isspace(p[len-1])) {
-            len--;
-          }
-          p[len] = '\0';
-          printf("%s\n", p);
-        }
+      if (high_key) {
+        sc.high_keylen = strlen(high_key);
       }
     }
+    return scan_rows(&sc, fp, show_data);
   }
-  return count;
+  return 0;
 }
@@ -0,0 +1,149 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_show.c
+ *
+ *  Display of nodes and of the tree, on the standard output.
+ *
+ *  Part of the library, because insertions and deletions trace
+ *  the nodes they change when debugging is on. What is shown
+ *  (node ids, empty slots and links) is set by the caller.
+ *
+ * ----------------------------------------------------------------- */
+#include <stdio.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+
+static char G_extended = 0;  // Empty slots, parents and next leaves
+static char G_id = 1;        // Node ids
+
+extern void  bpltree_show_extended(char on) {
+   G_extended = on;
+}
+
+extern void  bpltree_show_ids(char on) {
+   G_id = on;
+}
+
+extern void  bpltree_show_node(BPLTREE_T *t, NODE_T *n, short indent) {
+   short i;
+   char  buff[KEY_TEXTLEN];
+
+   assert(n);
+   if (G_id) {
+     printf("%3d-", n->id);
+   }
+   putchar('[');
+   if (!n->is_leaf) {
+     if (!G_extended) {
+       for (i = 1; i <= n->keycnt; i++) {
+         if (i > 1) {
+           putchar(' ');
+         }
+         printf("%s", bpltree_keytext(t, n->node.internal.k[i].key,
+                                      buff, KEY_TEXTLEN));
+         if (i < n->keycnt) {
+           putchar(',');
+         }
+       }
+     } else {
+       // Internal node, not extended
+       for (i = 0; i <= bpltree_maxkeys(t); i++) {
+         if (n->node.internal.k[i].key) {
+           printf("%s", bpltree_keytext(t, n->node.internal.k[i].key,
+                                        buff, KEY_TEXTLEN));
+         } else {
+           if (i) {
+             putchar('*');
+           }
+         }
+         if (n->node.internal.k[i].bigger) {
+           if (G_id) {
+             printf("<%hd>", (n->node.internal.k[i].bigger)->id);
+           } else {
+             putchar(':');
+           }
+         } else {
+           putchar('~');
+         }
+       }
+       if (n->parent) {
+         printf("(^%hd)", (n->parent)->id);
+       }
+     }
+   } else {
+     // Leaf node
+     short max_shown = (G_extended ? bpltree_maxkeys(t) : n->keycnt);
+     for (i = 0; i < max_shown; i++) {
+       if (i > 0) {
+         if (indent) {
+           for (short k = 0; k < indent; k++) {
+             putchar(' ');
+           }
+         }
+         if (G_id) {
+           for (short k = 0; k < 4; k++) {
+             putchar(' ');
+           }
+         }
+         putchar(' ');  // For the square bracket
+       }
+       printf("%s", bpltree_keytext(t, n->node.leaf.k[i].key,
+                                    buff, KEY_TEXTLEN));
+       if (_is_posting(n->node.leaf.k[i].pos)) {
+         printf("\t(%ld positions)", posting_count(n->node.leaf.k[i].pos));
+       } else {
+         printf("\t%010lu", (unsigned long)(n->node.leaf.k[i].pos));
+       }
+       if ((i < max_shown-1) || G_extended) {
+         putchar('\n');
+       }
+     }
+     if (G_extended && n->parent) {
+       if (indent) {
+         for (short k = 0; k <= (indent + (G_id ? 4 : 0)); k++) {
+           putchar(' ');
+         }
+       }
+       printf("(^%hd)", (n->parent)->id);
+     }
+     if (G_extended && _is_leaf(n)) {
+       if (n->node.leaf.next) {
+         printf("(->%hd)", (n->node.leaf.next)->id);
+       } else {
+         printf("(->*)");
+       }
+     }
+   }
+   printf("]\n");
+   fflush(stdout);
+}
+
+extern void  bpltree_display(BPLTREE_T *t, NODE_T *n, int blanks) {
+  if (n) {
+    int  i;
+
+    for (i = 1; i <= blanks; i++) {
+      putchar(' ');
+    }
+    bpltree_show_node(t, n, (n->is_leaf ? blanks : 0));
+    if (!n->is_leaf) {
+      for (i = 0; i <= n->keycnt; i++) {
+        bpltree_display(t, n->node.internal.k[i].bigger, blanks + 3);
+      }
+    }
+  }                             /* End of if */
+  fflush(stdout);
+}                               /* End of bpltree_display() */
+
+extern int  bpltree_show_tree(BPLTREE_T *t) {
+  // The whole tree. Image and paged tree nodes aren't tree
+  // nodes: returns -1 with the error set instead.
+  if (t->image) {
+    bpltree_err_seterr(image_err(t), NULL);
+    return -1;
+  }
+  bpltree_display(t, bpltree_root(t), 0);
+  return 0;
+}
@@ -0,0 +1,218 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_simd.c
+ *
+ *  Vector search of numeric keys in a node, and vector splitting
+ *  of rows into fields.
+ *
+ *  In a numeric tree, the prefix array of a node holds the keys
+ *  themselves (see bpltree_keyprefix()), so finding a slot comes
+ *  down to counting how many prefixes are smaller than the one
+ *  searched - which can be done 4 (AVX2) or 2 (SSE4.2) slots at
+ *  a time with a compare and a movemask.
+ *
+ *  Rows of the text file are cut into fields when they are
+ *  indexed and when they are scanned. Comparing 32 (AVX2) or 16
+ *  (SSE2) bytes at a time with the separator and with the end
+ *  of line gives masks of where fields end, in one pass over
+ *  the row and without copying it.
+ *
+ *  Kernels are picked once, according to what the processor
+ *  supports.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "bpltree.h"
+#include "debug.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86
+#endif
+
+// Prefixes are unsigned, vector compares are signed
+#define SIGN_BIT   0x8000000000000000ULL
+
+typedef short (*COUNT_FUNC_T)(PREFIX_T *p, short cnt, PREFIX_T key);
+typedef short (*SPLIT_FUNC_T)(char *row, size_t len, char sep,
+                              unsigned int *ends, short max,
+                              size_t *rowlen);
+
+static short count_scalar(PREFIX_T *p, short cnt, PREFIX_T key) {
+    short i;
+    short smaller = 0;
+
+    for (i = 0; i < cnt; i++) {
+      smaller += (p[i] < key);
+    }
+    return smaller;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse4.2")))
+static short count_sse42(PREFIX_T *p, short cnt, PREFIX_T key) {
+    __m128i k = _mm_set1_epi64x((long long)(key ^ SIGN_BIT));
+    __m128i sign = _mm_set1_epi64x((long long)SIGN_BIT);
+    __m128i v;
+    short   i;
+    short   smaller = 0;
+
+    for (i = 0; i + 2 <= cnt; i += 2) {
+      v = _mm_xor_si128(_mm_loadu_si128((__m128i *)&(p[i])), sign);
+      smaller += __builtin_popcount(
+                   _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, v))));
+    }
+    return smaller + count_scalar(&(p[i]), cnt - i, key);
+}
+
+__attribute__((target("avx2")))
+static short count_avx2(PREFIX_T *p, short cnt, PREFIX_T key) {
+    __m256i k = _mm256_set1_epi64x((long long)(key ^ SIGN_BIT));
+    __m256i sign = _mm256_set1_epi64x((long long)SIGN_BIT);
+    __m256i v;
+    short   i;
+    short   smaller = 0;
+
+    for (i = 0; i + 4 <= cnt; i += 4) {
+      v = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)&(p[i])), sign);
+      smaller += __builtin_popcount(
+              _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, v))));
+    }
+    return smaller + count_scalar(&(p[i]), cnt - i, key);
+}
+#endif
+
+static short split_from(char *row, size_t i, size_t len, char sep,
+                        unsigned int *ends, short n, short max,
+                        size_t *rowlen) {
+    // Byte by byte from i, n fields found so far
+    for (; (i < len) && (row[i] != '\n'); i++) {
+      if ((row[i] == sep) && (n < max - 1)) {
+        ends[n++] = (unsigned int)i;
+      }
+    }
+    ends[n++] = (unsigned int)i;
+    *rowlen = i;
+    return n;
+}
+
+static short split_scalar(char *row, size_t len, char sep,
+                          unsigned int *ends, short max, size_t *rowlen) {
+    return split_from(row, 0, len, sep, ends, 0, max, rowlen);
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static short split_sse2(char *row, size_t len, char sep,
+                        unsigned int *ends, short max, size_t *rowlen) {
+    __m128i       s = _mm_set1_epi8(sep);
+    __m128i       nl = _mm_set1_epi8('\n');
+    __m128i       v;
+    unsigned int  m;
+    unsigned int  eol;
+    size_t        i;
+    short         n = 0;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+      v = _mm_loadu_si128((__m128i *)(row + i));
+      m = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, s));
+      eol = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+      if (eol) {
+        // Separators before the end of the row only
+        m &= (eol & -eol) - 1;
+      }
+      while (m && (n < max - 1)) {
+        ends[n++] = (unsigned int)(i + __builtin_ctz(m));
+        m &= m - 1;
+      }
+      if (eol) {
+        i += __builtin_ctz(eol);
+        ends[n++] = (unsigned int)i;
+        *rowlen = i;
+        return n;
+      }
+    }
+    return split_from(row, i, len, sep, ends, n, max, rowlen);
+}
+
+__attribute__((target("avx2")))
+static short split_avx2(char *row, size_t len, char sep,
+                        unsigned int *ends, short max, size_t *rowlen) {
+    __m256i       s = _mm256_set1_epi8(sep);
+    __m256i       nl = _mm256_set1_epi8('\n');
+    __m256i       v;
+    unsigned int  m;
+    unsigned int  eol;
+    size_t        i;
+    short         n = 0;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+      v = _mm256_loadu_si256((__m256i *)(row + i));
+      m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, s));
+      eol = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+      if (eol) {
+        m &= (eol & -eol) - 1;
+      }
+      while (m && (n < max - 1)) {
+        ends[n++] = (unsigned int)(i + __builtin_ctz(m));
+        m &= m - 1;
+      }
+      if (eol) {
+        i += __builtin_ctz(eol);
+        ends[n++] = (unsigned int)i;
+        *rowlen = i;
+        return n;
+      }
+    }
+    return split_from(row, i, len, sep, ends, n, max, rowlen);
+}
+#endif
+
+static COUNT_FUNC_T   G_count = count_scalar;
+static SPLIT_FUNC_T   G_split = split_scalar;
+static pthread_once_t G_picked = PTHREAD_ONCE_INIT;
+
+static void pick_kernel(void) {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      debug(0, "numeric node search and row splitting: AVX2");
+      G_count = count_avx2;
+      G_split = split_avx2;
+      return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+      debug(0, "row splitting: SSE2");
+      G_split = split_sse2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+      debug(0, "numeric node search: SSE4.2");
+      G_count = count_sse42;
+      return;
+    }
+#endif
+    debug(0, "numeric node search: scalar");
+}
+
+extern short bpltree_numcount(PREFIX_T *p, short cnt, PREFIX_T key) {
+    // Number of prefixes among the cnt ones starting at p
+    // that are smaller than key
+    (void)pthread_once(&G_picked, pick_kernel);
+    return G_count(p, cnt, key);
+}
+
+extern short bpltree_fieldsplit(char *row, size_t len, char sep,
+                                unsigned int *ends, short max,
+                                size_t *rowlen) {
+    // Cuts the row (which ends at the first '\n', or after len
+    // bytes) into at most max fields: ends[i] is where field i
+    // ends, the next one starts one byte further, the last one
+    // takes what remains. Returns the number of fields (at
+    // least one), rowlen is set to the length of the row.
+    (void)pthread_once(&G_picked, pick_kernel);
+    return G_split(row, len, sep, ends, max, rowlen);
+}
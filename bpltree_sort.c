@@ -0,0 +1,179 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_sort.c
+ *
+ *  Parallel sort of (key, position) pairs before building
+ *  a tree bottom-up.
+ *
+ *  The array is cut into one run per core, each run is sorted
+ *  by its own thread, then runs are merged. Duplicates can only
+ *  be told for sure during the merge, which is where they are
+ *  reported.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "debug.h"
+
+#define MIN_RUN     4096   // Not worth starting a thread for less
+#define MAX_RUNS      64
+
+typedef struct run_t {
+           KEY_POS_T *k;
+           long       cnt;
+           long       cur;   // Next entry to merge
+        } RUN_T;
+
+static int keypos_cmp(const void *a, const void *b) {
+    // Duplicate keys (if accepted) come in file order
+    KEY_POS_T *x = (KEY_POS_T *)a;
+    KEY_POS_T *y = (KEY_POS_T *)b;
+    int        cmp = bpltree_keycmp(x->key, y->key);
+
+    if (cmp == 0) {
+      cmp = (x->pos < y->pos ? -1 : (x->pos > y->pos ? 1 : 0));
+    }
+    return cmp;
+}
+
+static void *sort_run(void *arg) {
+    RUN_T *r = (RUN_T *)arg;
+
+    qsort(r->k, r->cnt, sizeof(KEY_POS_T), keypos_cmp);
+    return NULL;
+}
+
+static void dupl_error(BPLTREE_T *t, char *key) {
+    char buff[KEY_TEXTLEN];
+
+    bpltree_err_seterr(BPLT_ERR_DUPL,
+                       bpltree_keytext(t, key, buff, KEY_TEXTLEN));
+}
+
+static int run_cmp(RUN_T *runs, short a, short b) {
+    return keypos_cmp(&(runs[a].k[runs[a].cur]), &(runs[b].k[runs[b].cur]));
+}
+
+static void sift_down(RUN_T *runs, short *heap, short heapcnt, short i) {
+    // heap[] holds indexes of runs, smallest current key first
+    short child;
+    short tmp;
+
+    while ((child = 2 * i + 1) < heapcnt) {
+      if ((child + 1 < heapcnt)
+          && (run_cmp(runs, heap[child+1], heap[child]) < 0)) {
+        child++;
+      }
+      if (run_cmp(runs, heap[i], heap[child]) <= 0) {
+        break;
+      }
+      tmp = heap[i];
+      heap[i] = heap[child];
+      heap[child] = tmp;
+      i = child;
+    }
+}
+
+static int merge_runs(BPLTREE_T *t, RUN_T *runs, short runcnt,
+                      KEY_POS_T *out) {
+    // k-way merge of sorted runs into out.
+    // Returns -1 as soon as a duplicate is met.
+    short  heap[MAX_RUNS];
+    short  heapcnt = 0;
+    short  i;
+    long   n = 0;
+    RUN_T *r;
+
+    for (i = 0; i < runcnt; i++) {
+      if (runs[i].cnt) {
+        heap[heapcnt++] = i;
+      }
+    }
+    for (i = heapcnt / 2 - 1; i >= 0; i--) {
+      sift_down(runs, heap, heapcnt, i);
+    }
+    while (heapcnt) {
+      r = &(runs[heap[0]]);
+      if (n && (bpltree_keycmp(out[n-1].key, r->k[r->cur].key) == 0)
+          && (!t->dupl || (out[n-1].pos == r->k[r->cur].pos))) {
+        dupl_error(t, r->k[r->cur].key);
+        return -1;
+      }
+      out[n++] = r->k[r->cur++];
+      if (r->cur == r->cnt) {
+        heap[0] = heap[--heapcnt];
+      }
+      sift_down(runs, heap, heapcnt, 0);
+    }
+    return 0;
+}
+
+extern int sort_keys(BPLTREE_T *t, KEY_POS_T *kp, long cnt) {
+    // Sorts kp in place. Returns 0 if OK, -1 if
+    // duplicate keys were found (duplicate pairs if
+    // the tree accepts duplicate keys).
+    RUN_T      runs[MAX_RUNS];
+    pthread_t  th[MAX_RUNS];
+    char       started[MAX_RUNS];
+    short      runcnt;
+    short      i;
+    long       ncpu;
+    long       start;
+    KEY_POS_T *out;
+    int        ret;
+
+    if ((kp == NULL) || (cnt < 2)) {
+      return 0;
+    }
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > MAX_RUNS) {
+      ncpu = MAX_RUNS;
+    }
+    runcnt = (short)(cnt / MIN_RUN);
+    if (runcnt > ncpu) {
+      runcnt = (short)ncpu;
+    }
+    if (runcnt < 1) {
+      runcnt = 1;
+    }
+    debug(0, "sorting %ld keys in %hd run%s", cnt, runcnt,
+          (runcnt > 1 ? "s" : ""));
+    start = 0;
+    for (i = 0; i < runcnt; i++) {
+      runs[i].k = &(kp[start]);
+      runs[i].cnt = cnt / runcnt + (i < cnt % runcnt ? 1 : 0);
+      runs[i].cur = 0;
+      start += runs[i].cnt;
+    }
+    // The current thread sorts the first run
+    for (i = 1; i < runcnt; i++) {
+      started[i] = 1;
+      if (pthread_create(&(th[i]), NULL, sort_run, &(runs[i])) != 0) {
+        // No thread - do it ourselves
+        debug(0, "cannot start thread for run %hd", i);
+        started[i] = 0;
+        (void)sort_run(&(runs[i]));
+      }
+    }
+    (void)sort_run(&(runs[0]));
+    for (i = 1; i < runcnt; i++) {
+      if (started[i]) {
+        (void)pthread_join(th[i], NULL);
+      }
+    }
+    out = (KEY_POS_T *)malloc(cnt * sizeof(KEY_POS_T));
+    assert(out);
+    if ((ret = merge_runs(t, runs, runcnt, out)) == 0) {
+      (void)memcpy(kp, out, cnt * sizeof(KEY_POS_T));
+    }
+    free(out);
+    return ret;
+}
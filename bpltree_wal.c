@@ -0,0 +1,542 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                         bpltree_wal.c
+ *
+ *  Write-ahead log.
+ *
+ *  Every successful insertion or deletion is appended to a log
+ *  file before the caller is told it is done, so that changes
+ *  survive a crash. Records are appended in memory while the
+ *  leaf that changed is still latched - two changes to the same
+ *  key are therefore logged in the order they were made - and
+ *  written once the latches are gone. Writing waits for the
+ *  disk, and while one thread waits the others append: the
+ *  next thread to write writes for all of them, with a single
+ *  sync (group commit).
+ *
+ *  Once enough has been logged, the tree is saved as an image
+ *  (see bpltree_image.c), the checkpoint, by a thread of its
+ *  own so that the writer that crossed the mark doesn't wait
+ *  for it. Saving reads a
+ *  snapshot and writers go on meanwhile, so the checkpoint
+ *  holds all changes logged before it started and maybe some
+ *  logged after. The log is then cut so as to begin where the
+ *  checkpoint started. Recovery loads the checkpoint and
+ *  replays the log: replaying a change that the checkpoint
+ *  already holds fails harmlessly, and because changes to one
+ *  key (to one position of a key, with duplicates) alternate
+ *  between insertion and deletion, the last one always wins.
+ *
+ *  Log position (LSN) n is byte n of the log since it was first
+ *  created, whatever has been cut since. The log file starts
+ *  with the position of its first record; the checkpoint is
+ *  <log>.ckpt.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+#include "debug.h"
+
+#define LOG_MAGIC         "BPLTLOG1"
+#define CHECKPOINT_BYTES  (16 * 1024 * 1024)  // Logged between checkpoints
+#define MAX_RECORD_KEY    (1024 * 1024)       // Anything longer is garbage
+
+typedef struct log_hdr_t {
+           char   magic[8];
+           off_t  base;          // Position of the first record
+         } LOG_HDR_T;
+
+typedef struct log_rec_t {
+           unsigned int   sum;   // Of the record, key included
+           unsigned int   len;   // Of the key, which follows
+           char           op;
+           unsigned long  val;
+         } LOG_REC_T;
+
+typedef struct wal_t {
+           int              fd;
+           char            *fname;
+           off_t            base;         // Position at the start of fd
+           off_t            appended;     // After the last record
+           off_t            durable;      // What comes before is on disk
+           off_t            checkpointed; // Where the last checkpoint began
+           char            *buf;          // Appended, not written yet
+           size_t           used;
+           size_t           max;
+           char            *spare;        // Being written
+           size_t           sparemax;
+           char             flushing;     // Someone writes
+           char             checkpointing;
+           char             background;   // Thread to join
+           pthread_t        checkpointer;
+           char             failed;       // Nothing can be logged any more
+           long             syncs;
+           long             records;
+           pthread_mutex_t  lock;
+           pthread_cond_t   done;         // Flushing is over
+           pthread_cond_t   ckpt_done;    // Checkpointing is over
+         } WAL_T;
+
+static char *path(char *fname, char *suffix) {
+    char *p = (char *)malloc(strlen(fname) + strlen(suffix) + 1);
+
+    assert(p);
+    strcpy(p, fname);
+    strcat(p, suffix);
+    return p;
+}
+
+static unsigned int checksum(LOG_REC_T *rec, char *key) {
+    // FNV-1a of the record with sum set to 0, then of the key
+    unsigned int   h = 2166136261u;
+    unsigned int   sum = rec->sum;
+    unsigned char *p;
+    size_t         i;
+
+    rec->sum = 0;
+    p = (unsigned char *)rec;
+    for (i = 0; i < sizeof(LOG_REC_T); i++) {
+      h = (h ^ p[i]) * 16777619u;
+    }
+    rec->sum = sum;
+    p = (unsigned char *)key;
+    for (i = 0; i < rec->len; i++) {
+      h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int sync_dir(char *fname) {
+    // Makes a file creation or renaming durable
+    char *copy = strdup(fname);
+    int   fd;
+    int   ret = -1;
+
+    assert(copy);
+    if ((fd = open(dirname(copy), O_RDONLY)) != -1) {
+      ret = fsync(fd);
+      close(fd);
+    }
+    free(copy);
+    return ret;
+}
+
+static int write_all(int fd, char *buf, size_t len) {
+    ssize_t n;
+
+    while (len) {
+      if ((n = write(fd, buf, len)) <= 0) {
+        return -1;
+      }
+      buf += n;
+      len -= n;
+    }
+    return 0;
+}
+
+extern int bpltree_recover(BPLTREE_T *t, char *logname, long *keycnt) {
+    // Loads the last checkpoint of the changes logged into
+    // logname, if there is one, into an empty tree. Returns 1
+    // if there was one (*keycnt is then set to the number of
+    // keys), 0 if there wasn't (the tree is then loaded as it
+    // was before the log started), -1 if it cannot be read.
+    // bpltree_log() must follow.
+    char *ckpt = path(logname, ".ckpt");
+    int   ret = 0;
+
+    if (access(ckpt, F_OK) == 0) {
+      ret = 1;
+      if ((*keycnt = bpltree_restore(t, ckpt)) < 0) {
+        ret = -1;
+      }
+    }
+    free(ckpt);
+    return ret;
+}
+
+static long replay(BPLTREE_T *t, int fd, off_t *end) {
+    // Applies the records of the log, *end is set to where the
+    // last complete one ends. Returns the number of records.
+    LOG_REC_T  rec;
+    FILE      *fp;
+    char      *key = NULL;
+    size_t     keymax = 0;
+    long       cnt = 0;
+
+    *end = sizeof(LOG_HDR_T);
+    if ((fp = fdopen(dup(fd), "r")) == NULL) {
+      return -1;
+    }
+    (void)fseek(fp, *end, SEEK_SET);
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+      if (rec.len > MAX_RECORD_KEY) {
+        break;
+      }
+      if (rec.len + 1 > keymax) {
+        keymax = rec.len + 1;
+        key = (char *)realloc(key, keymax);
+        assert(key);
+      }
+      if ((fread(key, 1, rec.len, fp) != rec.len)
+          || (checksum(&rec, key) != rec.sum)) {
+        // Torn by a crash
+        break;
+      }
+      key[rec.len] = '\0';
+      // Changes that the checkpoint holds fail
+      if (rec.op == WAL_INSERT) {
+        (void)bpltree_insert(t, key, rec.val);
+      } else if (rec.op == WAL_REMOVE) {
+        (void)bpltree_delete_val(t, key, rec.val);
+      } else {
+        (void)bpltree_delete(t, key);
+      }
+      *end += sizeof(rec) + rec.len;
+      cnt++;
+    }
+    fclose(fp);
+    free(key);
+    bpltree_err_reset();
+    return cnt;
+}
+
+extern long bpltree_log(BPLTREE_T *t, char *logname) {
+    // Logs changes to the tree into logname from now on. If the
+    // log exists, what it holds is first applied to the tree,
+    // which must be as bpltree_recover() left it.
+    // Returns the number of changes applied, -1 if the log
+    // cannot be used.
+    WAL_T      *w;
+    LOG_HDR_T   hdr;
+    struct stat st;
+    off_t       end;
+    long        cnt = 0;
+    int         fd;
+
+    if (t->image) {
+      bpltree_err_seterr(image_err(t), NULL);
+      return -1;
+    }
+    assert(t->wal == NULL);
+    if (((fd = open(logname, O_RDWR | O_CREAT, 0644)) == -1)
+        || (fstat(fd, &st) == -1)) {
+      bpltree_err_seterr(BPLT_ERR_IO, logname);
+      return -1;
+    }
+    if (st.st_size == 0) {
+      memset(&hdr, 0, sizeof(hdr));
+      memcpy(hdr.magic, LOG_MAGIC, sizeof(hdr.magic));
+      hdr.base = 0;
+      end = sizeof(hdr);
+      if (write_all(fd, (char *)&hdr, sizeof(hdr))
+          || fsync(fd) || sync_dir(logname)) {
+        close(fd);
+        bpltree_err_seterr(BPLT_ERR_IO, logname);
+        return -1;
+      }
+    } else {
+      if ((pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+          || memcmp(hdr.magic, LOG_MAGIC, sizeof(hdr.magic))) {
+        close(fd);
+        bpltree_err_seterr(BPLT_ERR_LOG, logname);
+        return -1;
+      }
+      if (((cnt = replay(t, fd, &end)) < 0)
+          || ((end < st.st_size) && ftruncate(fd, end))
+          || (lseek(fd, end, SEEK_SET) == -1)) {
+        close(fd);
+        bpltree_err_seterr(BPLT_ERR_IO, logname);
+        return -1;
+      }
+      debug(0, "%ld change%s replayed from %s", cnt,
+            (cnt > 1 ? "s" : ""), logname);
+    }
+    w = (WAL_T *)calloc(1, sizeof(WAL_T));
+    assert(w);
+    w->fd = fd;
+    w->fname = strdup(logname);
+    w->base = hdr.base;
+    w->appended = hdr.base + end - sizeof(hdr);
+    w->durable = w->appended;
+    w->checkpointed = hdr.base;
+    (void)pthread_mutex_init(&(w->lock), NULL);
+    (void)pthread_cond_init(&(w->done), NULL);
+    (void)pthread_cond_init(&(w->ckpt_done), NULL);
+    t->wal = w;
+    return cnt;
+}
+
+extern off_t wal_append(BPLTREE_T *t, char op, char *key,
+                        unsigned long val) {
+    // Appends a change to the log in memory and returns
+    // the position to pass to wal_commit()
+    WAL_T     *w = t->wal;
+    LOG_REC_T  rec;
+    size_t     len = strlen(key);
+    off_t      lsn;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.len = (unsigned int)len;
+    rec.op = op;
+    rec.val = val;
+    rec.sum = checksum(&rec, key);
+    (void)pthread_mutex_lock(&(w->lock));
+    while (w->used + sizeof(rec) + len > w->max) {
+      w->max = (w->max ? 2 * w->max : 4096);
+      w->buf = (char *)realloc(w->buf, w->max);
+      assert(w->buf);
+    }
+    memcpy(w->buf + w->used, &rec, sizeof(rec));
+    memcpy(w->buf + w->used + sizeof(rec), key, len);
+    w->used += sizeof(rec) + len;
+    w->appended += sizeof(rec) + len;
+    w->records++;
+    lsn = w->appended;
+    (void)pthread_mutex_unlock(&(w->lock));
+    return lsn;
+}
+
+static void flush(WAL_T *w) {
+    // Called with the lock held. Writes what has been
+    // appended so far, without the lock while writing.
+    char   *buf = w->buf;
+    size_t  max = w->max;
+    size_t  used = w->used;
+    off_t   upto = w->appended;
+    char    failed;
+
+    w->flushing = 1;
+    w->buf = w->spare;
+    w->max = w->sparemax;
+    w->used = 0;
+    (void)pthread_mutex_unlock(&(w->lock));
+    failed = (write_all(w->fd, buf, used) || fdatasync(w->fd));
+    (void)pthread_mutex_lock(&(w->lock));
+    w->spare = buf;
+    w->sparemax = max;
+    if (failed) {
+      w->failed = 1;
+    } else {
+      w->durable = upto;
+      w->syncs++;
+    }
+    w->flushing = 0;
+    (void)pthread_cond_broadcast(&(w->done));
+}
+
+static void sync_upto(WAL_T *w, off_t lsn) {
+    // Called with the lock held. Returns once the log is
+    // on disk up to lsn, or cannot be written. Whoever finds
+    // nobody writing writes everything appended so far, for
+    // all the threads waiting.
+    while (!w->failed && (w->durable < lsn)) {
+      if (w->flushing) {
+        (void)pthread_cond_wait(&(w->done), &(w->lock));
+      } else {
+        flush(w);
+      }
+    }
+}
+
+static int rotate(WAL_T *w, off_t lsn) {
+    // Cuts the log, which is on disk up to lsn at least,
+    // so that it starts at lsn. Returns -1 if it cannot, or
+    // if the renaming of the new log cannot be made durable -
+    // the new log is used anyway once renamed.
+    char      *tmp = path(w->fname, ".tmp");
+    char       buf[8192];
+    LOG_HDR_T  hdr;
+    off_t      from;
+    off_t      to;
+    ssize_t    n;
+    int        fd;
+    int        ret = -1;
+    char       renamed = 0;
+
+    // Nobody writes the log while it is copied
+    (void)pthread_mutex_lock(&(w->lock));
+    while (w->flushing) {
+      (void)pthread_cond_wait(&(w->done), &(w->lock));
+    }
+    w->flushing = 1;
+    from = sizeof(hdr) + lsn - w->base;
+    to = sizeof(hdr) + w->durable - w->base;
+    (void)pthread_mutex_unlock(&(w->lock));
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) != -1) {
+      memset(&hdr, 0, sizeof(hdr));
+      memcpy(hdr.magic, LOG_MAGIC, sizeof(hdr.magic));
+      hdr.base = lsn;
+      ret = write_all(fd, (char *)&hdr, sizeof(hdr));
+      while ((ret == 0) && (from < to)) {
+        n = (to - from < (off_t)sizeof(buf) ? to - from : (off_t)sizeof(buf));
+        if ((n = pread(w->fd, buf, n, from)) <= 0) {
+          ret = -1;
+        } else {
+          ret = write_all(fd, buf, n);
+          from += n;
+        }
+      }
+      if ((ret == 0) && (fsync(fd) || rename(tmp, w->fname))) {
+        ret = -1;
+      }
+      if (ret) {
+        close(fd);
+        (void)unlink(tmp);
+      } else {
+        // The log is the new file from now on, whether
+        // the renaming is durable or not
+        renamed = 1;
+        ret = sync_dir(w->fname);
+      }
+    }
+    (void)pthread_mutex_lock(&(w->lock));
+    if (renamed) {
+      close(w->fd);
+      w->fd = fd;
+      w->base = lsn;
+    }
+    w->flushing = 0;
+    (void)pthread_cond_broadcast(&(w->done));
+    (void)pthread_mutex_unlock(&(w->lock));
+    free(tmp);
+    return ret;
+}
+
+static int checkpoint(BPLTREE_T *t) {
+    // Called by the thread that has set checkpointing
+    WAL_T *w = t->wal;
+    char  *tmp = path(w->fname, ".ckpt.tmp");
+    char  *ckpt = path(w->fname, ".ckpt");
+    off_t  lsn;
+    int    ret;
+
+    // Changes logged so far are all in the tree
+    (void)pthread_mutex_lock(&(w->lock));
+    lsn = w->appended;
+    sync_upto(w, lsn);
+    ret = (w->failed ? -1 : 0);
+    (void)pthread_mutex_unlock(&(w->lock));
+    debug(0, "checkpoint from %ld", (long)lsn);
+    if ((ret == 0) && ((ret = bpltree_save(t, tmp)) == 0)) {
+      if (rename(tmp, ckpt) || sync_dir(ckpt) || rotate(w, lsn)) {
+        bpltree_err_seterr(BPLT_ERR_IO, w->fname);
+        ret = -1;
+      }
+    }
+    (void)pthread_mutex_lock(&(w->lock));
+    if (ret == 0) {
+      w->checkpointed = lsn;
+    }
+    w->checkpointing = 0;
+    (void)pthread_cond_broadcast(&(w->ckpt_done));
+    (void)pthread_mutex_unlock(&(w->lock));
+    free(tmp);
+    free(ckpt);
+    return ret;
+}
+
+static void *checkpointer(void *arg) {
+    // Background checkpoint. If it fails, the log goes on
+    // growing and the next commit tries again.
+    BPLTREE_T *t = (BPLTREE_T *)arg;
+
+    if (checkpoint(t)) {
+      debug(0, "checkpoint failed: %s", bpltree_err_msg());
+    }
+    return NULL;
+}
+
+extern int wal_commit(BPLTREE_T *t, off_t lsn) {
+    // Returns once the log is on disk up to lsn, 0 if all is
+    // well (group commit, see sync_upto()). May then start a
+    // checkpoint, which it doesn't wait for.
+    WAL_T *w = t->wal;
+    char   ckpt;
+    int    ret;
+
+    (void)pthread_mutex_lock(&(w->lock));
+    sync_upto(w, lsn);
+    ret = (w->failed ? -1 : 0);
+    if ((ckpt = (!w->failed && !w->checkpointing
+                 && (w->durable - w->checkpointed >= CHECKPOINT_BYTES)))) {
+      w->checkpointing = 1;
+    }
+    (void)pthread_mutex_unlock(&(w->lock));
+    if (ret) {
+      // The change is in the tree already
+      bpltree_err_seterr(BPLT_ERR_UNLOGGED, w->fname);
+    } else if (ckpt) {
+      // Only the thread that set checkpointing gets here;
+      // the previous checkpointer has done its work
+      if (w->background) {
+        (void)pthread_join(w->checkpointer, NULL);
+      }
+      if ((w->background = (pthread_create(&(w->checkpointer), NULL,
+                                           checkpointer, t) == 0)) == 0) {
+        (void)checkpoint(t);
+      }
+    }
+    return ret;
+}
+
+extern int bpltree_checkpoint(BPLTREE_T *t) {
+    // Takes a checkpoint now, once the one being taken, if
+    // any, is over. Returns 0 if successful, -1 otherwise.
+    WAL_T *w = t->wal;
+
+    if (t->image) {
+      // Paged trees aren't logged, their pages are synced
+      return page_checkpoint(t);
+    }
+    if (w == NULL) {
+      bpltree_err_seterr(BPLT_ERR_NOLOG, NULL);
+      return -1;
+    }
+    (void)pthread_mutex_lock(&(w->lock));
+    while (w->checkpointing) {
+      (void)pthread_cond_wait(&(w->ckpt_done), &(w->lock));
+    }
+    w->checkpointing = 1;
+    (void)pthread_mutex_unlock(&(w->lock));
+    return checkpoint(t);
+}
+
+extern void wal_close(WAL_T *w) {
+    // Writes what is left, once the checkpoint being taken,
+    // if any, is over
+    if (w) {
+      if (w->background) {
+        (void)pthread_join(w->checkpointer, NULL);
+      }
+      (void)pthread_mutex_lock(&(w->lock));
+      while (w->flushing) {
+        (void)pthread_cond_wait(&(w->done), &(w->lock));
+      }
+      if (w->used && !w->failed) {
+        flush(w);
+      }
+      (void)pthread_mutex_unlock(&(w->lock));
+      debug(0, "%ld record%s logged with %ld sync%s",
+            w->records, (w->records > 1 ? "s" : ""),
+            w->syncs, (w->syncs > 1 ? "s" : ""));
+      close(w->fd);
+      (void)pthread_mutex_destroy(&(w->lock));
+      (void)pthread_cond_destroy(&(w->done));
+      (void)pthread_cond_destroy(&(w->ckpt_done));
+      free(w->fname);
+      free(w->buf);
+      free(w->spare);
+      free(w);
+    }
+}
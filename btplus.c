@@ -9,6 +9,8 @@ static char *G_btplus_words[] = {
     "autolist",
     "autotree",
     "bye",
+    "checkpoint",
+    "count",
     "del",
     "display",
     "find",
@@ -17,12 +19,17 @@ static char *G_btplus_words[] = {
     "help",
     "hush",
     "id",
+    "iget",
+    "igettime",
     "ins",
     "list",
+    "mget",
+    "mgettime",
     "noid",
     "notrc",
     "quit",
     "rem",
+    "save",
     "scan",
     "scantime",
     "search",
@@ -33,7 +40,7 @@ static char *G_btplus_words[] = {
 
 extern int btplus_search(char *w) {
   int start = 0;
-  int end = BTPLUS_COUNT - 1;
+  int end = BTPLUS_KEYWORDS - 1;
   int mid;
   int pos = BTPLUS_NOT_FOUND;
   int comp;
@@ -44,7 +51,7 @@ extern int btplus_search(char *w) {
       if ((comp = strcasecmp(G_btplus_words[mid], w)) == 0) {
          pos = mid;
          start = end + 1;
-       } else if ((mid < BTPLUS_COUNT - 1)
+       } else if ((mid < BTPLUS_KEYWORDS-1)
                && ((comp = strcasecmp(G_btplus_words[mid+1], w)) == 0)) {
          pos = mid+1;
          start = end + 1;
@@ -61,7 +68,7 @@ extern int btplus_search(char *w) {
 }
 
 extern char *btplus_keyword(int code) {
-  if ((code >= 0) && (code < BTPLUS_COUNT)) {
+  if ((code >= 0) && (code < BTPLUS_KEYWORDS)) {
     return G_btplus_words[code];
   } else {
     return (char *)NULL;
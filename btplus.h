@@ -1,34 +1,41 @@
-#ifndef _BTPLUS_HEADER
+#ifndef BTPLUS_HEADER
 
-#define _BTPLUS_HEADER
+#define BTPLUS_HEADER
 
 #define BTPLUS_NOT_FOUND	-1
 #define BTPLUS_ADD	  0
 #define BTPLUS_AUTOLIST	  1
 #define BTPLUS_AUTOTREE	  2
 #define BTPLUS_BYE	  3
-#define BTPLUS_DEL	  4
-#define BTPLUS_DISPLAY	  5
-#define BTPLUS_FIND	  6
-#define BTPLUS_GET	  7
-#define BTPLUS_GETTIME	  8
-#define BTPLUS_HELP	  9
-#define BTPLUS_HUSH	 10
-#define BTPLUS_ID	 11
-#define BTPLUS_INS	 12
-#define BTPLUS_LIST	 13
-#define BTPLUS_NOID	 14
-#define BTPLUS_NOTRC	 15
-#define BTPLUS_QUIT	 16
-#define BTPLUS_REM	 17
-#define BTPLUS_SCAN	 18
-#define BTPLUS_SCANTIME	 19
-#define BTPLUS_SEARCH	 20
-#define BTPLUS_SHOW	 21
-#define BTPLUS_STOP	 22
-#define BTPLUS_TRC	 23
+#define BTPLUS_CHECKPOINT	  4
+#define BTPLUS_COUNT	  5
+#define BTPLUS_DEL	  6
+#define BTPLUS_DISPLAY	  7
+#define BTPLUS_FIND	  8
+#define BTPLUS_GET	  9
+#define BTPLUS_GETTIME	 10
+#define BTPLUS_HELP	 11
+#define BTPLUS_HUSH	 12
+#define BTPLUS_ID	 13
+#define BTPLUS_IGET	 14
+#define BTPLUS_IGETTIME	 15
+#define BTPLUS_INS	 16
+#define BTPLUS_LIST	 17
+#define BTPLUS_MGET	 18
+#define BTPLUS_MGETTIME	 19
+#define BTPLUS_NOID	 20
+#define BTPLUS_NOTRC	 21
+#define BTPLUS_QUIT	 22
+#define BTPLUS_REM	 23
+#define BTPLUS_SAVE	 24
+#define BTPLUS_SCAN	 25
+#define BTPLUS_SCANTIME	 26
+#define BTPLUS_SEARCH	 27
+#define BTPLUS_SHOW	 28
+#define BTPLUS_STOP	 29
+#define BTPLUS_TRC	 30
 
-#define BTPLUS_COUNT	24
+#define BTPLUS_KEYWORDS	31
 
 extern int   btplus_search(char *w);
 extern char *btplus_keyword(int code);
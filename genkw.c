@@ -28,7 +28,7 @@ static char G_reversed = 0;
 static void gen_search(FILE *fp, char *lowerpre, char *upperpre, char cs) {
     fprintf(fp, "extern int %s_search(char *w) {\n", lowerpre);
     fprintf(fp, "  int start = 0;\n");
-    fprintf(fp, "  int end = %s_COUNT - 1;\n", upperpre);
+    fprintf(fp, "  int end = %s_KEYWORDS - 1;\n", upperpre);
     fprintf(fp, "  int mid;\n");
     fprintf(fp, "  int pos = %s_NOT_FOUND;\n", upperpre);
     fprintf(fp, "  int comp;\n\n");
@@ -39,7 +39,7 @@ static void gen_search(FILE *fp, char *lowerpre, char *upperpre, char cs) {
                 (cs ?"":"case"), lowerpre);
     fprintf(fp, "         pos = mid;\n");
     fprintf(fp, "         start = end + 1;\n");
-    fprintf(fp, "       } else if ((mid < %s_COUNT-1)\n", upperpre);
+    fprintf(fp, "       } else if ((mid < %s_KEYWORDS-1)\n", upperpre);
     fprintf(fp, "               && ((comp = str%scmp(G_%s_words[mid+1], w)) == 0)) {\n",
                 (cs ?"":"case"), lowerpre);
     fprintf(fp, "         pos = mid+1;\n");
@@ -65,7 +65,7 @@ static void gen_search(FILE *fp, char *lowerpre, char *upperpre, char cs) {
       fprintf(fp, "  int i = 0;\n");
       fprintf(fp, "  int comp = 1;\n\n");
       fprintf(fp, "  if (w) {\n");
-      fprintf(fp, "    while ((i < %s_COUNT)\n", upperpre);
+      fprintf(fp, "    while ((i < %s_KEYWORDS)\n", upperpre);
       fprintf(fp, "           && ((comp > 0)\n");
       fprintf(fp, "               || (%s*w%s == %s*(G_%s_words[i])%s))) {\n",
                   (cs?"":"toupper("),
@@ -94,14 +94,14 @@ static void gen_search(FILE *fp, char *lowerpre, char *upperpre, char cs) {
       fprintf(fp, "  int comp = 1;\n\n");
       fprintf(fp, "  if (w) {\n");
       fprintf(fp, "    len = strlen(w);\n");
-      fprintf(fp, "    while ((i < %s_COUNT) && (comp > 0)) {\n", upperpre);
+      fprintf(fp, "    while ((i < %s_KEYWORDS) && (comp > 0)) {\n", upperpre);
       fprintf(fp, "      comp = strn%scmp(G_%s_words[i],w,len);\n",
                 (cs ?"":"case"), lowerpre);
       fprintf(fp, "      i++;\n");
       fprintf(fp, "    }\n");
       fprintf(fp, "    if (comp == 0) {\n");
       fprintf(fp, "      pos = i - 1;\n");
-      fprintf(fp, "      if ((i < %s_COUNT)\n", upperpre);
+      fprintf(fp, "      if ((i < %s_KEYWORDS)\n", upperpre);
       fprintf(fp, "          && (strn%scmp(G_%s_words[i],w,len)==0)) {\n",
                     (cs ?"":"case"), lowerpre);
       fprintf(fp, "         pos = %s_AMBIGUOUS;\n", upperpre);
@@ -112,7 +112,7 @@ static void gen_search(FILE *fp, char *lowerpre, char *upperpre, char cs) {
       fprintf(fp, "}\n\n");
     }
     fprintf(fp, "extern char *%s_keyword(int code) {\n", lowerpre);
-    fprintf(fp, "  if ((code >= 0) && (code < %s_COUNT)) {\n", upperpre);
+    fprintf(fp, "  if ((code >= 0) && (code < %s_KEYWORDS)) {\n", upperpre);
     fprintf(fp, "    return G_%s_words[code];\n", lowerpre);
     fprintf(fp, "  } else {\n");
     fprintf(fp, "    return (char *)NULL;\n");
@@ -256,7 +256,7 @@ int main(int argc, char **argv) {
        }
     }
     fprintf(fc, "    NULL};\n\n");
-    fprintf(fh, "\n#define %s_COUNT\t%d\n\n", uppername, cnt);
+    fprintf(fh, "\n#define %s_KEYWORDS\t%d\n\n", uppername, cnt);
     fprintf(fh, "extern int   %s_search(char *w);\n", lowername);
     if (G_reversed) {
       fprintf(fh, "extern int   %s_best_match(char *w);\n", lowername);
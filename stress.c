@@ -0,0 +1,618 @@
+/* ----------------------------------------------------------------- *
+ *
+ *                            stress.c
+ *
+ *  Stress test of a tree searched while it changes.
+ *
+ *  Writers insert and delete keys while readers look them up
+ *  with bpltree_find_key(), count ranges with bpltree_get() and
+ *  go through ranges with cursors. Writer w owns the keys
+ *  w<w>_<n>, each the key of a row of a scratch file; writers
+ *  work on the same nodes, where their keys meet, but never on
+ *  the same keys. Keys with an even n are put in before anything
+ *  starts and never deleted; keys with an odd n come and go, and
+ *  their writer knows which are in the tree. Readers check what
+ *  doesn't depend on timing:
+ *    - keys with an even n are always found, keys past the
+ *      last n never are,
+ *    - a range comes in key order, with all its even keys,
+ *      each with the offset of its row,
+ *    - get finds at least the even keys of a range, at most
+ *      all of them.
+ *  Every so often, a writer pins a snapshot (bpltree_snapshot())
+ *  and opens a cursor on its keys, then makes a batch of changes:
+ *  the cursor, and get while the snapshot is pinned, must see its
+ *  keys exactly as they were before the batch.
+ *  Once everybody has stopped, the tree must hold exactly what
+ *  the writers say.
+ *
+ *  Before anything starts, batches of keys on two fields, some on
+ *  the first field only, are looked up with bpltree_mget() in a
+ *  tree of their own: each must find every row that one of its
+ *  keys matches, once.
+ *
+ *  With -p, the tree is a paged tree (see bpltree_page.c) kept in
+ *  a new file, read and written through a buffer pool of a few
+ *  frames (-P), so that pages keep being evicted. Paged trees
+ *  have no cursors or snapshots: readers look keys up and count
+ *  ranges with bpltree_get(). Once everybody has stopped, the
+ *  tree is also checked after being closed and opened again.
+ *
+ *  Usage: stress [-w writers] [-r readers] [-s seconds]
+ *                [-k keys per node] [-p file [-P frames]]
+ *  Exits with 1 if anything went wrong.
+ *
+ * ----------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <assert.h>
+
+#include "bpltree.h"
+#include "bpltree_err.h"
+
+#define OPTIONS        "w:r:s:k:p:P:"
+#define WRITER_KEYS    4096   // n goes from 0 to WRITER_KEYS - 1
+#define ROW_LEN          11   // w<2 digits>_<6 digits>\n
+#define KEY_LEN          32
+#define RANGE_MAX       300   // Keys in a range that is read
+#define BATCH            16   // Taken at once from a cursor
+#define MAX_REPORTS      20   // Failures shown
+#define SNAPSHOT_EVERY  500   // Changes between snapshot checks
+#define SNAPSHOT_BATCH  200   // Changes made behind a snapshot
+#define PAGED_FRAMES     64   // Default buffer pool of a paged tree
+#define MGET_BATCHES    200   // Checked before anything starts
+#define MGET_KEYS         6   // At most, in a batch
+#define MGET_FIRST        5   // Values of the first field,
+#define MGET_SECOND       3   // and of the second one
+
+static BPLTREE_T  *G_t = NULL;
+static FILE       *G_fp = NULL;
+static short       G_writers = 4;
+static char      **G_present;      // By writer and n
+static char       *G_paged = NULL; // File of a paged tree
+static char        G_stop = 0;
+static long        G_errors = 0;
+static long        G_reads = 0;
+static long        G_writes = 0;
+
+static void failure(char *fmt, ...) {
+    va_list ap;
+
+    if (__atomic_add_fetch(&G_errors, 1, __ATOMIC_SEQ_CST) <= MAX_REPORTS) {
+      va_start(ap, fmt);
+      vfprintf(stderr, fmt, ap);
+      va_end(ap);
+      fputc('\n', stderr);
+    }
+}
+
+static char stopped(void) {
+    return __atomic_load_n(&G_stop, __ATOMIC_ACQUIRE);
+}
+
+static void key_text(char *buf, short w, long n) {
+    sprintf(buf, "w%02hd_%06ld", w, n);
+}
+
+static off_t key_row(short w, long n) {
+    return (off_t)(w * WRITER_KEYS + n) * ROW_LEN;
+}
+
+static char key_parse(char *text, short *w, long *n) {
+    return (sscanf(text, "w%hd_%ld", w, n) == 2);
+}
+
+static void range_text(char *buf, short w, long lo, long hi) {
+    // As bpltree_get() takes it
+    key_text(buf, w, lo);
+    strcat(buf, ",");
+    key_text(buf + strlen(buf), w, hi);
+}
+
+static long evens(long lo, long hi) {
+    // Even numbers from lo to hi
+    return (hi < lo ? 0 : hi / 2 - (lo + 1) / 2 + 1);
+}
+
+static char change(short w, unsigned int *seed) {
+    // Inserts or deletes a key with an odd n. Returns 0
+    // if the tree didn't do what it was asked.
+    char key[KEY_LEN];
+    long n = 2 * (rand_r(seed) % (WRITER_KEYS / 2)) + 1;
+
+    key_text(key, w, n);
+    if (G_present[w][n]) {
+      if (bpltree_delete(G_t, key)) {
+        failure("%s cannot be deleted: %s", key, bpltree_err_msg());
+        return 0;
+      }
+      G_present[w][n] = 0;
+    } else {
+      if (bpltree_insert(G_t, key, (unsigned long)key_row(w, n))) {
+        failure("%s cannot be inserted: %s", key, bpltree_err_msg());
+        return 0;
+      }
+      G_present[w][n] = 1;
+    }
+    return 1;
+}
+
+static long rows_of(short w, long lo, long hi) {
+    char range[2 * KEY_LEN];
+
+    range_text(range, w, lo, hi);
+    return bpltree_get(G_t, range, G_fp, 0);
+}
+
+static void lookup(short w, long n) {
+    char     key[KEY_LEN];
+    KEYLOC_T loc;
+
+    if (G_paged) {
+      // Nodes aren't in memory
+      if (rows_of(w, n & ~1L, n & ~1L) != 1) {
+        failure("get: w%02hd_%06ld not found", w, n & ~1L);
+      }
+      if (rows_of(w, WRITER_KEYS + n, WRITER_KEYS + n) != 0) {
+        failure("get: w%02hd_%06ld found", w, WRITER_KEYS + n);
+      }
+      return;
+    }
+    key_text(key, w, n & ~1L);
+    loc = bpltree_find_key(G_t, key);
+    if (loc.n == NULL) {
+      failure("find: %s not found", key);
+    }
+    key_text(key, w, WRITER_KEYS + n);
+    loc = bpltree_find_key(G_t, key);
+    if (loc.n != NULL) {
+      failure("find: %s found", key);
+    }
+}
+
+static void count(short w, long lo, long hi) {
+    long cnt = rows_of(w, lo, hi);
+
+    if ((cnt < evens(lo, hi)) || (cnt > hi - lo + 1)) {
+      failure("get: %ld rows from %ld to %ld of writer %hd",
+              cnt, lo, hi, w);
+    }
+}
+
+static long scan(CURSOR_T *c, short w, long lo, long hi, char desc,
+                 char *present) {
+    // Goes through what the cursor hands out, which must be
+    // keys of writer w from lo to hi in order, with all the
+    // even ones, and all those present says if not NULL.
+    // Returns the number of rows.
+    KEY_POS_T  batch[BATCH];
+    char       text[KEY_TEXTLEN];
+    long       got;
+    long       i;
+    long       n;
+    long       prev = (desc ? hi + 1 : lo - 1);
+    long       even = 0;
+    long       rows = 0;
+    long       expected = 0;
+    short      kw;
+
+    while ((got = bpltree_cursor_next(c, batch, BATCH)) > 0) {
+      for (i = 0; i < got; i++) {
+        rows++;
+        if (!key_parse(bpltree_keytext(G_t, batch[i].key, text,
+                                       KEY_TEXTLEN), &kw, &n)
+            || (kw != w) || (n < lo) || (n > hi)) {
+          failure("cursor: %s out of range", text);
+          continue;
+        }
+        if (desc ? (n >= prev) : (n <= prev)) {
+          failure("cursor: %s after %ld", text, prev);
+        }
+        if (batch[i].pos != key_row(w, n)) {
+          failure("cursor: %s at %ld", text, (long)batch[i].pos);
+        }
+        if (present && !present[n]) {
+          failure("cursor: %s isn't there", text);
+        }
+        even += ((n % 2) == 0);
+        prev = n;
+      }
+    }
+    if (even != evens(lo, hi)) {
+      failure("cursor: %ld even keys from %ld to %ld of writer %hd",
+              even, lo, hi, w);
+    }
+    if (present) {
+      for (n = lo; n <= hi; n++) {
+        expected += present[n];
+      }
+      if (rows != expected) {
+        failure("cursor: %ld keys of writer %hd, %ld expected",
+                rows, w, expected);
+      }
+    }
+    return rows;
+}
+
+static CURSOR_T *cursor_on(short w, long lo, long hi, char desc) {
+    // A cursor on the keys of writer w from lo to hi
+    char      low[KEY_LEN];
+    char      high[KEY_LEN];
+    CURSOR_T *c;
+
+    key_text(low, w, lo);
+    key_text(high, w, hi);
+    if (((c = bpltree_cursor_open(G_t, desc)) == NULL)
+        || bpltree_cursor_seek(c, low, high)) {
+      failure("cursor: %s", bpltree_err_msg());
+      bpltree_cursor_close(c);
+      return NULL;
+    }
+    return c;
+}
+
+static void range(short w, long lo, long hi, char desc) {
+    CURSOR_T *c;
+
+    if ((c = cursor_on(w, lo, hi, desc)) != NULL) {
+      (void)scan(c, w, lo, hi, desc, NULL);
+      bpltree_cursor_close(c);
+    }
+}
+
+static void snapshot_check(short w, unsigned int *seed, char *old) {
+    // A snapshot pinned, and a cursor opened on it, before a
+    // batch of changes see the keys of writer w as they were
+    CURSOR_T *c;
+    char      range[2 * KEY_LEN];
+    long      expected = 0;
+    long      n;
+    int       cnt;
+    int       i;
+
+    memcpy(old, G_present[w], WRITER_KEYS);
+    for (n = 0; n < WRITER_KEYS; n++) {
+      expected += old[n];
+    }
+    bpltree_snapshot(G_t);
+    c = cursor_on(w, 0, WRITER_KEYS - 1, 0);
+    for (i = 0; i < SNAPSHOT_BATCH; i++) {
+      (void)change(w, seed);
+    }
+    if (c) {
+      (void)scan(c, w, 0, WRITER_KEYS - 1, 0, old);
+      bpltree_cursor_close(c);
+    }
+    range_text(range, w, 0, WRITER_KEYS - 1);
+    if ((cnt = bpltree_get(G_t, range, G_fp, 0)) != expected) {
+      failure("get: %d rows of writer %hd in the snapshot, %ld expected",
+              cnt, w, expected);
+    }
+    bpltree_snapshot_end(G_t);
+}
+
+static void mget_check(void) {
+    // Keys on the first field only match all the keys that
+    // start with it ("ab" matches "ab:x" and "abc:y"): rows
+    // that several keys of a batch match must come once
+    static char *first[MGET_FIRST] = {"a", "ab", "abc", "b", "ba"};
+    static char *second[MGET_SECOND] = {"x", "xy", "z"};
+    BPLTREE_T   *t = bpltree_new();
+    char        *tkeys[MGET_FIRST * MGET_SECOND];
+    char        *enc[MGET_FIRST * MGET_SECOND];
+    char        *batch[MGET_KEYS];
+    char        *probe;
+    char        *p;
+    unsigned int seed = 7;
+    long         expected;
+    int          cnt;
+    int          b;
+    int          i;
+    int          j;
+    int          k;
+
+    (void)bpltree_mapdata(t, G_fp);
+    for (i = 0; i < MGET_FIRST * MGET_SECOND; i++) {
+      tkeys[i] = (char *)malloc(KEY_LEN);
+      assert(tkeys[i]);
+      sprintf(tkeys[i], "%s:%s",
+              first[i / MGET_SECOND], second[i % MGET_SECOND]);
+      enc[i] = bpltree_keyencode(t, tkeys[i]);
+      if (bpltree_insert(t, tkeys[i], (unsigned long)key_row(0, i))) {
+        failure("mget: %s cannot be inserted: %s",
+                tkeys[i], bpltree_err_msg());
+      }
+    }
+    for (b = 0; b < MGET_BATCHES; b++) {
+      cnt = 1 + rand_r(&seed) % MGET_KEYS;
+      for (i = 0; i < cnt; i++) {
+        // A key of the tree, or its first field
+        j = rand_r(&seed) % (MGET_FIRST * MGET_SECOND);
+        batch[i] = strdup(tkeys[j]);
+        assert(batch[i]);
+        if (rand_r(&seed) % 2) {
+          *strchr(batch[i], ':') = '\0';
+        }
+      }
+      expected = 0;
+      for (k = 0; k < MGET_FIRST * MGET_SECOND; k++) {
+        for (i = 0; i < cnt; i++) {
+          probe = bpltree_keyencode(t, batch[i]);
+          j = bpltree_keycmp(probe, enc[k]);
+          free(probe);
+          if (j == 0) {
+            expected++;
+            break;
+          }
+        }
+      }
+      if ((j = bpltree_mget(t, batch, cnt, G_fp, 0)) != expected) {
+        p = (char *)malloc(cnt * KEY_LEN);
+        assert(p);
+        *p = '\0';
+        for (i = 0; i < cnt; i++) {
+          strcat(p, batch[i]);
+          strcat(p, (i < cnt - 1 ? "," : ""));
+        }
+        failure("mget: %d rows for %s, %ld expected", j, p, expected);
+        free(p);
+      }
+      for (i = 0; i < cnt; i++) {
+        free(batch[i]);
+      }
+    }
+    for (i = 0; i < MGET_FIRST * MGET_SECOND; i++) {
+      free(tkeys[i]);
+      free(enc[i]);
+    }
+    bpltree_free(t);
+}
+
+static void *writer(void *arg) {
+    short        w = (short)(long)arg;
+    unsigned int seed = 1 + w;
+    char        *old = (char *)malloc(WRITER_KEYS);
+    long         cnt = 0;
+
+    assert(old);
+    while (!stopped()) {
+      if (!G_paged && ((cnt % SNAPSHOT_EVERY) == 0)) {
+        snapshot_check(w, &seed, old);
+        cnt += SNAPSHOT_BATCH;
+      } else {
+        (void)change(w, &seed);
+        cnt++;
+      }
+    }
+    free(old);
+    (void)__atomic_add_fetch(&G_writes, cnt, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void *reader(void *arg) {
+    unsigned int seed = 1000 + (unsigned int)(long)arg;
+    short        w;
+    long         lo;
+    long         hi;
+    long         cnt = 0;
+
+    while (!stopped()) {
+      w = (short)(rand_r(&seed) % G_writers);
+      lo = rand_r(&seed) % WRITER_KEYS;
+      hi = lo + rand_r(&seed) % RANGE_MAX;
+      if (hi >= WRITER_KEYS) {
+        hi = WRITER_KEYS - 1;
+      }
+      switch (cnt % (G_paged ? 2 : 4)) {
+        case 0:
+          lookup(w, lo);
+          break;
+        case 1:
+          count(w, lo, hi);
+          break;
+        default:
+          range(w, lo, hi, (char)(cnt % 4 == 3));
+          break;
+      }
+      cnt++;
+    }
+    (void)__atomic_add_fetch(&G_reads, cnt, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void paged_check(void) {
+    // Same as final_check() on a paged tree, key by key
+    short w;
+    long  n;
+    long  cnt;
+    long  expected;
+
+    for (w = 0; w < G_writers; w++) {
+      expected = 0;
+      for (n = 0; n < WRITER_KEYS; n++) {
+        if ((cnt = rows_of(w, n, n)) != G_present[w][n]) {
+          failure("get: %ld rows for w%02hd_%06ld, %d expected",
+                  cnt, w, n, G_present[w][n]);
+        }
+        expected += G_present[w][n];
+      }
+      if ((cnt = rows_of(w, 0, WRITER_KEYS - 1)) != expected) {
+        failure("get: %ld rows of writer %hd, %ld expected",
+                cnt, w, expected);
+      }
+    }
+}
+
+static BPLTREE_T *paged_open(short maxkeys, long frames) {
+    BPLTREE_T *t = bpltree_new();
+
+    bpltree_setmaxkeys(t, maxkeys);
+    bpltree_setpool(t, frames);
+    if (bpltree_open(t, G_paged) < 0) {
+      fprintf(stderr, "%s: %s %s\n", G_paged,
+              bpltree_err_msg(), bpltree_err_info());
+      exit(1);
+    }
+    (void)bpltree_mapdata(t, G_fp);
+    return t;
+}
+
+static void final_check(void) {
+    // Everything has stopped: the tree must hold what
+    // the writers say
+    CURSOR_T *c;
+    short     w;
+    long      n;
+    long      cnt;
+    long      total = 0;
+
+    if (G_paged) {
+      paged_check();
+      return;
+    }
+    for (w = 0; w < G_writers; w++) {
+      if ((c = cursor_on(w, 0, WRITER_KEYS - 1, 0)) != NULL) {
+        (void)scan(c, w, 0, WRITER_KEYS - 1, 0, G_present[w]);
+        bpltree_cursor_close(c);
+      }
+      for (n = 0; n < WRITER_KEYS; n++) {
+        total += G_present[w][n];
+      }
+    }
+    c = bpltree_cursor_open(G_t, 0);
+    (void)bpltree_cursor_seek(c, NULL, NULL);
+    if ((cnt = bpltree_cursor_count(c)) != total) {
+      failure("%ld keys in the tree, %ld expected", cnt, total);
+    }
+    bpltree_cursor_close(c);
+}
+
+int main(int argc, char **argv) {
+    pthread_t      *threads;
+    struct timespec pause;
+    short           readers = 4;
+    short           maxkeys = 8;
+    long            frames = PAGED_FRAMES;
+    double          seconds = 3;
+    char            key[KEY_LEN];
+    short           w;
+    long            n;
+    int             ch;
+    int             i;
+
+    while ((ch = getopt(argc, argv, OPTIONS)) != -1) {
+      switch (ch) {
+        case 'w':
+          G_writers = (short)atoi(optarg);
+          break;
+        case 'r':
+          readers = (short)atoi(optarg);
+          break;
+        case 's':
+          seconds = atof(optarg);
+          break;
+        case 'k':
+          maxkeys = (short)atoi(optarg);
+          break;
+        case 'p':
+          G_paged = optarg;
+          break;
+        case 'P':
+          frames = atol(optarg);
+          break;
+        default:
+          fprintf(stderr,
+                  "Usage: %s [-w writers] [-r readers] [-s seconds]"
+                  " [-k keys per node] [-p file [-P frames]]\n", argv[0]);
+          exit(1);
+      }
+    }
+    if ((G_writers < 1) || (G_writers > 99) || (readers < 1)
+        || (maxkeys < 3) || (seconds <= 0) || (frames < 1)) {
+      fprintf(stderr, "%s: invalid values\n", argv[0]);
+      exit(1);
+    }
+    if (G_paged && (access(G_paged, F_OK) == 0)) {
+      fprintf(stderr, "%s: %s exists\n", argv[0], G_paged);
+      exit(1);
+    }
+    // The rows of the keys, for get
+    if ((G_fp = tmpfile()) == NULL) {
+      perror("tmpfile");
+      exit(1);
+    }
+    for (w = 0; w < G_writers; w++) {
+      for (n = 0; n < WRITER_KEYS; n++) {
+        key_text(key, w, n);
+        fprintf(G_fp, "%s\n", key);
+      }
+    }
+    (void)fflush(G_fp);
+    mget_check();
+    if (G_paged) {
+      G_t = paged_open(maxkeys, frames);
+    } else {
+      G_t = bpltree_new();
+      bpltree_setmaxkeys(G_t, maxkeys);
+      (void)bpltree_mapdata(G_t, G_fp);
+    }
+    G_present = (char **)malloc(G_writers * sizeof(char *));
+    assert(G_present);
+    for (w = 0; w < G_writers; w++) {
+      G_present[w] = (char *)calloc(WRITER_KEYS, 1);
+      assert(G_present[w]);
+      for (n = 0; n < WRITER_KEYS; n += 2) {
+        key_text(key, w, n);
+        if (bpltree_insert(G_t, key, (unsigned long)key_row(w, n))) {
+          failure("%s cannot be inserted: %s", key, bpltree_err_msg());
+        }
+        G_present[w][n] = 1;
+      }
+    }
+    threads = (pthread_t *)malloc((G_writers + readers) * sizeof(pthread_t));
+    assert(threads);
+    for (i = 0; i < G_writers + readers; i++) {
+      if (pthread_create(&(threads[i]), NULL,
+                         (i < G_writers ? writer : reader),
+                         (void *)(long)(i < G_writers ? i : i - G_writers))) {
+        perror("pthread_create");
+        exit(1);
+      }
+    }
+    pause.tv_sec = (time_t)seconds;
+    pause.tv_nsec = (long)((seconds - pause.tv_sec) * 1e9);
+    (void)nanosleep(&pause, NULL);
+    __atomic_store_n(&G_stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < G_writers + readers; i++) {
+      (void)pthread_join(threads[i], NULL);
+    }
+    final_check();
+    if (G_paged) {
+      // Everything must have been written back
+      bpltree_free(G_t);
+      G_t = paged_open(maxkeys, frames);
+      final_check();
+    }
+    printf("%hd writer%s, %hd reader%s: %ld changes, %ld reads, "
+           "%ld error%s\n",
+           G_writers, (G_writers > 1 ? "s" : ""),
+           readers, (readers > 1 ? "s" : ""),
+           G_writes, G_reads, G_errors, (G_errors == 1 ? "" : "s"));
+    for (w = 0; w < G_writers; w++) {
+      free(G_present[w]);
+    }
+    free(G_present);
+    free(threads);
+    bpltree_free(G_t);
+    fclose(G_fp);
+    if (G_paged) {
+      (void)unlink(G_paged);
+    }
+    return (G_errors ? 1 : 0);
+}